@@ -0,0 +1,543 @@
+#include "mongo.h"
+#include "bson_dumper.h"
+#include "columns.h"
+#include "parallel_insert.h"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Micro-benchmarks for the writer, the readers and the message builders.
+//
+// Usage: bench [filter] [min_ms]
+//
+// Only the benchmarks whose name contains `filter` are run. Each benchmark is
+// repeated, doubling the number of iterations, until a run lasts at least
+// `min_ms` milliseconds (200 by default). The results are printed on stdout as
+// one JSON object per line:
+//
+// {"name": "writer_small", "iterations": 1048576, "ns_per_op": 61.2,
+//  "bytes_per_op": 98, "mb_per_s": 1601.3, "simd": "sse2"}
+
+namespace {
+
+// Written to at the end of every iteration so the compiler can't throw the
+// work away.
+volatile int64_t sink;
+
+struct Benchmark {
+    const char *name;
+    // Runs `iterations` times the operation and returns the number of bytes
+    // processed by one operation (0 if that doesn't make sense).
+    std::function<int64_t(int64_t iterations)> run;
+};
+
+//------------------------------------------------------------------------------
+// BsonWriter
+
+void WriteSmall(okmongo::BsonWriter *w, int32_t i) {
+    w->Document();
+    w->Element("_id", static_cast<int64_t>(i));
+    w->Element("name", "a small document");
+    w->Element("score", 1.5);
+    w->Element("active", true);
+    w->PushDocument("sub");
+    w->Element("a", i);
+    w->Element("b", i + 1);
+    w->Pop();
+    w->Pop();
+}
+
+void WriteLarge(okmongo::BsonWriter *w, int32_t i) {
+    w->Document();
+    for (int32_t j = 0; j < 500; ++j) {
+        w->Element(j, i + j);
+    }
+    w->PushArray("names");
+    for (int32_t j = 0; j < 200; ++j) {
+        w->Element(j, "some medium sized string value");
+    }
+    w->Pop();
+    w->Pop();
+}
+
+int64_t BenchWriter(int64_t iterations,
+                    void (*write)(okmongo::BsonWriter *, int32_t)) {
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        write(&w, static_cast<int32_t>(i));
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+//------------------------------------------------------------------------------
+// BsonReader
+
+class NullReader : public okmongo::BsonReader<NullReader> {
+public:
+    int64_t values = 0;
+    void EmitInt32(int32_t v) { values += v; }
+    void EmitUtf8(const char *, int32_t len) { values += len; }
+    void EmitError(const char *msg) {
+        fprintf(stderr, "Parse error: %s\n", msg);
+        abort();
+    }
+};
+
+const std::string &LargeDocument() {
+    static const std::string doc = [] {
+        okmongo::BsonWriter w;
+        WriteLarge(&w, 0);
+        return w.ToString();
+    }();
+    return doc;
+}
+
+int64_t BenchReader(int64_t iterations, int32_t chunk) {
+    const std::string &doc = LargeDocument();
+    const int32_t len = static_cast<int32_t>(doc.size());
+    if (chunk == 0) {
+        chunk = len;
+    }
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        NullReader r;
+        for (int32_t pos = 0; pos < len; pos += chunk) {
+            r.Consume(doc.data() + pos, std::min(chunk, len - pos));
+        }
+        total += r.values;
+    }
+    sink = total;
+    return len;
+}
+
+//------------------------------------------------------------------------------
+// Dumpers
+
+int64_t BenchDumpStream(int64_t iterations) {
+    const std::string &doc = LargeDocument();
+    std::ostringstream ss;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        ss.str(std::string());
+        okmongo::BsonDocDumper d(&ss);
+        d.Consume(doc.data(), static_cast<int32_t>(doc.size()));
+        total += static_cast<int64_t>(ss.tellp());
+    }
+    sink = total;
+    return static_cast<int64_t>(doc.size());
+}
+
+int64_t BenchDumpBuffer(int64_t iterations, okmongo::DumpStyle style) {
+    const std::string &doc = LargeDocument();
+    std::string out;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        out.clear();
+        okmongo::BsonDocBufferDumper d(&out, style);
+        d.Consume(doc.data(), static_cast<int32_t>(doc.size()));
+        total += static_cast<int64_t>(out.size());
+    }
+    sink = total;
+    return static_cast<int64_t>(doc.size());
+}
+
+//------------------------------------------------------------------------------
+// BsonValue
+
+constexpr int32_t kNumFields = 64;
+
+const std::string &FieldsDocument() {
+    static const std::string doc = [] {
+        okmongo::BsonWriter w;
+        w.Document();
+        char key[16];
+        for (int32_t i = 0; i < kNumFields; ++i) {
+            snprintf(key, sizeof(key), "field_%d", i);
+            w.Element(static_cast<const char *>(key), i);
+        }
+        w.Pop();
+        return w.ToString();
+    }();
+    return doc;
+}
+
+int64_t BenchGetField(int64_t iterations, int32_t position) {
+    const std::string &doc = FieldsDocument();
+    const okmongo::BsonValue v(doc.data(), static_cast<int32_t>(doc.size()));
+    char key[16];
+    snprintf(key, sizeof(key), "field_%d", position);
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        total += v.GetField(key).GetInt32();
+    }
+    sink = total;
+    return 0;
+}
+
+int64_t BenchIndexGetField(int64_t iterations, int32_t position) {
+    const std::string &doc = FieldsDocument();
+    const okmongo::BsonValue v(doc.data(), static_cast<int32_t>(doc.size()));
+    okmongo::BsonValueIndex idx;
+    idx.Reset(v);
+    char key[16];
+    snprintf(key, sizeof(key), "field_%d", position);
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        total += idx.GetField(key).GetInt32();
+    }
+    sink = total;
+    return 0;
+}
+
+constexpr okmongo::StringMatcherAction<okmongo::BsonTag> kColumnFields[] = {
+        {"field_10", okmongo::BsonTag::kInt32},
+        {"field_40", okmongo::BsonTag::kInt64},
+        {"field_60", okmongo::BsonTag::kDouble},
+        {nullptr, okmongo::BsonTag::kMinKey}};
+
+constexpr int64_t kColumnBatch = 1024;
+
+// Pull 3 fields out of a batch of documents one `GetField` at a time.
+int64_t BenchColumnsGetField(int64_t iterations) {
+    const std::string &doc = FieldsDocument();
+    const okmongo::BsonValue v(doc.data(), static_cast<int32_t>(doc.size()));
+    std::vector<int64_t> a, b;
+    std::vector<double> c;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        if (i % kColumnBatch == 0) {
+            a.clear();
+            b.clear();
+            c.clear();
+        }
+        a.push_back(v.GetField("field_10").GetInt32());
+        b.push_back(v.GetField("field_40").GetInt32());
+        c.push_back(v.GetField("field_60").GetInt32());
+        total += a.back();
+    }
+    sink = total;
+    return static_cast<int64_t>(doc.size());
+}
+
+int64_t BenchColumnsExtract(int64_t iterations) {
+    const std::string &doc = FieldsDocument();
+    const okmongo::BsonValue v(doc.data(), static_cast<int32_t>(doc.size()));
+    okmongo::Columns<kColumnFields> cols;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        if (i % kColumnBatch == 0) {
+            cols.Clear();
+        }
+        cols.Append(v);
+        total += cols.Int64s(0)[cols.rows() - 1];
+    }
+    sink = total;
+    return static_cast<int64_t>(doc.size());
+}
+
+//------------------------------------------------------------------------------
+// StringMatcher
+
+constexpr okmongo::StringMatcherAction<int> kwds4[] = {
+        {"code", 0}, {"errmsg", 1}, {"index", 2}, {"ok", 3}, {nullptr, -1}};
+
+// "100" ... "299"
+#define KW(a, b, c) {#a #b #c, a * 100 + b * 10 + c},
+#define KW10(a, b)                                                      \
+    KW(a, b, 0) KW(a, b, 1) KW(a, b, 2) KW(a, b, 3) KW(a, b, 4) KW(a, b, 5) \
+            KW(a, b, 6) KW(a, b, 7) KW(a, b, 8) KW(a, b, 9)
+#define KW100(a)                                                       \
+    KW10(a, 0) KW10(a, 1) KW10(a, 2) KW10(a, 3) KW10(a, 4) KW10(a, 5) \
+            KW10(a, 6) KW10(a, 7) KW10(a, 8) KW10(a, 9)
+
+constexpr okmongo::StringMatcherAction<int> kwds30[] = {
+        KW10(1, 0) KW10(1, 1) KW10(1, 2){nullptr, -1}};
+
+// `StringMatcher` is limited to 255 keywords
+constexpr okmongo::StringMatcherAction<int> kwds200[] = {
+        KW100(1) KW100(2){nullptr, -1}};
+
+template <typename Matcher>
+int64_t BenchMatcher(int64_t iterations, const char *const *words,
+                     size_t num_words) {
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        Matcher m;
+        for (const char *s = words[static_cast<size_t>(i) % num_words]; *s;
+             ++s) {
+            m.AddChar(*s);
+        }
+        m.AddChar('\000');
+        total += m.GetResult();
+    }
+    sink = total;
+    return 0;
+}
+
+const char *const kSmallWords[] = {"code", "errmsg", "index", "ok", "nope"};
+const char *const kNumberWords[] = {"100", "129", "250", "299", "999"};
+
+//------------------------------------------------------------------------------
+// Message builders
+
+struct Doc {
+    int32_t i;
+    const char *name;
+};
+
+}  // namespace
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    w->Element("i", d.i);
+    w->Element("name", d.name);
+    return true;
+}
+}  // namespace okmongo
+
+namespace {
+
+const std::vector<Doc> &BatchDocs() {
+    static const std::vector<Doc> docs = [] {
+        std::vector<Doc> res;
+        for (int32_t i = 0; i < okmongo::kMaxWriteBatchSize; ++i) {
+            res.push_back(Doc{i, "document in a batch"});
+        }
+        return res;
+    }();
+    return docs;
+}
+
+int64_t BenchFillInsertRange(int64_t iterations) {
+    const std::vector<Doc> &docs = BatchDocs();
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        std::vector<Doc>::const_iterator curs = docs.begin();
+        okmongo::FillInsertRangeOp(&w, static_cast<int32_t>(i), "db", "coll",
+                                   &curs, docs.cend());
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+int64_t BenchParallelInsertRange(int64_t iterations, int32_t threads) {
+    const std::vector<Doc> &docs = BatchDocs();
+    okmongo::ParallelInsertEncoder enc(threads);
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        std::vector<Doc>::const_iterator curs = docs.begin();
+        enc.FillInsertRangeOp(&w, static_cast<int32_t>(i), "db", "coll", &curs,
+                              docs.cend());
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+int64_t BenchPreparedInsertRange(int64_t iterations) {
+    const std::vector<Doc> &docs = BatchDocs();
+    const okmongo::PreparedInsert ins("db", "coll");
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        std::vector<Doc>::const_iterator curs = docs.begin();
+        ins.FillRange(&w, static_cast<int32_t>(i), &curs, docs.cend());
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+int64_t BenchFillInsertSmall(int64_t iterations) {
+    const Doc d = {1, "x"};
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        okmongo::FillInsertOp(&w, static_cast<int32_t>(i), "db", "coll", d);
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+int64_t BenchPreparedInsertSmall(int64_t iterations) {
+    const Doc d = {1, "x"};
+    const okmongo::PreparedInsert ins("db", "coll");
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        ins.Fill(&w, static_cast<int32_t>(i), d);
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+// A command with a fixed shape: `{count: "coll", limit: n, query: {}}`
+int64_t BenchWriterCommand(int64_t iterations) {
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        w.Document();
+        w.Element("count", "coll");
+        w.Element("limit", static_cast<int32_t>(i));
+        w.PushDocument("query");
+        w.Pop();
+        w.Pop();
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+constexpr okmongo::StaticElement kCountCommand[] = {
+        okmongo::StaticString("count", "coll"),
+        okmongo::StaticSlot("limit", okmongo::BsonTag::kInt32),
+        okmongo::StaticPushDocument("query"), okmongo::StaticPop(),
+        okmongo::StaticEnd()};
+
+int64_t BenchStaticCommand(int64_t iterations) {
+    okmongo::BsonWriter w;
+    int64_t total = 0;
+    for (int64_t i = 0; i < iterations; ++i) {
+        w.Clear();
+        okmongo::StaticDocument<kCountCommand>::Append(
+                &w, static_cast<int32_t>(i));
+        total += w.len();
+    }
+    sink = total;
+    return w.len();
+}
+
+//------------------------------------------------------------------------------
+
+const std::vector<Benchmark> &Benchmarks() {
+    typedef okmongo::StringMatcher<int, kwds4> Linear4;
+    typedef okmongo::TrieMatcher<int, kwds4> Trie4;
+    typedef okmongo::StringMatcher<int, kwds30> Linear30;
+    typedef okmongo::TrieMatcher<int, kwds30> Trie30;
+    typedef okmongo::StringMatcher<int, kwds200> Linear200;
+    typedef okmongo::TrieMatcher<int, kwds200> Trie200;
+    const size_t kSmall = sizeof(kSmallWords) / sizeof(kSmallWords[0]);
+    const size_t kNumbers = sizeof(kNumberWords) / sizeof(kNumberWords[0]);
+
+    static const std::vector<Benchmark> res = {
+            {"writer_small",
+             [](int64_t n) { return BenchWriter(n, WriteSmall); }},
+            {"writer_large",
+             [](int64_t n) { return BenchWriter(n, WriteLarge); }},
+            {"reader_whole", [](int64_t n) { return BenchReader(n, 0); }},
+            {"reader_chunk128", [](int64_t n) { return BenchReader(n, 128); }},
+            {"reader_chunk1", [](int64_t n) { return BenchReader(n, 1); }},
+            {"dump_ostream", BenchDumpStream},
+            {"dump_buffer",
+             [](int64_t n) {
+                 return BenchDumpBuffer(n, okmongo::DumpStyle::kPretty);
+             }},
+            {"dump_buffer_compact",
+             [](int64_t n) {
+                 return BenchDumpBuffer(n, okmongo::DumpStyle::kCompact);
+             }},
+            {"getfield_first", [](int64_t n) { return BenchGetField(n, 0); }},
+            {"getfield_middle",
+             [](int64_t n) { return BenchGetField(n, kNumFields / 2); }},
+            {"getfield_last",
+             [](int64_t n) { return BenchGetField(n, kNumFields - 1); }},
+            {"index_getfield_last",
+             [](int64_t n) { return BenchIndexGetField(n, kNumFields - 1); }},
+            {"columns_getfield_3", BenchColumnsGetField},
+            {"columns_extract_3", BenchColumnsExtract},
+            {"matcher_linear_4",
+             [=](int64_t n) {
+                 return BenchMatcher<Linear4>(n, kSmallWords, kSmall);
+             }},
+            {"matcher_trie_4",
+             [=](int64_t n) {
+                 return BenchMatcher<Trie4>(n, kSmallWords, kSmall);
+             }},
+            {"matcher_linear_30",
+             [=](int64_t n) {
+                 return BenchMatcher<Linear30>(n, kNumberWords, kNumbers);
+             }},
+            {"matcher_trie_30",
+             [=](int64_t n) {
+                 return BenchMatcher<Trie30>(n, kNumberWords, kNumbers);
+             }},
+            {"matcher_linear_200",
+             [=](int64_t n) {
+                 return BenchMatcher<Linear200>(n, kNumberWords, kNumbers);
+             }},
+            {"matcher_trie_200",
+             [=](int64_t n) {
+                 return BenchMatcher<Trie200>(n, kNumberWords, kNumbers);
+             }},
+            {"writer_command", BenchWriterCommand},
+            {"static_command", BenchStaticCommand},
+            {"fill_insert_small", BenchFillInsertSmall},
+            {"prepared_insert_small", BenchPreparedInsertSmall},
+            {"fill_insert_range_max_batch", BenchFillInsertRange},
+            {"prepared_insert_range_max_batch", BenchPreparedInsertRange},
+            {"parallel_insert_range_max_batch",
+             [](int64_t n) { return BenchParallelInsertRange(n, 0); }},
+            {"parallel_insert_range_max_batch_4_threads",
+             [](int64_t n) { return BenchParallelInsertRange(n, 4); }},
+    };
+    return res;
+}
+
+void Run(const Benchmark &b, double min_ms) {
+    typedef std::chrono::steady_clock Clock;
+    int64_t iterations = 1;
+    for (;;) {
+        const Clock::time_point start = Clock::now();
+        const int64_t bytes = b.run(iterations);
+        const double ns = static_cast<double>(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        Clock::now() - start)
+                        .count());
+        if (ns >= min_ms * 1e6 || iterations >= (INT64_C(1) << 40)) {
+            const double ns_per_op = ns / static_cast<double>(iterations);
+            const double mb_per_s =
+                    bytes > 0 ? static_cast<double>(bytes) * 1e3 / ns_per_op
+                              : 0;
+            printf("{\"name\": \"%s\", \"iterations\": %lld, "
+                   "\"ns_per_op\": %.1f, \"bytes_per_op\": %lld, "
+                   "\"mb_per_s\": %.1f, \"simd\": \"%s\"}\n",
+                   b.name, static_cast<long long>(iterations), ns_per_op,
+                   static_cast<long long>(bytes), mb_per_s,
+                   okmongo::SimdKernelName());
+            fflush(stdout);
+            return;
+        }
+        iterations *= 2;
+    }
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+    const char *filter = argc > 1 ? argv[1] : "";
+    const double min_ms = argc > 2 ? atof(argv[2]) : 200;
+    for (const Benchmark &b : Benchmarks()) {
+        if (strstr(b.name, filter) != nullptr) {
+            Run(b, min_ms);
+        }
+    }
+}
@@ -2,9 +2,13 @@
 #include "bson_dumper.h"
 #include <sstream>
 #include <iostream>
+#include <vector>
 
-static std::string SpoonFeed(const std::string &s) {
-    constexpr size_t kChunkSize = 5;
+extern "C" {
+#include <sys/uio.h>
+}
+
+static std::string SpoonFeed(const std::string &s, size_t kChunkSize = 5) {
     std::ostringstream ss;
     okmongo::BsonDocDumper r(&ss);
     const char *dt = s.data();
@@ -12,8 +16,9 @@ static std::string SpoonFeed(const std::string &s) {
     for (const int32_t max_len =
                  static_cast<int32_t>((s.size() / kChunkSize) * kChunkSize);
          len < max_len; len += kChunkSize) {
-        const int32_t consumed = r.Consume(dt + len, kChunkSize);
-        assert(consumed == kChunkSize);
+        const int32_t consumed =
+                r.Consume(dt + len, static_cast<int32_t>(kChunkSize));
+        assert(consumed == static_cast<int32_t>(kChunkSize));
     }
     if (len < static_cast<int32_t>(s.size())) {
         const int32_t remaining = s.size() % kChunkSize;
@@ -23,8 +28,7 @@ static std::string SpoonFeed(const std::string &s) {
     return ss.str();
 }
 
-static std::string PrintBsonValue(const std::string &s) {
-    okmongo::BsonValue v(s.data(), static_cast<int32_t>(s.size()));
+static std::string PrintBsonValue(const okmongo::BsonValue &v) {
     std::ostringstream ss;
     okmongo::BsonDocDumper d(&ss);
     bool ok = Print(v, &d);
@@ -34,6 +38,179 @@ static std::string PrintBsonValue(const std::string &s) {
     return ss.str();
 }
 
+static std::string PrintBsonValue(const std::string &s) {
+    return PrintBsonValue(
+            okmongo::BsonValue(s.data(), static_cast<int32_t>(s.size())));
+}
+
+// Logs the top-level field names and skips the values of the fields listed
+// in `skipped`.
+class Skipper : public okmongo::BsonReader<Skipper> {
+public:
+    std::vector<std::string> skipped;
+    std::string log;
+    std::string name;
+    int32_t values = 0;
+    bool failed = false;
+
+    void EmitFieldName(const char *s, int32_t len) {
+        if (len > 0) {
+            name.append(s, static_cast<size_t>(len));
+            return;
+        }
+        if (depth() == 1) {
+            log += name + ";";
+            for (const std::string &k : skipped) {
+                if (k == name) {
+                    SkipValue();
+                }
+            }
+        }
+        name.clear();
+    }
+
+    void EmitOpenDoc() { log += "{"; }
+    void EmitOpenArray() { log += "["; }
+    void EmitClose() { log += "}"; }
+    void EmitInt32(int32_t) { ++values; }
+    void EmitInt64(int64_t) { ++values; }
+    void EmitBool(bool) { ++values; }
+    void EmitDouble(double) { ++values; }
+    void EmitNull() { ++values; }
+    void EmitUtf8(const char *, int32_t len) { values += len == 0; }
+    void EmitBindata(const char *, int32_t len) { values += len == 0; }
+    void EmitUtcDatetime(int64_t) { ++values; }
+    void EmitTimestamp(int64_t) { ++values; }
+    void EmitObjectId(const char *) { ++values; }
+    void EmitError(const char *) { failed = true; }
+};
+
+static Skipper Skip(const std::string &s, size_t chunk,
+                    const std::vector<std::string> &skipped) {
+    Skipper r;
+    r.skipped = skipped;
+    for (size_t pos = 0; pos < s.size() && !r.Done(); pos += chunk) {
+        const int32_t len =
+                static_cast<int32_t>(std::min(chunk, s.size() - pos));
+        r.Consume(s.data() + pos, len);
+    }
+    return r;
+}
+
+static void TestSkip(const std::string &doc) {
+    const std::vector<std::string> all = {
+            "int32",    "int64",     "double",   "null",
+            "bool",     "bool2",     "string",   "date",
+            "objectid", "timestamp", "bin_data", "long_array_name"};
+    const std::string names =
+            "int32;int64;double;null;bool;bool2;string;date;objectid;"
+            "timestamp;bin_data;long_array_name;";
+    const Skipper full = Skip(doc, doc.size(), {});
+    assert(full.Done() && !full.failed);
+    assert(full.values == 16);
+    for (size_t chunk = 1; chunk <= doc.size(); ++chunk) {
+        const Skipper none = Skip(doc, chunk, {});
+        assert(none.log == full.log && none.values == full.values);
+
+        // Nothing at all is emitted for the skipped values
+        const Skipper r = Skip(doc, chunk, all);
+        assert(r.Done() && !r.failed);
+        assert(r.log == "{" + names + "}");
+        assert(r.values == 0);
+
+        const Skipper some =
+                Skip(doc, chunk, {"string", "long_array_name", "int32"});
+        assert(some.Done() && !some.failed);
+        assert(some.log == "{" + names + "}");
+        assert(some.values == full.values - 7);
+    }
+
+    // Skipped documents still need a valid length
+    std::string bad = doc;
+    const size_t pos = bad.find("long_array_name") + 16;
+    bad[pos] = 2;
+    bad[pos + 1] = bad[pos + 2] = bad[pos + 3] = 0;
+    for (size_t chunk : {static_cast<size_t>(1), bad.size()}) {
+        assert(Skip(bad, chunk, all).failed);
+    }
+}
+
+static std::string BufferDump(const std::string &s, size_t chunk,
+                              okmongo::DumpStyle style) {
+    std::string out;
+    okmongo::BsonDocBufferDumper r(&out, style);
+    for (size_t pos = 0; pos < s.size(); pos += chunk) {
+        const int32_t len =
+                static_cast<int32_t>(std::min(chunk, s.size() - pos));
+        const int32_t consumed = r.Consume(s.data() + pos, len);
+        assert(consumed == len);
+    }
+    return out;
+}
+
+// The buffered dumper has to print exactly what the ostream one prints.
+static void TestBufferDumper(const std::string &doc) {
+    std::string all_bytes;
+    for (int c = 0; c < 256; ++c) {
+        all_bytes.push_back(static_cast<char>(c == 0 ? 1 : c));
+    }
+    okmongo::BsonWriter w;
+    w.Document();
+    {
+        w.Element("bytes", all_bytes);
+        w.Element("esc\"aped\n", "\\ \t");
+        w.Element("min", std::numeric_limits<int32_t>::min());
+        w.Element("min64", std::numeric_limits<int64_t>::min());
+        w.Element("max64", std::numeric_limits<int64_t>::max());
+        w.Element("small", 1e-300);
+        w.Element("neg", -0.0);
+        w.Element("inf", std::numeric_limits<double>::infinity());
+        w.Element("third", 1.0 / 3);
+        w.ElementUtcDatetime("before", -5);
+        w.ElementUtcDatetime("after", 1400000000);
+        w.ElementTimestamp("ts", (INT64_C(7) << 32) | 12345);
+        w.ElementBindata("bin", okmongo::BindataSubtype::kUuid,
+                         all_bytes.data(),
+                         static_cast<int32_t>(all_bytes.size()));
+        w.PushDocument("deep");
+        for (int i = 0; i < 70; ++i) {
+            w.PushArray(0);
+        }
+        w.Element(0, "bottom");
+        for (int i = 0; i < 70; ++i) {
+            w.Pop();
+        }
+        w.Pop();
+    }
+    w.Pop();
+    for (const std::string &d : {doc, w.ToString()}) {
+        const std::string expected = SpoonFeed(d, d.size());
+        std::string compact;
+        for (size_t i = 0; i < expected.size(); ++i) {
+            if (expected[i] == '\n' && i + 1 < expected.size()) {
+                while (expected[i + 1] == ' ') {
+                    ++i;
+                }
+                continue;
+            }
+            compact.push_back(expected[i]);
+        }
+        for (size_t chunk : {static_cast<size_t>(1), static_cast<size_t>(7),
+                             d.size()}) {
+            assert(BufferDump(d, chunk, okmongo::DumpStyle::kPretty) ==
+                   expected);
+            assert(BufferDump(d, chunk, okmongo::DumpStyle::kCompact) ==
+                   compact);
+        }
+        std::string out = "prefix";
+        okmongo::BsonDocBufferDumper r(&out);
+        assert(Print(okmongo::BsonValue(d.data(),
+                                        static_cast<int32_t>(d.size())),
+                     &r));
+        assert(out == "prefix" + PrintBsonValue(d));
+    }
+}
+
 // kDocument
 // kArray
 // kUtf8
@@ -56,7 +233,93 @@ static std::string PrintBsonValue(const std::string &s) {
 // kMinKey
 // kMaxKey
 
+// Every field of the document sorts strictly after the previous one
+static void CheckAscending(const okmongo::BsonWriter &w) {
+    const okmongo::BsonValue doc(w.data(), w.len());
+    std::vector<okmongo::BsonValue> values;
+    for (okmongo::BsonValueIt it(doc); !it.Done(); it.next()) {
+        values.push_back(it);
+    }
+    assert(values.size() > 1);
+    for (size_t i = 0; i < values.size(); ++i) {
+        assert(values[i].Compare(values[i]) == 0);
+        for (size_t j = i + 1; j < values.size(); ++j) {
+            assert(values[i].Compare(values[j]) < 0);
+            assert(values[j].Compare(values[i]) > 0);
+        }
+    }
+}
+
+static void TestCompare() {
+    okmongo::BsonWriter w;
+    const char oid1[okmongo::kObjectIdLen] = {1};
+    const char oid2[okmongo::kObjectIdLen] = {2};
+    // The types, in mongo's order
+    w.Document();
+    w.Element("null", nullptr);
+    w.Element("nan", std::numeric_limits<double>::quiet_NaN());
+    w.Element("-inf", -std::numeric_limits<double>::infinity());
+    w.Element("int64", -(static_cast<int64_t>(1) << 62));
+    w.Element("int32", -3);
+    w.Element("double", -2.5);
+    w.Element("int32", 0);
+    w.Element("double", 0.5);
+    w.Element("int64", static_cast<int64_t>(1));
+    w.Element("int64", std::numeric_limits<int64_t>::max());
+    w.Element("double", 9223372036854775808.0);
+    w.Element("string", "");
+    w.Element("string", "a");
+    w.Element("string", "ab");
+    w.Element("string", "b");
+    w.PushDocument("doc");
+    w.Pop();
+    w.PushDocument("doc");
+    w.Element("a", 1);
+    w.Pop();
+    w.PushDocument("doc");
+    w.Element("a", 1);
+    w.Element("a", 1);
+    w.Pop();
+    w.PushDocument("doc");
+    w.Element("a", "1");  // Strings after numbers
+    w.Pop();
+    w.PushDocument("doc");
+    w.Element("b", "0");  // The types come before the keys
+    w.Pop();
+    w.PushArray("array");
+    w.Element(0, 1);
+    w.Pop();
+    w.ElementBindata("bin", okmongo::BindataSubtype::kBinary, "b", 1);
+    w.ElementBindata("bin", okmongo::BindataSubtype::kGeneric, "ab", 2);
+    w.ElementBindata("bin", okmongo::BindataSubtype::kFunction, "ab", 2);
+    w.ElementObjectId("oid", oid1);
+    w.ElementObjectId("oid", oid2);
+    w.Element("bool", false);
+    w.Element("bool", true);
+    w.ElementUtcDatetime("date", -1);
+    w.ElementUtcDatetime("date", 1);
+    w.ElementTimestamp("ts", 1);
+    w.ElementTimestamp("ts", -1);  // Unsigned
+    w.Pop();
+    CheckAscending(w);
+
+    // Numbers are compared by value whatever their type
+    w.Clear();
+    w.Document();
+    w.Element("a", 1);
+    w.Element("b", static_cast<int64_t>(1));
+    w.Element("c", 1.0);
+    w.Pop();
+    const okmongo::BsonValue doc(w.data(), w.len());
+    assert(doc.GetField("a").Compare(doc.GetField("b")) == 0);
+    assert(doc.GetField("c").Compare(doc.GetField("b")) == 0);
+    // Missing fields are nulls
+    assert(doc.GetField("z").Compare(okmongo::BsonValue()) == 0);
+    assert(doc.GetField("z").Compare(doc.GetField("a")) < 0);
+}
+
 int main() {
+    TestCompare();
     okmongo::BsonWriter w;
     const char oid[okmongo::kObjectIdLen] = {};
     w.Document();
@@ -102,18 +365,180 @@ int main() {
             exit(1);
         }
         std::cout << v1;
+        // The whole buffer at once goes through the reader's fast path, it
+        // should emit exactly the same thing as the state machine.
+        for (size_t chunk : {static_cast<size_t>(1), res.size()}) {
+            if (SpoonFeed(res, chunk) != v1) {
+                std::cerr << "Chunk size " << chunk << " changed the output"
+                          << std::endl;
+                exit(1);
+            }
+        }
     }
 
+    TestSkip(res);
+    TestBufferDumper(res);
+
     // Crude getfield test
     {
         okmongo::BsonValue v(res.data(), static_cast<int32_t>(res.size()));
         okmongo::BsonValueIt It(v);
+        okmongo::BsonValueIndex idx(v);
+        assert(idx.Valid());
+        int32_t cnt = 0;
         while (!It.Done()) {
             okmongo::BsonValue v2 = v.GetField(It.key());
             assert(!v2.Empty());
+            okmongo::BsonValue v3 = idx.GetField(It.key());
+            assert(v3.Tag() == v2.Tag());
+            assert(PrintBsonValue(v3) == PrintBsonValue(v2));
             It.next();
+            ++cnt;
+        }
+        assert(idx.size() == cnt);
+        assert(idx.GetField("not_a_field").Empty());
+        assert(idx.GetField("int").Empty());
+    }
+    // Pooled writers should write the same bytes and give their buffers back
+    {
+        okmongo::BsonBufferPool pool;
+        for (int round = 0; round < 3; ++round) {
+            okmongo::BsonWriter pw(&pool);
+            pw.Document();
+            for (int32_t i = 0; i < 100; ++i) {
+                pw.Element(i, res);
+            }
+            pw.Pop();
+            okmongo::BsonWriter hw;
+            hw.Document();
+            for (int32_t i = 0; i < 100; ++i) {
+                hw.Element(i, res);
+            }
+            hw.Pop();
+            assert(pw.ToString() == hw.ToString());
         }
+        assert(pool.Cached() > 0);
     }
+
+    // Moving, shrinking and releasing the buffers
+    {
+        okmongo::BsonBufferPool pool;
+        for (okmongo::BsonBufferPool *p :
+             {static_cast<okmongo::BsonBufferPool *>(nullptr), &pool}) {
+            for (size_t len : {static_cast<size_t>(10), res.size()}) {
+                const std::string payload = res.substr(0, len);
+                okmongo::BsonWriter a(p);
+                a.Reserve(static_cast<int32_t>(len) * 5);
+                assert(a.capacity() >= static_cast<int32_t>(len) * 5);
+                const int32_t capacity = a.capacity();
+                a.AppendRawBytes(payload.data(),
+                                 static_cast<int32_t>(payload.size()));
+                assert(a.capacity() == capacity);
+                const char *heap = a.data();
+
+                okmongo::BsonWriter b(std::move(a));
+                assert(b.ToString() == payload);
+                assert(a.len() == 0 && a.ToString().empty());
+                // Heap buffers are handed over, not copied
+                assert(capacity == b.capacity() &&
+                       (b.data() == heap) == (capacity > 240));
+                a.AppendRawBytes("x", 1);  // Still usable
+
+                okmongo::BsonWriter c;
+                c.AppendRawBytes(res.data(), static_cast<int32_t>(res.size()));
+                c = std::move(b);
+                assert(c.ToString() == payload);
+                assert(b.len() == 0);
+
+                std::vector<okmongo::BsonWriter> queue;
+                queue.push_back(std::move(c));
+                queue.emplace_back();
+                queue.back().AppendRawBytes("y", 1);
+                assert(queue[0].ToString() == payload);
+
+                okmongo::BsonWriter &q = queue[0];
+                q.ShrinkToFit();
+                assert(q.ToString() == payload);
+                assert(q.capacity() <= std::max(capacity, 512));
+                if (payload.size() <= 240) {
+                    assert(q.capacity() == 240);
+                }
+
+                int32_t rlen = -1;
+                std::unique_ptr<char[]> buf = q.Release(&rlen);
+                assert(rlen == static_cast<int32_t>(payload.size()));
+                assert(std::string(buf.get(), payload.size()) == payload);
+                assert(q.len() == 0 && q.capacity() == 240);
+                q.AppendRawBytes(payload.data(),
+                                 static_cast<int32_t>(payload.size()));
+                assert(q.ToString() == payload);
+            }
+        }
+    }
+
+    // Scatter/gather output should put the same bytes on the wire
+    {
+        const std::string big(1000, 'x');
+        okmongo::BsonWriter ew;
+        ew.SetExternalThreshold(512);
+        okmongo::BsonWriter cw;
+        for (okmongo::BsonWriter *bw : {&ew, &cw}) {
+            bw->AppendRaw<int32_t>(0);
+            bw->AppendRawBytes(big.data(), static_cast<int32_t>(big.size()));
+            bw->Document();
+            {
+                bw->Element("small", "value");
+                bw->Element("big", big);
+                bw->PushDocument("sub");
+                {
+                    bw->ElementBindata("bin", okmongo::BindataSubtype::kGeneric,
+                                       big.data(),
+                                       static_cast<int32_t>(big.size()));
+                }
+                bw->Pop();
+            }
+            bw->Pop();
+            bw->FlushLen();
+        }
+        assert(ew.ToString() == cw.ToString());
+        assert(ew.MessageLen() == cw.len());
+        assert(ew.len() < 100);
+
+        std::vector<struct iovec> iov(ew.IovecCount());
+        const int32_t cnt =
+                ew.FillIovecs(iov.data(), static_cast<int32_t>(iov.size()));
+        assert(cnt == static_cast<int32_t>(iov.size()));
+        std::string gathered;
+        for (const struct iovec &v : iov) {
+            gathered.append(static_cast<const char *>(v.iov_base), v.iov_len);
+        }
+        assert(gathered == cw.ToString());
+
+        std::string copied(static_cast<size_t>(ew.MessageLen()), '\0');
+        ew.CopyTo(&copied[0]);
+        assert(copied == cw.ToString());
+    }
+
+    // The vectorised scanning has to agree with memchr on every alignment and
+    // length and never look past the end of the range.
+    {
+        std::string buf(100, 'a');
+        for (size_t nul = 0; nul <= buf.size(); nul += 7) {
+            std::string b = buf;
+            if (nul < b.size()) {
+                b[nul] = '\000';
+            }
+            for (size_t start = 0; start < 40; ++start) {
+                for (size_t len = 0; start + len <= b.size(); ++len) {
+                    const char *s = b.data() + start;
+                    const void *expected = memchr(s, '\000', len);
+                    const char *found = okmongo::FindNul(s, s + len);
+                    assert(found == (expected ? expected : s + len));
+                }
+            }
+        }
+    }
+
     // Fuzz test...
     for (size_t i = 0; i < res.size(); ++i) {
         char &c = res[i];
@@ -122,6 +547,9 @@ int main() {
         for (c = std::numeric_limits<char>::min();
              c < std::numeric_limits<char>::max(); ++c) {
             (void)PrintBsonValue(res);
+            okmongo::BsonValueIndex idx(okmongo::BsonValue(
+                    res.data(), static_cast<int32_t>(res.size())));
+            (void)idx.GetField("int32");
         }
         c = backup;
     }
@@ -0,0 +1,124 @@
+#include "columns.h"
+#include "mongo.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Columnar extraction of a few fields out of batches of documents.
+
+constexpr okmongo::StringMatcherAction<okmongo::BsonTag> kFields[] = {
+        {"active", okmongo::BsonTag::kBool},
+        {"count", okmongo::BsonTag::kInt64},
+        {"price", okmongo::BsonTag::kDouble},
+        {"stats", okmongo::BsonTag::kInt32},
+        {"stats.seen", okmongo::BsonTag::kUtcDatetime},
+        {"stats.views", okmongo::BsonTag::kInt32},
+        {nullptr, okmongo::BsonTag::kMinKey}};
+
+typedef okmongo::Columns<kFields> Cols;
+
+enum Col : size_t { kActive, kCount, kPrice, kStats, kSeen, kViews };
+
+static std::string MakeDoc(int32_t i) {
+    okmongo::BsonWriter w;
+    w.Document();
+    w.Element("_id", i);
+    if (i % 3 != 0) {
+        w.Element("active", i % 2 == 0);
+    }
+    if (i % 2 == 0) {
+        w.Element("count", i);  // int32 in an int64 column
+    } else {
+        w.Element("count", static_cast<int64_t>(i) << 33);
+    }
+    if (i % 5 == 0) {
+        w.Element("price", "free");  // Wrong type
+    } else {
+        w.Element("price", i + 0.5);
+    }
+    // Not entered
+    w.PushDocument("other");
+    w.Element("views", -1);
+    w.Pop();
+    w.PushDocument("stats");
+    {
+        w.Element("views", i * 10);
+        w.ElementUtcDatetime("seen", 1000 + i);
+        w.PushDocument("deeper");
+        w.Element("views", -1);
+        w.Pop();
+    }
+    w.Pop();
+    w.Pop();
+    return w.ToString();
+}
+
+static void Check(const Cols &cols, size_t row, int32_t i) {
+    assert(cols.Valid(kActive, row) == (i % 3 != 0));
+    assert(cols.Bools(kActive)[row] == (i % 3 != 0 && i % 2 == 0 ? 1 : 0));
+    assert(cols.Valid(kCount, row));
+    const int64_t count = (i % 2 == 0) ? i : static_cast<int64_t>(i) << 33;
+    assert(cols.Int64s(kCount)[row] == count);
+    assert(cols.Valid(kPrice, row) == (i % 5 != 0));
+    assert(cols.Doubles(kPrice)[row] == (i % 5 != 0 ? i + 0.5 : 0));
+    // A document where we want an int
+    assert(!cols.Valid(kStats, row));
+    assert(cols.Valid(kSeen, row));
+    assert(cols.Int64s(kSeen)[row] == 1000 + i);
+    assert(cols.Valid(kViews, row));
+    assert(cols.Int64s(kViews)[row] == i * 10);
+}
+
+static void TestColumns() {
+    constexpr int32_t kNumDocs = 200;
+    std::vector<std::string> docs;
+    std::vector<okmongo::BsonValue> values;
+    for (int32_t i = 0; i < kNumDocs; ++i) {
+        docs.push_back(MakeDoc(i));
+    }
+    for (const std::string &d : docs) {
+        values.emplace_back(d.data(), static_cast<int32_t>(d.size()));
+    }
+    Cols cols;
+    assert(Cols::kNumColumns == 6);
+    cols.Reserve(kNumDocs);
+    assert(cols.Append(values.begin(), values.end()) == 0);
+    assert(cols.rows() == kNumDocs);
+    for (int32_t i = 0; i < kNumDocs; ++i) {
+        Check(cols, static_cast<size_t>(i), i);
+    }
+    assert(cols.Int64s(kPrice) == nullptr && cols.Doubles(kCount) == nullptr);
+    assert(cols.Bools(kViews) == nullptr);
+    assert(cols.NullCount(kCount) == 0);
+    assert(cols.NullCount(kActive) == (kNumDocs + 2) / 3);
+    assert(cols.NullCount(kPrice) == kNumDocs / 5);
+    assert(cols.NullCount(kStats) == kNumDocs);
+
+    // The validity bitmaps can be used a word at a time
+    size_t valid = 0;
+    for (size_t w = 0; w < (cols.rows() + 63) / 64; ++w) {
+        valid += static_cast<size_t>(
+                __builtin_popcountll(cols.Validity(kPrice)[w]));
+    }
+    assert(valid == kNumDocs - cols.NullCount(kPrice));
+
+    cols.Clear();
+    assert(cols.rows() == 0);
+    cols.Append(values[7]);
+    Check(cols, 0, 7);
+
+    // Rows are added for invalid documents too
+    std::string bad = docs[1];
+    bad[4] = 0x42;  // The type of the first field
+    assert(!cols.Append(okmongo::BsonValue(bad.data(),
+                                           static_cast<int32_t>(bad.size()))));
+    assert(!cols.Append(okmongo::BsonValue()));
+    assert(cols.rows() == 3);
+    assert(!cols.Valid(kCount, 1) && !cols.Valid(kCount, 2));
+    assert(cols.NullCount(kCount) == 2);
+}
+
+int main() {
+    TestColumns();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,145 @@
+#include "compression.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Round trips replies through OP_COMPRESSED with all the codecs that were
+// compiled in.
+
+class Collector : public okmongo::BsonValueResponseReader<Collector> {
+public:
+    std::vector<int32_t> values;
+    std::string error;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        values.push_back(v.GetField("i").GetInt32());
+    }
+
+    void EmitError(const char *msg) { error = msg; }
+};
+
+typedef okmongo::Decompressing<Collector> Reader;
+
+constexpr int32_t kNumDocs = 500;
+
+static okmongo::BsonWriter *MakeReply(okmongo::BsonWriter *w,
+                                      int32_t external_threshold = 0) {
+    static const std::string pad(2000, 'p');
+    w->SetExternalThreshold(external_threshold);
+    okmongo::ResponseHeader hdr = ReplyHeader(34, kNumDocs);
+    hdr.request_id = 12;
+    WriteReply(w, hdr, [](okmongo::BsonWriter *d, int32_t i) {
+        d->Document();
+        d->Element("i", i);
+        d->Element("pad", pad);
+        d->Pop();
+    });
+    return w;
+}
+
+static void Feed(Reader *r, const std::string &msg, size_t chunk) {
+    for (size_t pos = 0; pos < msg.size(); pos += chunk) {
+        const int32_t len =
+                static_cast<int32_t>(std::min(chunk, msg.size() - pos));
+        assert(r->Consume(msg.data() + pos, len) == len);
+    }
+}
+
+static void CheckRead(const std::string &msg, bool compressed) {
+    const size_t chunks[] = {1, 7, 100, 4096, msg.size()};
+    for (const size_t chunk : chunks) {
+        Reader r;
+        Feed(&r, msg, chunk);
+        assert(r.error.empty());
+        assert(r.Done());
+        assert(r.WasCompressed() == compressed);
+        assert(r.Header().response_to == 34);
+        assert(r.values.size() == static_cast<size_t>(kNumDocs));
+        for (int32_t i = 0; i < kNumDocs; ++i) {
+            assert(r.values[static_cast<size_t>(i)] == i);
+        }
+    }
+}
+
+static void TestRoundTrip(okmongo::Compressor c) {
+    okmongo::BsonWriter reply, w;
+    MakeReply(&reply);
+    assert(okmongo::FillCompressedOp(&w, reply, c));
+    std::string msg = w.ToString();
+
+    okmongo::CompressedHeader hdr;
+    std::memcpy(&hdr, msg.data(), sizeof(hdr));
+    assert(hdr.message_length == static_cast<int32_t>(msg.size()));
+    assert(hdr.op_code ==
+           static_cast<int32_t>(okmongo::MongoOpcode::kCompressed));
+    assert(hdr.request_id == 12 && hdr.response_to == 34);
+    assert(hdr.original_opcode ==
+           static_cast<int32_t>(okmongo::MongoOpcode::kReply));
+    assert(hdr.uncompressed_size + 16 == reply.MessageLen());
+    assert(hdr.compressor_id == static_cast<uint8_t>(c));
+    if (c != okmongo::Compressor::kNoop) {
+        assert(w.MessageLen() < reply.MessageLen() / 3);
+    }
+    CheckRead(msg, true);
+
+    // Writers with external segments are compressed the same way.
+    okmongo::BsonWriter ext_reply, ext_w;
+    MakeReply(&ext_reply, 1024);
+    assert(ext_reply.IovecCount() > 1);
+    assert(okmongo::FillCompressedOp(&ext_w, ext_reply, c));
+    assert(ext_w.ToString() == msg);
+
+    // Corrupted (or truncated) data
+    if (c != okmongo::Compressor::kNoop) {
+        msg[msg.size() / 2] ^= 0x5a;
+        msg[msg.size() / 2 + 1] ^= 0x5a;
+        Reader r;
+        r.Consume(msg.data(), static_cast<int32_t>(msg.size()));
+        assert(!r.error.empty() && r.Done());
+    }
+}
+
+static void TestPassThrough() {
+    okmongo::BsonWriter reply;
+    CheckRead(MakeReply(&reply)->ToString(), false);
+}
+
+static void TestUnsupported() {
+    okmongo::BsonWriter w;
+    int i = 0;
+    for (const okmongo::Compressor c :
+         {okmongo::Compressor::kSnappy, okmongo::Compressor::kZlib,
+          okmongo::Compressor::kZstd}) {
+        if (!okmongo::HasCompressor(c)) {
+            okmongo::BsonWriter reply;
+            assert(!okmongo::FillCompressedOp(&w, *MakeReply(&reply), c));
+            assert(w.len() == 0);
+            ++i;
+        }
+    }
+    // Unknown compressor id
+    okmongo::BsonWriter reply;
+    assert(okmongo::FillCompressedOp(&w, *MakeReply(&reply),
+                                     okmongo::Compressor::kNoop));
+    std::string msg = w.ToString();
+    msg[sizeof(okmongo::CompressedHeader) - 1] = 42;
+    Reader r;
+    r.Consume(msg.data(), static_cast<int32_t>(msg.size()));
+    assert(r.error == "Unsupported compressed message");
+    std::cout << i << " compressor(s) not available" << std::endl;
+}
+
+int main() {
+    assert(okmongo::HasCompressor(okmongo::Compressor::kNoop));
+    for (const okmongo::Compressor c :
+         {okmongo::Compressor::kNoop, okmongo::Compressor::kSnappy,
+          okmongo::Compressor::kZlib, okmongo::Compressor::kZstd}) {
+        if (okmongo::HasCompressor(c)) {
+            TestRoundTrip(c);
+        }
+    }
+    TestPassThrough();
+    TestUnsupported();
+    std::cout << "ok" << std::endl;
+}
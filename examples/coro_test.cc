@@ -0,0 +1,181 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "coro.h"
+#include "epoll_loop.h"
+#include "test_util.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+// Coroutines pipelining requests through a `CoroClient` on a socketpair; the
+// test plays the server and answers in reverse order.
+
+class Reply : public okmongo::BsonValueResponseReader<Reply> {
+public:
+    int32_t i = -1;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        i = v.GetField("i").GetInt32();
+    }
+
+    void EmitError(const char *) { assert(false); }
+};
+
+// The server side of the socketpair.
+class Server {
+public:
+    explicit Server(int fd) : fd_(fd) {}
+
+    // Read whatever is available and return the ids of the complete
+    // requests.
+    void Read(std::vector<int32_t> *ids) {
+        char buf[4096];
+        ssize_t res;
+        while ((res = read(fd_, buf, sizeof(buf))) > 0) {
+            in_.append(buf, static_cast<size_t>(res));
+        }
+        while (in_.size() >= sizeof(okmongo::MsgHeader)) {
+            okmongo::MsgHeader hdr;
+            std::memcpy(&hdr, in_.data(), sizeof(hdr));
+            const size_t len = static_cast<size_t>(hdr.message_length);
+            if (in_.size() < len) {
+                break;
+            }
+            ids->push_back(hdr.request_id);
+            in_.erase(0, len);
+        }
+    }
+
+    void Write(const std::string &s) {
+        out_ += s;
+        while (!out_.empty()) {
+            const ssize_t res = write(fd_, out_.data(), out_.size());
+            if (res < 0) {
+                assert(errno == EAGAIN || errno == EWOULDBLOCK);
+                return;
+            }
+            out_.erase(0, static_cast<size_t>(res));
+        }
+    }
+
+private:
+    int fd_;
+    std::string in_;
+    std::string out_;
+};
+
+struct Result {
+    int32_t id = 0;
+    int32_t read = -1;  // By the reader
+    bool ok = false;
+};
+
+static okmongo::Task Request(okmongo::CoroClient *client,
+                             const std::string &pad, Result *res) {
+    okmongo::BsonWriter w;
+    res->id = client->NextRequestId();
+    MakeRequest(&w, res->id, pad);
+    Reply r;
+    auto reply = client->Reply(res->id, &r);
+    if (!co_await client->Send(w)) {
+        co_return;
+    }
+    res->ok = co_await reply;
+    res->read = r.i;
+}
+
+static void TestPipeline() {
+    okmongo::EpollLoop loop(256 * 1024);
+    assert(loop.Ok());
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    okmongo::CoroClient client;
+    Server server(fds[1]);
+    okmongo::Connection conn(fds[0], &client);
+    client.Attach(&conn);
+    assert(loop.Add(&conn));
+
+    constexpr size_t kNumRequests = 32;
+    // Requests are big enough that they don't all fit in the output buffer
+    const std::string pad(64 * 1024, 'x');
+    std::vector<Result> results(kNumRequests);
+    std::vector<okmongo::Task> tasks;
+    for (Result &r : results) {
+        tasks.push_back(Request(&client, pad, &r));
+    }
+    // They can't all be in the output buffer: some wait to be sent
+    assert(conn.Pending() < static_cast<int32_t>(kNumRequests * pad.size()));
+
+    std::vector<int32_t> received;
+    bool answered = false;
+    const auto all_done = [&tasks]() {
+        for (const okmongo::Task &t : tasks) {
+            if (!t.Done()) {
+                return false;
+            }
+        }
+        return true;
+    };
+    while (!all_done()) {
+        assert(conn.Open());
+        loop.RunOnce(10);
+        server.Read(&received);
+        if (!answered && received.size() == kNumRequests) {
+            for (auto it = received.rbegin(); it != received.rend(); ++it) {
+                server.Write(MakeNumberedReply(ReplyHeader(*it), *it));
+            }
+            answered = true;
+        }
+        server.Write("");
+    }
+    assert(client.InFlight() == 0);
+    for (const Result &r : results) {
+        assert(r.ok && r.read == r.id);
+    }
+
+    // Destroying a coroutine cancels its request
+    tasks.clear();
+    Result cancelled;
+    tasks.push_back(Request(&client, "", &cancelled));
+    assert(client.InFlight() == 1);
+    tasks.clear();
+    assert(client.InFlight() == 0);
+
+    // A message that can never fit in the output buffer fails right away
+    Result too_large;
+    tasks.push_back(Request(&client, std::string(
+            static_cast<size_t>(conn.BufferSize()), 'x'), &too_large));
+    assert(tasks.back().Done() && !too_large.ok);
+    assert(client.InFlight() == 0 && conn.Open());
+    tasks.clear();
+
+    // The server going away fails the requests
+    Result failed;
+    tasks.push_back(Request(&client, "", &failed));
+    close(fds[1]);
+    for (int i = 0; i < 10 && !tasks.back().Done(); ++i) {
+        loop.RunOnce(10);
+    }
+    assert(tasks.back().Done() && !failed.ok);
+    assert(client.InFlight() == 0);
+    // ... and the ones after that
+    Result late;
+    tasks.push_back(Request(&client, "", &late));
+    assert(tasks.back().Done() && !late.ok);
+    loop.Remove(&conn);
+    close(fds[0]);
+}
+
+int main() {
+    TestPipeline();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,269 @@
+#include "cursor.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Plays the replies of a server to a `Cursor`, in all possible chunk sizes.
+
+class Batch : public okmongo::BsonValueResponseReader<Batch> {
+public:
+    std::vector<int32_t> values;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        values.push_back(v.GetField("i").GetInt32());
+    }
+
+    void EmitError(const char *) { assert(false); }
+
+    void Clear() {
+        BsonValueResponseReader<Batch>::Clear();
+        values.clear();
+    }
+};
+
+// Logs all the events
+class Docs : public okmongo::Cursor<Docs, Batch> {
+public:
+    std::string log;
+    std::vector<int32_t> values;
+    std::vector<int32_t> more_to_come;
+    okmongo::BsonWriter get_more;
+    const Batch *previous = nullptr;
+
+    Docs(const okmongo::QueryOptions &opts)
+        : Cursor<Docs, Batch>("db", "coll", opts) {}
+
+    void EmitGetMore() {
+        log += "g";
+        get_more.Clear();
+        assert(FillGetMore(&get_more, 1000 + Batches()));
+    }
+
+    void EmitMoreToCome(int32_t response_to) {
+        log += "m";
+        more_to_come.push_back(response_to);
+    }
+
+    void EmitBatch(Batch &b) {
+        log += "b";
+        // The readers are used in turn and left alone until reused.
+        assert(&b != previous);
+        previous = &b;
+        values.insert(values.end(), b.values.begin(), b.values.end());
+    }
+
+    void EmitDone() { log += "d"; }
+
+    void EmitError(const char *) { log += "e"; }
+};
+
+static std::string MakeBatch(int32_t request_id, int64_t cursor_id,
+                             int32_t first, int32_t num_docs,
+                             int32_t flags = 0) {
+    okmongo::ResponseHeader hdr = ReplyHeader(0, num_docs);
+    hdr.request_id = request_id;
+    hdr.response_flags = flags;
+    hdr.cursor_id = cursor_id;
+    return MakeNumberedReply(hdr, first);
+}
+
+static void Feed(Docs *docs, const std::string &stream, size_t chunk) {
+    for (size_t pos = 0; pos < stream.size(); pos += chunk) {
+        const int32_t len =
+                static_cast<int32_t>(std::min(chunk, stream.size() - pos));
+        if (docs->Consume(stream.data() + pos, len) != len) {
+            return;
+        }
+    }
+}
+
+template <>
+bool okmongo::BsonWriteFields<int>(okmongo::BsonWriter *w, const int &i) {
+    w->Element("i", i);
+    return true;
+}
+
+static void TestQueryFlags() {
+    okmongo::BsonWriter w;
+    okmongo::BsonWriter expected;
+    // The old interface is unchanged: positive limits close the cursor
+    assert(okmongo::FillQueryOp(&w, 1, "db", "coll", 1, 5));
+    const okmongo::QueryOptions limited = {0, 0, -5};
+    assert(okmongo::FillQueryOp(&expected, 1, "db", "coll", 1, limited));
+    assert(w.ToString() == expected.ToString());
+
+    w.Clear();
+    const okmongo::QueryOptions opts = {okmongo::kExhaust | okmongo::kSlaveOk,
+                                        3, 100};
+    assert(okmongo::FillQueryOp(&w, 1, "db", "coll", 1, opts));
+    const char *const body = w.data() + sizeof(okmongo::MsgHeader);
+    int32_t v;
+    std::memcpy(&v, body, sizeof(v));
+    assert(v == (okmongo::kExhaust | okmongo::kSlaveOk));
+    const size_t ns = std::strlen("db.coll") + 1;
+    std::memcpy(&v, body + 4 + ns, sizeof(v));
+    assert(v == 3);
+    std::memcpy(&v, body + 8 + ns, sizeof(v));
+    assert(v == 100);
+
+    w.Clear();
+    assert(okmongo::FillGetMoreOp(&w, 7, "db", "coll", 42, 100));
+    std::memcpy(&v, w.data() + w.len() - 12, sizeof(v));
+    assert(v == 100);
+}
+
+static void TestPrefetch() {
+    const std::string stream = MakeBatch(1, 42, 0, 3) +
+                               MakeBatch(2, 42, 3, 3) + MakeBatch(3, 0, 6, 2);
+    for (size_t chunk = 1; chunk <= stream.size(); ++chunk) {
+        Docs docs({0, 0, 3});
+        okmongo::BsonWriter w;
+        assert(docs.FillQuery(&w, 1, 1));
+        Feed(&docs, stream, chunk);
+        // The getMore goes out before the batch is read
+        assert(docs.log == "gbgbbd");
+        assert(docs.Done() && !docs.WantsGetMore());
+        assert(docs.Batches() == 3);
+        assert((docs.values == std::vector<int32_t>{0, 1, 2, 3, 4, 5, 6, 7}));
+        assert(docs.more_to_come.empty());
+
+        okmongo::BsonWriter expected;
+        okmongo::FillGetMoreOp(&expected, 1001, "db", "coll", 42, 3);
+        assert(docs.get_more.ToString() == expected.ToString());
+        w.Clear();
+        assert(!docs.FillGetMore(&w, 2));
+        assert(!docs.FillKill(&w, 2));
+    }
+}
+
+static void TestExhaust() {
+    const std::string stream = MakeBatch(10, 42, 0, 2) +
+                               MakeBatch(11, 42, 2, 2) + MakeBatch(12, 0, 4, 1);
+    for (size_t chunk = 1; chunk <= stream.size(); ++chunk) {
+        Docs docs({okmongo::kExhaust, 0, 2});
+        Feed(&docs, stream, chunk);
+        assert(docs.log == "mbmbbd");
+        assert((docs.more_to_come == std::vector<int32_t>{10, 11}));
+        assert((docs.values == std::vector<int32_t>{0, 1, 2, 3, 4}));
+        assert(docs.Done());
+    }
+}
+
+static void TestErrors() {
+    {
+        Docs docs({0, 0, 0});
+        const std::string stream =
+                MakeBatch(1, 42, 0, 1) +
+                MakeBatch(2, 0, 0, 0, okmongo::kCursorNotFound);
+        Feed(&docs, stream, stream.size());
+        assert(docs.log == "gbe");
+        assert(!docs.Done());
+        assert(docs.Consume(stream.data(), 1) == -1);
+    }
+    {
+        // Giving up before the end
+        Docs docs({0, 0, 0});
+        const std::string stream = MakeBatch(1, 42, 0, 1);
+        Feed(&docs, stream, stream.size());
+        okmongo::BsonWriter w, expected;
+        assert(docs.FillKill(&w, 5));
+        okmongo::FillKillCursorsOp(&expected, 5, 42);
+        assert(w.ToString() == expected.ToString());
+        assert(docs.Done());
+    }
+}
+
+// The cursors in a killCursors message
+static std::vector<int64_t> KilledCursors(const okmongo::BsonWriter &w) {
+    int32_t num;
+    std::memcpy(&num, w.data() + 20, sizeof(num));
+    std::vector<int64_t> res(static_cast<size_t>(num));
+    assert(w.len() == 24 + 8 * num);
+    std::memcpy(res.data(), w.data() + 24, 8 * res.size());
+    return res;
+}
+
+static void TestKillCursors() {
+    okmongo::BsonWriter w, expected;
+    const std::vector<int64_t> ids = {42, 43, 44, 45, 46};
+
+    // One cursor is the same as the single id version
+    auto curs = ids.cbegin();
+    assert(okmongo::FillKillCursorsOp(&w, 5, &curs, ids.cend(), 1));
+    okmongo::FillKillCursorsOp(&expected, 5, 42);
+    assert(w.ToString() == expected.ToString());
+    assert(curs == ids.cbegin() + 1);
+
+    w.Clear();
+    assert(okmongo::FillKillCursorsOp(&w, 5, &curs, ids.cend(), 3));
+    assert(KilledCursors(w) == std::vector<int64_t>({43, 44, 45}));
+    w.Clear();
+    assert(okmongo::FillKillCursorsOp(&w, 5, &curs, ids.cend()));
+    assert(KilledCursors(w) == std::vector<int64_t>({46}));
+    assert(curs == ids.cend());
+    assert(!okmongo::FillKillCursorsOp(&w, 5, &curs, ids.cend()));
+}
+
+static void TestReaper() {
+    okmongo::CursorReaper reaper({3, 100});
+    okmongo::BsonWriter w;
+    assert(!reaper.Due(0, 0) && !reaper.Fill(0, &w, 1));
+
+    reaper.Abandon(1, 42, 1000);
+    reaper.Abandon(1, 0, 1000);  // Not a cursor
+    okmongo::ResponseHeader hdr;
+    hdr.cursor_id = 43;
+    hdr.response_flags = 0;
+    reaper.Abandon(1, hdr, 1050);
+    hdr.response_flags = okmongo::kCursorNotFound;
+    reaper.Abandon(1, hdr, 1050);  // Already gone
+    reaper.Abandon(4, 44, 1050);
+    assert(reaper.Pending(1) == 2 && reaper.Pending() == 3);
+    assert(reaper.Connections() == 5 && reaper.Pending(0) == 0);
+
+    // By time
+    assert(!reaper.Due(1, 1099) && reaper.Due(1, 1100));
+    assert(!reaper.Due(4, 1100));
+    assert(reaper.Fill(1, &w, 7));
+    assert(KilledCursors(w) == std::vector<int64_t>({42, 43}));
+    assert(reaper.Pending(1) == 0 && !reaper.Due(1, 5000));
+    assert(!reaper.Fill(1, &w, 8));
+
+    // By count
+    reaper.Abandon(4, 45, 1060);
+    assert(!reaper.Due(4, 1060));
+    reaper.Abandon(4, 46, 1070);
+    assert(reaper.Due(4, 1070));
+    w.Clear();
+    assert(reaper.Fill(4, &w, 9));
+    assert(KilledCursors(w) == std::vector<int64_t>({44, 45, 46}));
+
+    // Closed connections take their cursors with them
+    reaper.Abandon(2, 47, 2000);
+    reaper.Forget(2);
+    assert(reaper.Pending() == 0 && !reaper.Due(2, 9000));
+
+    // From a cursor
+    Docs docs({0, 0, 0});
+    const std::string stream = MakeBatch(1, 48, 0, 1);
+    Feed(&docs, stream, stream.size());
+    docs.Abandon(&reaper, 3, 3000);
+    assert(docs.Done() && !docs.WantsGetMore());
+    assert(reaper.Pending(3) == 1);
+    docs.Abandon(&reaper, 3, 3000);
+    assert(reaper.Pending(3) == 1);
+    w.Clear();
+    assert(reaper.Fill(3, &w, 10));
+    assert(KilledCursors(w) == std::vector<int64_t>({48}));
+}
+
+int main() {
+    TestQueryFlags();
+    TestPrefetch();
+    TestExhaust();
+    TestErrors();
+    TestKillCursors();
+    TestReaper();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,195 @@
+#include "dump_file.h"
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+// Scanning a file of concatenated documents from several threads.
+
+static std::string MakeDump(int32_t num_docs) {
+    okmongo::BsonWriter w;
+    for (int32_t i = 0; i < num_docs; ++i) {
+        w.Document();
+        w.Element("i", i);
+        w.Element("s", std::string(static_cast<size_t>(i % 100), 'x'));
+        w.Pop();
+    }
+    return w.ToString();
+}
+
+class TmpFile {
+public:
+    explicit TmpFile(const std::string &content) {
+        char path[] = "/tmp/okmongo_dump_XXXXXX";
+        const int fd = mkstemp(path);
+        assert(fd != -1);
+        path_ = path;
+        const ssize_t res = write(fd, content.data(), content.size());
+        assert(res == static_cast<ssize_t>(content.size()));
+        close(fd);
+    }
+
+    ~TmpFile() { unlink(path_.c_str()); }
+
+    const char *path() const { return path_.c_str(); }
+
+private:
+    std::string path_;
+};
+
+// Sums all the int32s it sees (there's one per document)
+class Summer : public okmongo::BsonReader<Summer> {
+public:
+    int64_t sum = 0;
+    int64_t docs = 0;
+
+    void EmitInt32(int32_t v) {
+        sum += v;
+        ++docs;
+    }
+
+    void EmitError(const char *) {}
+};
+
+static void TestParallelFor() {
+    for (int32_t threads : {0, 1, 3, 8}) {
+        for (size_t n : {0, 1, 7, 1000}) {
+            std::vector<int> seen(n, 0);
+            const auto f = [&seen, threads](int32_t worker, size_t begin,
+                                            size_t end) {
+                assert(worker >= 0);
+                assert(threads == 0 || worker < threads);
+                assert(end - begin <= 10);
+                for (size_t i = begin; i < end; ++i) {
+                    ++seen[i];
+                }
+            };
+            okmongo::ParallelFor(n, 10, threads, f);
+            for (int s : seen) {
+                assert(s == 1);
+            }
+        }
+    }
+}
+
+static void TestWorkerPool() {
+    for (int32_t threads : {1, 3}) {
+        okmongo::WorkerPool pool(threads);
+        assert(pool.threads() == threads);
+        // The same threads run loop after loop
+        for (size_t n : {0, 1, 7, 1000, 1000}) {
+            std::vector<int> seen(n, 0);
+            pool.ParallelFor(n, 10, [&seen, threads](int32_t worker,
+                                                     size_t begin, size_t end) {
+                assert(worker >= 0 && worker < threads);
+                assert(end - begin <= 10);
+                for (size_t i = begin; i < end; ++i) {
+                    ++seen[i];
+                }
+            });
+            for (int s : seen) {
+                assert(s == 1);
+            }
+        }
+    }
+}
+
+static void TestScan() {
+    constexpr int32_t kNumDocs = 10000;
+    const TmpFile tmp(MakeDump(kNumDocs));
+    okmongo::DumpFile f;
+    assert(f.Open(tmp.path()));
+    assert(f.size() == kNumDocs);
+    assert(f.Document(1234).GetField("i").GetInt32() == 1234);
+    constexpr int64_t kSum =
+            static_cast<int64_t>(kNumDocs) * (kNumDocs - 1) / 2;
+
+    for (int32_t threads : {1, 2, 4}) {
+        std::vector<int64_t> sums(static_cast<size_t>(threads), 0);
+        std::vector<int> seen(kNumDocs, 0);
+        f.ForEach(threads, [&sums, &seen](int32_t worker, size_t i,
+                                         const okmongo::BsonValue &doc) {
+            const int32_t v = doc.GetField("i").GetInt32();
+            assert(static_cast<size_t>(v) == i);
+            sums[static_cast<size_t>(worker)] += v;
+            ++seen[i];
+        });
+        int64_t sum = 0;
+        for (int64_t s : sums) {
+            sum += s;
+        }
+        assert(sum == kSum);
+        for (int s : seen) {
+            assert(s == 1);
+        }
+
+        std::vector<Summer> readers(static_cast<size_t>(threads));
+        assert(f.ReadAll(&readers));
+        sum = 0;
+        int64_t docs = 0;
+        for (const Summer &r : readers) {
+            sum += r.sum;
+            docs += r.docs;
+        }
+        assert(sum == kSum);
+        assert(docs == kNumDocs);
+    }
+}
+
+static void TestErrors() {
+    okmongo::DumpFile f;
+    assert(!f.Open("/nonexistent/okmongo.bson"));
+    assert(!f.Error().empty());
+
+    {
+        const TmpFile empty("");
+        assert(f.Open(empty.path()));
+        assert(f.size() == 0);
+        std::vector<Summer> readers(2);
+        assert(f.ReadAll(&readers));
+    }
+
+    const std::string dump = MakeDump(3);
+    // Truncated in the middle of a document
+    {
+        const TmpFile tmp(dump.substr(0, dump.size() - 3));
+        assert(!f.Open(tmp.path()));
+        assert(f.size() == 0);
+        assert(f.Error().find("Invalid document length") == 0);
+    }
+    // Trailing bytes
+    {
+        const TmpFile tmp(dump + "abc");
+        assert(!f.Open(tmp.path()));
+        assert(f.Error().find("Truncated document") == 0);
+    }
+    // Not a document
+    {
+        std::string bad = dump;
+        bad[bad.size() - 1] = 'x';
+        const TmpFile tmp(bad);
+        assert(!f.Open(tmp.path()));
+        assert(f.Error().find("Unterminated document") == 0);
+    }
+    // A document the readers can't read
+    {
+        std::string bad = dump;
+        bad[4] = 0x42;  // The type of the first field
+        const TmpFile tmp(bad);
+        assert(f.Open(tmp.path()));
+        std::vector<Summer> readers(1);
+        assert(!f.ReadAll(&readers));
+    }
+}
+
+int main() {
+    TestParallelFor();
+    TestWorkerPool();
+    TestScan();
+    TestErrors();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,284 @@
+#include "mongo.h"
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+// Offline tests for the message builders in mongo.h: the prepared commands
+// must produce exactly the same bytes as the `Fill*Op` functions.
+
+struct Doc {
+    int32_t i;
+    std::string name;
+};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    w->Element("i", d.i);
+    w->Element("name", d.name);
+    return true;
+}
+}  // namespace okmongo
+
+static std::string Bytes(const okmongo::BsonWriter &w) { return w.ToString(); }
+
+static void TestPreparedInsert() {
+    const okmongo::PreparedInsert ins("db", "coll");
+    const Doc a = {1, "a"}, b = {2, std::string(300, 'b')};
+    okmongo::BsonWriter expected, w;
+    okmongo::FillInsertOp(&expected, 7, "db", "coll", a, b);
+    // Reusing the same writer
+    for (int32_t round = 0; round < 3; ++round) {
+        assert(ins.Fill(&w, 7, a, b));
+        assert(Bytes(w) == Bytes(expected));
+    }
+    assert(ins.Fill(&w, 8, a));
+    expected.Clear();
+    okmongo::FillInsertOp(&expected, 8, "db", "coll", a);
+    assert(Bytes(w) == Bytes(expected));
+
+    std::vector<Doc> docs;
+    for (int32_t i = 0; i < okmongo::kMaxWriteBatchSize + 10; ++i) {
+        docs.push_back(Doc{i, std::string(static_cast<size_t>(i % 13), 'x')});
+    }
+    std::vector<Doc>::const_iterator c1 = docs.begin(), c2 = docs.begin();
+    while (c1 != docs.end()) {
+        expected.Clear();
+        okmongo::FillInsertRangeOp(&expected, 9, "db", "coll", &c1,
+                                   docs.cend());
+        assert(ins.FillRange(&w, 9, &c2, docs.cend()));
+        assert(c1 == c2);
+        assert(Bytes(w) == Bytes(expected));
+    }
+}
+
+static void TestPreparedUpdateDelete() {
+    const Doc q = {1, "q"}, op = {2, "op"};
+    okmongo::BsonWriter expected, w;
+    const okmongo::PreparedUpdate upd("db", "coll");
+    for (int32_t upsert = 0; upsert < 2; ++upsert) {
+        expected.Clear();
+        okmongo::FillUpdateOp(&expected, 11 + upsert, "db", "coll", q, op,
+                              upsert == 1);
+        assert(upd.Fill(&w, 11 + upsert, q, op, upsert == 1));
+        assert(Bytes(w) == Bytes(expected));
+    }
+
+    const okmongo::PreparedDelete del("db", "coll");
+    expected.Clear();
+    okmongo::FillDeleteOp(&expected, 13, "db", "coll", q);
+    assert(del.Fill(&w, 13, q));
+    assert(Bytes(w) == Bytes(expected));
+}
+
+typedef okmongo::UpdateStatement<Doc, Doc> Update;
+
+// Every batch must be within `limits` and be byte for byte the message we get
+// when the range stops right where the batch did.
+template <typename FillRange>
+static void CheckBatches(const std::vector<Doc> &docs,
+                         const okmongo::BatchLimits &limits,
+                         FillRange fill_range, int32_t external_threshold) {
+    typedef std::vector<Doc>::const_iterator It;
+    okmongo::BsonWriter w, expected;
+    w.SetExternalThreshold(external_threshold);
+    int32_t batches = 0;
+    for (It curs = docs.begin(); curs != docs.end();) {
+        const It start = curs;
+        w.Clear();
+        assert(fill_range(&w, &curs, docs.cend(), limits));
+        assert(curs != start);
+        assert(curs - start <= limits.max_count);
+        assert(w.MessageLen() <= limits.max_bytes);
+        const std::string msg = w.ToString();
+        assert(static_cast<int32_t>(msg.size()) == w.MessageLen());
+
+        It exact = start;
+        expected.Clear();
+        assert(fill_range(&expected, &exact, curs,
+                          okmongo::kDefaultMsgBatchLimits));
+        assert(exact == curs);
+        assert(Bytes(expected) == msg);
+        ++batches;
+    }
+    assert(batches > 1);
+}
+
+static void TestByteLimits() {
+    std::vector<Doc> docs;
+    for (int32_t i = 0; i < 100; ++i) {
+        docs.push_back(Doc{i, std::string(static_cast<size_t>(i * 37), 'x')});
+    }
+    typedef std::vector<Doc>::const_iterator It;
+    const okmongo::BatchLimits limits = {40, 8000};
+    const okmongo::PreparedInsert ins("db", "coll");
+    for (int32_t threshold : {0, 512}) {
+        CheckBatches(docs, limits,
+                     [](okmongo::BsonWriter *w, It *curs, It end,
+                        const okmongo::BatchLimits &l) {
+                         return okmongo::FillInsertRangeOp(w, 1, "db", "coll",
+                                                           curs, end, l);
+                     },
+                     threshold);
+        CheckBatches(docs, limits,
+                     [&ins](okmongo::BsonWriter *w, It *curs, It end,
+                            const okmongo::BatchLimits &l) {
+                         return ins.FillRange(w, 1, curs, end, l);
+                     },
+                     threshold);
+        CheckBatches(docs, limits,
+                     [](okmongo::BsonWriter *w, It *curs, It end,
+                        const okmongo::BatchLimits &l) {
+                         return okmongo::FillDeleteRangeOp(w, 1, "db", "coll",
+                                                           curs, end, l);
+                     },
+                     threshold);
+        CheckBatches(docs, limits,
+                     [](okmongo::BsonWriter *w, It *curs, It end,
+                        const okmongo::BatchLimits &l) {
+                         return okmongo::FillMsgInsertRangeOp(
+                                 w, 1, "db", "coll", curs, end, l);
+                     },
+                     threshold);
+        CheckBatches(docs, limits,
+                     [](okmongo::BsonWriter *w, It *curs, It end,
+                        const okmongo::BatchLimits &l) {
+                         return okmongo::FillMsgDeleteRangeOp(
+                                 w, 1, "db", "coll", curs, end, l);
+                     },
+                     threshold);
+    }
+
+    // Not even one document fits
+    okmongo::BsonWriter w;
+    It curs = docs.begin() + 99;
+    const okmongo::BatchLimits tiny = {10, 1000};
+    assert(!okmongo::FillInsertRangeOp(&w, 1, "db", "coll", &curs, docs.cend(),
+                                       tiny));
+    assert(curs == docs.begin() + 99);
+}
+
+static void TestUpdateRange() {
+    std::vector<Update> updates;
+    for (int32_t i = 0; i < 50; ++i) {
+        updates.push_back(Update{Doc{i, "q"}, Doc{i, "u"}, (i % 2) == 0});
+    }
+    okmongo::BsonWriter expected, w;
+
+    // A range of one is a plain update
+    std::vector<Update>::const_iterator curs = updates.begin();
+    okmongo::FillUpdateRangeOp(&w, 3, "db", "coll", &curs,
+                               updates.cbegin() + 1);
+    assert(curs == updates.begin() + 1);
+    okmongo::FillUpdateOp(&expected, 3, "db", "coll", updates[0].q,
+                          updates[0].u, updates[0].upsert);
+    assert(Bytes(w) == Bytes(expected));
+
+    w.Clear();
+    expected.Clear();
+    curs = updates.begin();
+    okmongo::FillMsgUpdateRangeOp(&w, 3, "db", "coll", &curs,
+                                  updates.cbegin() + 1);
+    okmongo::FillMsgUpdateOp(&expected, 3, "db", "coll", updates[0].q,
+                             updates[0].u, updates[0].upsert);
+    assert(Bytes(w) == Bytes(expected));
+
+    const okmongo::PreparedUpdate upd("db", "coll");
+    const okmongo::BatchLimits limits = {20, 100000};
+    std::vector<Update>::const_iterator c1 = updates.begin(),
+                                        c2 = updates.begin();
+    while (c1 != updates.end()) {
+        expected.Clear();
+        okmongo::FillUpdateRangeOp(&expected, 4, "db", "coll", &c1,
+                                   updates.cend(), limits);
+        upd.FillRange(&w, 4, &c2, updates.cend(), limits);
+        assert(c1 == c2);
+        assert(Bytes(w) == Bytes(expected));
+    }
+}
+
+// The command document of a query on `db.$cmd`
+static okmongo::BsonValue Command(const okmongo::BsonWriter &w) {
+    const char *doc = w.data() + sizeof(okmongo::MsgHeader) + 4 +
+                      std::strlen("db.$cmd") + 1 + 8;
+    int32_t len;
+    std::memcpy(&len, doc, sizeof(len));
+    return okmongo::BsonValue(doc, len);
+}
+
+static void TestWriteConcern() {
+    const Doc a = {1, "a"};
+    okmongo::BsonWriter w, expected;
+
+    okmongo::FillInsertOp(&w, 1, "db", "coll", a);
+    const okmongo::BsonValue ack = Command(w).GetField("writeConcern");
+    assert(ack.GetField("w").GetInt32() == 1);
+    assert(ack.GetField("j").Empty() && ack.GetField("wtimeout").Empty());
+    assert(okmongo::Acknowledged::kExpectsReply);
+
+    w.Clear();
+    okmongo::FillDeleteOp<okmongo::Unacknowledged>(&w, 1, "db", "coll", a);
+    const okmongo::BsonValue unack = Command(w).GetField("writeConcern");
+    assert(unack.GetField("w").GetInt32() == 0);
+    assert(!okmongo::Unacknowledged::kExpectsReply);
+
+    typedef okmongo::MajorityWriteConcern<true, 500> Majority;
+    w.Clear();
+    okmongo::FillUpdateOp<Majority>(&w, 1, "db", "coll", a, a, true);
+    const okmongo::BsonValue wc = Command(w).GetField("writeConcern");
+    const okmongo::BsonValue majority = wc.GetField("w");
+    assert(std::string(majority.GetData(), majority.GetDataSize()) ==
+           "majority");
+    assert(wc.GetField("j").GetBool());
+    assert(wc.GetField("wtimeout").GetInt32() == 500);
+
+    // The prepared commands take the policy as an argument
+    const okmongo::PreparedInsert ins("db", "coll", Majority());
+    assert(ins.ExpectsReply());
+    assert(ins.Fill(&w, 3, a));
+    expected.Clear();
+    okmongo::FillInsertOp<Majority>(&expected, 3, "db", "coll", a);
+    assert(Bytes(w) == Bytes(expected));
+
+    const okmongo::PreparedDelete del("db", "coll", okmongo::Unacknowledged());
+    assert(!del.ExpectsReply());
+    assert(del.Fill(&w, 4, a));
+    expected.Clear();
+    okmongo::FillDeleteOp<okmongo::Unacknowledged>(&expected, 4, "db", "coll",
+                                                   a);
+    assert(Bytes(w) == Bytes(expected));
+
+    // Unacknowledged OP_MSG don't get a reply
+    okmongo::OpMsgHeader hdr;
+    w.Clear();
+    okmongo::FillMsgInsertOp<okmongo::Unacknowledged>(&w, 5, "db", "coll", a);
+    std::memcpy(&hdr, w.data(), sizeof(hdr));
+    assert(hdr.flag_bits == okmongo::kMoreToCome);
+    w.Clear();
+    okmongo::FillMsgInsertOp<Majority>(&w, 5, "db", "coll", a);
+    std::memcpy(&hdr, w.data(), sizeof(hdr));
+    assert(hdr.flag_bits == 0);
+
+    // The byte limits account for the bigger write concern
+    std::vector<Doc> docs;
+    for (int32_t i = 0; i < 100; ++i) {
+        docs.push_back(Doc{i, std::string(static_cast<size_t>(i * 37), 'x')});
+    }
+    typedef std::vector<Doc>::const_iterator It;
+    CheckBatches(docs, {40, 8000},
+                 [](okmongo::BsonWriter *w, It *curs, It end,
+                    const okmongo::BatchLimits &l) {
+                     return okmongo::FillInsertRangeOp<Majority>(
+                             w, 1, "db", "coll", curs, end, l);
+                 },
+                 0);
+}
+
+int main() {
+    TestPreparedInsert();
+    TestPreparedUpdateDelete();
+    TestByteLimits();
+    TestUpdateRange();
+    TestWriteConcern();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,230 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "epoll_loop.h"
+#include "multiplexer.h"
+#include "test_util.h"
+#ifdef HAVE_LIBURING
+#include "uring_loop.h"
+#endif
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+// Pipelines requests through a `Connection` on a socketpair; the test plays
+// the server and answers in reverse order.
+
+class Mux : public okmongo::ResponseMultiplexer<Mux> {
+public:
+    void EmitError(const char *) { assert(false); }
+};
+
+class Reply : public okmongo::BsonValueResponseReader<Reply> {
+public:
+    int32_t i = -1;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        i = v.GetField("i").GetInt32();
+    }
+
+    void EmitError(const char *) { assert(false); }
+};
+
+// The server side of the socketpair.
+class Server {
+public:
+    explicit Server(int fd) : fd_(fd) {}
+
+    // Read whatever is available and return the ids of the complete
+    // requests.
+    void Read(std::vector<int32_t> *ids) {
+        char buf[4096];
+        ssize_t res;
+        while ((res = read(fd_, buf, sizeof(buf))) > 0) {
+            in_.append(buf, static_cast<size_t>(res));
+        }
+        assert(res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK));
+        while (in_.size() >= sizeof(okmongo::MsgHeader)) {
+            okmongo::MsgHeader hdr;
+            std::memcpy(&hdr, in_.data(), sizeof(hdr));
+            const size_t len = static_cast<size_t>(hdr.message_length);
+            if (in_.size() < len) {
+                break;
+            }
+            ids->push_back(hdr.request_id);
+            in_.erase(0, len);
+        }
+    }
+
+    void Queue(const std::string &s) { out_ += s; }
+
+    void Write() {
+        while (!out_.empty()) {
+            const ssize_t res = write(fd_, out_.data(), out_.size());
+            if (res < 0) {
+                assert(errno == EAGAIN || errno == EWOULDBLOCK);
+                return;
+            }
+            out_.erase(0, static_cast<size_t>(res));
+        }
+    }
+
+private:
+    int fd_;
+    std::string in_;
+    std::string out_;
+};
+
+template <typename Loop>
+static void TestPipeline(Loop *loop) {
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    Mux mux;
+    Server server(fds[1]);
+    okmongo::Connection conn(fds[0], &mux);
+    assert(loop->Add(&conn));
+
+    constexpr int32_t kNumRequests = 64;
+    const std::string pad(64 * 1024, 'x');
+    std::vector<Reply> replies(kNumRequests);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < kNumRequests; ++i) {
+        ids.push_back(mux.NextRequestId());
+        mux.Expect(ids.back(), &replies[static_cast<size_t>(i)]);
+    }
+
+    okmongo::BsonWriter w;
+    size_t sent = 0;
+    std::vector<int32_t> received;
+    bool answered = false;
+    while (mux.InFlight() > 0) {
+        assert(conn.Open());
+        while (sent < ids.size()) {
+            // Requests are big enough that they don't all fit in the socket
+            // buffers (or in the output buffer of the connection); half of
+            // them have external segments.
+            MakeRequest(&w, ids[sent], pad, ids[sent] % 2 == 0 ? 1024 : 0);
+            if (conn.Send(w) != okmongo::Connection::SendResult::kQueued) {
+                break;
+            }
+            ++sent;
+        }
+        loop->RunOnce(10);
+        server.Read(&received);
+        if (!answered && received.size() == ids.size()) {
+            assert(received == ids);
+            for (auto it = received.rbegin(); it != received.rend(); ++it) {
+                server.Queue(MakeNumberedReply(ReplyHeader(*it), *it));
+            }
+            answered = true;
+        }
+        server.Write();
+    }
+    for (int32_t i = 0; i < kNumRequests; ++i) {
+        const Reply &r = replies[static_cast<size_t>(i)];
+        assert(r.Done());
+        assert(r.i == ids[static_cast<size_t>(i)]);
+    }
+    assert(conn.Pending() == 0);
+
+    // The server going away closes the connection.
+    close(fds[1]);
+    for (int i = 0; i < 10 && conn.Open(); ++i) {
+        loop->RunOnce(10);
+    }
+    assert(conn.state() == okmongo::Connection::State::kClosed);
+    loop->Remove(&conn);
+    assert(conn.Send(w) == okmongo::Connection::SendResult::kClosed);
+    close(fds[0]);
+}
+
+// Messages bigger than the output buffer are written out of their writer
+template <typename Loop>
+static void TestInPlace(Loop *loop) {
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    Mux mux;
+    Server server(fds[1]);
+    okmongo::Connection conn(fds[0], &mux);
+    assert(loop->Add(&conn));
+
+    const std::string pad(3 * static_cast<size_t>(conn.BufferSize()), 'x');
+    okmongo::BsonWriter big, small;
+    MakeRequest(&big, 2, pad, 1024);  // With external segments
+    assert(big.IovecCount() > 1);
+    MakeRequest(&small, 3, "");
+    assert(conn.Send(big) == okmongo::Connection::SendResult::kTooLarge);
+    assert(conn.Send(small) == okmongo::Connection::SendResult::kQueued);
+    assert(conn.SendInPlace(big) == okmongo::Connection::SendResult::kQueued);
+    // Nothing goes after it until it is out
+    assert(conn.Send(small) == okmongo::Connection::SendResult::kFull);
+    assert(conn.SendInPlace(small) == okmongo::Connection::SendResult::kFull);
+
+    std::vector<int32_t> received;
+    while (conn.SendingInPlace() || received.size() < 2) {
+        assert(conn.Open());
+        loop->RunOnce(10);
+        server.Read(&received);
+    }
+    assert(received == std::vector<int32_t>({3, 2}));
+    assert(conn.Pending() == 0);
+    assert(conn.Send(small) == okmongo::Connection::SendResult::kQueued);
+    loop->Remove(&conn);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+// Removing a connection whose peer stopped reading drops the write in flight;
+// the loop can still be destroyed.
+template <typename Loop, typename... Args>
+static void TestRemoveStalled(Args... args) {
+    int fds[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) == 0);
+    {
+        Mux mux;
+        okmongo::Connection conn(fds[0], &mux);
+        okmongo::BsonWriter w;
+        Loop loop(args...);
+        if (loop.Ok()) {
+            assert(loop.Add(&conn));
+            MakeRequest(&w, 2,
+                        std::string(64 * static_cast<size_t>(conn.BufferSize()),
+                                    'x'));
+            assert(conn.SendInPlace(w) ==
+                   okmongo::Connection::SendResult::kQueued);
+            // The socket buffers fill up
+            for (int i = 0; i < 10; ++i) {
+                loop.RunOnce(10);
+            }
+            assert(conn.SendingInPlace());
+            loop.Remove(&conn);
+        }
+    }
+    close(fds[0]);
+    close(fds[1]);
+}
+
+int main() {
+    okmongo::EpollLoop epoll_loop(256 * 1024);
+    assert(epoll_loop.Ok());
+    TestPipeline(&epoll_loop);
+    TestInPlace(&epoll_loop);
+    TestRemoveStalled<okmongo::EpollLoop>(64 * 1024);
+#ifdef HAVE_LIBURING
+    TestRemoveStalled<okmongo::UringLoop>(1, 64 * 1024);
+    okmongo::UringLoop uring_loop(4, 256 * 1024);
+    // The ring might not be available (old kernels, seccomp...)
+    if (uring_loop.Ok()) {
+        TestPipeline(&uring_loop);
+        TestInPlace(&uring_loop);
+    }
+#endif
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,258 @@
+#include "json_reader.h"
+#include "bson_dumper.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Reads JSON back into bson, in all possible chunk sizes.
+
+static std::string Read(const std::string &json, size_t chunk,
+                        int32_t *consumed = nullptr) {
+    okmongo::BsonWriter w;
+    okmongo::JsonReader r(&w);
+    int32_t total = 0;
+    for (size_t pos = 0; pos < json.size() && !r.Done(); pos += chunk) {
+        const int32_t len =
+                static_cast<int32_t>(std::min(chunk, json.size() - pos));
+        const int32_t n = r.Consume(json.data() + pos, len);
+        if (n < 0) {
+            assert(r.Failed() && r.ErrorMsg() != nullptr);
+            assert(w.len() == 0);
+            return "error";
+        }
+        total += n;
+    }
+    if (consumed != nullptr) {
+        *consumed = total;
+    }
+    assert(r.Done() && !r.Failed());
+    return w.ToString();
+}
+
+static void CheckRead(const std::string &json, const std::string &expected) {
+    for (size_t chunk = 1; chunk <= json.size(); ++chunk) {
+        if (Read(json, chunk) != expected) {
+            std::cerr << "Chunk size " << chunk << " failed on:\n"
+                      << json << std::endl;
+            exit(1);
+        }
+    }
+}
+
+// Whatever `BsonDumper` prints has to be read back as the same bson.
+static void TestRoundTrip() {
+    const char oid[okmongo::kObjectIdLen] = {'\x01', '\xff', 'a', 'b'};
+    std::string bytes;
+    for (int c = 0; c < 256; ++c) {
+        bytes.push_back(static_cast<char>(c));
+    }
+    okmongo::BsonWriter w;
+    w.Document();
+    {
+        w.Element("int32", -12);
+        w.Element("int64", static_cast<int64_t>(1) << 40);
+        w.Element("small_int64", static_cast<int64_t>(3));
+        w.Element("double", 1.5);
+        w.Element("null", nullptr);
+        w.Element("bool", true);
+        w.Element("bool2", false);
+        w.Element("string", bytes);
+        w.Element("esc\"aped\tkey", "");
+        w.ElementUtcDatetime("date", 1400000000);
+        w.ElementUtcDatetime("old_date", -5);
+        w.ElementObjectId("objectid", oid);
+        w.ElementTimestamp("timestamp", (INT64_C(7) << 32) | 12345);
+        w.ElementBindata("bin_data", okmongo::BindataSubtype::kUuid,
+                         bytes.data(), static_cast<int32_t>(bytes.size()));
+        w.PushDocument("empty");
+        w.Pop();
+        w.PushArray("empty_array");
+        w.Pop();
+        w.PushArray("array");
+        {
+            w.Element(0, "world");
+            w.Element(1, 1.25);
+            w.PushDocument(2);
+            {
+                w.ElementObjectId("_id", oid);
+                w.PushArray("deeper");
+                w.Element(0, 1);
+                w.Pop();
+            }
+            w.Pop();
+            w.PushDocument(3);
+            w.Pop();
+        }
+        w.Pop();
+        w.PushDocument("$set");
+        w.Element("a", 1);
+        w.Pop();
+    }
+    w.Pop();
+    const std::string bson = w.ToString();
+    std::string json;
+    okmongo::BsonDocBufferDumper d(&json);
+    d.Consume(bson.data(), static_cast<int32_t>(bson.size()));
+    CheckRead(json, bson);
+
+    std::string compact;
+    okmongo::BsonDocBufferDumper cd(&compact, okmongo::DumpStyle::kCompact);
+    cd.Consume(bson.data(), static_cast<int32_t>(bson.size()));
+    CheckRead(compact, bson);
+}
+
+static void TestJson() {
+    okmongo::BsonWriter w;
+    w.Document();
+    {
+        w.PushArray("a");
+        {
+            w.Element(0, 1);
+            w.Element(1, 2.5);
+            w.Element(2, -300.0);
+            w.Element(3, "x\xc3\xa9\xf0\x9f\x98\x80/\b\f\n\r");
+            w.Element(4, std::string("nul\0byte", 8));
+        }
+        w.Pop();
+        w.Element("big", INT64_C(12345678901));
+        w.Element("huge", 1e20);
+        w.Element("zero", 0);
+        w.Element("neg", INT64_C(-9223372036854775807) - 1);
+        w.ElementUtcDatetime("d", 42);
+        w.ElementUtcDatetime("epoch", 0);
+        w.Element("long", static_cast<int64_t>(5));
+    }
+    w.Pop();
+    const std::string json =
+            " {\"a\" :[1,2.5,-3e2 ,\"x\\u00e9\\ud83d\\ude00\\/\\b\\f\\n\\r\","
+            "\"nul\\u0000byte\"], \"big\":12345678901,\n"
+            "\"huge\": 100000000000000000000, \"zero\": 0,"
+            "\"neg\": -9223372036854775808,"
+            "\"d\": {\"$date\": 42},"
+            "\"epoch\": {\"$date\": \"1970-01-01T00:00:00Z\"},"
+            "\"long\": {\"$numberLong\": \"5\"}}";
+    CheckRead(json, w.ToString());
+
+    // Reading stops at the end of the document
+    int32_t consumed;
+    const std::string two = "{\"doc\": 1} {\"doc\": 2}";
+    w.Clear();
+    w.Document();
+    w.Element("doc", 1);
+    w.Pop();
+    assert(Read(two, two.size(), &consumed) == w.ToString());
+    assert(consumed == 10);
+}
+
+static void TestErrors() {
+    const char *bad[] = {
+            "[]",
+            "{\"a\" 1}",
+            "{\"a\": 1,}",
+            "{\"a\": [1}",
+            "{\"a\": 01}",
+            "{\"a\": 1.}",
+            "{\"a\": tru}",
+            "{\"a\": \"\\ud83d\"}",
+            "{\"a\": \"\\q\"}",
+            "{\"a\": \"\x01\"}",
+            "{\"a\\u0000\": 1}",
+            "{\"a\": {\"$oid\": \"12\"}}",
+            "{\"a\": {\"$oid\": 12}}",
+            "{\"a\": {\"$date\": \"yesterday\"}}",
+            "{\"a\": {\"$binary\": \"abc\"}}",
+            "{\"a\": {\"$timestamp\": {\"i\": 1}}}",
+            "{\"a\": {\"$numberLong\": \"1\", \"b\": [1]}}",
+    };
+    for (const char *json : bad) {
+        const std::string s = json;
+        for (size_t chunk = 1; chunk <= s.size(); ++chunk) {
+            const std::string res = Read(s + " ", chunk);
+            if (res != "error") {
+                std::cerr << "Should have failed: " << s << std::endl;
+                exit(1);
+            }
+        }
+    }
+    std::string deep;
+    for (int i = 0; i < okmongo::JsonReader::kMaxDepth + 1; ++i) {
+        deep += "{\"a\":";
+    }
+    assert(Read(deep, deep.size()) == "error");
+
+    // What was in the writer before the document is left alone
+    okmongo::BsonWriter w;
+    w.Document();
+    w.Element("before", 1);
+    const std::string before = w.ToString();
+    okmongo::JsonReader r(&w);
+    const std::string json = "{\"a\": [{\"b\": [1, 2}]}";
+    assert(r.Consume(json.data(), static_cast<int32_t>(json.size())) == -1);
+    assert(w.ToString() == before);
+    r.Clear();
+    assert(r.Consume("{\"a\": [{", 8) == 8);
+    r.Cancel();
+    assert(r.Failed());
+    assert(w.ToString() == before);
+}
+
+struct Doc {
+    int32_t i;
+    std::string s;
+};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    w->Element("i", d.i);
+    w->Element("s", d.s);
+    return true;
+}
+}  // namespace okmongo
+
+static void TestInsert() {
+    std::vector<Doc> docs;
+    std::vector<std::string> texts;
+    for (int32_t i = 0; i < 3000; ++i) {
+        docs.push_back(Doc{i, std::string(static_cast<size_t>(i % 50), 'x')});
+        texts.push_back("{\"i\": " + std::to_string(i) + ", \"s\": \"" +
+                        docs.back().s + "\"}\n");
+    }
+    std::vector<okmongo::JsonDocument> json;
+    for (const std::string &t : texts) {
+        json.push_back(okmongo::JsonDocument{
+                t.data(), static_cast<int32_t>(t.size())});
+    }
+    auto curs = docs.cbegin();
+    auto json_curs = json.cbegin();
+    while (curs != docs.cend()) {
+        okmongo::BsonWriter expected, w;
+        assert(okmongo::FillInsertRangeOp(&expected, 1, "db", "coll", &curs,
+                                          docs.cend()));
+        assert(okmongo::FillInsertRangeOp(&w, 1, "db", "coll", &json_curs,
+                                          json.cend()));
+        assert(w.ToString() == expected.ToString());
+        assert(json_curs - json.cbegin() == curs - docs.cbegin());
+    }
+
+    // Invalid documents fail the whole operation
+    const std::string text[] = {"{\"i\": 1}", "{\"i\": }", "{\"i\": 2} x",
+                                "{\"i\": [1,"};
+    for (size_t i = 1; i < 4; ++i) {
+        const okmongo::JsonDocument bad[] = {
+                {text[0].data(), static_cast<int32_t>(text[0].size())},
+                {text[i].data(), static_cast<int32_t>(text[i].size())}};
+        const okmongo::JsonDocument *bad_curs = bad;
+        okmongo::BsonWriter w;
+        assert(!okmongo::FillInsertRangeOp(&w, 1, "db", "coll", &bad_curs,
+                                           bad + 2));
+    }
+}
+
+int main() {
+    TestRoundTrip();
+    TestJson();
+    TestErrors();
+    TestInsert();
+    std::cout << "ok" << std::endl;
+}
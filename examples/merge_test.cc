@@ -0,0 +1,254 @@
+#include "merge.h"
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Merges the replies of fake servers and checks them against a sort.
+
+// A server with a sorted result set, returned `batch` documents at a time
+struct Server {
+    std::vector<int32_t> values;
+    int64_t cursor_id;
+    size_t batch;
+    size_t pos = 0;
+    int32_t replies = 0;
+
+    std::string Reply(int32_t request_id) {
+        okmongo::BsonWriter w;
+        const size_t n = std::min(batch, values.size() - pos);
+        okmongo::ResponseHeader hdr = {};
+        hdr.request_id = request_id;
+        hdr.op_code = static_cast<int32_t>(okmongo::MongoOpcode::kReply);
+        hdr.cursor_id = pos + n == values.size() ? 0 : cursor_id;
+        hdr.number_returned = static_cast<int32_t>(n);
+        w.AppendRaw(hdr);
+        for (size_t i = 0; i < n; ++i, ++pos) {
+            w.Document();
+            w.PushDocument("k");
+            w.Element("v", values[pos]);
+            w.Pop();
+            w.Element("src", static_cast<int64_t>(cursor_id));
+            w.Pop();
+        }
+        w.FlushLen();
+        ++replies;
+        return w.ToString();
+    }
+};
+
+template <>
+bool okmongo::BsonWriteFields<int>(okmongo::BsonWriter *w, const int &i) {
+    w->Element("i", i);
+    return true;
+}
+
+static void Feed(okmongo::CursorMerger *merger, int32_t source,
+                 const std::string &reply) {
+    // In small chunks to split documents
+    for (size_t pos = 0; pos < reply.size(); pos += 7) {
+        const int32_t len =
+                static_cast<int32_t>(std::min<size_t>(7, reply.size() - pos));
+        assert(merger->Consume(source, reply.data() + pos, len) == len);
+    }
+}
+
+static okmongo::BsonValue MakeDoc(okmongo::BsonWriter *w, int32_t a,
+                                  double b) {
+    w->Clear();
+    w->Document();
+    w->Element("a", a);
+    w->PushDocument("x");
+    w->Element("b", b);
+    w->Pop();
+    w->Pop();
+    return okmongo::BsonValue(w->data(), w->len());
+}
+
+static void TestSortKey() {
+    const okmongo::SortKey key({{"a", 1}, {"x.b", -1}});
+    okmongo::BsonWriter w1, w2, w3;
+    const okmongo::BsonValue d1 = MakeDoc(&w1, 1, 2.5);
+    const okmongo::BsonValue d2 = MakeDoc(&w2, 1, 3);
+    const okmongo::BsonValue d3 = MakeDoc(&w3, 2, 0);
+    assert(key.Compare(d1, d1) == 0);
+    assert(key.Compare(d2, d1) < 0 && key.Compare(d1, d2) > 0);
+    assert(key.Compare(d1, d3) < 0 && key.Compare(d3, d2) > 0);
+
+    // Missing fields are nulls: before everything else
+    const okmongo::SortKey missing({{"x.c", 1}, {"a", -1}});
+    assert(missing.Compare(d3, d1) < 0);
+}
+
+// Run the merge to the end, sending getMores when they are wanted
+static std::vector<int32_t> Merge(okmongo::CursorMerger *merger,
+                                  std::vector<Server> *servers) {
+    std::vector<int32_t> res;
+    okmongo::BsonWriter w;
+    int32_t request_id = 100;
+    for (int32_t i = 0; i < merger->Sources(); ++i) {
+        Feed(merger, i, (*servers)[static_cast<size_t>(i)].Reply(i));
+    }
+    for (;;) {
+        okmongo::BsonValue doc;
+        while (merger->Next(&doc)) {
+            res.push_back(doc.GetField("k").GetField("v").GetInt32());
+        }
+        if (!merger->Waiting()) {
+            break;
+        }
+        for (int32_t i = 0; i < merger->Sources(); ++i) {
+            Server &s = (*servers)[static_cast<size_t>(i)];
+            w.Clear();
+            if (merger->FillGetMore(i, &w, ++request_id)) {
+                assert(s.pos < s.values.size());
+                Feed(merger, i, s.Reply(request_id));
+            }
+        }
+    }
+    return res;
+}
+
+static std::vector<Server> MakeServers() {
+    std::vector<Server> res(3);
+    for (int32_t i = 0; i < 60; ++i) {
+        Server &s = res[static_cast<size_t>(i % 7 == 0 ? 2 : i % 2)];
+        s.values.push_back(i / 3);  // With duplicates
+    }
+    for (size_t i = 0; i < res.size(); ++i) {
+        res[i].cursor_id = 42 + static_cast<int64_t>(i);
+        res[i].batch = 3 + i;
+    }
+    return res;
+}
+
+static std::vector<int32_t> Expected(const std::vector<Server> &servers) {
+    std::vector<int32_t> res;
+    for (const Server &s : servers) {
+        res.insert(res.end(), s.values.begin(), s.values.end());
+    }
+    std::sort(res.begin(), res.end());
+    return res;
+}
+
+static void TestMerge() {
+    const okmongo::SortKey key({{"k.v", 1}});
+    std::vector<Server> servers = MakeServers();
+    okmongo::CursorMerger merger(key, {0, 0, 0, 0});
+    for (size_t i = 0; i < servers.size(); ++i) {
+        merger.AddSource("db", "coll");
+    }
+    okmongo::BsonValue doc;
+    assert(!merger.Next(&doc) && merger.Waiting() && !merger.Done());
+
+    const std::vector<int32_t> res = Merge(&merger, &servers);
+    assert(res == Expected(servers));
+    assert(merger.Done() && !merger.Failed());
+    assert(merger.Returned() == static_cast<int32_t>(res.size()));
+    for (int32_t i = 0; i < merger.Sources(); ++i) {
+        assert(!merger.WantsKill(i) && !merger.WantsGetMore(i));
+    }
+
+    // Ties keep the order of the sources
+    okmongo::CursorMerger ties(key, {0, 0, 0, 0});
+    std::vector<Server> same(2);
+    for (size_t i = 0; i < same.size(); ++i) {
+        same[i].values = {1, 1, 2};
+        same[i].cursor_id = static_cast<int64_t>(i);
+        same[i].batch = 10;
+        ties.AddSource("db", "coll");
+    }
+    std::vector<int64_t> order;
+    for (int32_t i = 0; i < 2; ++i) {
+        Feed(&ties, i, same[static_cast<size_t>(i)].Reply(i));
+    }
+    while (ties.Next(&doc)) {
+        order.push_back(doc.GetField("src").GetInt64());
+    }
+    assert(ties.Done());
+    assert(order == std::vector<int64_t>({0, 0, 1, 1, 0, 1}));
+}
+
+static void TestPrefetch() {
+    const okmongo::SortKey key({{"k.v", 1}});
+    std::vector<Server> servers(1);
+    servers[0].values = {1, 2, 3, 4, 5, 6, 7, 8};
+    servers[0].cursor_id = 42;
+    servers[0].batch = 2;
+    okmongo::CursorMerger merger(key, {0, 0, 0, 0});
+    merger.AddSource("db", "coll");
+    okmongo::BsonWriter w;
+    Feed(&merger, 0, servers[0].Reply(1));
+    // One batch waiting: prefetch the next one...
+    assert(merger.FillGetMore(0, &w, 2));
+    Feed(&merger, 0, servers[0].Reply(2));
+    // ... but not more until the first one is merged
+    assert(!merger.WantsGetMore(0));
+    okmongo::BsonValue doc;
+    assert(merger.Next(&doc) && merger.Next(&doc));
+    assert(merger.WantsGetMore(0));
+}
+
+static void TestLimit() {
+    const okmongo::SortKey key({{"k.v", 1}});
+    std::vector<Server> servers = MakeServers();
+    okmongo::CursorMerger merger(key, {0, 100, 4, 7});
+    for (size_t i = 0; i < servers.size(); ++i) {
+        merger.AddSource("db", "coll");
+    }
+    // The batches are no bigger than the documents we need
+    okmongo::BsonWriter w, expected;
+    assert(merger.FillQuery(0, &w, 1, 5));
+    assert(okmongo::FillQueryOp(&expected, 1, "db", "coll", 5,
+                                okmongo::QueryOptions{0, 0, 11}));
+    assert(w.ToString() == expected.ToString());
+
+    const std::vector<int32_t> all = Expected(servers);
+    for (Server &s : servers) {
+        s.batch = 2;
+    }
+    const std::vector<int32_t> res = Merge(&merger, &servers);
+    assert(res == std::vector<int32_t>(all.begin() + 4, all.begin() + 11));
+    assert(merger.Done());
+    // We stopped pulling batches long before the end
+    for (int32_t i = 0; i < merger.Sources(); ++i) {
+        const Server &s = servers[static_cast<size_t>(i)];
+        assert(s.pos < s.values.size() && s.pos <= 11 + s.batch);
+        assert(!merger.WantsGetMore(i));
+        // ... and their cursors need to be closed
+        assert(merger.WantsKill(i));
+        w.Clear();
+        expected.Clear();
+        assert(merger.FillKill(i, &w, 7));
+        okmongo::FillKillCursorsOp(&expected, 7, s.cursor_id);
+        assert(w.ToString() == expected.ToString());
+        assert(!merger.WantsKill(i));
+    }
+    // Late replies are ignored
+    Feed(&merger, 0, servers[0].Reply(8));
+    okmongo::BsonValue doc;
+    assert(!merger.Next(&doc) && merger.Returned() == 7);
+}
+
+static void TestErrors() {
+    const okmongo::SortKey key({{"k.v", 1}});
+    okmongo::CursorMerger merger(key, {0, 0, 0, 0});
+    merger.AddSource("db", "coll");
+    okmongo::ResponseHeader hdr = {};
+    hdr.message_length = sizeof(hdr);
+    hdr.op_code = static_cast<int32_t>(okmongo::MongoOpcode::kReply);
+    hdr.response_flags = okmongo::kCursorNotFound;
+    assert(merger.Consume(0, reinterpret_cast<const char *>(&hdr),
+                          sizeof(hdr)) == -1);
+    okmongo::BsonValue doc;
+    assert(merger.Failed() && !merger.Next(&doc));
+}
+
+int main() {
+    TestSortKey();
+    TestMerge();
+    TestPrefetch();
+    TestLimit();
+    TestErrors();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,132 @@
+#include "multiplexer.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Replies to several requests, back to back and out of order, must each end
+// up in the right reader.
+
+class Mux : public okmongo::ResponseMultiplexer<Mux> {
+public:
+    std::vector<int32_t> done;
+    int32_t unexpected = 0;
+
+    void EmitReplyDone(int32_t request_id) { done.push_back(request_id); }
+
+    void EmitUnexpectedReply(const okmongo::MsgHeader &) { ++unexpected; }
+};
+
+// Counts documents and remembers the value of "i" in the first one.
+class Counter : public okmongo::BsonValueResponseReader<Counter> {
+public:
+    int32_t docs = 0;
+    int32_t first = -1;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        if (docs++ == 0) {
+            first = v.GetField("i").GetInt32();
+        }
+    }
+
+    void EmitError(const char *) { assert(false); }
+};
+
+class MsgCounter : public okmongo::BsonValueMsgReader<MsgCounter> {
+public:
+    int32_t docs = 0;
+    int32_t first = -1;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        if (docs++ == 0) {
+            first = v.GetField("i").GetInt32();
+        }
+    }
+
+    void EmitError(const char *) { assert(false); }
+};
+
+static void WriteDoc(okmongo::BsonWriter *w, int32_t i) {
+    w->Document();
+    w->Element("i", i);
+    w->Element("pad", std::string(static_cast<size_t>(i), 'p'));
+    w->Pop();
+}
+
+static std::string MakeReplyTo(int32_t response_to, int32_t num_docs) {
+    return MakeReply(ReplyHeader(response_to, num_docs),
+                     [response_to](okmongo::BsonWriter *w, int32_t i) {
+                         WriteDoc(w, response_to * 100 + i);
+                     });
+}
+
+static std::string MakeMsgReply(int32_t response_to) {
+    okmongo::BsonWriter w;
+    okmongo::OpMsgHeader hdr(0, 0);
+    hdr.response_to = response_to;
+    w.AppendRaw(hdr);
+    w.AppendRaw<uint8_t>(0);
+    WriteDoc(&w, response_to * 100);
+    w.FlushLen();
+    return w.ToString();
+}
+
+static void TestOutOfOrder() {
+    Mux probe;
+    const int32_t a = probe.NextRequestId(), b = probe.NextRequestId(),
+                  c = probe.NextRequestId();
+    assert(a != b && b != c && a != c);
+
+    // c, <unexpected>, a, b
+    const std::string stream = MakeMsgReply(c) + MakeReplyTo(77, 2) +
+                               MakeReplyTo(a, 3) + MakeReplyTo(b, 1);
+    for (size_t chunk = 1; chunk <= stream.size(); ++chunk) {
+        Mux mux;
+        Counter ra, rb;
+        MsgCounter rc;
+        mux.Expect(a, &ra);
+        mux.Expect(b, &rb);
+        mux.Expect(c, &rc);
+        assert(mux.InFlight() == 3);
+        for (size_t pos = 0; pos < stream.size(); pos += chunk) {
+            const int32_t len = static_cast<int32_t>(
+                    std::min(chunk, stream.size() - pos));
+            assert(mux.Consume(stream.data() + pos, len) == len);
+        }
+        assert(mux.InFlight() == 0);
+        assert(!mux.InReply());
+        assert(mux.unexpected == 1);
+        assert((mux.done == std::vector<int32_t>{c, a, b}));
+        assert(ra.Done() && ra.docs == 3 && ra.first == a * 100);
+        assert(rb.Done() && rb.docs == 1 && rb.first == b * 100);
+        assert(rc.Done() && rc.docs == 1 && rc.first == c * 100);
+    }
+}
+
+static void TestCancel() {
+    Mux mux;
+    Counter r;
+    const int32_t id = mux.NextRequestId();
+    mux.Expect(id, &r);
+    const std::string reply = MakeReplyTo(id, 2);
+    assert(mux.Consume(reply.data(), 20) == 20);
+    assert(mux.InReply());
+    // Ids of replies being read aren't reused
+    assert(mux.NextRequestId() != id);
+    mux.Cancel(id);
+    const int32_t len = static_cast<int32_t>(reply.size()) - 20;
+    assert(mux.Consume(reply.data() + 20, len) == len);
+    assert(mux.done.empty());
+    assert(!r.Done());
+
+    // Message too short: the stream is lost
+    const char bad[16] = {3};
+    assert(mux.Consume(bad, sizeof(bad)) == -1);
+    assert(mux.Consume(reply.data(), 4) == -1);
+}
+
+int main() {
+    TestOutOfOrder();
+    TestCancel();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,149 @@
+#include "parallel_insert.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The parallel encoder must write exactly the same messages as the
+// sequential `Fill*InsertRangeOp`.
+
+struct Doc {
+    int32_t i;
+    std::string name;
+};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    if (d.i < 0) {
+        return false;
+    }
+    w->Element("i", d.i);
+    w->Element("name", d.name);
+    return true;
+}
+}  // namespace okmongo
+
+typedef std::vector<Doc>::const_iterator It;
+
+static std::vector<Doc> MakeDocs(int32_t n) {
+    std::vector<Doc> docs;
+    for (int32_t i = 0; i < n; ++i) {
+        // A few big documents in the middle of small ones
+        const size_t len = (i % 97 == 0) ? 20000 : static_cast<size_t>(i % 13);
+        docs.push_back(Doc{i, std::string(len, 'x')});
+    }
+    return docs;
+}
+
+// Split `docs` in batches with both encoders and compare the messages
+template <typename Parallel, typename Sequential>
+static void CheckBatches(const std::vector<Doc> &docs,
+                         const okmongo::BatchLimits &limits, Parallel par,
+                         Sequential seq) {
+    for (int32_t threads : {1, 2, 5}) {
+        okmongo::ParallelInsertEncoder enc(threads);
+        assert(enc.threads() == threads);
+        for (int32_t threshold : {0, 512}) {
+            okmongo::BsonWriter w, expected;
+            w.SetExternalThreshold(threshold);
+            expected.SetExternalThreshold(threshold);
+            It c1 = docs.begin(), c2 = docs.begin();
+            int32_t batches = 0;
+            while (c1 != docs.end()) {
+                w.Clear();
+                expected.Clear();
+                assert(seq(&expected, &c1, docs.cend(), limits));
+                assert(par(&enc, &w, &c2, docs.cend(), limits));
+                assert(c1 == c2);
+                assert(w.ToString() == expected.ToString());
+                // The parallel encoder doesn't point at its own buffers
+                assert(w.MessageLen() == w.len());
+                ++batches;
+            }
+            assert(batches > 1);
+        }
+    }
+}
+
+static void TestInsertRange() {
+    const std::vector<Doc> docs = MakeDocs(5000);
+    CheckBatches(docs, okmongo::kDefaultBatchLimits,
+                 [](okmongo::ParallelInsertEncoder *enc, okmongo::BsonWriter *w,
+                    It *curs, It end, const okmongo::BatchLimits &l) {
+                     return enc->FillInsertRangeOp(w, 1, "db", "coll", curs,
+                                                   end, l);
+                 },
+                 [](okmongo::BsonWriter *w, It *curs, It end,
+                    const okmongo::BatchLimits &l) {
+                     return okmongo::FillInsertRangeOp(w, 1, "db", "coll",
+                                                       curs, end, l);
+                 });
+    // Batches cut by size, over several waves
+    const okmongo::BatchLimits limits = {100000, 300000};
+    CheckBatches(docs, limits,
+                 [](okmongo::ParallelInsertEncoder *enc, okmongo::BsonWriter *w,
+                    It *curs, It end, const okmongo::BatchLimits &l) {
+                     return enc->FillMsgInsertRangeOp<okmongo::Unacknowledged>(
+                             w, 2, "db", "coll", curs, end, l);
+                 },
+                 [](okmongo::BsonWriter *w, It *curs, It end,
+                    const okmongo::BatchLimits &l) {
+                     return okmongo::FillMsgInsertRangeOp<
+                             okmongo::Unacknowledged>(w, 2, "db", "coll", curs,
+                                                      end, l);
+                 });
+    // Batches cut by count
+    const okmongo::BatchLimits counted = {1234, okmongo::kMaxMessageSize};
+    CheckBatches(docs, counted,
+                 [](okmongo::ParallelInsertEncoder *enc, okmongo::BsonWriter *w,
+                    It *curs, It end, const okmongo::BatchLimits &l) {
+                     return enc->FillMsgInsertRangeOp(w, 3, "db", "coll", curs,
+                                                      end, l);
+                 },
+                 [](okmongo::BsonWriter *w, It *curs, It end,
+                    const okmongo::BatchLimits &l) {
+                     return okmongo::FillMsgInsertRangeOp(w, 3, "db", "coll",
+                                                          curs, end, l);
+                 });
+}
+
+static void TestErrors() {
+    okmongo::ParallelInsertEncoder enc(3);
+    okmongo::BsonWriter w;
+    std::vector<Doc> docs = MakeDocs(100);
+
+    // Not even one document fits
+    It curs = docs.begin();
+    const okmongo::BatchLimits tiny = {10, 1000};
+    assert(!enc.FillInsertRangeOp(&w, 1, "db", "coll", &curs, docs.cend(),
+                                  tiny));
+    assert(curs == docs.begin());
+
+    // A document that can't be serialised
+    docs[42].i = -1;
+    w.Clear();
+    assert(!enc.FillInsertRangeOp(&w, 1, "db", "coll", &curs, docs.cend()));
+    assert(curs == docs.begin() + 42);
+    // ... unless the batch stops before it
+    curs = docs.begin();
+    const okmongo::BatchLimits small = {40, okmongo::kMaxBsonObjectSize};
+    w.Clear();
+    assert(enc.FillInsertRangeOp(&w, 1, "db", "coll", &curs, docs.cend(),
+                                 small));
+    assert(curs == docs.begin() + 40);
+
+    // Empty ranges
+    w.Clear();
+    okmongo::BsonWriter expected;
+    curs = docs.begin();
+    assert(enc.FillMsgInsertRangeOp(&w, 1, "db", "coll", &curs, curs));
+    It c2 = docs.begin();
+    assert(okmongo::FillMsgInsertRangeOp(&expected, 1, "db", "coll", &c2, c2));
+    assert(w.ToString() == expected.ToString());
+}
+
+int main() {
+    TestInsertRange();
+    TestErrors();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,248 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "pool.h"
+#include "test_util.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+// A pool over socketpairs: the test plays a primary and a secondary that
+// answer the heartbeats and tag the replies to the other requests with their
+// name.
+
+struct All {};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<All>(BsonWriter *, const All &) {
+    return true;
+}
+}  // namespace okmongo
+
+class Reply : public okmongo::BsonValueResponseReader<Reply> {
+public:
+    std::string server;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        const okmongo::BsonValue name = v.GetField("server");
+        server.assign(name.GetData(), static_cast<size_t>(name.GetDataSize()));
+    }
+
+    void EmitError(const char *) { assert(false); }
+};
+
+// The server side of one of the connections
+class Server {
+public:
+    Server(int fd, const std::string &name, bool primary)
+        : fd_(fd), name_(name), primary_(primary) {}
+
+    // Answer everything that came in; returns the number of requests that
+    // weren't heartbeats.
+    int32_t Serve() {
+        char buf[4096];
+        ssize_t res;
+        while ((res = read(fd_, buf, sizeof(buf))) > 0) {
+            in_.append(buf, static_cast<size_t>(res));
+        }
+        // The client might have gone away
+        assert(res == 0 || errno == EAGAIN || errno == EWOULDBLOCK);
+        int32_t requests = 0;
+        while (in_.size() >= sizeof(okmongo::MsgHeader)) {
+            okmongo::MsgHeader hdr;
+            std::memcpy(&hdr, in_.data(), sizeof(hdr));
+            const size_t len = static_cast<size_t>(hdr.message_length);
+            if (in_.size() < len) {
+                break;
+            }
+            // OP_QUERY: header, flags and then the collection name.
+            const char *coll = in_.data() + sizeof(hdr) + sizeof(int32_t);
+            if (std::strcmp(coll, "admin.$cmd") == 0) {
+                ++heartbeats;
+                out_ += MakeReply(ReplyHeader(hdr.request_id),
+                                  [this](okmongo::BsonWriter *w, int32_t) {
+                                      WriteIsMaster(w);
+                                  });
+            } else {
+                ++requests;
+                out_ += MakeReply(ReplyHeader(hdr.request_id),
+                                  [this](okmongo::BsonWriter *w, int32_t) {
+                                      WriteName(w);
+                                  });
+            }
+            in_.erase(0, len);
+        }
+        while (!out_.empty()) {
+            const ssize_t n = write(fd_, out_.data(), out_.size());
+            assert(n > 0);
+            out_.erase(0, static_cast<size_t>(n));
+        }
+        return requests;
+    }
+
+    void Close() { close(fd_); }
+
+    int32_t heartbeats = 0;
+
+private:
+    void WriteIsMaster(okmongo::BsonWriter *w) const {
+        w->Document();
+        w->Element("ismaster", primary_);
+        w->Element("secondary", !primary_);
+        w->Element("setName", "rs0");
+        w->Element("ok", 1.0);
+        w->Pop();
+    }
+
+    void WriteName(okmongo::BsonWriter *w) const {
+        w->Document();
+        w->Element("server", name_);
+        w->Pop();
+    }
+
+    int fd_;
+    std::string name_;
+    bool primary_;
+    std::string in_;
+    std::string out_;
+};
+
+static void TestPool() {
+    constexpr int32_t kLinks = 2;
+    okmongo::EpollLoop loop(64 * 1024);
+    assert(loop.Ok());
+    okmongo::PoolOptions opts;
+    opts.heartbeat_interval_ms = 60000;
+    // Whichever answers first is as good as the other.
+    opts.local_threshold_ms = 60000;
+    okmongo::ConnectionPool pool(&loop, opts);
+
+    std::vector<int> client_fds;
+    std::vector<Server> servers;
+    for (const char *name : {"primary", "secondary"}) {
+        std::vector<int> fds;
+        for (int32_t i = 0; i < kLinks; ++i) {
+            int sp[2];
+            assert(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sp) ==
+                   0);
+            fds.push_back(sp[0]);
+            client_fds.push_back(sp[0]);
+            servers.emplace_back(sp[1], name, name[0] == 'p');
+        }
+        assert(pool.AddServer(name, fds) ==
+               static_cast<int32_t>(servers.size() / kLinks) - 1);
+    }
+    const auto serve = [&servers]() {
+        int32_t requests = 0;
+        for (Server &s : servers) {
+            requests += s.Serve();
+        }
+        return requests;
+    };
+
+    okmongo::BsonWriter w;
+    Reply reply;
+    int32_t id = pool.NextRequestId();
+    okmongo::FillQueryOp(&w, id, "db", "coll", All{});
+    // Nobody to send it to yet
+    assert(pool.Send(okmongo::ReadPreference::kNearest, w, id, &reply) == -1);
+
+    for (int i = 0; i < 100 && pool.Discovering(); ++i) {
+        pool.Heartbeat();
+        loop.RunOnce(10);
+        serve();
+        loop.RunOnce(10);
+    }
+    assert(!pool.Discovering());
+    assert(pool.InFlight() == 0);
+    const okmongo::Topology &t = pool.topology();
+    assert(t.server(0).type == okmongo::ServerType::kPrimary);
+    assert(t.server(1).type == okmongo::ServerType::kSecondary);
+    assert(t.server(0).rtt_us >= 0 && t.server(1).rtt_us >= 0);
+    // One heartbeat per server, not per connection
+    assert(servers[0].heartbeats + servers[1].heartbeats == 1);
+    assert(servers[2].heartbeats + servers[3].heartbeats == 1);
+    // Not due yet
+    pool.Heartbeat();
+    loop.RunOnce(0);
+    serve();
+    assert(servers[0].heartbeats + servers[1].heartbeats == 1);
+
+    // The requests are spread over the connections of the secondary.
+    constexpr int32_t kRequests = 8;
+    std::vector<Reply> replies(kRequests);
+    for (Reply &r : replies) {
+        id = pool.NextRequestId();
+        w.Clear();
+        okmongo::FillQueryOp(&w, id, "db", "coll", All{});
+        assert(pool.Send(okmongo::ReadPreference::kSecondary, w, id, &r) == 1);
+    }
+    assert(pool.InFlight() == kRequests);
+    assert(t.server(1).in_flight == kRequests);
+    loop.RunOnce(10);
+    assert(servers[0].Serve() == 0 && servers[1].Serve() == 0);
+    assert(servers[2].Serve() == kRequests / 2);
+    assert(servers[3].Serve() == kRequests / 2);
+    for (int i = 0; i < 100 && pool.InFlight() > 0; ++i) {
+        loop.RunOnce(10);
+    }
+    assert(pool.InFlight() == 0);
+    assert(t.server(1).in_flight == 0);
+    for (const Reply &r : replies) {
+        assert(r.Done() && r.server == "secondary");
+    }
+
+    id = pool.NextRequestId();
+    w.Clear();
+    okmongo::FillQueryOp(&w, id, "db", "coll", All{});
+    assert(pool.Send(okmongo::ReadPreference::kPrimary, w, id, &reply) == 0);
+    pool.Cancel(id);
+    assert(pool.InFlight() == 0 && t.server(0).in_flight == 0);
+    loop.RunOnce(10);
+    assert(serve() == 1);
+    loop.RunOnce(10);
+    assert(!reply.Done());
+
+    // The secondary goes away: reads fall back on the primary.
+    for (size_t i = 2; i < 4; ++i) {
+        shutdown(client_fds[i], SHUT_RDWR);
+    }
+    const okmongo::ServerType unknown = okmongo::ServerType::kUnknown;
+    for (int i = 0; i < 10 && t.server(1).type != unknown; ++i) {
+        loop.RunOnce(10);
+        pool.Heartbeat();
+    }
+    assert(t.server(1).type == okmongo::ServerType::kUnknown);
+    id = pool.NextRequestId();
+    w.Clear();
+    okmongo::FillQueryOp(&w, id, "db", "coll", All{});
+    assert(pool.Send(okmongo::ReadPreference::kSecondary, w, id, &reply) ==
+           -1);
+    assert(pool.Send(okmongo::ReadPreference::kSecondaryPreferred, w, id,
+                     &reply) == 0);
+    for (int i = 0; i < 100 && pool.InFlight() > 0; ++i) {
+        loop.RunOnce(10);
+        serve();
+    }
+    assert(reply.Done() && reply.server == "primary");
+
+    for (const int fd : client_fds) {
+        close(fd);
+    }
+    for (Server &s : servers) {
+        s.Close();
+    }
+}
+
+int main() {
+    TestPool();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,253 @@
+#include "mongo.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// Offline tests for the readers in mongo.h: we forge server replies with a
+// `BsonWriter` and feed them back in chunks of every possible size.
+
+static void WriteDoc(okmongo::BsonWriter *w, int32_t i) {
+    w->Document();
+    w->Element("i", i);
+    w->Element("name", std::string(static_cast<size_t>(i * 7), 'a'));
+    w->PushArray("arr");
+    for (int32_t j = 0; j < i; ++j) {
+        w->Element(j, static_cast<int64_t>(j));
+    }
+    w->Pop();
+    w->Pop();
+}
+
+class ValueCollector
+        : public okmongo::BsonValueResponseReader<ValueCollector> {
+public:
+    std::vector<int32_t> ids;
+    std::vector<size_t> name_lens;
+    bool failed = false;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        ids.push_back(v.GetField("i").GetInt32());
+        const okmongo::BsonValue name = v.GetField("name");
+        name_lens.push_back(static_cast<size_t>(name.GetDataSize()));
+    }
+
+    void EmitError(const char *msg) {
+        std::cerr << "Parse error: " << msg << std::endl;
+        failed = true;
+    }
+};
+
+template <typename Reader>
+static void Feed(Reader *r, const std::string &msg, size_t chunk) {
+    size_t pos = 0;
+    while (pos < msg.size()) {
+        const size_t len = std::min(chunk, msg.size() - pos);
+        const int32_t consumed =
+                r->Consume(msg.data() + pos, static_cast<int32_t>(len));
+        assert(consumed == static_cast<int32_t>(len));
+        pos += len;
+    }
+}
+
+static void TestBsonValueReader() {
+    const int32_t kNumDocs = 5;
+    const std::string reply = MakeReply(ReplyHeader(42, kNumDocs), WriteDoc);
+    for (size_t chunk = 1; chunk <= reply.size(); ++chunk) {
+        ValueCollector r;
+        Feed(&r, reply, chunk);
+        assert(r.Done());
+        assert(!r.failed);
+        assert(r.Header().response_to == 42);
+        assert(r.ids.size() == static_cast<size_t>(kNumDocs));
+        for (int32_t i = 0; i < kNumDocs; ++i) {
+            assert(r.ids[i] == i);
+            assert(r.name_lens[i] == static_cast<size_t>(i * 7));
+        }
+    }
+}
+
+static void WriteOpResult(okmongo::BsonWriter *w) {
+    w->Document();
+    {
+        w->Element("n", 3);
+        w->Element("nModified", 2);
+        w->PushArray("writeErrors");
+        {
+            w->PushDocument(0);
+            w->Element("index", 1);
+            w->Element("code", 11000);
+            w->Element("errmsg", "duplicate key");
+            w->Pop();
+        }
+        w->Pop();
+        w->PushDocument("unrelated");
+        {
+            w->Element("n", 12);
+            w->Element("ok", 0);
+        }
+        w->Pop();
+        w->Element("ok", 1);
+    }
+    w->Pop();
+}
+
+static std::string MakeOpReply() {
+    return MakeReply(ReplyHeader(0), [](okmongo::BsonWriter *w, int32_t) {
+        WriteOpResult(w);
+    });
+}
+
+static void CheckOpResult(const okmongo::OperationResponse &res) {
+    assert(res.ok == 1);
+    assert(res.n == 3);
+    assert(res.nModified == 2);
+    assert(res.errors.size() == 1);
+    assert(res.errors[0].index == 1);
+    assert(res.errors[0].code == 11000);
+    assert(res.errors[0].msg == "duplicate key");
+}
+
+static void TestOpResponseParser() {
+    const std::string reply = MakeOpReply();
+    for (size_t chunk = 1; chunk <= reply.size(); ++chunk) {
+        okmongo::OpResponseParser r;
+        Feed(&r, reply, chunk);
+        assert(r.Done());
+        CheckOpResult(r.Result());
+    }
+}
+
+//------------------------------------------------------------------------------
+// OP_MSG
+
+struct Doc {
+    int32_t i;
+};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    w->Element("i", d.i);
+    return true;
+}
+}  // namespace okmongo
+
+static std::string Str(const okmongo::BsonValue &v) {
+    return std::string(v.GetData(), static_cast<size_t>(v.GetDataSize()));
+}
+
+class MsgCollector : public okmongo::BsonValueMsgReader<MsgCollector> {
+public:
+    // One entry per document: "<sequence id>:<value of i>" ("" and the
+    // command name for the body).
+    std::vector<std::string> docs;
+    int32_t sequences = 0;
+    bool failed = false;
+
+    void EmitBsonValue(const okmongo::BsonValue &v) {
+        const okmongo::BsonValue i = v.GetField("i");
+        if (SequenceId().empty()) {
+            docs.push_back(":" + Str(v.GetField("insert")));
+            assert(Str(v.GetField("$db")) == "db");
+        } else {
+            docs.push_back(SequenceId() + ":" + std::to_string(i.GetInt32()));
+        }
+    }
+
+    void EmitSequenceDone() { ++sequences; }
+
+    void EmitError(const char *msg) {
+        std::cerr << "Parse error: " << msg << std::endl;
+        failed = true;
+    }
+};
+
+static std::string MakeMsgReply(uint32_t flags) {
+    okmongo::BsonWriter w;
+    w.AppendRaw(okmongo::OpMsgHeader(0, flags));
+    w.AppendRaw<uint8_t>(0);
+    WriteOpResult(&w);
+    if ((flags & okmongo::kChecksumPresent) != 0) {
+        w.AppendRaw<uint32_t>(0xdeadbeef);
+    }
+    w.FlushLen();
+    return w.ToString();
+}
+
+static void TestMsgInsert() {
+    okmongo::BsonWriter w;
+    okmongo::FillMsgInsertOp(&w, 5, "db", "coll", Doc{1}, Doc{2}, Doc{3});
+    const std::string msg = w.ToString();
+    for (size_t chunk = 1; chunk <= msg.size(); ++chunk) {
+        MsgCollector r;
+        Feed(&r, msg, chunk);
+        assert(r.Done());
+        assert(!r.failed);
+        assert(r.Header().request_id == 5);
+        assert(r.sequences == 1);
+        const std::vector<std::string> expected = {
+                ":coll", "documents:1", "documents:2", "documents:3"};
+        assert(r.docs == expected);
+    }
+
+    std::vector<Doc> docs;
+    for (int32_t i = 0; i < 2000; ++i) {
+        docs.push_back(Doc{i});
+    }
+    std::vector<Doc>::const_iterator curs = docs.begin();
+    w.Clear();
+    okmongo::FillMsgInsertRangeOp(&w, 6, "db", "coll", &curs, docs.cend());
+    // More than `kMaxWriteBatchSize` in one go
+    assert(curs == docs.end());
+    MsgCollector r;
+    Feed(&r, w.ToString(), 4096);
+    assert(r.Done());
+    assert(!r.failed);
+    assert(r.docs.size() == docs.size() + 1);
+    assert(r.docs.back() == "documents:1999");
+}
+
+static void TestMsgResponseParser() {
+    const uint32_t checksum = okmongo::kChecksumPresent;
+    for (uint32_t flags : {0u, checksum}) {
+        const std::string reply = MakeMsgReply(flags);
+        for (size_t chunk = 1; chunk <= reply.size(); ++chunk) {
+            okmongo::MsgResponseParser r;
+            Feed(&r, reply, chunk);
+            assert(r.Done());
+            CheckOpResult(r.Result());
+        }
+    }
+
+    // Unknown section kind
+    std::string reply = MakeMsgReply(0);
+    reply[sizeof(okmongo::OpMsgHeader)] = 2;
+    okmongo::MsgResponseParser r;
+    assert(r.Consume(reply.data(), static_cast<int32_t>(reply.size())) == -1);
+    assert(r.Result().errors.size() == 1);
+    assert(r.Result().errors[0].type == okmongo::CmdError::Type::ParseError);
+
+    // Only one body section
+    okmongo::BsonWriter w;
+    w.AppendRaw(okmongo::OpMsgHeader(0, 0));
+    for (int32_t i = 0; i < 2; ++i) {
+        w.AppendRaw<uint8_t>(0);
+        WriteOpResult(&w);
+    }
+    w.FlushLen();
+    reply = w.ToString();
+    okmongo::MsgResponseParser twice;
+    assert(twice.Consume(reply.data(), static_cast<int32_t>(reply.size())) ==
+           -1);
+    assert(twice.Result().errors.back().type ==
+           okmongo::CmdError::Type::ParseError);
+}
+
+int main() {
+    TestBsonValueReader();
+    TestOpResponseParser();
+    TestMsgInsert();
+    TestMsgResponseParser();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,138 @@
+#include "static_document.h"
+#include <iostream>
+#include <string>
+
+// Documents serialised at compile time must be byte for byte what a
+// `BsonWriter` writes.
+
+using okmongo::BsonTag;
+
+constexpr okmongo::StaticElement kIsMaster[] = {
+        okmongo::StaticInt32("ismaster", 1), okmongo::StaticEnd()};
+
+typedef okmongo::StaticDocument<kIsMaster> IsMaster;
+
+static_assert(IsMaster::kSize == 19, "Computed at compile time");
+static_assert(IsMaster::kBytes[4] == '\x10' && IsMaster::kBytes[14] == 1,
+              "Computed at compile time");
+
+constexpr okmongo::StaticElement kEverything[] = {
+        okmongo::StaticString("find", "coll"),
+        okmongo::StaticSlot("limit", BsonTag::kInt32),
+        okmongo::StaticInt64("big", -1234567890123LL),
+        okmongo::StaticBool("single", true),
+        okmongo::StaticNull("nothing"),
+        okmongo::StaticPushDocument("filter"),
+        okmongo::StaticSlot("score", BsonTag::kDouble),
+        okmongo::StaticPushArray("tags"),
+        okmongo::StaticString("a"),
+        okmongo::StaticInt32(2),
+        okmongo::StaticPushDocument(),
+        okmongo::StaticSlot("at", BsonTag::kUtcDatetime),
+        okmongo::StaticPop(),
+        okmongo::StaticBool(false),
+        okmongo::StaticInt32(4),
+        okmongo::StaticInt32(5),
+        okmongo::StaticInt32(6),
+        okmongo::StaticInt32(7),
+        okmongo::StaticInt32(8),
+        okmongo::StaticInt32(9),
+        okmongo::StaticNull(),
+        okmongo::StaticSlot(BsonTag::kBool),  // Key "11"
+        okmongo::StaticPop(),                 // tags
+        okmongo::StaticPushDocument("empty"),
+        okmongo::StaticPop(),
+        okmongo::StaticPop(),  // filter
+        okmongo::StaticSlot("n", BsonTag::kInt64),
+        okmongo::StaticEnd()};
+
+typedef okmongo::StaticDocument<kEverything> Everything;
+
+static_assert(Everything::kNumSlots == 5, "");
+
+static void WriteEverything(okmongo::BsonWriter *w, int32_t limit,
+                            double score, int64_t at, bool b, int64_t n) {
+    w->Element("find", "coll");
+    w->Element("limit", limit);
+    w->Element("big", static_cast<int64_t>(-1234567890123LL));
+    w->Element("single", true);
+    w->Element("nothing", nullptr);
+    w->PushDocument("filter");
+    {
+        w->Element("score", score);
+        w->PushArray("tags");
+        {
+            w->Element(0, "a");
+            w->Element(1, 2);
+            w->PushDocument(2);
+            w->ElementUtcDatetime("at", at);
+            w->Pop();
+            w->Element(3, false);
+            for (int32_t i = 4; i < 10; ++i) {
+                w->Element(i, i);
+            }
+            w->Element(10, nullptr);
+            w->Element(11, b);
+        }
+        w->Pop();
+        w->PushDocument("empty");
+        w->Pop();
+    }
+    w->Pop();
+    w->Element("n", n);
+}
+
+static void TestBytes() {
+    okmongo::BsonWriter expected, w;
+    expected.Document();
+    expected.Element("ismaster", 1);
+    expected.Pop();
+    IsMaster::Append(&w);
+    assert(w.ToString() == expected.ToString());
+
+    for (int32_t round = 0; round < 2; ++round) {
+        const int32_t limit = round == 0 ? 0 : -5;
+        const double score = round == 0 ? 0 : 3.25;
+        const int64_t at = round == 0 ? 0 : 1500000000000LL;
+        const int64_t n = round == 0 ? 0 : -1;
+        expected.Clear();
+        expected.Document();
+        WriteEverything(&expected, limit, score, at, round == 1, n);
+        expected.Pop();
+        w.Clear();
+        Everything::Append(&w, limit, score, at, round == 1, n);
+        assert(w.ToString() == expected.ToString());
+        assert(Everything::kSize == w.len());
+
+        // As a field
+        expected.Clear();
+        expected.Document();
+        expected.Element("before", 1);
+        expected.PushDocument("cmd");
+        WriteEverything(&expected, limit, score, at, round == 1, n);
+        expected.Pop();
+        expected.Pop();
+        w.Clear();
+        w.Document();
+        w.Element("before", 1);
+        Everything::AppendField(&w, "cmd", limit, score, at, round == 1, n);
+        w.Pop();
+        assert(w.ToString() == expected.ToString());
+    }
+
+    // The slots are where the values are
+    w.Clear();
+    Everything::Append(&w, 1, 2.0, static_cast<int64_t>(3), true,
+                       static_cast<int64_t>(4));
+    const okmongo::BsonValue doc(w.data(), w.len());
+    int32_t limit;
+    std::memcpy(&limit, w.data() + Everything::SlotOffset(0), sizeof(limit));
+    assert(limit == 1 && doc.GetField("limit").GetInt32() == 1);
+    assert(doc.GetField("n").GetInt64() == 4);
+    assert(doc.GetField("filter").GetField("score").GetDouble() == 2.0);
+}
+
+int main() {
+    TestBytes();
+    std::cout << "ok" << std::endl;
+}
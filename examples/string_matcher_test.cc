@@ -1,5 +1,6 @@
 #include "string_matcher.h"
 #include <iostream>
+#include <cstdio>
 
 constexpr okmongo::StringMatcherAction<int> kwds[] = {{"moretest", 1},
                                                       {"test", 2},
@@ -43,7 +44,49 @@ constexpr okmongo::StringMatcherAction<int> kwds[] = {{"moretest", 1},
 //     int32_t v;
 // };
 
+// 300 keywords: "100" ... "399"
+#define KW(a, b, c) {#a #b #c, a * 100 + b * 10 + c},
+#define KW10(a, b)                                                      \
+    KW(a, b, 0) KW(a, b, 1) KW(a, b, 2) KW(a, b, 3) KW(a, b, 4) KW(a, b, 5) \
+            KW(a, b, 6) KW(a, b, 7) KW(a, b, 8) KW(a, b, 9)
+#define KW100(a)                                                       \
+    KW10(a, 0) KW10(a, 1) KW10(a, 2) KW10(a, 3) KW10(a, 4) KW10(a, 5) \
+            KW10(a, 6) KW10(a, 7) KW10(a, 8) KW10(a, 9)
+
+constexpr okmongo::StringMatcherAction<int> many_kwds[] = {
+        KW100(1) KW100(2) KW100(3){nullptr, -1}};
+
+template <typename Matcher>
+static int Match(const char *s) {
+    Matcher m;
+    for (; *s; ++s) {
+        m.AddChar(*s);
+    }
+    m.AddChar('\000');
+    return m.GetResult();
+}
+
+static void TestTrieMatcher() {
+    typedef okmongo::StringMatcher<int, kwds> Linear;
+    typedef okmongo::TrieMatcher<int, kwds> Trie;
+    for (const char *s : {"moretest", "test", "test1", "test1234", "test12",
+                          "", "t", "tests", "more", "zzz"}) {
+        assert(Match<Linear>(s) == Match<Trie>(s));
+    }
+
+    typedef okmongo::TrieMatcher<int, many_kwds> Big;
+    char buf[8];
+    for (int i = 0; i < 1000; ++i) {
+        snprintf(buf, sizeof(buf), "%d", i);
+        const int expected = (i >= 100 && i < 400) ? i : -1;
+        assert(Match<Big>(buf) == expected);
+    }
+    assert(Match<Big>("1000") == -1);
+    assert(Match<Big>("10") == -1);
+}
+
 int main() {
+    TestTrieMatcher();
     const char* needle = "test12";
     const char* pos = needle;
     okmongo::StringMatcher<int, kwds> sm;
@@ -0,0 +1,123 @@
+#include "struct_reader.h"
+#include "mongo.h"
+#include <iostream>
+#include <vector>
+
+struct User {
+    int64_t counter;
+    char id[okmongo::kObjectIdLen];
+    std::string name;
+    bool active;
+    double score;
+};
+
+constexpr okmongo::StringMatcherAction<okmongo::FieldDescriptor> user_fields[] =
+        {OKMONGO_STRUCT_FIELD(User, active),
+         OKMONGO_STRUCT_FIELD(User, counter),
+         OKMONGO_STRUCT_FIELD(User, id),
+         OKMONGO_STRUCT_FIELD(User, name),
+         OKMONGO_STRUCT_FIELD(User, score),
+         {nullptr, {okmongo::BsonTag::kMinKey, -1}}};
+
+static void WriteUser(okmongo::BsonWriter *w, int32_t i) {
+    const char oid[okmongo::kObjectIdLen] = {'o', 'i', 'd'};
+    w->Document();
+    {
+        w->Element("unknown", "skip me");
+        // int32 values widen into int64_t members
+        w->Element("counter", i);
+        w->PushDocument("nested");
+        {
+            w->Element("name", "not this one");
+            w->Element("counter", 1000);
+        }
+        w->Pop();
+        w->Element("name", std::string(static_cast<size_t>(20 + i), 'n'));
+        w->ElementObjectId("id", oid);
+        w->Element("active", (i % 2) == 0);
+        // Type mismatch: not decoded
+        w->Element("score", "high");
+    }
+    w->Pop();
+}
+
+class UserResponseReader
+        : public okmongo::StructDecoder<
+                  User, user_fields,
+                  okmongo::ResponseReader<UserResponseReader>> {
+public:
+    std::vector<User> users;
+    std::vector<uint64_t> seen;
+
+    void EmitDocumentStart(int32_t) {
+        users.push_back(User());
+        ClearFields();
+        Target(&users.back());
+    }
+
+    void EmitDocumentDone() { seen.push_back(FieldsSeen()); }
+};
+
+static void CheckUser(const User &u, int32_t i) {
+    assert(u.counter == i);
+    assert(u.name == std::string(static_cast<size_t>(20 + i), 'n'));
+    assert(u.active == ((i % 2) == 0));
+    assert(std::memcmp(u.id, "oid", 3) == 0);
+}
+
+int main() {
+    // Everything but "score" (the 5th field)
+    constexpr uint64_t kExpected = 0xf;
+    okmongo::BsonWriter w;
+    WriteUser(&w, 3);
+    const std::string doc = w.ToString();
+    for (int32_t chunk = 1; chunk <= static_cast<int32_t>(doc.size());
+         ++chunk) {
+        User u = User();
+        u.score = 1.5;
+        okmongo::StructReader<User, user_fields> r(&u);
+        for (int32_t pos = 0; pos < static_cast<int32_t>(doc.size());
+             pos += chunk) {
+            const int32_t len = std::min(
+                    chunk, static_cast<int32_t>(doc.size()) - pos);
+            assert(r.Consume(doc.data() + pos, len) == len);
+        }
+        assert(r.Done());
+        assert(!r.Failed());
+        assert(!r.Complete());
+        assert(r.FieldsSeen() == kExpected);
+        CheckUser(u, 3);
+        assert(u.score == 1.5);
+    }
+
+    // Decoding all the documents in a reply
+    {
+        okmongo::BsonWriter rw;
+        okmongo::ResponseHeader hdr = {};
+        hdr.number_returned = 4;
+        rw.AppendRaw(hdr);
+        for (int32_t i = 0; i < hdr.number_returned; ++i) {
+            WriteUser(&rw, i);
+        }
+        rw.FlushLen();
+        const std::string reply = rw.ToString();
+        UserResponseReader r;
+        r.Consume(reply.data(), static_cast<int32_t>(reply.size()));
+        assert(r.Done());
+        assert(r.users.size() == 4);
+        for (int32_t i = 0; i < 4; ++i) {
+            CheckUser(r.users[i], i);
+            assert(r.seen[i] == kExpected);
+        }
+    }
+
+    // Without a target the fields are parsed but not decoded
+    {
+        okmongo::StructReader<User, user_fields> r;
+        assert(r.Consume(doc.data(), static_cast<int32_t>(doc.size())) ==
+               static_cast<int32_t>(doc.size()));
+        assert(r.Done() && !r.Failed());
+        assert(r.FieldsSeen() == 0);
+    }
+    std::cout << "ok" << std::endl;
+}
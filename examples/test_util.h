@@ -0,0 +1,80 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Messages forged by the tests (the requests of a client and the
+ * replies of a server)
+ */
+#pragma once
+#include <cstdint>
+#include <string>
+#include "mongo.h"
+
+/**
+ * The header of an OP_REPLY to `response_to` with `num_docs` documents.
+ */
+inline okmongo::ResponseHeader ReplyHeader(int32_t response_to,
+                                           int32_t num_docs = 1) {
+    okmongo::ResponseHeader hdr = {};
+    hdr.response_to = response_to;
+    hdr.op_code = static_cast<int32_t>(okmongo::MongoOpcode::kReply);
+    hdr.number_returned = num_docs;
+    return hdr;
+}
+
+/**
+ * Write an OP_REPLY with `hdr.number_returned` documents in `w`, the `i`th
+ * one (a whole document) written by `doc(w, i)`. The length of the message
+ * is filled in.
+ */
+template <typename F>
+void WriteReply(okmongo::BsonWriter *w, const okmongo::ResponseHeader &hdr,
+                F doc) {
+    w->AppendRaw(hdr);
+    for (int32_t i = 0; i < hdr.number_returned; ++i) {
+        doc(w, i);
+    }
+    w->FlushLen();
+}
+
+/**
+ * Same as `WriteReply` in a string.
+ */
+template <typename F>
+std::string MakeReply(const okmongo::ResponseHeader &hdr, F doc) {
+    okmongo::BsonWriter w;
+    WriteReply(&w, hdr, doc);
+    return w.ToString();
+}
+
+/**
+ * An OP_REPLY whose documents are `{i: first}`, `{i: first + 1}`...
+ */
+inline std::string MakeNumberedReply(const okmongo::ResponseHeader &hdr,
+                                     int32_t first) {
+    return MakeReply(hdr, [first](okmongo::BsonWriter *w, int32_t i) {
+        w->Document();
+        w->Element("i", first + i);
+        w->Pop();
+    });
+}
+
+/**
+ * A request (framed as an OP_QUERY) whose body is `{i: id, pad: pad}`. Values
+ * of at least `external_threshold` bytes are kept out of the writer (see
+ * `BsonWriter::SetExternalThreshold`).
+ */
+inline void MakeRequest(okmongo::BsonWriter *w, int32_t id,
+                        const std::string &pad,
+                        int32_t external_threshold = 0) {
+    w->Clear();
+    w->SetExternalThreshold(external_threshold);
+    okmongo::MsgHeader hdr = {};
+    hdr.request_id = id;
+    hdr.op_code = static_cast<int32_t>(okmongo::MongoOpcode::kQuery);
+    w->AppendRaw(hdr);
+    w->Document();
+    w->Element("i", id);
+    w->Element("pad", pad);
+    w->Pop();
+    w->FlushLen();
+}
@@ -0,0 +1,178 @@
+#include "topology.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+
+// Reading ismaster replies and selecting servers.
+
+static std::string MakeIsMaster(bool ismaster) {
+    const auto doc = [ismaster](okmongo::BsonWriter *w, int32_t) {
+        w->Document();
+        {
+            w->Element("setName", "rs0");
+            w->Element("ismaster", ismaster);
+            w->Element("secondary", !ismaster);
+            w->PushArray("hosts");
+            w->Element(0, "a:27017");
+            w->Element(1, "b:27017");
+            w->Pop();
+            w->PushArray("passives");
+            w->Element(0, "c:27017");
+            w->Pop();
+            // Skipped
+            w->PushDocument("lastWrite");
+            w->Element("primary", "x");
+            w->PushArray("hosts");
+            w->Element(0, "x");
+            w->Pop();
+            w->Pop();
+            w->Element("primary", "a:27017");
+            w->Element("maxBsonObjectSize", 1024);
+            w->Element("maxWireVersion", 6);
+            w->Element("maxWriteBatchSize", INT64_C(5000));
+            w->Element("ok", 1.0);
+        }
+        w->Pop();
+    };
+    return MakeReply(ReplyHeader(0), doc);
+}
+
+static void TestParser() {
+    const std::string reply = MakeIsMaster(false);
+    for (size_t chunk = 1; chunk <= reply.size(); ++chunk) {
+        okmongo::IsMasterParser p;
+        for (size_t pos = 0; pos < reply.size(); pos += chunk) {
+            const int32_t len = static_cast<int32_t>(
+                    std::min(chunk, reply.size() - pos));
+            assert(p.Consume(reply.data() + pos, len) == len);
+        }
+        assert(p.Done() && !p.Failed());
+        const okmongo::IsMasterReply &r = p.Result();
+        assert(r.ok && !r.ismaster && r.secondary);
+        assert(!r.arbiter_only && !r.hidden && !r.is_mongos);
+        assert(r.set_name == "rs0");
+        assert(r.primary == "a:27017");
+        assert((r.hosts ==
+                std::vector<std::string>{"a:27017", "b:27017", "c:27017"}));
+        assert(r.max_bson_object_size == 1024);
+        assert(r.max_wire_version == 6);
+        assert(r.max_write_batch_size == 5000);
+        assert(okmongo::GetServerType(r) == okmongo::ServerType::kSecondary);
+    }
+    okmongo::IsMasterParser p;
+    const std::string primary = MakeIsMaster(true);
+    p.Consume(primary.data(), static_cast<int32_t>(primary.size()));
+    assert(okmongo::GetServerType(p.Result()) ==
+           okmongo::ServerType::kPrimary);
+}
+
+static okmongo::IsMasterReply Describe(okmongo::ServerType t) {
+    okmongo::IsMasterReply r;
+    r.ok = true;
+    switch (t) {
+        case okmongo::ServerType::kPrimary:
+            r.set_name = "rs0";
+            r.ismaster = true;
+            break;
+        case okmongo::ServerType::kSecondary:
+            r.set_name = "rs0";
+            r.secondary = true;
+            break;
+        case okmongo::ServerType::kMongos:
+            r.is_mongos = true;
+            break;
+        case okmongo::ServerType::kStandalone:
+            r.ismaster = true;
+            break;
+        case okmongo::ServerType::kOther:
+            r.set_name = "rs0";
+            r.arbiter_only = true;
+            break;
+        case okmongo::ServerType::kUnknown:
+            r.ok = false;
+            break;
+    }
+    assert(okmongo::GetServerType(r) == t);
+    return r;
+}
+
+static void TestSelect() {
+    using okmongo::ReadPreference;
+    using okmongo::ServerType;
+    okmongo::Topology t(15);
+    const int32_t p = t.AddServer("p");
+    const int32_t s1 = t.AddServer("s1");
+    const int32_t s2 = t.AddServer("s2");
+    const int32_t arb = t.AddServer("arb");
+    for (ReadPreference pref :
+         {ReadPreference::kPrimary, ReadPreference::kPrimaryPreferred,
+          ReadPreference::kSecondary, ReadPreference::kSecondaryPreferred,
+          ReadPreference::kNearest}) {
+        assert(t.Select(pref) == -1);
+    }
+
+    t.OnHeartbeat(p, Describe(ServerType::kPrimary), 30000);
+    t.OnHeartbeat(s1, Describe(ServerType::kSecondary), 1000);
+    t.OnHeartbeat(s2, Describe(ServerType::kSecondary), 10000);
+    t.OnHeartbeat(arb, Describe(ServerType::kOther), 10);
+    assert(t.Select(ReadPreference::kPrimary) == p);
+    assert(t.Select(ReadPreference::kPrimaryPreferred) == p);
+    assert(t.Select(ReadPreference::kSecondaryPreferred) == s1);
+    assert(t.Select(ReadPreference::kNearest) == s1);
+
+    // Both secondaries are within the latency window: load decides.
+    t.OnRequestSent(s1);
+    assert(t.Select(ReadPreference::kSecondary) == s2);
+    t.OnRequestSent(s2);
+    assert(t.Select(ReadPreference::kSecondary) == s1);
+    // The primary is too far to be used, whatever its load.
+    t.OnRequestSent(s1);
+    t.OnRequestSent(s2);
+    assert(t.Select(ReadPreference::kNearest) == s1);
+    t.OnRequestDone(s1);
+    t.OnRequestDone(s1);
+    t.OnRequestDone(s2);
+    t.OnRequestDone(s2);
+    assert(t.server(s1).in_flight == 0 && t.server(s2).in_flight == 0);
+
+    // Moving average of the round trip times
+    assert(t.server(s2).rtt_us == 10000);
+    t.OnHeartbeat(s2, Describe(ServerType::kSecondary), 20000);
+    assert(t.server(s2).rtt_us == 12000);
+    for (int i = 0; i < 20; ++i) {
+        t.OnHeartbeat(s2, Describe(ServerType::kSecondary), 100000);
+    }
+    assert(t.server(s2).rtt_us > 90000);
+    t.OnRequestSent(s1);
+    assert(t.Select(ReadPreference::kSecondary) == s1);
+    t.OnRequestDone(s1);
+
+    t.OnServerDown(s1);
+    assert(t.server(s1).rtt_us == -1);
+    assert(t.Select(ReadPreference::kSecondary) == s2);
+    t.OnServerDown(s2);
+    assert(t.Select(ReadPreference::kSecondary) == -1);
+    assert(t.Select(ReadPreference::kSecondaryPreferred) == p);
+    t.OnServerDown(p);
+    assert(t.Select(ReadPreference::kPrimaryPreferred) == -1);
+
+    // Standalone servers and mongos take everything
+    okmongo::Topology sharded;
+    const int32_t m1 = sharded.AddServer("m1");
+    const int32_t m2 = sharded.AddServer("m2");
+    sharded.OnHeartbeat(m1, Describe(ServerType::kMongos), 100);
+    sharded.OnHeartbeat(m2, Describe(ServerType::kMongos), 200);
+    sharded.OnRequestSent(m1);
+    assert(sharded.Select(ReadPreference::kPrimary) == m2);
+    assert(sharded.Select(ReadPreference::kSecondary) == m2);
+    okmongo::Topology single;
+    single.OnHeartbeat(single.AddServer("s"),
+                       Describe(ServerType::kStandalone), 100);
+    assert(single.Select(ReadPreference::kSecondary) == 0);
+}
+
+int main() {
+    TestParser();
+    TestSelect();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,170 @@
+#include "trace.h"
+#include "test_util.h"
+#include <iostream>
+#include <string>
+#include <vector>
+
+// The tracing hooks, with a clock that ticks once per call.
+
+struct Tracer {
+    static int64_t now;
+
+    static int64_t Now() { return ++now; }
+
+    void OnBuild(const okmongo::BuildTrace &t) { builds.push_back(t); }
+
+    void OnReply(const okmongo::ReplyTrace &t) { replies.push_back(t); }
+
+    std::vector<okmongo::BuildTrace> builds;
+    std::vector<okmongo::ReplyTrace> replies;
+};
+
+int64_t Tracer::now = 0;
+
+struct Doc {
+    int32_t i;
+};
+
+namespace okmongo {
+template <>
+bool BsonWriteFields<Doc>(BsonWriter *w, const Doc &d) {
+    w->Element("i", d.i);
+    return true;
+}
+}  // namespace okmongo
+
+class Reader : public okmongo::ResponseReader<Reader> {
+public:
+    void EmitError(const char *) {}
+};
+
+static void TestBuild() {
+    Tracer t;
+    okmongo::BsonWriter w;
+    assert(okmongo::TraceFill(&t, &w, [&w] {
+        return okmongo::FillInsertOp(&w, 7, "db", "coll", Doc{1}, Doc{2});
+    }));
+    assert(t.builds.size() == 1);
+    const okmongo::BuildTrace &b = t.builds[0];
+    assert(b.request_id == 7);
+    assert(b.op_code == static_cast<int32_t>(okmongo::MongoOpcode::kQuery));
+    assert(b.bytes == w.MessageLen());
+    assert(b.end_ns > b.start_ns);
+
+    // Messages appended after others
+    const int32_t before = w.MessageLen();
+    assert(okmongo::TraceFill(&t, &w, [&w] {
+        return okmongo::FillIsMasterOp(&w, 8);
+    }));
+    assert(t.builds.size() == 2);
+    assert(t.builds[1].request_id == 8);
+    assert(t.builds[1].bytes == w.MessageLen() - before);
+
+    // Failures aren't reported
+    assert(!okmongo::TraceFill(&t, &w, [] { return false; }));
+    assert(t.builds.size() == 2);
+}
+
+static void TestReply() {
+    const std::string reply = MakeNumberedReply(ReplyHeader(42, 3), 0);
+    for (size_t chunk = 1; chunk <= reply.size(); ++chunk) {
+        Tracer t;
+        okmongo::Traced<Reader, Tracer> r;
+        r.SetTracer(&t);
+        int32_t calls = 0;
+        for (size_t pos = 0; pos < reply.size(); pos += chunk) {
+            const int32_t len = static_cast<int32_t>(
+                    std::min(chunk, reply.size() - pos));
+            assert(r.Consume(reply.data() + pos, len) == len);
+            ++calls;
+        }
+        assert(r.Done());
+        assert(t.replies.size() == 1);
+        const okmongo::ReplyTrace &tr = t.replies[0];
+        assert(tr.ok);
+        assert(tr.request_id == 42);
+        assert(tr.number_returned == 3);
+        assert(tr.bytes == static_cast<int32_t>(reply.size()));
+        assert(tr.last_byte_ns - tr.first_byte_ns == 2 * calls - 1);
+        assert(tr.parse_ns == calls);
+
+        // Nothing else is reported until the reader is cleared
+        assert(r.Consume(reply.data(), 1) == 0);
+        assert(t.replies.size() == 1);
+        r.Clear();
+        assert(r.Consume(reply.data(), static_cast<int32_t>(reply.size())) ==
+               static_cast<int32_t>(reply.size()));
+        assert(t.replies.size() == 2);
+    }
+
+    // Errors are reported too
+    std::string bad = MakeNumberedReply(ReplyHeader(1, 1), 0);
+    bad[sizeof(okmongo::ResponseHeader)] = 2;  // Invalid document size
+    Tracer t;
+    okmongo::Traced<Reader, Tracer> r;
+    r.SetTracer(&t);
+    r.Consume(bad.data(), static_cast<int32_t>(bad.size()));
+    assert(t.replies.size() == 1 && !t.replies[0].ok);
+
+    // The null tracer compiles to the plain reader
+    okmongo::Traced<Reader, okmongo::NullTracer> n;
+    assert(n.Consume(reply.data(), static_cast<int32_t>(reply.size())) ==
+           static_cast<int32_t>(reply.size()));
+    assert(n.Done());
+}
+
+static void TestHistogram() {
+    okmongo::Histogram h;
+    assert(h.Count() == 0 && h.Quantile(0.5) == 0);
+    h.Record(0);
+    h.Record(-5);
+    h.Record(1);
+    h.Record(3);
+    h.Record(1000);
+    assert(h.Count() == 5);
+    assert(h.Sum() == 1004);
+    assert(h.Bucket(0) == 2);
+    assert(h.Bucket(1) == 1);
+    assert(h.Bucket(2) == 1);
+    assert(h.Bucket(10) == 1);
+    assert(okmongo::Histogram::BucketLimit(10) == 1024);
+    assert(h.Quantile(0) == 1);
+    assert(h.Quantile(0.5) == 1);
+    assert(h.Quantile(0.8) == 4);
+    assert(h.Quantile(1) == 1024);
+    h.Record(INT64_MAX);
+    assert(h.Bucket(63) == 1);
+    assert(h.Quantile(1) == okmongo::Histogram::BucketLimit(63));
+
+    // End to end
+    okmongo::HistogramTracer t;
+    okmongo::BsonWriter w;
+    assert(okmongo::TraceFill(&t, &w, [&w] {
+        return okmongo::FillIsMasterOp(&w, 5);
+    }));
+    const std::string reply = MakeNumberedReply(ReplyHeader(5, 2), 0);
+    okmongo::Traced<Reader, okmongo::HistogramTracer> r;
+    r.SetTracer(&t);
+    r.Consume(reply.data(), static_cast<int32_t>(reply.size()));
+    assert(t.build_ns.Count() == 1 && t.request_bytes.Count() == 1);
+    assert(t.request_bytes.Sum() == static_cast<uint64_t>(w.MessageLen()));
+    assert(t.wait_ns.Count() == 1);
+    assert(t.read_ns.Count() == 1 && t.parse_ns.Count() == 1);
+    assert(t.reply_bytes.Sum() == reply.size());
+    assert(t.number_returned.Sum() == 2);
+    assert(t.errors == 0);
+
+    // Replies to requests we didn't see being built
+    const std::string other = MakeNumberedReply(ReplyHeader(6, 0), 0);
+    r.Clear();
+    r.Consume(other.data(), static_cast<int32_t>(other.size()));
+    assert(t.wait_ns.Count() == 1);
+    assert(t.read_ns.Count() == 2);
+}
+
+int main() {
+    TestBuild();
+    TestReply();
+    TestHistogram();
+    std::cout << "ok" << std::endl;
+}
@@ -0,0 +1,125 @@
+#include "connection.h"
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
+namespace okmongo {
+
+Connection::SendResult Connection::Send(const BsonWriter &w) {
+    if (!Open() || out_ == nullptr) {
+        return SendResult::kClosed;
+    }
+    const int32_t len = w.MessageLen();
+    if (len > buf_size_) {
+        return SendResult::kTooLarge;
+    }
+    if (SendingInPlace()) {
+        return SendResult::kFull;
+    }
+    if (buf_size_ - out_tail_ < len && !out_busy_ && out_head_ > 0) {
+        const int32_t pending = Buffered();
+        std::memmove(out_, out_ + out_head_, static_cast<size_t>(pending));
+        out_head_ = 0;
+        out_tail_ = pending;
+    }
+    if (buf_size_ - out_tail_ < len) {
+        return SendResult::kFull;
+    }
+    w.CopyTo(out_ + out_tail_);
+    out_tail_ += len;
+    return SendResult::kQueued;
+}
+
+Connection::SendResult Connection::SendInPlace(const BsonWriter &w) {
+    if (!Open() || out_ == nullptr) {
+        return SendResult::kClosed;
+    }
+    if (SendingInPlace()) {
+        return SendResult::kFull;
+    }
+    const int32_t n = w.IovecCount();
+    in_place_.resize(static_cast<size_t>(n));
+    w.FillIovecs(in_place_.data(), n);
+    in_place_pos_ = 0;
+    in_place_len_ = w.MessageLen();
+    if (in_place_len_ == 0) {
+        in_place_.clear();
+    }
+    return SendResult::kQueued;
+}
+
+void Connection::Attach(char *in, char *out, int32_t size) {
+    in_ = in;
+    out_ = out;
+    buf_size_ = size;
+    out_head_ = out_tail_ = 0;
+    in_place_.clear();
+    in_place_pos_ = 0;
+    in_place_len_ = 0;
+    out_busy_ = false;
+    writable_ = true;
+}
+
+void Connection::Detach() { Attach(nullptr, nullptr, 0); }
+
+void Connection::Deliver(const char *s, int32_t len) {
+    if (!Open()) {
+        return;
+    }
+    if (consume_(sink_, s, len) != len) {
+        Fail(-1);
+    }
+}
+
+void Connection::Sent(int32_t len) {
+    assert(len <= Buffered());
+    out_head_ += len;
+    if (out_head_ == out_tail_) {
+        out_head_ = out_tail_ = 0;
+    }
+    Wake();
+}
+
+void Connection::SentInPlace(int32_t len) {
+    assert(len <= in_place_len_);
+    in_place_len_ -= len;
+    size_t left = static_cast<size_t>(len);
+    while (left > 0) {
+        struct iovec &v = in_place_[in_place_pos_];
+        const size_t n = std::min(left, v.iov_len);
+        v.iov_base = static_cast<char *>(v.iov_base) + n;
+        v.iov_len -= n;
+        left -= n;
+        if (v.iov_len == 0) {
+            ++in_place_pos_;
+        }
+    }
+    if (in_place_len_ == 0) {
+        in_place_.clear();
+        in_place_pos_ = 0;
+    }
+    Wake();
+}
+
+void Connection::Wake() {
+    if (waker_ != nullptr) {
+        waker_(waker_arg_);
+    }
+}
+
+void Connection::Fail(int error) {
+    if (Open()) {
+        state_ = State::kFailed;
+        error_ = error;
+        Wake();
+    }
+}
+
+void Connection::Close() {
+    if (Open()) {
+        state_ = State::kClosed;
+        Wake();
+    }
+}
+
+}  // namespace okmongo
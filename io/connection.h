@@ -0,0 +1,182 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief A non-blocking connection driven by one of the event loops
+ *
+ * This is not part of the core library (it lives in `libokmongo_io`): the
+ * readers and writers in `libokmongo` don't do any IO.
+ */
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "bson.h"
+
+extern "C" {
+#include <sys/uio.h>
+}
+
+namespace okmongo {
+
+class EpollLoop;
+class UringLoop;
+
+/**
+ * Default size of the input and output buffers of a connection.
+ *
+ * Every connection of a loop gets both (`UringLoop` pins them in memory),
+ * keep this small: messages bigger than the output buffer are sent in place
+ * (see `Connection::SendInPlace`).
+ */
+constexpr int32_t kDefaultIoBufferSize = 1 << 20;
+
+/**
+ * A socket to a server along with the consumer of everything read from it.
+ *
+ * The consumer (the "sink") is anything with a
+ * `int32_t Consume(const char *, int32_t)` method: a `ResponseMultiplexer`
+ * for a pipelined connection or a single reader. It must take all the bytes
+ * it is given; a connection whose sink stops (or fails) is put in the
+ * `kFailed` state.
+ *
+ * Messages are copied in the output buffer by `Send` and written out by the
+ * loop the connection is attached to, all the messages queued between two
+ * iterations of the loop go out in one system call. Big messages (and the
+ * ones with external segments) can also be written straight out of their
+ * writer by `SendInPlace`.
+ */
+class Connection {
+public:
+    enum class State : uint8_t {
+        kOpen,
+        kClosed,  ///< The server closed the connection
+        kFailed   ///< See `error()`
+    };
+
+    enum class SendResult : uint8_t {
+        kQueued,
+        kFull,      ///< No room right now: let the loop run and try again
+        kTooLarge,  ///< The message will never fit in the output buffer
+        kClosed     ///< Not open or not attached to a loop
+    };
+
+    /**
+     * `fd` must be a connected, non-blocking, socket. It isn't owned by the
+     * connection.
+     */
+    template <typename Sink>
+    Connection(int fd, Sink *sink)
+        : fd_(fd), sink_(sink), consume_(&ConsumeThunk<Sink>) {}
+
+    Connection(const Connection &) = delete;
+    Connection &operator=(const Connection &) = delete;
+
+    int fd() const { return fd_; }
+
+    /**
+     * Queue a copy of the message in `w`.
+     *
+     * The writer can be reused as soon as this returns. Messages bigger than
+     * the output buffer are `kTooLarge`: send them with `SendInPlace`.
+     */
+    SendResult Send(const BsonWriter &w);
+
+    /**
+     * Queue the message in `w` without copying it: it is written with
+     * `writev` straight out of the buffer of `w` and its external segments,
+     * after what was queued before it. The message can be of any size.
+     *
+     * `w` must be left alone until `SendingInPlace()` is false. There is only
+     * one such message at a time and nothing can be queued behind it
+     * (`kFull`) until it is out.
+     */
+    SendResult SendInPlace(const BsonWriter &w);
+
+    /**
+     * Whether a message queued by `SendInPlace` is still being written.
+     */
+    bool SendingInPlace() const { return !in_place_.empty(); }
+
+    /**
+     * Size of the output buffer (the largest message `Send` can copy).
+     */
+    int32_t BufferSize() const { return buf_size_; }
+
+    /**
+     * Number of bytes waiting to be written.
+     */
+    int32_t Pending() const { return Buffered() + in_place_len_; }
+
+    State state() const { return state_; }
+
+    bool Open() const { return state_ == State::kOpen; }
+
+    /**
+     * The `errno` of the failure or -1 if the sink stopped.
+     */
+    int error() const { return error_; }
+
+    /**
+     * Call `fn(arg)` from the loop whenever pending data was written out (there
+     * might be room for more messages) and when the connection stops being
+     * open. There is one waker per connection, `nullptr` removes it.
+     */
+    void SetWaker(void (*fn)(void *arg), void *arg) {
+        waker_ = fn;
+        waker_arg_ = arg;
+    }
+
+private:
+    friend class EpollLoop;
+    friend class UringLoop;
+
+    template <typename Sink>
+    static int32_t ConsumeThunk(void *sink, const char *s, int32_t len) {
+        return static_cast<Sink *>(sink)->Consume(s, len);
+    }
+
+    // Interface for the loops...
+    void Attach(char *in, char *out, int32_t size);
+    void Detach();
+    void Deliver(const char *s, int32_t len);
+    void Sent(int32_t len);
+    void SentInPlace(int32_t len);
+    void Fail(int error);
+    void Close();
+    void Wake();
+
+    // Bytes in the output buffer, they are written before the in place
+    // message
+    int32_t Buffered() const { return out_tail_ - out_head_; }
+    const char *PendingData() const { return out_ + out_head_; }
+    // What is left of the in place message
+    struct iovec *InPlaceIovecs() { return in_place_.data() + in_place_pos_; }
+    int InPlaceCount() const {
+        return static_cast<int>(in_place_.size() - in_place_pos_);
+    }
+
+    int fd_;
+    void *sink_;
+    int32_t (*consume_)(void *sink, const char *s, int32_t len);
+    void (*waker_)(void *arg) = nullptr;
+    void *waker_arg_ = nullptr;
+
+    State state_ = State::kOpen;
+    int error_ = 0;
+    // Set by the loop when the kernel is reading the output buffer (we can't
+    // move the pending data around).
+    bool out_busy_ = false;
+    // Edge-triggered loops only write when the socket is writable.
+    bool writable_ = true;
+
+    char *in_ = nullptr;
+    char *out_ = nullptr;
+    int32_t buf_size_ = 0;
+    int32_t out_head_ = 0;
+    int32_t out_tail_ = 0;
+
+    std::vector<struct iovec> in_place_;
+    size_t in_place_pos_ = 0;
+    int32_t in_place_len_ = 0;  // Left to write
+};
+
+}  // namespace okmongo
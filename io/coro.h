@@ -0,0 +1,422 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief C++20 coroutines on top of a `Connection`
+ *
+ * Unlike the rest of the library this needs C++20; it is header only and the
+ * tests are only built if configure finds a compiler with coroutines.
+ */
+#pragma once
+#if !defined(__cpp_impl_coroutine)
+#error "coro.h requires C++20 coroutines"
+#endif
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include "connection.h"
+#include "multiplexer.h"
+
+namespace okmongo {
+
+/**
+ * A coroutine that starts right away and runs on its own (e.g.: one per
+ * incoming request in a server). Destroying the task destroys the coroutine
+ * (and cancels whatever it was waiting on).
+ */
+class Task {
+public:
+    struct promise_type;
+    typedef std::coroutine_handle<promise_type> Handle;
+
+    struct promise_type {
+        Task get_return_object() {
+            return Task(Handle::from_promise(*this));
+        }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    Task(Task &&other) noexcept : handle_(other.handle_) {
+        other.handle_ = nullptr;
+    }
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task() {
+        if (handle_) {
+            handle_.destroy();
+        }
+    }
+
+    /**
+     * The coroutine ran to completion.
+     */
+    bool Done() const { return !handle_ || handle_.done(); }
+
+private:
+    explicit Task(Handle h) : handle_(h) {}
+
+    Handle handle_;
+};
+
+class CoroClient;
+
+/**
+ * Something a coroutine waits on, kept in an intrusive list by the client:
+ * waiting doesn't allocate anything besides the coroutine frame (the
+ * multiplexer finds the readers of the replies in that list too).
+ */
+class CoroWaiter {
+public:
+    CoroWaiter(const CoroWaiter &) = delete;
+    CoroWaiter &operator=(const CoroWaiter &) = delete;
+
+    bool await_ready() const noexcept { return state_ != State::kPending; }
+
+    void await_suspend(std::coroutine_handle<> h) noexcept { handle_ = h; }
+
+    /**
+     * @return false if the connection failed or the reply couldn't be read.
+     */
+    bool await_resume() const noexcept { return state_ == State::kDone; }
+
+protected:
+    friend class CoroClient;
+
+    enum class State : uint8_t { kPending, kDone, kFailed };
+
+    explicit CoroWaiter(CoroClient *client) : client_(client) {}
+
+    CoroClient *const client_;
+    State state_ = State::kPending;
+    // Replies only...
+    int32_t request_id_ = 0;
+    bool expecting_ = false;  // The reply hasn't started yet
+    bool ok_ = true;          // The reader took the whole reply
+    int32_t (*consume_)(void *waiter, const char *s, int32_t len) = nullptr;
+    std::coroutine_handle<> handle_;
+    CoroWaiter *prev_ = nullptr;
+    CoroWaiter *next_ = nullptr;
+};
+
+/**
+ * Waits on the reply to a request, see `CoroClient::Reply`.
+ */
+template <typename Reader>
+class ReplyAwaiter : public CoroWaiter {
+public:
+    ~ReplyAwaiter();
+
+    /**
+     * Called by the multiplexer with the bytes of the reply.
+     */
+    int32_t Consume(const char *s, int32_t len);
+
+private:
+    friend class CoroClient;
+
+    ReplyAwaiter(CoroClient *client, int32_t request_id, Reader *reader);
+
+    static int32_t ConsumeThunk(void *waiter, const char *s, int32_t len) {
+        return static_cast<ReplyAwaiter *>(static_cast<CoroWaiter *>(waiter))
+                ->Consume(s, len);
+    }
+
+    Reader *const reader_;
+};
+
+/**
+ * Waits until a message was queued on the connection, see `CoroClient::Send`.
+ */
+class SendAwaiter : public CoroWaiter {
+public:
+    ~SendAwaiter();
+
+    bool await_ready() noexcept;
+
+    void await_suspend(std::coroutine_handle<> h) noexcept;
+
+private:
+    friend class CoroClient;
+
+    SendAwaiter(CoroClient *client, const BsonWriter *w)
+        : CoroWaiter(client), w_(w) {}
+
+    const BsonWriter *const w_;
+};
+
+/**
+ * Lets coroutines send requests on a `Connection` and wait for their replies.
+ *
+ * The client is the sink of the connection: a `ResponseMultiplexer` routes
+ * every reply to the reader of its request (by `response_to`) and the
+ * coroutine waiting on it is resumed right from the loop, as soon as the
+ * reply was read. Coroutines waiting for room in the output buffer are
+ * resumed when the loop writes out pending data. When the connection stops
+ * being open everything that waits is resumed with a failure.
+ *
+ * Wait on the reply before sending the request (the reply could otherwise
+ * arrive while the coroutine waits to send): requests can be pipelined that
+ * way, each with its own reply.
+ *
+ * > okmongo::CoroClient client;
+ * > okmongo::Connection c(fd, &client);
+ * > client.Attach(&c);
+ * > loop.Add(&c);
+ * > ...
+ * > const int32_t id = client.NextRequestId();
+ * > okmongo::FillQueryOp(&w, id, "db", "coll", qry);
+ * > auto reply = client.Reply(id, &reader);
+ * > if (co_await client.Send(w) && co_await reply) {...}
+ */
+class CoroClient : public ResponseMultiplexer<CoroClient> {
+public:
+    CoroClient() {}
+    CoroClient(const CoroClient &) = delete;
+    CoroClient &operator=(const CoroClient &) = delete;
+    ~CoroClient() {
+        if (conn_ != nullptr) {
+            conn_->SetWaker(nullptr, nullptr);
+        }
+    }
+
+    /**
+     * Send requests on `c` (whose sink must be this client).
+     */
+    void Attach(Connection *c) {
+        conn_ = c;
+        c->SetWaker(&WakeThunk, this);
+    }
+
+    /**
+     * Queue the message in `w`: `co_await` returns once it is in the output
+     * buffer of the connection (`w` can be reused), right away if there is
+     * room. It fails right away if the message is bigger than the whole
+     * output buffer.
+     */
+    SendAwaiter Send(const BsonWriter &w) { return SendAwaiter(this, &w); }
+
+    /**
+     * Start waiting on the reply to `request_id`, read by `reader`.
+     *
+     * `co_await` returns once the reply was read. The reader must outlive
+     * the awaiter, destroying the awaiter before that cancels the request.
+     */
+    template <typename Reader>
+    ReplyAwaiter<Reader> Reply(int32_t request_id, Reader *reader) {
+        return ReplyAwaiter<Reader>(this, request_id, reader);
+    }
+
+    /**
+     * Fail everything that waits.
+     */
+    void Abort();
+
+    void EmitReplyDone(int32_t request_id);
+
+    // The connection fails along with `Consume`
+    void EmitError(const char *) {}
+
+private:
+    template <typename Reader>
+    friend class ReplyAwaiter;
+    friend class SendAwaiter;
+    friend class ResponseMultiplexer<CoroClient>;
+    typedef ResponseMultiplexer<CoroClient> Parent;
+
+    struct List {
+        CoroWaiter *head = nullptr;
+        CoroWaiter *tail = nullptr;
+    };
+
+    static void Link(List *l, CoroWaiter *w);
+    static void Unlink(List *l, CoroWaiter *w);
+
+    static void WakeThunk(void *client) {
+        static_cast<CoroClient *>(client)->Wake();
+    }
+
+    bool Open() const { return conn_ != nullptr && conn_->Open(); }
+
+    // The multiplexer looks the replies up in `replies_` (linearly: there
+    // are rarely more than a few dozen requests in flight) and then in what
+    // was registered with `Expect`.
+    CoroWaiter *Expected(int32_t request_id) const;
+    bool TakeRequest(int32_t request_id, Request *res);
+    bool Expecting(int32_t request_id) const {
+        return Expected(request_id) != nullptr || Parent::Expecting(request_id);
+    }
+    size_t NumExpected() const;
+
+    void Wake();
+    // Resume `w`, which isn't waiting anymore
+    void Finish(List *l, CoroWaiter *w, CoroWaiter::State state);
+
+    Connection *conn_ = nullptr;
+    List replies_;
+    List senders_;
+    // The reply being read
+    CoroWaiter *reading_ = nullptr;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename Reader>
+ReplyAwaiter<Reader>::ReplyAwaiter(CoroClient *client, int32_t request_id,
+                                   Reader *reader)
+    : CoroWaiter(client), reader_(reader) {
+    request_id_ = request_id;
+    if (!client->Open()) {
+        state_ = State::kFailed;
+        return;
+    }
+    consume_ = &ConsumeThunk;
+    expecting_ = true;
+    CoroClient::Link(&client->replies_, this);
+}
+
+template <typename Reader>
+ReplyAwaiter<Reader>::~ReplyAwaiter() {
+    if (state_ == State::kPending) {
+        client_->Cancel(request_id_);
+        CoroClient::Unlink(&client_->replies_, this);
+    }
+    if (client_->reading_ == this) {
+        client_->reading_ = nullptr;
+    }
+}
+
+template <typename Reader>
+int32_t ReplyAwaiter<Reader>::Consume(const char *s, int32_t len) {
+    client_->reading_ = this;
+    const int32_t res = reader_->Consume(s, len);
+    ok_ = ok_ && res == len;
+    return res;
+}
+
+inline SendAwaiter::~SendAwaiter() {
+    if (state_ == State::kPending && handle_) {
+        CoroClient::Unlink(&client_->senders_, this);
+    }
+}
+
+inline bool SendAwaiter::await_ready() noexcept {
+    if (!client_->Open() || w_->MessageLen() > client_->conn_->BufferSize()) {
+        state_ = State::kFailed;
+    } else if (client_->senders_.head == nullptr &&
+               client_->conn_->Send(*w_) == Connection::SendResult::kQueued) {
+        state_ = State::kDone;
+    }
+    return state_ != State::kPending;
+}
+
+inline void SendAwaiter::await_suspend(std::coroutine_handle<> h) noexcept {
+    handle_ = h;
+    CoroClient::Link(&client_->senders_, this);
+}
+
+inline void CoroClient::Link(List *l, CoroWaiter *w) {
+    w->prev_ = l->tail;
+    w->next_ = nullptr;
+    if (l->tail != nullptr) {
+        l->tail->next_ = w;
+    } else {
+        l->head = w;
+    }
+    l->tail = w;
+}
+
+inline void CoroClient::Unlink(List *l, CoroWaiter *w) {
+    (w->prev_ != nullptr ? w->prev_->next_ : l->head) = w->next_;
+    (w->next_ != nullptr ? w->next_->prev_ : l->tail) = w->prev_;
+    w->prev_ = w->next_ = nullptr;
+}
+
+inline void CoroClient::Finish(List *l, CoroWaiter *w,
+                               CoroWaiter::State state) {
+    Unlink(l, w);
+    w->state_ = state;
+    std::coroutine_handle<> h = w->handle_;
+    w->handle_ = nullptr;
+    if (h) {
+        h.resume();
+    }
+}
+
+inline CoroWaiter *CoroClient::Expected(int32_t request_id) const {
+    for (CoroWaiter *w = replies_.head; w != nullptr; w = w->next_) {
+        if (w->expecting_ && w->request_id_ == request_id) {
+            return w;
+        }
+    }
+    return nullptr;
+}
+
+inline bool CoroClient::TakeRequest(int32_t request_id, Request *res) {
+    CoroWaiter *w = Expected(request_id);
+    if (w == nullptr) {
+        return Parent::TakeRequest(request_id, res);
+    }
+    w->expecting_ = false;
+    *res = Request{w, w->consume_};
+    return true;
+}
+
+inline size_t CoroClient::NumExpected() const {
+    size_t res = Parent::NumExpected();
+    for (CoroWaiter *w = replies_.head; w != nullptr; w = w->next_) {
+        res += w->expecting_ ? 1 : 0;
+    }
+    return res;
+}
+
+inline void CoroClient::EmitReplyDone(int32_t request_id) {
+    CoroWaiter *w = reading_;
+    reading_ = nullptr;
+    if (w == nullptr || w->request_id_ != request_id) {
+        return;
+    }
+    Finish(&replies_, w, w->ok_ ? CoroWaiter::State::kDone
+                                : CoroWaiter::State::kFailed);
+}
+
+inline void CoroClient::Abort() {
+    while (replies_.head != nullptr) {
+        CoroWaiter *w = replies_.head;
+        Cancel(w->request_id_);
+        if (reading_ == w) {
+            reading_ = nullptr;
+        }
+        Finish(&replies_, w, CoroWaiter::State::kFailed);
+    }
+    while (senders_.head != nullptr) {
+        Finish(&senders_, senders_.head, CoroWaiter::State::kFailed);
+    }
+}
+
+inline void CoroClient::Wake() {
+    if (!Open()) {
+        Abort();
+        return;
+    }
+    while (senders_.head != nullptr) {
+        CoroWaiter *w = senders_.head;
+        switch (conn_->Send(*static_cast<SendAwaiter *>(w)->w_)) {
+            case Connection::SendResult::kQueued:
+                Finish(&senders_, w, CoroWaiter::State::kDone);
+                break;
+            case Connection::SendResult::kTooLarge:
+                Finish(&senders_, w, CoroWaiter::State::kFailed);
+                break;
+            case Connection::SendResult::kFull:
+                return;
+            case Connection::SendResult::kClosed:
+                Abort();
+                return;
+        }
+    }
+}
+
+}  // namespace okmongo
@@ -0,0 +1,82 @@
+#include "dump_file.h"
+#include <cerrno>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+namespace okmongo {
+
+constexpr size_t DumpFile::kGrain;
+
+bool DumpFile::Open(const char *path) {
+    Close();
+    error_.clear();
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        error_ = std::string("open: ") + std::strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        error_ = std::string("fstat: ") + std::strerror(errno);
+        close(fd);
+        return false;
+    }
+    len_ = static_cast<size_t>(st.st_size);
+    if (len_ > 0) {
+        void *m = mmap(nullptr, len_, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            error_ = std::string("mmap: ") + std::strerror(errno);
+            len_ = 0;
+            close(fd);
+            return false;
+        }
+        data_ = static_cast<const char *>(m);
+        // The index walks the whole file and the scans will read it all.
+        madvise(m, len_, MADV_WILLNEED);
+    }
+    close(fd);
+    if (!Index()) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+void DumpFile::Close() {
+    if (data_ != nullptr) {
+        munmap(const_cast<char *>(data_), len_);
+    }
+    data_ = nullptr;
+    len_ = 0;
+    offsets_.clear();
+}
+
+bool DumpFile::Index() {
+    size_t pos = 0;
+    while (pos < len_) {
+        int32_t len;
+        if (len_ - pos < 5) {
+            error_ = "Truncated document at offset " + std::to_string(pos);
+            return false;
+        }
+        std::memcpy(&len, data_ + pos, sizeof(len));
+        if (len < 5 || static_cast<size_t>(len) > len_ - pos) {
+            error_ = "Invalid document length at offset " + std::to_string(pos);
+            return false;
+        }
+        if (data_[pos + static_cast<size_t>(len) - 1] != '\0') {
+            error_ = "Unterminated document at offset " + std::to_string(pos);
+            return false;
+        }
+        offsets_.push_back(pos);
+        pos += static_cast<size_t>(len);
+    }
+    return true;
+}
+
+}  // namespace okmongo
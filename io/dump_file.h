@@ -0,0 +1,141 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Reading `mongodump` `.bson` files in parallel
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "bson.h"
+#include "parallel.h"
+
+namespace okmongo {
+
+/**
+ * A memory mapped file of concatenated bson documents (what `mongodump`
+ * writes).
+ *
+ * `Open` maps the file and walks the length prefixes of the documents to
+ * index them, the documents are not copied: they are `BsonValue`s pointing
+ * in the mapping and stay valid until the file is closed. The scans split
+ * the index in ranges that are processed concurrently.
+ *
+ * > okmongo::DumpFile f;
+ * > if (!f.Open("dump/db/coll.bson")) ... f.Error() ...
+ * > std::vector<int64_t> sums(okmongo::DefaultThreads());
+ * > f.ForEach(0, [&](int32_t worker, size_t, const okmongo::BsonValue &doc) {
+ * >     sums[worker] += doc.GetField("n").GetInt64();
+ * > });
+ */
+class DumpFile {
+public:
+    /**
+     * Number of documents in the ranges handed to the workers.
+     */
+    static constexpr size_t kGrain = 1024;
+
+    DumpFile() {}
+    ~DumpFile() { Close(); }
+
+    DumpFile(const DumpFile &) = delete;
+    DumpFile &operator=(const DumpFile &) = delete;
+
+    /**
+     * Map and index `path`.
+     *
+     * @return false if the file couldn't be read or isn't a sequence of
+     * documents (see `Error()`), nothing is mapped then.
+     */
+    bool Open(const char *path);
+
+    void Close();
+
+    /**
+     * What made `Open` fail.
+     */
+    const std::string &Error() const { return error_; }
+
+    /**
+     * Number of documents.
+     */
+    size_t size() const { return offsets_.size(); }
+
+    BsonValue Document(size_t i) const {
+        return BsonValue(data_ + offsets_[i], DocumentLen(i));
+    }
+
+    /**
+     * Call `f(worker, index, doc)` on every document, from `threads` threads
+     * (see `ParallelFor`). `f` is called concurrently.
+     */
+    template <typename F>
+    void ForEach(int32_t threads, F f) const;
+
+    /**
+     * Run every document through one of the `readers` (any `BsonReader`): the
+     * documents are split between the readers and a reader is only used by
+     * one thread, it is `Clear`ed before every document.
+     *
+     * The readers are used as the per thread state: use as many as you want
+     * threads and merge their results afterwards.
+     *
+     * @return false if a reader failed on one of the documents (the others
+     * are still read).
+     */
+    template <typename Reader>
+    bool ReadAll(std::vector<Reader> *readers) const;
+
+private:
+    bool Index();
+
+    int32_t DocumentLen(size_t i) const {
+        int32_t len;
+        std::memcpy(&len, data_ + offsets_[i], sizeof(len));
+        return len;
+    }
+
+    const char *data_ = nullptr;
+    size_t len_ = 0;
+    std::vector<size_t> offsets_;
+    std::string error_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename F>
+void DumpFile::ForEach(int32_t threads, F f) const {
+    ParallelFor(size(), kGrain, threads,
+                [this, &f](int32_t worker, size_t begin, size_t end) {
+                    for (size_t i = begin; i < end; ++i) {
+                        f(worker, i, Document(i));
+                    }
+                });
+}
+
+template <typename Reader>
+bool DumpFile::ReadAll(std::vector<Reader> *readers) const {
+    if (readers->empty()) {
+        return size() == 0;
+    }
+    std::atomic<bool> ok{true};
+    ParallelFor(size(), kGrain, static_cast<int32_t>(readers->size()),
+                [this, readers, &ok](int32_t worker, size_t begin,
+                                     size_t end) {
+                    Reader &r = (*readers)[static_cast<size_t>(worker)];
+                    for (size_t i = begin; i < end; ++i) {
+                        const int32_t len = DocumentLen(i);
+                        r.Clear();
+                        if (r.Consume(data_ + offsets_[i], len) != len ||
+                            !r.Done()) {
+                            ok = false;
+                        }
+                    }
+                });
+    return ok;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,129 @@
+#include "epoll_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+namespace okmongo {
+
+namespace {
+constexpr int kMaxEvents = 64;
+}  // namespace
+
+EpollLoop::EpollLoop(int32_t buffer_size)
+    : epfd_(epoll_create1(EPOLL_CLOEXEC)), buffer_size_(buffer_size) {}
+
+EpollLoop::~EpollLoop() {
+    for (Slot &s : slots_) {
+        s.conn->Detach();
+    }
+    if (epfd_ != -1) {
+        close(epfd_);
+    }
+}
+
+bool EpollLoop::Add(Connection *c) {
+    struct epoll_event ev = {};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd_, EPOLL_CTL_ADD, c->fd(), &ev) == -1) {
+        return false;
+    }
+    Slot s = {c, std::unique_ptr<char[]>(
+                         new char[2 * static_cast<size_t>(buffer_size_)])};
+    c->Attach(s.mem.get(), s.mem.get() + buffer_size_, buffer_size_);
+    slots_.push_back(std::move(s));
+    return true;
+}
+
+void EpollLoop::Remove(Connection *c) {
+    for (auto it = slots_.begin(); it != slots_.end(); ++it) {
+        if (it->conn == c) {
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, c->fd(), nullptr);
+            c->Detach();
+            slots_.erase(it);
+            return;
+        }
+    }
+}
+
+void EpollLoop::Flush(Connection *c) {
+    while (c->Open() && c->writable_ && c->Pending() > 0) {
+        // The output buffer goes first
+        const bool buffered = c->Buffered() > 0;
+        ssize_t res;
+        if (buffered) {
+            res = send(c->fd(), c->PendingData(),
+                       static_cast<size_t>(c->Buffered()), MSG_NOSIGNAL);
+        } else {
+            struct msghdr msg = {};
+            msg.msg_iov = c->InPlaceIovecs();
+            msg.msg_iovlen =
+                    static_cast<size_t>(std::min(c->InPlaceCount(), IOV_MAX));
+            res = sendmsg(c->fd(), &msg, MSG_NOSIGNAL);
+        }
+        if (res >= 0 && buffered) {
+            c->Sent(static_cast<int32_t>(res));
+        } else if (res >= 0) {
+            c->SentInPlace(static_cast<int32_t>(res));
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            // Wait for the next EPOLLOUT edge
+            c->writable_ = false;
+        } else if (errno != EINTR) {
+            c->Fail(errno);
+        }
+    }
+}
+
+void EpollLoop::Read(Connection *c) {
+    // Edge-triggered: we have to drain the socket.
+    while (c->Open()) {
+        const ssize_t res =
+                read(c->fd(), c->in_, static_cast<size_t>(c->buf_size_));
+        if (res > 0) {
+            c->Deliver(c->in_, static_cast<int32_t>(res));
+        } else if (res == 0) {
+            c->Close();
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return;
+        } else if (errno != EINTR) {
+            c->Fail(errno);
+        }
+    }
+}
+
+int EpollLoop::RunOnce(int timeout_ms) {
+    for (Slot &s : slots_) {
+        Flush(s.conn);
+    }
+    struct epoll_event events[kMaxEvents];
+    int n;
+    do {
+        n = epoll_wait(epfd_, events, kMaxEvents, timeout_ms);
+    } while (n == -1 && errno == EINTR);
+    for (int i = 0; i < n; ++i) {
+        Connection *c = static_cast<Connection *>(events[i].data.ptr);
+        const uint32_t ev = events[i].events;
+        if ((ev & EPOLLOUT) != 0) {
+            c->writable_ = true;
+            Flush(c);
+        }
+        if ((ev & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) != 0) {
+            Read(c);
+        }
+        if ((ev & EPOLLERR) != 0 && c->Open()) {
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(c->fd(), SOL_SOCKET, SO_ERROR, &err, &len);
+            c->Fail(err);
+        }
+    }
+    return n;
+}
+
+}  // namespace okmongo
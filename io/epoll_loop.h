@@ -0,0 +1,75 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Edge-triggered epoll driver for `Connection`s
+ */
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "connection.h"
+
+namespace okmongo {
+
+/**
+ * Runs `Connection`s on an edge-triggered epoll set.
+ *
+ * Every iteration writes out what was queued on the connections (one `send`
+ * per connection), waits for events and reads until the sockets are drained,
+ * feeding everything to the sinks of the connections.
+ *
+ * > okmongo::EpollLoop loop;
+ * > okmongo::Connection c(fd, &mux);
+ * > loop.Add(&c);
+ * > c.Send(w);
+ * > while (mux.InFlight() > 0 && c.Open()) loop.RunOnce(-1);
+ */
+class EpollLoop {
+public:
+    explicit EpollLoop(int32_t buffer_size = kDefaultIoBufferSize);
+    ~EpollLoop();
+
+    EpollLoop(const EpollLoop &) = delete;
+    EpollLoop &operator=(const EpollLoop &) = delete;
+
+    /**
+     * Whether the epoll set could be created.
+     */
+    bool Ok() const { return epfd_ != -1; }
+
+    /**
+     * Start driving `c`, this allocates the buffers of the connection.
+     *
+     * @return false if the socket couldn't be added to the epoll set.
+     */
+    bool Add(Connection *c);
+
+    /**
+     * Stop driving `c` (and free its buffers). Anything still pending is
+     * dropped.
+     */
+    void Remove(Connection *c);
+
+    /**
+     * Flush the connections, wait at most `timeout_ms` (-1 for ever) for
+     * events and handle them.
+     *
+     * @return the number of events handled or -1 if `epoll_wait` failed.
+     */
+    int RunOnce(int timeout_ms);
+
+private:
+    struct Slot {
+        Connection *conn;
+        std::unique_ptr<char[]> mem;
+    };
+
+    void Flush(Connection *c);
+    void Read(Connection *c);
+
+    int epfd_;
+    int32_t buffer_size_;
+    std::vector<Slot> slots_;
+};
+
+}  // namespace okmongo
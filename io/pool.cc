@@ -0,0 +1,247 @@
+#include "pool.h"
+#include <cstring>
+
+extern "C" {
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+}
+
+namespace okmongo {
+
+namespace {
+
+// A blocking connect followed by a switch to non-blocking mode.
+int Connect(const struct addrinfo *addrs) {
+    for (const struct addrinfo *a = addrs; a != nullptr; a = a->ai_next) {
+        const int fd = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC,
+                              a->ai_protocol);
+        if (fd == -1) {
+            continue;
+        }
+        const int one = 1;
+        if (connect(fd, a->ai_addr, a->ai_addrlen) == 0 &&
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0 &&
+            fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == 0) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+}  // namespace
+
+ConnectionPool::ConnectionPool(EpollLoop *loop, const PoolOptions &opts)
+    : loop_(loop), opts_(opts), topology_(opts.local_threshold_ms) {}
+
+ConnectionPool::~ConnectionPool() {
+    for (auto &m : members_) {
+        for (auto &l : m->links) {
+            DropLink(l.get());
+            if (l->owned) {
+                close(l->conn.fd());
+            }
+        }
+    }
+}
+
+int32_t ConnectionPool::AddServer(const std::string &name,
+                                  const std::vector<int> &fds) {
+    std::unique_ptr<Member> m(new Member());
+    const int32_t server = topology_.size();
+    for (const int fd : fds) {
+        m->links.emplace_back(new Link(this, server, fd, false));
+        Link *l = m->links.back().get();
+        if (!loop_->Add(&l->conn)) {
+            for (auto &added : m->links) {
+                DropLink(added.get());
+            }
+            return -1;
+        }
+        l->attached = true;
+    }
+    members_.push_back(std::move(m));
+    return topology_.AddServer(name);
+}
+
+int32_t ConnectionPool::AddHost(const std::string &host, uint16_t port) {
+    struct addrinfo hints;
+    std::memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo *addrs = nullptr;
+    const std::string service = std::to_string(port);
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &addrs) != 0) {
+        return -1;
+    }
+    std::vector<int> fds;
+    for (int32_t i = 0; i < opts_.connections_per_host; ++i) {
+        const int fd = Connect(addrs);
+        if (fd == -1) {
+            break;
+        }
+        fds.push_back(fd);
+    }
+    freeaddrinfo(addrs);
+    int32_t res = -1;
+    if (static_cast<int32_t>(fds.size()) == opts_.connections_per_host) {
+        res = AddServer(host + ":" + service, fds);
+    }
+    if (res == -1) {
+        for (const int fd : fds) {
+            close(fd);
+        }
+        return -1;
+    }
+    for (auto &l : members_.back()->links) {
+        l->owned = true;
+    }
+    return res;
+}
+
+int32_t ConnectionPool::NextRequestId() {
+    do {
+        next_id_ = (next_id_ == INT32_MAX) ? 1 : next_id_ + 1;
+    } while (requests_.count(next_id_) != 0);
+    return next_id_;
+}
+
+void ConnectionPool::Cancel(int32_t request_id) {
+    auto it = requests_.find(request_id);
+    if (it == requests_.end()) {
+        return;
+    }
+    Link *link = it->second;
+    Member &m = *members_[static_cast<size_t>(link->server)];
+    link->mux.Cancel(request_id);
+    requests_.erase(it);
+    if (request_id == m.heartbeat_id) {
+        m.heartbeat_id = 0;
+        --heartbeats_;
+    } else {
+        topology_.OnRequestDone(link->server);
+    }
+}
+
+ConnectionPool::Link *ConnectionPool::PickLink(int32_t server) {
+    Link *best = nullptr;
+    for (auto &l : members_[static_cast<size_t>(server)]->links) {
+        if (!l->attached || !l->conn.Open()) {
+            continue;
+        }
+        if (best == nullptr || l->mux.InFlight() < best->mux.InFlight()) {
+            best = l.get();
+        }
+    }
+    return best;
+}
+
+void ConnectionPool::ReplyDone(Link *link, int32_t request_id) {
+    requests_.erase(request_id);
+    Member &m = *members_[static_cast<size_t>(link->server)];
+    if (request_id != m.heartbeat_id) {
+        topology_.OnRequestDone(link->server);
+        return;
+    }
+    --heartbeats_;
+    m.heartbeat_id = 0;
+    m.answered = true;
+    const auto rtt = std::chrono::duration_cast<std::chrono::microseconds>(
+            Clock::now() - m.heartbeat_sent);
+    if (m.parser.Failed()) {
+        topology_.OnServerDown(link->server);
+    } else {
+        topology_.OnHeartbeat(link->server, m.parser.Result(), rtt.count());
+    }
+}
+
+void ConnectionPool::SendHeartbeat(int32_t server, Clock::time_point now) {
+    Member &m = *members_[static_cast<size_t>(server)];
+    Link *link = PickLink(server);
+    if (link == nullptr) {
+        return;
+    }
+    const int32_t id = NextRequestId();
+    heartbeat_.Clear();
+    FillIsMasterOp(&heartbeat_, id);
+    if (link->conn.Send(heartbeat_) != Connection::SendResult::kQueued) {
+        return;
+    }
+    m.parser.Clear();
+    link->mux.Expect(id, &m.parser);
+    requests_[id] = link;
+    ++heartbeats_;
+    m.heartbeat_id = id;
+    m.heartbeat_sent = now;
+    m.sent = true;
+}
+
+void ConnectionPool::DropLink(Link *link) {
+    if (!link->attached) {
+        return;
+    }
+    loop_->Remove(&link->conn);
+    link->attached = false;
+}
+
+void ConnectionPool::Heartbeat() {
+    // Forget about the requests sent on closed connections
+    for (auto it = requests_.begin(); it != requests_.end();) {
+        Link *link = it->second;
+        if (link->conn.Open()) {
+            ++it;
+            continue;
+        }
+        Member &m = *members_[static_cast<size_t>(link->server)];
+        if (it->first == m.heartbeat_id) {
+            m.heartbeat_id = 0;
+            --heartbeats_;
+        } else {
+            topology_.OnRequestDone(link->server);
+        }
+        it = requests_.erase(it);
+    }
+
+    const Clock::time_point now = Clock::now();
+    const Clock::duration interval =
+            std::chrono::milliseconds(opts_.heartbeat_interval_ms);
+    for (int32_t i = 0; i < topology_.size(); ++i) {
+        Member &m = *members_[static_cast<size_t>(i)];
+        bool open = false;
+        for (auto &l : m.links) {
+            if (l->conn.Open()) {
+                open = true;
+            } else {
+                DropLink(l.get());
+            }
+        }
+        if (!open) {
+            m.answered = true;
+            topology_.OnServerDown(i);
+            continue;
+        }
+        if (m.heartbeat_id == 0) {
+            if (!m.sent || now - m.heartbeat_sent >= interval) {
+                SendHeartbeat(i, now);
+            }
+        } else if (now - m.heartbeat_sent >= interval) {
+            // Still waiting: the server is too slow to be used.
+            topology_.OnServerDown(i);
+        }
+    }
+}
+
+bool ConnectionPool::Discovering() const {
+    for (const auto &m : members_) {
+        if (!m->answered) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,202 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Pipelined connections to all the servers of a deployment
+ */
+#pragma once
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "connection.h"
+#include "epoll_loop.h"
+#include "multiplexer.h"
+#include "topology.h"
+
+namespace okmongo {
+
+struct PoolOptions {
+    /**
+     * Number of connections opened by `ConnectionPool::AddHost`.
+     */
+    int32_t connections_per_host = 2;
+
+    /**
+     * Time between two `ismaster` heartbeats to a server.
+     */
+    int64_t heartbeat_interval_ms = 10000;
+
+    /**
+     * See `Topology`.
+     */
+    int64_t local_threshold_ms = 15;
+};
+
+/**
+ * Keeps a few pipelined connections open to every server and routes the
+ * requests according to their read preference.
+ *
+ * Every server is sent a `FillIsMasterOp` heartbeat every
+ * `heartbeat_interval_ms`: this is what tells us the role of each server
+ * and how far it is. Requests go to the server picked by `Topology` and, on
+ * that server, on the connection with the fewest requests in flight.
+ *
+ * Nothing is done behind your back: the pool is driven by the loop it was
+ * given and `Heartbeat` has to be called regularly.
+ *
+ * > okmongo::ConnectionPool pool(&loop);
+ * > pool.AddHost("db1.example.com", 27017);
+ * > pool.AddHost("db2.example.com", 27017);
+ * > while (pool.Discovering()) { pool.Heartbeat(); loop.RunOnce(10); }
+ * > const int32_t id = pool.NextRequestId();
+ * > okmongo::FillQueryOp(&w, id, "db", "coll", query);
+ * > pool.Send(okmongo::ReadPreference::kSecondaryPreferred, w, id, &reader);
+ * > while (pool.InFlight() > 0) { pool.Heartbeat(); loop.RunOnce(10); }
+ */
+class ConnectionPool {
+public:
+    explicit ConnectionPool(EpollLoop *loop,
+                            const PoolOptions &opts = PoolOptions());
+    ~ConnectionPool();
+
+    ConnectionPool(const ConnectionPool &) = delete;
+    ConnectionPool &operator=(const ConnectionPool &) = delete;
+
+    /**
+     * Add a server we already have connections to.
+     *
+     * The sockets must be connected and non-blocking, they aren't owned by
+     * the pool.
+     *
+     * @return the index of the server in `topology()` or -1 if the sockets
+     * couldn't be added to the loop.
+     */
+    int32_t AddServer(const std::string &name, const std::vector<int> &fds);
+
+    /**
+     * Open `connections_per_host` connections to `host` (this blocks until
+     * they are established).
+     *
+     * @return the index of the server in `topology()` or -1 on error.
+     */
+    int32_t AddHost(const std::string &host, uint16_t port);
+
+    /**
+     * Allocate an id for a new request (ids are unique across the pool).
+     */
+    int32_t NextRequestId();
+
+    /**
+     * Send the request in `w` to a server acceptable for `pref`; its reply
+     * will go to `reader`.
+     *
+     * @return the index of the server or -1 if no server is eligible (or
+     * its connections are all full or closed).
+     */
+    template <typename Reader>
+    int32_t Send(ReadPreference pref, const BsonWriter &w, int32_t request_id,
+                 Reader *reader);
+
+    /**
+     * Stop waiting on `request_id`, its reply will be skipped.
+     */
+    void Cancel(int32_t request_id);
+
+    /**
+     * Send the heartbeats that are due and take note of the connections that
+     * were closed. The requests that were in flight on those are dropped:
+     * their readers will never see a reply.
+     *
+     * Servers whose heartbeat isn't back after `heartbeat_interval_ms` are
+     * considered down until it is.
+     */
+    void Heartbeat();
+
+    /**
+     * Whether some servers haven't answered their first heartbeat yet.
+     */
+    bool Discovering() const;
+
+    /**
+     * Number of requests (heartbeats excluded) waiting for a reply.
+     */
+    size_t InFlight() const { return requests_.size() - heartbeats_; }
+
+    const Topology &topology() const { return topology_; }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Link;
+
+    class Mux : public ResponseMultiplexer<Mux> {
+    public:
+        Mux(ConnectionPool *pool, Link *link) : pool_(pool), link_(link) {}
+
+        void EmitReplyDone(int32_t request_id) {
+            pool_->ReplyDone(link_, request_id);
+        }
+
+    private:
+        ConnectionPool *pool_;
+        Link *link_;
+    };
+
+    struct Link {
+        Link(ConnectionPool *pool, int32_t server, int fd, bool owned)
+            : server(server), owned(owned), mux(pool, this), conn(fd, &mux) {}
+
+        int32_t server;
+        bool owned;  // We close the fd
+        bool attached = false;
+        Mux mux;
+        Connection conn;
+    };
+
+    struct Member {
+        std::vector<std::unique_ptr<Link>> links;
+        IsMasterParser parser;
+        int32_t heartbeat_id = 0;  // 0 if no heartbeat is in flight
+        bool answered = false;
+        bool sent = false;
+        Clock::time_point heartbeat_sent;
+    };
+
+    // The open connection of `server` with the fewest requests in flight
+    Link *PickLink(int32_t server);
+    void ReplyDone(Link *link, int32_t request_id);
+    void SendHeartbeat(int32_t server, Clock::time_point now);
+    void DropLink(Link *link);
+
+    EpollLoop *loop_;
+    PoolOptions opts_;
+    Topology topology_;
+    std::vector<std::unique_ptr<Member>> members_;
+    // Where the requests (heartbeats included) are in flight
+    std::unordered_map<int32_t, Link *> requests_;
+    size_t heartbeats_ = 0;
+    int32_t next_id_ = 0;
+    BsonWriter heartbeat_;
+};
+
+template <typename Reader>
+int32_t ConnectionPool::Send(ReadPreference pref, const BsonWriter &w,
+                             int32_t request_id, Reader *reader) {
+    const int32_t server = topology_.Select(pref);
+    if (server == -1) {
+        return -1;
+    }
+    Link *link = PickLink(server);
+    if (link == nullptr ||
+        link->conn.Send(w) != Connection::SendResult::kQueued) {
+        return -1;
+    }
+    link->mux.Expect(request_id, reader);
+    requests_[request_id] = link;
+    topology_.OnRequestSent(server);
+    return server;
+}
+
+}  // namespace okmongo
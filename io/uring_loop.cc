@@ -0,0 +1,227 @@
+#include "uring_loop.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/uio.h>
+}
+
+namespace okmongo {
+
+UringLoop::UringLoop(int32_t max_connections, int32_t buffer_size,
+                     unsigned entries)
+    : buffer_size_(buffer_size),
+      slab_(new char[2 * static_cast<size_t>(buffer_size) *
+                     static_cast<size_t>(max_connections)]),
+      slots_(static_cast<size_t>(max_connections)) {
+    if (io_uring_queue_init(entries, &ring_, 0) < 0) {
+        return;
+    }
+    struct iovec slab;
+    slab.iov_base = slab_.get();
+    slab.iov_len = 2 * static_cast<size_t>(buffer_size) *
+                   static_cast<size_t>(max_connections);
+    if (io_uring_register_buffers(&ring_, &slab, 1) < 0) {
+        io_uring_queue_exit(&ring_);
+        return;
+    }
+    for (size_t i = 0; i < slots_.size(); ++i) {
+        Slot &s = slots_[i];
+        s.mem = slab_.get() + 2 * i * static_cast<size_t>(buffer_size);
+        s.read_op = Op{&s, OpKind::kRead};
+        s.write_op = Op{&s, OpKind::kWrite};
+        s.cancel_op = Op{&s, OpKind::kCancel};
+    }
+    ok_ = true;
+}
+
+UringLoop::~UringLoop() {
+    if (!ok_) {
+        return;
+    }
+    for (Slot &s : slots_) {
+        if (s.conn != nullptr) {
+            Remove(s.conn);
+        }
+    }
+    // The kernel must be done with the buffers before we free them.
+    io_uring_submit(&ring_);
+    for (;;) {
+        bool busy = false;
+        for (const Slot &s : slots_) {
+            busy = busy || Busy(s);
+        }
+        if (!busy) {
+            break;
+        }
+        struct io_uring_cqe *cqe;
+        if (io_uring_wait_cqe(&ring_, &cqe) < 0) {
+            break;
+        }
+        Complete(cqe);
+        io_uring_cqe_seen(&ring_, cqe);
+    }
+    io_uring_queue_exit(&ring_);
+}
+
+bool UringLoop::Add(Connection *c) {
+    for (Slot &s : slots_) {
+        if (s.conn == nullptr && !Busy(s)) {
+            s.conn = c;
+            c->Attach(s.mem, s.mem + buffer_size_, buffer_size_);
+            return true;
+        }
+    }
+    return false;
+}
+
+void UringLoop::Remove(Connection *c) {
+    for (Slot &s : slots_) {
+        if (s.conn != c) {
+            continue;
+        }
+        s.conn = nullptr;
+        c->Detach();
+        // A write to a peer that stopped reading would never complete
+        if (s.reading) {
+            Cancel(&s, &s.read_op);
+        }
+        if (s.writing) {
+            Cancel(&s, &s.write_op);
+        }
+        return;
+    }
+}
+
+void UringLoop::Cancel(Slot *s, Op *op) {
+    struct io_uring_sqe *sqe = GetSqe();
+    if (sqe != nullptr) {
+        io_uring_prep_cancel(sqe, op, 0);
+        io_uring_sqe_set_data(sqe, &s->cancel_op);
+        ++s->cancelling;
+    }
+}
+
+struct io_uring_sqe *UringLoop::GetSqe() {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring_);
+    if (sqe == nullptr) {
+        // The submission queue is full: push what we have to the kernel.
+        io_uring_submit(&ring_);
+        sqe = io_uring_get_sqe(&ring_);
+    }
+    return sqe;
+}
+
+void UringLoop::Queue(Slot *s) {
+    Connection *c = s->conn;
+    if (c == nullptr || !c->Open()) {
+        return;
+    }
+    if (!s->reading) {
+        struct io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        io_uring_prep_read_fixed(sqe, c->fd(), c->in_,
+                                 static_cast<unsigned>(c->buf_size_), 0, 0);
+        io_uring_sqe_set_data(sqe, &s->read_op);
+        s->reading = true;
+    }
+    if (!s->writing && c->Pending() > 0) {
+        struct io_uring_sqe *sqe = GetSqe();
+        if (sqe == nullptr) {
+            return;
+        }
+        // The output buffer goes first, then the message sent in place (the
+        // iovecs aren't touched until the write completes).
+        s->in_place = c->Buffered() == 0;
+        if (s->in_place) {
+            io_uring_prep_writev(
+                    sqe, c->fd(), c->InPlaceIovecs(),
+                    static_cast<unsigned>(std::min(c->InPlaceCount(), IOV_MAX)),
+                    0);
+        } else {
+            io_uring_prep_write_fixed(sqe, c->fd(), c->PendingData(),
+                                      static_cast<unsigned>(c->Buffered()), 0,
+                                      0);
+            c->out_busy_ = true;
+        }
+        io_uring_sqe_set_data(sqe, &s->write_op);
+        s->writing = true;
+    }
+}
+
+void UringLoop::Complete(const struct io_uring_cqe *cqe) {
+    const Op *op = static_cast<const Op *>(io_uring_cqe_get_data(cqe));
+    Slot *s = op->slot;
+    Connection *c = s->conn;
+    const int res = cqe->res;
+    switch (op->kind) {
+    case OpKind::kRead:
+        s->reading = false;
+        if (c == nullptr) {
+            return;
+        }
+        if (res > 0) {
+            c->Deliver(c->in_, res);
+        } else if (res == 0) {
+            c->Close();
+        } else if (res != -EINTR && res != -EAGAIN) {
+            c->Fail(-res);
+        }
+        return;
+    case OpKind::kWrite:
+        s->writing = false;
+        if (c == nullptr) {
+            return;
+        }
+        c->out_busy_ = false;
+        if (res >= 0 && s->in_place) {
+            c->SentInPlace(res);
+        } else if (res >= 0) {
+            c->Sent(res);
+        } else if (res != -EINTR && res != -EAGAIN) {
+            c->Fail(-res);
+        }
+        return;
+    case OpKind::kCancel:
+        --s->cancelling;
+        return;
+    }
+}
+
+int UringLoop::RunOnce(int timeout_ms) {
+    for (Slot &s : slots_) {
+        Queue(&s);
+    }
+    if (io_uring_submit(&ring_) < 0) {
+        return -1;
+    }
+    struct io_uring_cqe *cqe;
+    int res;
+    if (timeout_ms < 0) {
+        res = io_uring_wait_cqe(&ring_, &cqe);
+    } else {
+        struct __kernel_timespec ts;
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+        res = io_uring_wait_cqe_timeout(&ring_, &cqe, &ts);
+    }
+    if (res == -ETIME || res == -EINTR) {
+        return 0;
+    }
+    if (res < 0) {
+        return -1;
+    }
+    int n = 0;
+    while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+        Complete(cqe);
+        io_uring_cqe_seen(&ring_, cqe);
+        ++n;
+    }
+    return n;
+}
+
+}  // namespace okmongo
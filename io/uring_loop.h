@@ -0,0 +1,114 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief io_uring driver for `Connection`s
+ *
+ * Only built when configure found liburing (`HAVE_LIBURING`).
+ */
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "connection.h"
+
+extern "C" {
+#include <liburing.h>
+}
+
+namespace okmongo {
+
+/**
+ * Runs `Connection`s on an io_uring.
+ *
+ * The buffers of all the connections are carved out of one slab registered
+ * with the ring so reads and writes use the fixed-buffer operations (no
+ * per-operation page pinning). Every connection always has a read queued and
+ * one write as soon as it has pending data; `RunOnce` submits everything that
+ * was queued since the last iteration in one `io_uring_submit`.
+ *
+ * This is a drop-in replacement for `EpollLoop`.
+ */
+class UringLoop {
+public:
+    /**
+     * @param max_connections number of connections this loop can drive.
+     * @param buffer_size size of the input (and output) buffer of every
+     *   connection.
+     * @param entries size of the submission queue.
+     */
+    explicit UringLoop(int32_t max_connections,
+                       int32_t buffer_size = kDefaultIoBufferSize,
+                       unsigned entries = 256);
+    ~UringLoop();
+
+    UringLoop(const UringLoop &) = delete;
+    UringLoop &operator=(const UringLoop &) = delete;
+
+    /**
+     * Whether the ring could be set up and the buffers registered.
+     */
+    bool Ok() const { return ok_; }
+
+    /**
+     * Start driving `c`.
+     *
+     * @return false if all the slots are taken.
+     */
+    bool Add(Connection *c);
+
+    /**
+     * Stop driving `c`. Anything still pending is dropped and the read and
+     * write in flight are cancelled; the slot is reused once the kernel is
+     * done with them.
+     */
+    void Remove(Connection *c);
+
+    /**
+     * Queue reads and writes, submit them, wait at most `timeout_ms` (-1 for
+     * ever) for completions and handle them.
+     *
+     * @return the number of completions handled or -1 on error.
+     */
+    int RunOnce(int timeout_ms);
+
+private:
+    enum class OpKind : uint8_t { kRead, kWrite, kCancel };
+
+    struct Slot;
+
+    // The `user_data` of the sqes.
+    struct Op {
+        Slot *slot;
+        OpKind kind;
+    };
+
+    struct Slot {
+        Connection *conn = nullptr;
+        char *mem = nullptr;
+        bool reading = false;
+        bool writing = false;
+        bool in_place = false;  // ... the message sent in place
+        int8_t cancelling = 0;  // Cancels in flight
+        Op read_op;
+        Op write_op;
+        Op cancel_op;
+    };
+
+    bool Busy(const Slot &s) const {
+        return s.reading || s.writing || s.cancelling > 0;
+    }
+
+    // Cancel the operation of `s` in flight
+    void Cancel(Slot *s, Op *op);
+    struct io_uring_sqe *GetSqe();
+    void Queue(Slot *s);
+    void Complete(const struct io_uring_cqe *cqe);
+
+    struct io_uring ring_;
+    bool ok_ = false;
+    int32_t buffer_size_;
+    std::unique_ptr<char[]> slab_;
+    std::vector<Slot> slots_;
+};
+
+}  // namespace okmongo
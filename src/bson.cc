@@ -1,16 +1,258 @@
 #include "bson.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+extern "C" {
+#include <sys/uio.h>
+}
 
 namespace okmongo {
 
-BsonWriter::~BsonWriter() {
+int32_t BsonBufferPool::SizeClass(int32_t size) {
+    int32_t cls = 0;
+    while ((static_cast<int32_t>(1) << (cls + kMinClass_)) < size) {
+        ++cls;
+    }
+    return cls;
+}
+
+std::unique_ptr<char[]> BsonBufferPool::Acquire(int32_t *size) {
+    assert(*size > 0 && *size <= (1 << 30));
+    const int32_t cls = SizeClass(*size);
+    *size = static_cast<int32_t>(1) << (cls + kMinClass_);
+    auto &bucket = free_[cls];
+    if (bucket.empty()) {
+        return std::unique_ptr<char[]>(new char[*size]);
+    }
+    std::unique_ptr<char[]> res = std::move(bucket.back());
+    bucket.pop_back();
+    return res;
+}
+
+void BsonBufferPool::Recycle(std::unique_ptr<char[]> buf, int32_t size) {
+    const int32_t cls = SizeClass(size);
+    assert((static_cast<int32_t>(1) << (cls + kMinClass_)) == size);
+    auto &bucket = free_[cls];
+    if (static_cast<int32_t>(bucket.size()) < max_cached_) {
+        bucket.push_back(std::move(buf));
+    }
+}
+
+int32_t BsonBufferPool::Cached() const {
+    size_t res = 0;
+    for (const auto &bucket : free_) {
+        res += bucket.size();
+    }
+    return static_cast<int32_t>(res);
+}
+
+BsonWriter::BsonWriter(BsonWriter &&other) noexcept { TakeFrom(&other); }
+
+BsonWriter &BsonWriter::operator=(BsonWriter &&other) noexcept {
+    if (this != &other) {
+        FreeHeapBuffer();
+        TakeFrom(&other);
+    }
+    return *this;
+}
+
+BsonWriter::~BsonWriter() { FreeHeapBuffer(); }
+
+void BsonWriter::FreeHeapBuffer() {
     if (!DataIsInline()) {
+        if (pool_ != nullptr) {
+            pool_->Recycle(std::move(data_), size_);
+        }
+        data_.~unique_ptr<char[]>();
+        size_ = kMinSize_;
+    }
+}
+
+void BsonWriter::TakeFrom(BsonWriter *other) {
+    assert(DataIsInline());
+    if (other->DataIsInline()) {
+        std::memcpy(inline_data_, other->inline_data_,
+                    static_cast<size_t>(other->pos_));
+    } else {
+        new (&data_) std::unique_ptr<char[]>(std::move(other->data_));
+        other->data_.~unique_ptr<char[]>();
+    }
+    size_ = other->size_;
+    pos_ = other->pos_;
+    doc_start_ = other->doc_start_;
+    pool_ = other->pool_;
+    external_ = std::move(other->external_);
+    external_len_ = other->external_len_;
+    external_threshold_ = other->external_threshold_;
+    other->size_ = kMinSize_;
+    other->Clear();
+}
+
+void BsonWriter::ShrinkToFit() {
+    if (DataIsInline()) {
+        return;
+    }
+    if (pos_ <= kMinSize_) {
+        std::unique_ptr<char[]> old = std::move(data_);
+        data_.~unique_ptr<char[]>();
+        std::memcpy(inline_data_, old.get(), static_cast<size_t>(pos_));
+        if (pool_ != nullptr) {
+            pool_->Recycle(std::move(old), size_);
+        }
+        size_ = kMinSize_;
+        return;
+    }
+    int32_t new_size = pos_;
+    std::unique_ptr<char[]> new_doc;
+    if (pool_ != nullptr) {
+        new_doc = pool_->Acquire(&new_size);
+        if (new_size >= size_) {
+            // Already the smallest size class that fits
+            pool_->Recycle(std::move(new_doc), new_size);
+            return;
+        }
+    } else if (new_size < size_) {
+        new_doc.reset(new char[new_size]);
+    } else {
+        return;
+    }
+    std::memcpy(new_doc.get(), data_.get(), static_cast<size_t>(pos_));
+    if (pool_ != nullptr) {
+        pool_->Recycle(std::move(data_), size_);
+    }
+    data_ = std::move(new_doc);
+    size_ = new_size;
+}
+
+std::unique_ptr<char[]> BsonWriter::Release(int32_t *len) {
+    assert(external_.empty());
+    *len = pos_;
+    std::unique_ptr<char[]> res;
+    if (DataIsInline()) {
+        res.reset(new char[std::max(pos_, 1)]);
+        std::memcpy(res.get(), inline_data_, static_cast<size_t>(pos_));
+    } else {
+        res = std::move(data_);
         data_.~unique_ptr<char[]>();
+        size_ = kMinSize_;
     }
+    Clear();
+    return res;
+}
+
+void BsonWriter::Grow(int32_t r) {
+    int32_t new_size = std::max(2 * size_, size_ + r + 2);
+    std::unique_ptr<char[]> new_doc;
+    if (pool_ != nullptr) {
+        new_doc = pool_->Acquire(&new_size);
+    } else {
+        new_doc.reset(new char[new_size]);
+    }
+    std::memcpy(new_doc.get(), data(), static_cast<size_t>(pos_));
+    if (DataIsInline()) {
+        new (&data_) std::unique_ptr<char[]>(std::move(new_doc));
+    } else {
+        if (pool_ != nullptr) {
+            pool_->Recycle(std::move(data_), size_);
+        }
+        data_ = std::move(new_doc);
+    }
+    size_ = new_size;
 }
 
 void BsonWriter::Clear() {
     doc_start_ = 0;
     pos_ = 0;
+    external_.clear();
+    external_len_ = 0;
+}
+
+void BsonWriter::CopyFrom(const BsonWriter &other) {
+    Clear();
+    Reserve(other.pos_);
+    std::memcpy(WritableData(), other.data(), static_cast<size_t>(other.pos_));
+    pos_ = other.pos_;
+    doc_start_ = other.doc_start_;
+    external_ = other.external_;
+    external_len_ = other.external_len_;
+}
+
+void BsonWriter::Rewind(const Mark &m) {
+    assert(m.pos <= pos_ && m.doc_start == doc_start_);
+    assert(m.num_external <= external_.size());
+    pos_ = m.pos;
+    external_.resize(m.num_external);
+    external_len_ = m.external_len;
+}
+
+void BsonWriter::AppendExternal(const char *data, int32_t len) {
+    external_.push_back(ExternalSegment{pos_, data, len});
+    external_len_ += len;
+}
+
+int32_t BsonWriter::ExternalLenAfter(int32_t pos) const {
+    int32_t res = 0;
+    for (auto it = external_.rbegin(); it != external_.rend(); ++it) {
+        if (it->offset <= pos) {
+            break;
+        }
+        res += it->len;
+    }
+    return res;
+}
+
+int32_t BsonWriter::IovecCount() const {
+    int32_t res = 0;
+    int32_t pos = 0;
+    for (const ExternalSegment &seg : external_) {
+        if (seg.offset > pos) {
+            ++res;
+        }
+        ++res;
+        pos = seg.offset;
+    }
+    if (pos_ > pos) {
+        ++res;
+    }
+    return res;
+}
+
+int32_t BsonWriter::FillIovecs(struct iovec *iov, int32_t n) const {
+    int32_t res = 0;
+    int32_t pos = 0;
+    const char *buf = data();
+    auto push = [&](const char *base, int32_t len) {
+        if (res < n) {
+            iov[res].iov_base = const_cast<char *>(base);
+            iov[res].iov_len = static_cast<size_t>(len);
+            ++res;
+        }
+    };
+    for (const ExternalSegment &seg : external_) {
+        if (seg.offset > pos) {
+            push(buf + pos, seg.offset - pos);
+        }
+        push(seg.data, seg.len);
+        pos = seg.offset;
+    }
+    if (pos_ > pos) {
+        push(buf + pos, pos_ - pos);
+    }
+    return res;
+}
+
+void BsonWriter::CopyTo(char *dst) const {
+    int32_t pos = 0;
+    const char *buf = data();
+    for (const ExternalSegment &seg : external_) {
+        std::memcpy(dst, buf + pos, static_cast<size_t>(seg.offset - pos));
+        dst += seg.offset - pos;
+        std::memcpy(dst, seg.data, static_cast<size_t>(seg.len));
+        dst += seg.len;
+        pos = seg.offset;
+    }
+    std::memcpy(dst, buf + pos, static_cast<size_t>(pos_ - pos));
 }
 
 BsonTag ToBsonTag(char c) {
@@ -218,6 +460,7 @@ BsonValue BsonValue::GetField(const char *needle) const {
     if (tag_ != BsonTag::kDocument) {
         return BsonValue();
     }
+    const size_t needle_len = strlen(needle);
     const char *end = data_ + size_;
     const char *curs = data_ + sizeof(int32_t);
     while (curs < end) {
@@ -226,20 +469,10 @@ BsonValue BsonValue::GetField(const char *needle) const {
             return BsonValue();
         }
         ++curs;
-        const char *match_cpy = needle;
-        while (*curs == *match_cpy && *curs) {
-            ++curs;
-            ++match_cpy;
-            if (curs >= end - 1) {
-                return BsonValue();
-            }
-        }
-        const bool matched = *curs == '\000' && *match_cpy == '\000';
-        while (*curs) {
-            ++curs;
-            if (curs >= end - 1) {
-                return BsonValue();
-            }
+        bool matched;
+        curs = MatchKey(curs, end - 1, needle, needle_len, &matched);
+        if (curs == end - 1) {
+            return BsonValue();
         }
         ++curs;
         const int32_t size =
@@ -259,6 +492,164 @@ BsonValue BsonValue::GetField(const char *needle) const {
     return BsonValue();
 }
 
+namespace {
+    // The order of the types when sorting
+    int TypeRank(const BsonValue &v) {
+        if (v.Empty()) {
+            return 5;  // Missing fields are nulls
+        }
+        switch (v.Tag()) {
+            case BsonTag::kMinKey:
+                return 0;
+            case BsonTag::kNull:
+                return 5;
+            case BsonTag::kDouble:
+            case BsonTag::kInt32:
+            case BsonTag::kInt64:
+                return 10;
+            case BsonTag::kUtf8:
+                return 15;
+            case BsonTag::kDocument:
+                return 20;
+            case BsonTag::kArray:
+                return 25;
+            case BsonTag::kBindata:
+                return 30;
+            case BsonTag::kObjectId:
+                return 35;
+            case BsonTag::kBool:
+                return 40;
+            case BsonTag::kUtcDatetime:
+                return 45;
+            case BsonTag::kTimestamp:
+                return 47;
+            case BsonTag::kRegexp:
+                return 50;
+            case BsonTag::kJs:
+                return 60;
+            case BsonTag::kScopedJs:
+                return 65;
+            case BsonTag::kMaxKey:
+                break;
+        }
+        return 100;
+    }
+
+    template <typename T>
+    int Cmp(T l, T r) {
+        return l < r ? -1 : (r < l ? 1 : 0);
+    }
+
+    int CompareBytes(const char *l, int32_t llen, const char *r,
+                     int32_t rlen) {
+        const int res = std::memcmp(l, r, static_cast<size_t>(
+                                                  std::min(llen, rlen)));
+        return res != 0 ? res : Cmp(llen, rlen);
+    }
+
+    // Exact, even when `r` has no int64_t representation
+    int CompareInt64Double(int64_t l, double r) {
+        if (std::isnan(r)) {
+            return 1;
+        }
+        constexpr double k2Pow63 = 9223372036854775808.0;
+        if (r >= k2Pow63) {
+            return -1;
+        }
+        if (r < -k2Pow63) {
+            return 1;
+        }
+        const int64_t ri = static_cast<int64_t>(r);
+        if (l != ri) {
+            return Cmp(l, ri);
+        }
+        // `r - ri` is exact: they have the same exponent
+        return Cmp(0.0, r - static_cast<double>(ri));
+    }
+
+    int CompareDoubles(double l, double r) {
+        if (std::isnan(l) || std::isnan(r)) {
+            return Cmp(!std::isnan(l), !std::isnan(r));
+        }
+        return Cmp(l, r);
+    }
+
+    int CompareNumbers(const BsonValue &l, const BsonValue &r) {
+        const bool ldouble = l.Tag() == BsonTag::kDouble;
+        const bool rdouble = r.Tag() == BsonTag::kDouble;
+        const auto as_int = [](const BsonValue &v) {
+            return v.Tag() == BsonTag::kInt32 ? v.GetInt32() : v.GetInt64();
+        };
+        if (ldouble && rdouble) {
+            return CompareDoubles(l.GetDouble(), r.GetDouble());
+        }
+        if (ldouble) {
+            return -CompareInt64Double(as_int(r), l.GetDouble());
+        }
+        if (rdouble) {
+            return CompareInt64Double(as_int(l), r.GetDouble());
+        }
+        return Cmp(as_int(l), as_int(r));
+    }
+}  // namespace
+
+int BsonValue::Compare(const BsonValue &other) const {
+    const int rank = TypeRank(*this);
+    const int res = Cmp(rank, TypeRank(other));
+    if (res != 0) {
+        return res;
+    }
+    if (Empty() || other.Empty()) {
+        return 0;  // Nulls
+    }
+    switch (tag_) {
+        case BsonTag::kDouble:
+        case BsonTag::kInt32:
+        case BsonTag::kInt64:
+            return CompareNumbers(*this, other);
+        case BsonTag::kUtf8:
+        case BsonTag::kJs:
+            // Without the terminating null
+            return CompareBytes(data_ + 4, size_ - 5, other.data_ + 4,
+                                other.size_ - 5);
+        case BsonTag::kDocument:
+        case BsonTag::kArray: {
+            BsonValueIt l(*this), r(other);
+            for (; !l.Done() && !r.Done(); l.next(), r.next()) {
+                int elt = Cmp(TypeRank(l), TypeRank(r));
+                if (elt == 0) {
+                    elt = std::strcmp(l.key(), r.key());
+                }
+                if (elt == 0) {
+                    elt = l.Compare(r);
+                }
+                if (elt != 0) {
+                    return elt;
+                }
+            }
+            return Cmp(!l.Done(), !r.Done());
+        }
+        case BsonTag::kBindata:
+            // Length, then subtype and bytes
+            if (size_ != other.size_) {
+                return Cmp(size_, other.size_);
+            }
+            return std::memcmp(data_ + 4, other.data_ + 4,
+                               static_cast<size_t>(size_ - 4));
+        case BsonTag::kObjectId:
+            return std::memcmp(data_, other.data_, 12);
+        case BsonTag::kBool:
+            return Cmp(GetBool(), other.GetBool());
+        case BsonTag::kUtcDatetime:
+            return Cmp(GetUtcDatetime(), other.GetUtcDatetime());
+        case BsonTag::kTimestamp:
+            return Cmp(static_cast<uint64_t>(GetTimestamp()),
+                       static_cast<uint64_t>(other.GetTimestamp()));
+        default:
+            return CompareBytes(data_, size_, other.data_, other.size_);
+    }
+}
+
 void BsonValueIt::Invalidate() {
     data_ = nullptr;
     tag_ = BsonTag::kMinKey;
@@ -282,12 +673,10 @@ bool BsonValueIt::MoveTo(const char *curs) {
     }
     ++curs;
     const char *key = curs;
-    while (*curs) {
-        ++curs;
-        if (curs >= end_ - 1) {
-            Invalidate();
-            return false;
-        }
+    curs = FindNul(curs, end_ - 1);
+    if (curs == end_ - 1) {
+        Invalidate();
+        return false;
     }
     ++curs;
     auto size = GetValueLength(tag, curs, static_cast<int32_t>(end_ - curs));
@@ -312,14 +701,101 @@ BsonValueIt::BsonValueIt(const BsonValue &v) {
         return;
     }
     end_ = v.data_ + v.size_;
-    MoveTo(v.data_ + sizeof(int32_t));
+    error_ = !MoveTo(v.data_ + sizeof(int32_t));
 }
 
 bool BsonValueIt::next() {
     if (!Done()) {
-        return MoveTo(data_ + size_);
+        error_ = !MoveTo(data_ + size_);
+        return !error_;
     }
     return false;
 }
 
+uint32_t BsonValueIndex::Hash(const char *s, int32_t len) {
+    // FNV-1a
+    uint32_t h = 2166136261u;
+    for (int32_t i = 0; i < len; ++i) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+bool BsonValueIndex::Reset(const BsonValue &doc) {
+    data_ = nullptr;
+    entries_.clear();
+    if (doc.Tag() != BsonTag::kDocument && doc.Tag() != BsonTag::kArray) {
+        return false;
+    }
+    const char *const start = doc.data_;
+    const char *const end = doc.data_ + doc.size_;
+    const char *curs = start + sizeof(int32_t);
+    while (curs < end - 1) {
+        const BsonTag tag = ToBsonTag(*curs);
+        if (tag == BsonTag::kMinKey) {
+            entries_.clear();
+            return false;
+        }
+        ++curs;
+        const char *key = curs;
+        const char *key_end = FindNul(key, end - 1);
+        if (key_end == end - 1) {
+            entries_.clear();
+            return false;
+        }
+        curs = key_end + 1;
+        const int32_t size =
+                GetValueLength(tag, curs, static_cast<int32_t>(end - curs));
+        if (size == -1) {
+            entries_.clear();
+            return false;
+        }
+        Entry e;
+        e.hash = Hash(key, static_cast<int32_t>(key_end - key));
+        e.key = static_cast<int32_t>(key - start);
+        e.value = static_cast<int32_t>(curs - start);
+        e.size = size;
+        e.tag = tag;
+        entries_.push_back(e);
+        curs += size;
+    }
+    if (curs != end - 1 || *curs != '\000') {
+        entries_.clear();
+        return false;
+    }
+    // Sorting on the key offset as well keeps the first of duplicate keys
+    // first, like `BsonValue::GetField`.
+    std::sort(entries_.begin(), entries_.end(),
+              [](const Entry &l, const Entry &r) {
+                  return l.hash < r.hash || (l.hash == r.hash && l.key < r.key);
+              });
+    data_ = start;
+    return true;
+}
+
+BsonValue BsonValueIndex::GetField(const char *needle) const {
+    return GetField(needle, static_cast<int32_t>(strlen(needle)));
+}
+
+BsonValue BsonValueIndex::GetField(const char *needle, int32_t len) const {
+    const uint32_t h = Hash(needle, len);
+    auto it = std::lower_bound(
+            entries_.begin(), entries_.end(), h,
+            [](const Entry &e, uint32_t hash) { return e.hash < hash; });
+    for (; it != entries_.end() && it->hash == h; ++it) {
+        const char *key = data_ + it->key;
+        // The key is null terminated right before its value
+        if (it->value - it->key == len + 1 &&
+            std::memcmp(key, needle, static_cast<size_t>(len)) == 0) {
+            BsonValue res;
+            res.data_ = data_ + it->value;
+            res.tag_ = it->tag;
+            res.size_ = it->size;
+            return res;
+        }
+    }
+    return BsonValue();
+}
+
 }  // namespace okmongo
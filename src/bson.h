@@ -9,6 +9,13 @@
 #include <algorithm>
 #include <cassert>
 #include <cstddef>
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+#include "simd.h"
+
+struct iovec;
 
 namespace okmongo {
 
@@ -93,6 +100,56 @@ BsonTag ToBsonTag(char c);
 template <typename T>
 struct KeyHelper {};
 
+/**
+ * A cache of heap buffers for `BsonWriter`.
+ *
+ * Buffers are bucketed by power of two sizes. A writer that outgrows its inline
+ * storage takes a buffer from the matching bucket (only calling `new[]` if the
+ * bucket is empty) and hands it back when it grows again or gets destroyed.
+ * Once the pool is warm building a message doesn't allocate at all.
+ *
+ * @note This class is not thread safe, it is meant to be used by a single
+ * connection (or thread).
+ */
+class BsonBufferPool {
+public:
+    /**
+     * @param max_cached maximum number of idle buffers kept per size class;
+     * extra buffers are freed.
+     */
+    explicit BsonBufferPool(int32_t max_cached = 16) : max_cached_(max_cached) {}
+
+    BsonBufferPool(const BsonBufferPool &) = delete;
+    BsonBufferPool &operator=(const BsonBufferPool &) = delete;
+
+    /**
+     * Get a buffer of at least `*size` bytes.
+     *
+     * `*size` is updated to contain the real size of the buffer.
+     */
+    std::unique_ptr<char[]> Acquire(int32_t *size);
+
+    /**
+     * Give a buffer back to the pool. `size` must be the value returned by
+     * `Acquire`.
+     */
+    void Recycle(std::unique_ptr<char[]> buf, int32_t size);
+
+    /**
+     * Number of idle buffers currently held by the pool.
+     */
+    int32_t Cached() const;
+
+private:
+    static constexpr int32_t kMinClass_ = 9;  // 512 bytes
+    static constexpr int32_t kNumClasses_ = 31 - kMinClass_;
+
+    static int32_t SizeClass(int32_t size);
+
+    int32_t max_cached_;
+    std::vector<std::unique_ptr<char[]>> free_[kNumClasses_];
+};
+
 /**
  * A helper class to write bson values.
  *
@@ -100,14 +157,36 @@ struct KeyHelper {};
  * `data()`. This buffer is the only thing that needs to get allocated in
  * this class.
  *
- * @note this driver only works on little endian architectures.
- * @todo use allocators
+ * Messages that outgrow the inline buffer are moved to the heap. By default
+ * this goes through `new[]`; pass a `BsonBufferPool` to the constructor to
+ * recycle heap buffers between messages instead.
  *
+ * @note this driver only works on little endian architectures.
  */
 class BsonWriter {
 public:
     BsonWriter() {}
 
+    /**
+     * Draw heap buffers from `pool` (and give them back to it on destruction).
+     *
+     * The pool must outlive the writer.
+     */
+    explicit BsonWriter(BsonBufferPool *pool) : pool_(pool) {}
+
+    /**
+     * Take the content of `other` over, without copying it if it's on the
+     * heap; `other` is left empty.
+     *
+     * A heap buffer drawn from a pool is given back to that pool: the pool
+     * moves with the buffer.
+     */
+    BsonWriter(BsonWriter &&other) noexcept;
+    BsonWriter &operator=(BsonWriter &&other) noexcept;
+
+    BsonWriter(const BsonWriter &) = delete;
+    BsonWriter &operator=(const BsonWriter &) = delete;
+
     ~BsonWriter();
 
     /**
@@ -117,6 +196,71 @@ public:
      */
     void Clear();
 
+    /**
+     * Replace the content of this writer with a copy of `other`, including
+     * the documents that are still open in `other`.
+     *
+     * This is how partially written messages get reused as templates.
+     */
+    void CopyFrom(const BsonWriter &other);
+
+    /**
+     * A position in the writer, see `GetMark()`.
+     */
+    struct Mark {
+        int32_t pos;
+        int32_t doc_start;
+        int32_t external_len;
+        size_t num_external;
+    };
+
+    /**
+     * @defgroup bsw_capacity Buffer management
+     * @{
+     */
+
+    /**
+     * Make sure `r` more bytes can be written without reallocating.
+     */
+    void Reserve(int32_t r);
+
+    /**
+     * Size of the buffer.
+     */
+    int32_t capacity() const { return size_; }
+
+    /**
+     * Shrink the buffer to the size of the message (messages that fit in
+     * the inline buffer go back in it).
+     */
+    void ShrinkToFit();
+
+    /**
+     * Hand the buffer over to the caller and leave the writer empty.
+     *
+     * `*len` is set to the length of the message. Messages still in the
+     * inline buffer are copied in a new heap buffer. This can't be used when
+     * the writer holds external segments.
+     */
+    std::unique_ptr<char[]> Release(int32_t *len);
+
+    /** @} */
+
+    /**
+     * Get the current position of the writer.
+     */
+    Mark GetMark() const {
+        return Mark{pos_, doc_start_, external_len_, external_.size()};
+    }
+
+    /**
+     * Drop everything written since `m` was taken.
+     *
+     * The documents that were open when `m` was taken must still be open and
+     * no other document can be.
+     */
+    void Rewind(const Mark &m);
+
     /**
      * @defgroup bsw_fields Writing fields in arrays/documents
      * @{
@@ -199,12 +343,23 @@ public:
     template <typename K>
     void ElementBindata(const K key, const BindataSubtype, const char *value,
                         const int32_t value_len);
+
+    /**
+     * Copy a whole serialised document (e.g.: written by another writer) in a
+     * field. The bytes are always copied, whatever the external threshold.
+     */
+    template <typename K>
+    void ElementDocument(const K key, const char *doc, const int32_t doc_len);
     /** @} */
 
     /// Writes the current len of the buffer in the first field (as an int32).
     /// This should only be used IFF the first value of the buffer is an int32
     void FlushLen();
 
+    /// Writes the number of bytes written since `start` in the int32 at
+    /// `start` (an offset returned by `AppendLenPlaceholder`).
+    void FlushLen(int32_t start);
+
     /**
      * @defgroup bsw_raw BsonWriter raw values
      * These functions are used to write "raw" values in a `BsonWriter`.
@@ -219,8 +374,36 @@ public:
     template <typename T>
     void AppendRaw(const T &v);
 
+    /**
+     * Overwrite the raw value previously written at `offset`.
+     */
+    template <typename T>
+    void PatchRaw(int32_t offset, const T &v);
+
     void AppendRawBytes(const char *cnt, int32_t len);
 
+    /**
+     * Make room for `len` raw bytes and return where they go.
+     *
+     * This lets a producer (e.g.: a compressor) write straight into the
+     * writer: the bytes are only part of the message once `CommitRaw` is
+     * called. The pointer is invalidated by any other write.
+     */
+    char *ReserveRaw(int32_t len);
+
+    /**
+     * Add the first `len` bytes written in the space returned by `ReserveRaw`.
+     */
+    void CommitRaw(int32_t len);
+
+    /**
+     * Reserve room for an int32 length and return its offset.
+     *
+     * The length is filled in by `FlushLen(int32_t)` once all the bytes it
+     * covers have been written.
+     */
+    int32_t AppendLenPlaceholder();
+
     void AppendCstring(const char *cnt, int32_t len);
 
     /** @overload */
@@ -236,6 +419,9 @@ public:
 
     /**
      * Get the underlying buffer
+     *
+     * @note If the writer holds external segments this is not the whole
+     * message, use `FillIovecs()` or `ToString()`.
      */
     const char *data() const;
 
@@ -247,9 +433,58 @@ public:
     /**
      * Copy the content of the class to a `std::string`.
      *
+     * External segments are copied in.
      */
     std::string ToString() const;
 
+    /**
+     * @defgroup bsw_iovec Scatter/gather output
+     *
+     * Once a threshold is set, utf8 and bindata values (as well as raw bytes)
+     * at least that big are not copied into the writer: it keeps a pointer
+     * to the caller's memory instead and the message has to be sent with
+     * `writev`/`sendmsg`. Length prefixes still account for the external
+     * bytes so what ends up on the wire is identical.
+     *
+     * The memory of the external values must stay valid until the message has
+     * been sent.
+     * @{
+     */
+
+    /**
+     * Keep values of at least `threshold` bytes out of the buffer (0 turns
+     * this off, which is the default).
+     */
+    void SetExternalThreshold(int32_t threshold) {
+        assert(threshold >= 0);
+        external_threshold_ = threshold;
+    }
+
+    /**
+     * Length of the whole message (buffer and external segments).
+     */
+    int32_t MessageLen() const { return pos_ + external_len_; }
+
+    /**
+     * Number of `iovec`s needed to describe the message.
+     */
+    int32_t IovecCount() const;
+
+    /**
+     * Write the segments of the message in `iov`.
+     *
+     * @return the number of entries written (at most `n`).
+     */
+    int32_t FillIovecs(struct iovec *iov, int32_t n) const;
+
+    /**
+     * Copy the whole message (external segments included) to `dst`, which
+     * must have room for `MessageLen()` bytes.
+     */
+    void CopyTo(char *dst) const;
+
+    /** @} */
+
 protected:
     bool DataIsInline() const { return size_ == kMinSize_; }
 
@@ -274,6 +509,30 @@ protected:
     int32_t pos_ = 0;
     int32_t size_ = kMinSize_;
 
+    BsonBufferPool *pool_ = nullptr;
+
+    // A value stored outside of the buffer. The bytes logically sit right
+    // before `offset` in the buffer.
+    struct ExternalSegment {
+        int32_t offset;
+        const char *data;
+        int32_t len;
+    };
+
+    std::vector<ExternalSegment> external_;
+    int32_t external_len_ = 0;
+    int32_t external_threshold_ = 0;
+
+    bool IsExternal(int32_t len) const {
+        return external_threshold_ > 0 && len >= external_threshold_;
+    }
+
+    void AppendExternal(const char *data, int32_t len);
+
+    // Number of external bytes that logically come after the buffer offset
+    // `pos`
+    int32_t ExternalLenAfter(int32_t pos) const;
+
     /**
      * Count the number of digits appearing in the decimal representation of n
      *
@@ -293,7 +552,15 @@ protected:
 
     char *StartField(const BsonTag tag, int32_t k, const int32_t cntlen);
 
-    void Reserve(int32_t r);
+    // Slow path of `Reserve`: move the content to a bigger buffer.
+    void Grow(int32_t r);
+
+    // Go back to the inline buffer, dropping the content of the heap one.
+    void FreeHeapBuffer();
+
+    // Move the content of `other` in this writer, which must be using its
+    // inline buffer.
+    void TakeFrom(BsonWriter *other);
 
     template <BsonTag TAG, typename K, typename T>
     void Element(const K k, const T v);
@@ -340,6 +607,8 @@ protected:
         kReadStringTerm,
         kReadBinSubtype,
         kReadObjectId,
+        kReadSkipLen,
+        kSkip,
         kDone,
         kError,
         kHdr,   ///< Used by mongo packet readers...
@@ -355,6 +624,8 @@ protected:
     int32_t partial_;
     int32_t bytes_seen_;
 
+    bool skip_;  // The value of the current field should be skipped
+
     // This is capped at 100 by mongo anyway...
     int8_t depth() const { return depth_; }
 
@@ -383,6 +654,15 @@ public:
     template <typename Error_type>
     const char *Error(Error_type msg);
 
+    /**
+     * Jump over the value of the field being read.
+     *
+     * This should be called from `EmitFieldName`: the value is then skipped
+     * using its length (or the size of its type) and nothing is emitted for
+     * it. Skipped values are not validated.
+     */
+    void SkipValue() { skip_ = true; }
+
     /**
      * Tells us whether we are done parsing.
      */
@@ -422,6 +702,9 @@ protected:
         return s;
     }
 
+    // Called by `Consume` with the start of every chunk of input
+    void StartChunk(const char *) {}
+
     //--------------------------------------------------------------------------
 
     // CRTP...
@@ -452,6 +735,13 @@ protected:
     const char *ConsumeValue(const char *s, const char *end);
     const char *ConsumeValueObjectId(const char *s, const char *end);
     const char *ConsumeFieldName(const char *s, const char *end);
+    const char *ConsumeSkipValue(const char *s, const char *end);
+    const char *ConsumeSkipLenCnt(const char *s, const char *end, int32_t t);
+    const char *ConsumeSkip(const char *s, const char *end);
+
+    // Size of the value of type `typ_` at `v` or -1 if it cannot be told
+    // from the `avail` bytes at hand.
+    int32_t SkippedLen(const char *v, ptrdiff_t avail) const;
 
     void DispatchStringData(const char *s, const int32_t inlen);
     /**
@@ -460,6 +750,14 @@ protected:
     const char *ReadBytes(bool *done, const char *s, const char *end,
                           int32_t sz, char *dst, State state);
 
+    // Read a (potentially unaligned) value straight out of the input.
+    template <typename V>
+    static V Load(const char *s) {
+        V v;
+        std::memcpy(&v, s, sizeof(V));
+        return v;
+    }
+
     // Consume a fixed length and pass it to the continuation (cont)
     template <typename T, State state,
               const char *(BsonReader::*cont)(const char *s, const char *end,
@@ -515,6 +813,7 @@ protected:
     int32_t size_;
 
     friend class BsonValueIt;
+    friend class BsonValueIndex;
 
 public:
     BsonTag Tag() const { return tag_; }
@@ -525,8 +824,14 @@ public:
     BsonValue(const char *data, int32_t size, BsonTag tag = BsonTag::kDocument);
     BsonValue(const BsonValue &) = default;
     BsonValue(BsonValue &&) = default;
+    BsonValue &operator=(const BsonValue &) = default;
+    BsonValue &operator=(BsonValue &&) = default;
     bool Empty() const { return data_ == nullptr; }
 
+    // The bytes of the value, as they are in its document
+    const char *GetRaw() const { return data_; }
+    int32_t GetRawSize() const { return size_; }
+
     // Only for documents...
     BsonValue GetField(const char *needle) const;
 
@@ -537,6 +842,21 @@ public:
     double GetDouble() const;
     bool GetBool() const;
     BindataSubtype GetBinSubstype() const;
+
+    /**
+     * Compare two values in the order used by mongo to sort them: by type
+     * (minKey, null, numbers, strings, documents, arrays, bindata, object
+     * ids, booleans, dates, timestamps) then by value. Numbers are compared
+     * by value whatever their type (NaN comes first). Documents and arrays
+     * are compared element by element, on the type, the key then the value.
+     * An empty value (e.g.: a missing field) is compared as a null.
+     *
+     * The values are not decoded.
+     *
+     * @return a negative number, 0 or a positive number if `this` is lower,
+     * equal or greater than `other`.
+     */
+    int Compare(const BsonValue &other) const;
 };
 
 /**
@@ -546,6 +866,7 @@ class BsonValueIt : public BsonValue {
 protected:
     const char *end_ = nullptr;
     const char *key_ = nullptr;
+    bool error_ = false;
     void Invalidate();
     bool MoveTo(const char *);
 
@@ -557,6 +878,69 @@ public:
 
     // Returns `false` in case of error.
     bool next();
+
+    // Did we stop on a malformed element (including the first one)?
+    bool Error() const { return error_; }
+};
+
+/**
+ * An index on the fields of a document.
+ *
+ * `BsonValue::GetField` scans the document from the start on every call. When
+ * many fields are read from the same document build an index instead: it walks
+ * (and validates) the document once and stores the hash of every key along
+ * with the position of its value in a flat array. Lookups are then a binary
+ * search.
+ *
+ * The index keeps pointers into the document, which must outlive it. An index
+ * can be `Reset` on another document, in which case it reuses its storage.
+ */
+class BsonValueIndex {
+public:
+    BsonValueIndex() {}
+
+    explicit BsonValueIndex(const BsonValue &doc) { Reset(doc); }
+
+    /**
+     * Index a new document.
+     *
+     * @return `false` if `doc` isn't a valid document (or array), in which
+     * case the index is empty.
+     */
+    bool Reset(const BsonValue &doc);
+
+    /**
+     * Whether the last call to `Reset` succeeded.
+     */
+    bool Valid() const { return data_ != nullptr; }
+
+    /**
+     * Number of fields in the document.
+     */
+    int32_t size() const { return static_cast<int32_t>(entries_.size()); }
+
+    /**
+     * Same as `BsonValue::GetField`: returns the first field called `needle`
+     * or an empty value.
+     */
+    BsonValue GetField(const char *needle) const;
+
+    /** @overload */
+    BsonValue GetField(const char *needle, int32_t len) const;
+
+private:
+    struct Entry {
+        uint32_t hash;
+        int32_t key;    // Offsets in the document
+        int32_t value;
+        int32_t size;
+        BsonTag tag;
+    };
+
+    static uint32_t Hash(const char *s, int32_t len);
+
+    const char *data_ = nullptr;
+    std::vector<Entry> entries_;
 };
 
 //------------------------------------------------------------------------------
@@ -576,6 +960,9 @@ inline void BsonWriter::Pop() {
     *curs() = '\000';
     ++pos_;
     int32_t doc_len = pos_ - doc_start_;
+    if (!external_.empty()) {
+        doc_len += ExternalLenAfter(doc_start_);
+    }
     char *start_pos = WritableData() + doc_start_;
     std::memcpy(&doc_start_, start_pos, 4);
     std::memcpy(start_pos, &doc_len, 4);
@@ -643,6 +1030,14 @@ void BsonWriter::ElementObjectId(const K key, const char value[kObjectIdLen]) {
 template <typename K>
 void BsonWriter::ElementBindata(const K key, const BindataSubtype st,
                                 const char *value, const int32_t value_len) {
+    if (IsExternal(value_len)) {
+        char *out = StartField(BsonTag::kBindata, key, 5);
+        std::memcpy(out, &value_len, 4);
+        out[4] = static_cast<char>(st);
+        pos_ += 5;
+        AppendExternal(value, value_len);
+        return;
+    }
     const int32_t flen = 4 + 1 + value_len;
     char *out = StartField(BsonTag::kBindata, key, flen);
     std::memcpy(out, &value_len, 4);
@@ -651,6 +1046,14 @@ void BsonWriter::ElementBindata(const K key, const BindataSubtype st,
     pos_ += flen;
 }
 
+template <typename K>
+void BsonWriter::ElementDocument(const K key, const char *doc,
+                                 const int32_t doc_len) {
+    char *out = StartField(BsonTag::kDocument, key, doc_len);
+    std::memcpy(out, doc, static_cast<size_t>(doc_len));
+    pos_ += doc_len;
+}
+
 template <typename K>
 void BsonWriter::Element(const K key, std::nullptr_t) {
     StartField(BsonTag::kNull, key, 0);
@@ -659,10 +1062,20 @@ void BsonWriter::Element(const K key, std::nullptr_t) {
 template <typename K>
 void BsonWriter::Element(const K key, const char *value,
                          const int32_t value_len) {
-    const int32_t flen = 4 + value_len + 1;
-    char *out = StartField(BsonTag::kUtf8, key, flen);
     // includes the trailing null...
     const int32_t wlen = value_len + 1;
+    if (IsExternal(value_len)) {
+        char *out = StartField(BsonTag::kUtf8, key, 5);
+        std::memcpy(out, &wlen, 4);
+        pos_ += 4;
+        AppendExternal(value, value_len);
+        // StartField reserved room for the terminator
+        *curs() = '\000';
+        ++pos_;
+        return;
+    }
+    const int32_t flen = 4 + value_len + 1;
+    char *out = StartField(BsonTag::kUtf8, key, flen);
     std::memcpy(out, &wlen, 4);
     std::memcpy(out + 4, value, static_cast<size_t>(value_len));
     out[value_len + 4] = '\000';
@@ -670,18 +1083,42 @@ void BsonWriter::Element(const K key, const char *value,
 }
 
 inline void BsonWriter::FlushLen() {
-    int32_t doc_len = pos_;
+    int32_t doc_len = pos_ + external_len_;
     // We shouldn't have to use memcpy here: we know the alignment is fine.
     std::memcpy(WritableData(), &doc_len, sizeof(int32_t));
 }
 
+inline void BsonWriter::FlushLen(int32_t start) {
+    PatchRaw<int32_t>(start, pos_ - start + ExternalLenAfter(start));
+}
+
+inline int32_t BsonWriter::AppendLenPlaceholder() {
+    const int32_t res = pos_;
+    AppendRaw<int32_t>(0);
+    return res;
+}
+
 inline void BsonWriter::AppendRawBytes(const char *cnt, int32_t len) {
+    if (IsExternal(len)) {
+        AppendExternal(cnt, len);
+        return;
+    }
     Reserve(len);
     char *out = curs();
     std::memcpy(out, cnt, static_cast<size_t>(len));
     pos_ += len;
 }
 
+inline char *BsonWriter::ReserveRaw(int32_t len) {
+    Reserve(len);
+    return curs();
+}
+
+inline void BsonWriter::CommitRaw(int32_t len) {
+    assert(len >= 0 && pos_ + len <= size_);
+    pos_ += len;
+}
+
 inline void BsonWriter::AppendCstring(const char *cnt, int32_t len) {
     Reserve(len + 1);
     char *out = curs();
@@ -702,6 +1139,12 @@ void BsonWriter::AppendRaw(const T &v) {
     pos_ += sizeof(T);
 }
 
+template <typename T>
+void BsonWriter::PatchRaw(int32_t offset, const T &v) {
+    assert(offset >= 0 && offset + static_cast<int32_t>(sizeof(T)) <= pos_);
+    std::memcpy(WritableData() + offset, &v, sizeof(T));
+}
+
 inline void BsonWriter::Document() {
     Reserve(5);
     StartDocument();
@@ -712,7 +1155,19 @@ inline const char *BsonWriter::data() const {
 }
 
 inline std::string BsonWriter::ToString() const {
-    return std::string(data(), static_cast<size_t>(pos_));
+    if (external_.empty()) {
+        return std::string(data(), static_cast<size_t>(pos_));
+    }
+    std::string res;
+    res.reserve(static_cast<size_t>(MessageLen()));
+    int32_t pos = 0;
+    for (const ExternalSegment &seg : external_) {
+        res.append(data() + pos, static_cast<size_t>(seg.offset - pos));
+        res.append(seg.data, static_cast<size_t>(seg.len));
+        pos = seg.offset;
+    }
+    res.append(data() + pos, static_cast<size_t>(pos_ - pos));
+    return res;
 }
 
 inline void BsonWriter::StartDocument() {
@@ -780,15 +1235,7 @@ inline char *BsonWriter::StartField(const BsonTag tag, int32_t k,
 
 inline void BsonWriter::Reserve(int32_t r) {
     if (size_ < pos_ + r) {
-        auto new_size = std::max(2 * size_, size_ + r + 2);
-        std::unique_ptr<char[]> new_doc(new char[new_size]);
-        std::memcpy(new_doc.get(), data(), static_cast<size_t>(pos_));
-        if (DataIsInline()) {
-            new (&data_) std::unique_ptr<char[]>(std::move(new_doc));
-        } else {
-            data_ = std::move(new_doc);
-        }
-        size_ = new_size;
+        Grow(r);
     }
 }
 
@@ -811,6 +1258,7 @@ void BsonReader<T>::Clear() {
     depth_ = 0;
     partial_ = 0;
     bytes_seen_ = 0;
+    skip_ = false;
 }
 
 template <typename T>
@@ -834,6 +1282,7 @@ int32_t BsonReader<T>::Consume(const char *s, int32_t len) {
     }
 
     const char *end = nullptr;
+    impl().StartChunk(s);
     switch (state_) {
         case State::kError:
         case State::kDone:
@@ -868,6 +1317,12 @@ int32_t BsonReader<T>::Consume(const char *s, int32_t len) {
         case State::kReadObjectId:
             end = ConsumeValueObjectId(s, s + len);
             break;
+        case State::kReadSkipLen:
+            end = ConsumeSkipValue(s, s + len);
+            break;
+        case State::kSkip:
+            end = ConsumeSkip(s, s + len);
+            break;
         case State::kHdr:
             end = impl().ConsumeHdr(s, s + len);
             break;
@@ -892,23 +1347,142 @@ int32_t BsonReader<T>::Consume(const char *s, int32_t len) {
     return read;
 }
 
+// This is the fast path of the parser: as long as whole fields are available
+// in the input we decode them in this loop without going through `scratch_`
+// and the resumable states. As soon as a field is cut short we fall back on
+// the byte by byte state machine (which returns here once the field is read).
 template <typename T>
 const char *BsonReader<T>::ConsumeFieldTyp(const char *s, const char *end) {
-    if (s == end) {
-        state_ = State::kFieldTyp;
-        return end;
-    }
-    if (*s == '\000') {
-        --depth_;
-        impl().EmitClose();
-        if (depth_ == 0) {
-            return impl().DocumentDone(s + 1, end);
-        } else {
-            return ConsumeFieldTyp(s + 1, end);
+    for (;;) {
+        if (s == end) {
+            state_ = State::kFieldTyp;
+            return end;
+        }
+        if (*s == '\000') {
+            --depth_;
+            impl().EmitClose();
+            if (depth_ == 0) {
+                return impl().DocumentDone(s + 1, end);
+            }
+            ++s;
+            continue;
+        }
+        typ_ = ToBsonTag(*s);
+        const char *name = s + 1;
+        const char *name_end = FindNul(name, end);
+        if (name_end == end) {
+            return ConsumeFieldName(name, end);
         }
+        const int32_t name_len = static_cast<int32_t>(name_end - name);
+        if (name_len > 0) impl().EmitFieldName(name, name_len);
+        impl().EmitFieldName(nullptr, 0);
+
+        const char *v = name_end + 1;
+        const ptrdiff_t avail = end - v;
+        if (skip_) {
+            const int32_t skipped = SkippedLen(v, avail);
+            if (skipped < 0 || avail < skipped) {
+                return ConsumeValue(v, end);
+            }
+            skip_ = false;
+            s = v + skipped;
+            continue;
+        }
+        switch (typ_) {
+            case BsonTag::kDouble:
+                if (avail < 8) break;
+                impl().EmitDouble(Load<double>(v));
+                s = v + 8;
+                continue;
+            case BsonTag::kInt32:
+                if (avail < 4) break;
+                impl().EmitInt32(Load<int32_t>(v));
+                s = v + 4;
+                continue;
+            case BsonTag::kInt64:
+                if (avail < 8) break;
+                impl().EmitInt64(Load<int64_t>(v));
+                s = v + 8;
+                continue;
+            case BsonTag::kUtcDatetime:
+                if (avail < 8) break;
+                impl().EmitUtcDatetime(Load<int64_t>(v));
+                s = v + 8;
+                continue;
+            case BsonTag::kTimestamp:
+                if (avail < 8) break;
+                impl().EmitTimestamp(Load<int64_t>(v));
+                s = v + 8;
+                continue;
+            case BsonTag::kBool:
+                if (avail < 1) break;
+                impl().EmitBool(*v > 0);
+                s = v + 1;
+                continue;
+            case BsonTag::kNull:
+                impl().EmitNull();
+                s = v;
+                continue;
+            case BsonTag::kObjectId:
+                if (avail < kObjectIdLen) break;
+                impl().EmitObjectId(v);
+                s = v + kObjectIdLen;
+                continue;
+            case BsonTag::kDocument:
+            case BsonTag::kArray: {
+                if (avail < 4) break;
+                if (Load<int32_t>(v) < 5) {
+                    return Error("Document too small");
+                }
+                ++depth_;
+                if (typ_ == BsonTag::kDocument) {
+                    impl().EmitOpenDoc();
+                } else {
+                    impl().EmitOpenArray();
+                }
+                s = v + 4;
+                continue;
+            }
+            case BsonTag::kUtf8:
+            case BsonTag::kJs: {
+                if (avail < 4) break;
+                const int32_t len = Load<int32_t>(v);
+                if (len < 1) {
+                    return Error("Negative length!");
+                }
+                if (avail - 4 < len) break;
+                if (len > 1) {
+                    DispatchStringData(v + 4, len - 1);
+                }
+                DispatchStringData(nullptr, 0);
+                if (v[4 + len - 1] != '\000') {
+                    return Error("expected null byte");
+                }
+                s = v + 4 + len;
+                continue;
+            }
+            case BsonTag::kBindata: {
+                if (avail < 5) break;
+                const int32_t len = Load<int32_t>(v);
+                if (len < 0) {
+                    return Error("Negative length!");
+                }
+                if (avail - 5 < len) break;
+                impl().EmitBindataSubtype(BindataSubtype(v[4]));
+                if (len > 0) {
+                    DispatchStringData(v + 5, len);
+                }
+                DispatchStringData(nullptr, 0);
+                s = v + 5 + len;
+                continue;
+            }
+            default:
+                break;
+        }
+        // The value is incomplete (or something the fast path doesn't
+        // handle): let the state machine deal with it.
+        return ConsumeValue(v, end);
     }
-    typ_ = ToBsonTag(*s);
-    return ConsumeFieldName(s + 1, end);
 }
 
 template <typename T>
@@ -916,10 +1490,16 @@ const char *BsonReader<T>::ConsumeValueInt32Cnt(const char *s, const char *end,
                                                 int32_t t) {
     switch (typ_) {
         case BsonTag::kDocument:
+            if (t < 5) {
+                return Error("Document too small");
+            }
             ++depth_;
             impl().EmitOpenDoc();
             return ConsumeFieldTyp(s, end);
         case BsonTag::kArray:
+            if (t < 5) {
+                return Error("Document too small");
+            }
             ++depth_;
             impl().EmitOpenArray();
             return ConsumeFieldTyp(s, end);
@@ -1054,7 +1634,9 @@ const char *BsonReader<T>::ConsumeValueString(const char *s, const char *end) {
         }
         return end;
     }
-    DispatchStringData(s, partial_);
+    if (partial_ > 0) {
+        DispatchStringData(s, partial_);
+    }
     DispatchStringData(nullptr, 0);
     if (typ_ == BsonTag::kBindata) {
         s += partial_;
@@ -1067,6 +1649,9 @@ const char *BsonReader<T>::ConsumeValueString(const char *s, const char *end) {
 
 template <typename T>
 const char *BsonReader<T>::ConsumeValue(const char *s, const char *end) {
+    if (skip_) {
+        return ConsumeSkipValue(s, end);
+    }
     switch (typ_) {
         case BsonTag::kInt32:
         case BsonTag::kArray:
@@ -1102,6 +1687,10 @@ const char *BsonReader<T>::ConsumeValue(const char *s, const char *end) {
 template <typename T>
 const char *BsonReader<T>::ConsumeValueObjectId(const char *s,
                                                 const char *end) {
+    if (partial_ == 0 && end - s >= kObjectIdLen) {
+        impl().EmitObjectId(s);
+        return ConsumeFieldTyp(s + kObjectIdLen, end);
+    }
     bool done;
     s = ReadBytes(&done, s, end, kObjectIdLen, scratch_, State::kReadObjectId);
     if (!done) {
@@ -1113,16 +1702,12 @@ const char *BsonReader<T>::ConsumeValueObjectId(const char *s,
 
 template <typename T>
 const char *BsonReader<T>::ConsumeFieldName(const char *s, const char *end) {
-    const int32_t max_len = static_cast<int32_t>(end - s);
-    int32_t i = 0;
-    //  strnlen....
-    while (i < max_len) {
-        if (!s[i]) {
-            if (i > 0) impl().EmitFieldName(s, i);
-            impl().EmitFieldName(nullptr, 0);
-            return ConsumeValue(s + i + 1, end);
-        }
-        ++i;
+    const char *name_end = FindNul(s, end);
+    const int32_t i = static_cast<int32_t>(name_end - s);
+    if (name_end != end) {
+        if (i > 0) impl().EmitFieldName(s, i);
+        impl().EmitFieldName(nullptr, 0);
+        return ConsumeValue(name_end + 1, end);
     }
     if (i > 0) {
         impl().EmitFieldName(s, i);
@@ -1131,6 +1716,98 @@ const char *BsonReader<T>::ConsumeFieldName(const char *s, const char *end) {
     return end;
 }
 
+template <typename T>
+int32_t BsonReader<T>::SkippedLen(const char *v, ptrdiff_t avail) const {
+    // Leave enough room for the prefix (and the subtype) to be added.
+    constexpr int32_t kMaxLen = std::numeric_limits<int32_t>::max() - 5;
+    switch (typ_) {
+        case BsonTag::kDouble:
+        case BsonTag::kInt64:
+        case BsonTag::kUtcDatetime:
+        case BsonTag::kTimestamp:
+            return 8;
+        case BsonTag::kInt32:
+            return 4;
+        case BsonTag::kBool:
+            return 1;
+        case BsonTag::kNull:
+            return 0;
+        case BsonTag::kObjectId:
+            return kObjectIdLen;
+        case BsonTag::kDocument:
+        case BsonTag::kArray:
+        case BsonTag::kUtf8:
+        case BsonTag::kJs:
+        case BsonTag::kBindata: {
+            if (avail < 4) {
+                return -1;
+            }
+            const int32_t len = Load<int32_t>(v);
+            if (len < 0 || len > kMaxLen) {
+                return -1;
+            }
+            if (typ_ == BsonTag::kDocument || typ_ == BsonTag::kArray) {
+                return len < 5 ? -1 : len;
+            }
+            if (typ_ == BsonTag::kBindata) {
+                return len + 5;
+            }
+            return len < 1 ? -1 : len + 4;
+        }
+        default:
+            return -1;
+    }
+}
+
+template <typename T>
+const char *BsonReader<T>::ConsumeSkipValue(const char *s, const char *end) {
+    switch (typ_) {
+        case BsonTag::kDocument:
+        case BsonTag::kArray:
+        case BsonTag::kUtf8:
+        case BsonTag::kJs:
+        case BsonTag::kBindata:
+            return ReadVal<int32_t, State::kReadSkipLen,
+                           &BsonReader::ConsumeSkipLenCnt>(s, end);
+        default: {
+            const int32_t len = SkippedLen(s, end - s);
+            if (len < 0) {
+                skip_ = false;
+                return ConsumeValue(s, end);  // Report the error
+            }
+            skip_ = false;
+            partial_ = len;
+            return ConsumeSkip(s, end);
+        }
+    }
+}
+
+template <typename T>
+const char *BsonReader<T>::ConsumeSkipLenCnt(const char *s, const char *end,
+                                             int32_t t) {
+    std::memcpy(scratch_, &t, sizeof(t));
+    const int32_t len = SkippedLen(scratch_, sizeof(t));
+    if (len < 0) {
+        return Error("Invalid length");
+    }
+    skip_ = false;
+    partial_ = len - 4;
+    return ConsumeSkip(s, end);
+}
+
+template <typename T>
+const char *BsonReader<T>::ConsumeSkip(const char *s, const char *end) {
+    const ptrdiff_t inlen = end - s;
+    if (inlen < partial_) {
+        state_ = State::kSkip;
+        partial_ -= static_cast<int32_t>(inlen);
+        return end;
+    }
+    s += partial_;
+    partial_ = 0;
+    return ConsumeFieldTyp(s, end);
+}
+
 template <typename T>
 const char *BsonReader<T>::ReadBytes(bool *done, const char *s, const char *end,
                                      int32_t sz, char *dst, State state) {
@@ -1158,6 +1835,9 @@ template <typename T, typename BsonReader<Implementation>::State state,
 const char *BsonReader<Implementation>::ReadVal(const char *s,
                                                 const char *end) {
     static_assert(sizeof(T) <= sizeof(scratch_), "Type too big");
+    if (partial_ == 0 && end - s >= static_cast<ptrdiff_t>(sizeof(T))) {
+        return (this->*cont)(s + sizeof(T), end, Load<T>(s));
+    }
     T t;
     bool done;
     s = ReadBytes(&done, s, end, sizeof(T), scratch_, state);
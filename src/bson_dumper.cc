@@ -1,8 +1,12 @@
 #include "bson_dumper.h"
+#include <cstdio>
 
 namespace okmongo {
 
-bool Print(const BsonValue &v, BsonDocDumper *d) {
+namespace {
+
+template <typename Dumper>
+bool PrintValue(const BsonValue &v, Dumper *d) {
     BsonTag tag = v.Tag();
     switch (tag) {
         case BsonTag::kDouble:
@@ -39,7 +43,7 @@ bool Print(const BsonValue &v, BsonDocDumper *d) {
                 d->EmitFieldName(it.key(),
                                  static_cast<int32_t>(strlen(it.key())));
                 d->EmitFieldName(nullptr, 0);
-                ok = Print(it, d) && ok;
+                ok = PrintValue(it, d) && ok;
                 ok = it.next() && ok;
             }
             d->EmitClose();
@@ -49,16 +53,22 @@ bool Print(const BsonValue &v, BsonDocDumper *d) {
             d->EmitObjectId(v.GetData());
             return true;
         case BsonTag::kUtf8:
-            d->EmitUtf8(v.GetData(), v.GetDataSize());
+            if (v.GetDataSize() > 0) {
+                d->EmitUtf8(v.GetData(), v.GetDataSize());
+            }
             d->EmitUtf8(nullptr, 0);
             return true;
         case BsonTag::kJs:
-            d->EmitJs(v.GetData(), v.GetDataSize());
+            if (v.GetDataSize() > 0) {
+                d->EmitJs(v.GetData(), v.GetDataSize());
+            }
             d->EmitJs(nullptr, 0);
             return true;
         case BsonTag::kBindata:
             d->EmitBindataSubtype(v.GetBinSubstype());
-            d->EmitBindata(v.GetData(), v.GetDataSize());
+            if (v.GetDataSize() > 0) {
+                d->EmitBindata(v.GetData(), v.GetDataSize());
+            }
             d->EmitBindata(nullptr, 0);
             return true;
         case BsonTag::kScopedJs:
@@ -70,4 +80,103 @@ bool Print(const BsonValue &v, BsonDocDumper *d) {
     }
 }
 
+// How bytes are printed by the dumpers: 0 means as is, 'x' as a `\xhh` escape
+// and anything else as a backslash followed by that character.
+struct EscapeTable {
+    char tbl[256];
+
+    EscapeTable() {
+        for (int c = 0; c < 256; ++c) {
+            tbl[c] = (c >= 0x20 && c < 0x7f) ? 0 : 'x';
+        }
+        tbl[static_cast<unsigned char>('\n')] = 'n';
+        tbl[static_cast<unsigned char>('\t')] = 't';
+        tbl[static_cast<unsigned char>('"')] = '"';
+        tbl[static_cast<unsigned char>('\\')] = '\\';
+    }
+};
+
+const EscapeTable kEscapes;
+
+const char kHexDigits[] = "0123456789abcdef";
+
+// A new line and enough spaces for 64 levels of nesting
+const std::string kNewLine = "\n" + std::string(128, ' ');
+
+}  // namespace
+
+bool Print(const BsonValue &v, BsonDocDumper *d) { return PrintValue(v, d); }
+
+bool Print(const BsonValue &v, BsonDocBufferDumper *d) {
+    return PrintValue(v, d);
+}
+
+void AppendEscaped(std::string *out, const char *s, int32_t len) {
+    assert(len >= 0);
+    const char *const end = s + len;
+    while (s < end) {
+        const char *run = s;
+        while (s < end && kEscapes.tbl[static_cast<unsigned char>(*s)] == 0) {
+            ++s;
+        }
+        out->append(run, static_cast<size_t>(s - run));
+        if (s == end) {
+            return;
+        }
+        const unsigned char c = static_cast<unsigned char>(*s);
+        const char e = kEscapes.tbl[c];
+        if (e == 'x') {
+            const char hex[] = {'\\', 'x', kHexDigits[c >> 4],
+                                kHexDigits[c & 0xf]};
+            out->append(hex, sizeof(hex));
+        } else {
+            const char esc[] = {'\\', e};
+            out->append(esc, sizeof(esc));
+        }
+        ++s;
+    }
+}
+
+void AppendDecimal(std::string *out, int64_t i) {
+    // Work on the absolute value as an unsigned so INT64_MIN is fine.
+    uint64_t u = static_cast<uint64_t>(i);
+    if (i < 0) {
+        out->push_back('-');
+        u = ~u + 1;
+    }
+    char buf[20];
+    char *p = buf + sizeof(buf);
+    do {
+        *--p = static_cast<char>('0' + u % 10);
+        u /= 10;
+    } while (u != 0);
+    out->append(p, static_cast<size_t>(buf + sizeof(buf) - p));
+}
+
+void AppendDecimal(std::string *out, uint32_t i) {
+    AppendDecimal(out, static_cast<int64_t>(i));
+}
+
+void AppendDouble(std::string *out, double d) {
+    // This is what `std::ostream` does with its default flags.
+    char buf[32];
+    const int len = snprintf(buf, sizeof(buf), "%g", d);
+    out->append(buf, static_cast<size_t>(len));
+}
+
+void AppendNewLine(std::string *out, size_t depth) {
+    size_t spaces = 2 * depth;
+    const size_t n = std::min(spaces, kNewLine.size() - 1);
+    out->append(kNewLine.data(), n + 1);
+    spaces -= n;
+    if (spaces > 0) {
+        out->append(spaces, ' ');
+    }
+}
+
+void AppendHexByte(std::string *out, uint8_t c) {
+    const char hex[] = {kHexDigits[c >> 4], kHexDigits[c & 0xf]};
+    out->append(hex, sizeof(hex));
+}
+
 }  //  namespace okmongo
@@ -7,6 +7,8 @@
 #include <iomanip>
 #include <ctime>
 #include <limits>
+#include <string>
+#include <vector>
 
 /**
  * Dumps out BSON values in mongodb-extended-json
@@ -35,6 +37,8 @@ class BsonDumper : public Parent {
                 *tgt_ << "\\t";
             } else if (c == '\"') {
                 *tgt_ << "\\\"";
+            } else if (c == '\\') {
+                *tgt_ << "\\\\";
             } else if (std::isprint(c)) {
                 *tgt_ << c;
             } else {
@@ -212,4 +216,248 @@ public:
 };
 
 bool Print(const BsonValue &v, BsonDocDumper *d);
+
+//------------------------------------------------------------------------------
+
+/**
+ * Layout of the output of `BsonBufferDumper`
+ */
+enum class DumpStyle : uint8_t {
+    kPretty,  ///< One field per line (the same output as `BsonDumper`)
+    kCompact  ///< One document per line
+};
+
+/**
+ * @defgroup dump_helpers Helpers for BsonBufferDumper
+ * @{
+ */
+/**
+ * Append `[s, s + len)` to `out`, escaped like `BsonDumper` does.
+ */
+void AppendEscaped(std::string *out, const char *s, int32_t len);
+
+void AppendDecimal(std::string *out, int64_t i);
+
+void AppendDecimal(std::string *out, uint32_t i);
+
+void AppendDouble(std::string *out, double d);
+
+/**
+ * Append a new line followed by the indentation for `depth`.
+ */
+void AppendNewLine(std::string *out, size_t depth);
+
+void AppendHexByte(std::string *out, uint8_t c);
+/** @}*/
+
+/**
+ * Same as `BsonDumper` but appends its output to a string.
+ *
+ * This is meant for dumping large volumes of data: there is no `ostream`
+ * involved, the strings are escaped in runs and the output buffer is owned by
+ * the caller (who can reuse it between documents). With `DumpStyle::kPretty`
+ * the output is byte for byte the same as `BsonDumper`'s.
+ */
+template <typename Parent>
+class BsonBufferDumper : public Parent {
+    std::string *out_;
+    DumpStyle style_;
+    std::vector<BsonTag> stack_;
+    bool in_lit_ = false;
+    bool first_elt_ = true;
+    BindataSubtype subtype_;
+
+    bool InArray() const { return stack_.back() == BsonTag::kArray; }
+
+    void Append(const char *s, size_t len) { out_->append(s, len); }
+
+    template <size_t N>
+    void Append(const char (&s)[N]) {
+        out_->append(s, N - 1);
+    }
+
+    void PrintNl(bool pop) {
+        if (!pop && !first_elt_) {
+            out_->push_back(',');
+        }
+        first_elt_ = false;
+        if (style_ == DumpStyle::kPretty) {
+            AppendNewLine(out_, stack_.size());
+        }
+    }
+
+public:
+    /**
+     * `out` is not cleared, it has to outlive the dumper.
+     */
+    explicit BsonBufferDumper(std::string *out,
+                              DumpStyle style = DumpStyle::kPretty)
+        : out_(out), style_(style) {}
+
+    /**
+     * Write to `out` from now on.
+     */
+    void SetOutput(std::string *out) { out_ = out; }
+
+    std::string *Output() const { return out_; }
+
+    void EmitError(const char *msg) {
+        std::cerr << "Bson parsing error: " << msg << std::endl;
+    }
+
+    void EmitOpenDoc() {
+        stack_.push_back(BsonTag::kDocument);
+        out_->push_back('{');
+        first_elt_ = true;
+    }
+
+    void EmitOpenArray() {
+        stack_.push_back(BsonTag::kArray);
+        out_->push_back('[');
+        first_elt_ = true;
+    }
+
+    void EmitClose() {
+        const char c = InArray() ? ']' : '}';
+        stack_.pop_back();
+        PrintNl(true);
+        out_->push_back(c);
+        if (stack_.empty()) {
+            out_->push_back('\n');
+        }
+    }
+
+    void EmitInt32(int32_t i) { AppendDecimal(out_, static_cast<int64_t>(i)); }
+
+    void EmitInt64(int64_t i) {
+        Append("{ \"$numberLong\": \"");
+        AppendDecimal(out_, i);
+        Append("\" }");
+    }
+
+    void EmitUtcDatetime(int64_t i) {
+        Append("{ \"$date\": ");
+        if (i >= 0 && i <= std::numeric_limits<time_t>::max()) {
+            struct tm t;
+            gmtime_r(&i, &t);
+
+            char buf[32];
+            const size_t len = strftime(buf, sizeof(buf),
+                                        "\"%Y-%m-%dT%H:%M:%SZ\"", &t);
+            Append(buf, len);
+        } else {
+            EmitInt64(i);
+        }
+        Append(" }");
+    }
+
+    void EmitTimestamp(int64_t i) {
+        const uint32_t seconds = i & static_cast<uint32_t>(-1);
+        const uint32_t increments = (i >> 32) & static_cast<uint32_t>(-1);
+        Append("{ \"$timestamp\": { \"i\": ");
+        AppendDecimal(out_, increments);
+        Append(", \"s\": ");
+        AppendDecimal(out_, seconds);
+        Append(" }}");
+    }
+
+    void EmitBool(bool b) {
+        if (b) {
+            Append("true");
+        } else {
+            Append("false");
+        }
+    }
+
+    void EmitDouble(double d) { AppendDouble(out_, d); }
+
+    void EmitNull() { Append("null"); }
+
+    void EmitUtf8(const char *s, const int32_t len) {
+        assert(len >= 0);
+        if (!in_lit_) {
+            out_->push_back('"');
+            in_lit_ = true;
+        }
+        AppendEscaped(out_, s, len);
+        if (len == 0) {
+            out_->push_back('"');
+            in_lit_ = false;
+        }
+    }
+
+    void EmitBindata(const char *s, const int32_t len) {
+        assert(len >= 0);
+        AppendEscaped(out_, s, len);
+        if (len == 0) {
+            Append("\", \"$type\": \"");
+            AppendHexByte(out_, static_cast<uint8_t>(subtype_));
+            Append("\" }");
+        }
+    }
+
+    void EmitBindataSubtype(BindataSubtype st) {
+        subtype_ = st;
+        Append("{ \"$binary\": \"");
+    }
+
+    void EmitJs(const char *s, const int32_t len) {
+        assert(len >= 0);
+        if (!in_lit_) {
+            Append("{ \"$code\": \"");
+            in_lit_ = true;
+        }
+        AppendEscaped(out_, s, len);
+        if (len == 0) {
+            Append("\" }");
+            in_lit_ = false;
+        }
+    }
+
+    void EmitFieldName(const char *data, const int32_t len) {
+        assert(len >= 0);
+        if (!in_lit_) {
+            PrintNl(false);
+        }
+        if (!InArray()) {
+            if (!in_lit_) {
+                out_->push_back('"');
+            }
+            AppendEscaped(out_, data, len);
+            if (len == 0) {
+                Append("\": ");
+            }
+        }
+        in_lit_ = len > 0;
+    }
+
+    void EmitObjectId(const char *s) {
+        Append("{ \"$oid\": \"");
+        for (int i = 0; i < kObjectIdLen; ++i) {
+            AppendHexByte(out_, static_cast<uint8_t>(s[i]));
+        }
+        Append("\" }");
+    }
+
+    void EmitDocumentStart(int32_t idx) {
+        if (idx > 0) {
+            Append("=================\n");
+        }
+    }
+
+    void EmitStart(const ResponseHeader &hdr) {
+        Append("flags: ");
+        AppendDecimal(out_, static_cast<int64_t>(hdr.response_flags));
+        out_->push_back('\n');
+    }
+};  // class BsonBufferDumper
+
+class BsonDocBufferDumper
+        : public okmongo::BsonBufferDumper<
+                  okmongo::BsonReader<BsonDocBufferDumper>> {
+public:
+    using BsonBufferDumper::BsonBufferDumper;
+};
+
+bool Print(const BsonValue &v, BsonDocBufferDumper *d);
 }  // namespace okmongo
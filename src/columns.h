@@ -0,0 +1,342 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Extracting fields of many documents into typed arrays
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include "bson.h"
+#include "string_matcher.h"
+
+namespace okmongo {
+
+/**
+ * The tags `Columns` can extract.
+ */
+constexpr bool IsColumnTag(BsonTag t) {
+    return t == BsonTag::kInt32 || t == BsonTag::kInt64 ||
+           t == BsonTag::kUtcDatetime || t == BsonTag::kTimestamp ||
+           t == BsonTag::kDouble || t == BsonTag::kBool;
+}
+
+template <typename T>
+constexpr bool AllColumnTags(const StringMatcherAction<T> *k) {
+    return (k->match == nullptr) ||
+           (IsColumnTag(k->val) && AllColumnTags(k + 1));
+}
+
+/**
+ * Pulls the same fields out of a batch of documents in a structure of
+ * arrays, one column per field, ready to be crunched without going back to
+ * the bson.
+ *
+ * The fields are described by a `constexpr` array of `StringMatcherAction`
+ * sorted by path (the same way as for `TrieMatcher`): nested fields are
+ * given with dotted paths. The tag of a field selects the type of its
+ * column:
+ *
+ * | tag                                                 | column      |
+ * |-----------------------------------------------------|-------------|
+ * | `kInt32`, `kInt64`, `kUtcDatetime`, `kTimestamp`    | `int64_t`   |
+ * | `kDouble`                                           | `double`    |
+ * | `kBool`                                             | `uint8_t`   |
+ *
+ * `kInt64` columns also take `kInt32` values and `kDouble` columns take
+ * `kInt32` and `kInt64` values. Missing fields and values of any other type
+ * are null: their slot is 0 and their bit is cleared in the validity bitmap
+ * of the column.
+ *
+ * Every document is walked once, all the fields are matched in the same
+ * pass, the sub-documents that can't contain any of them are not
+ * entered and we stop as soon as all the columns have a value. When a field
+ * appears several times its first value of the right type is used.
+ *
+ * > constexpr okmongo::StringMatcherAction<okmongo::BsonTag> kFields[] = {
+ * >         {"price", okmongo::BsonTag::kDouble},
+ * >         {"stats.views", okmongo::BsonTag::kInt64},
+ * >         {nullptr, okmongo::BsonTag::kMinKey}};
+ * > okmongo::Columns<kFields> cols;
+ * > for (...) cols.Append(doc);
+ * > const double *prices = cols.Doubles(0);
+ */
+template <const StringMatcherAction<BsonTag> *fields>
+class Columns {
+public:
+    static constexpr size_t kNumColumns = GetNumActions(fields);
+
+    static_assert(AllColumnTags(fields), "Unsupported column type");
+
+    Columns() : columns_(kNumColumns) {}
+
+    void Clear();
+
+    /**
+     * Make room for `rows` rows.
+     */
+    void Reserve(size_t rows);
+
+    /**
+     * Add a row with the fields of `doc`.
+     *
+     * @return false if `doc` isn't a valid document (the fields found before
+     * the error are kept).
+     */
+    bool Append(const BsonValue &doc);
+
+    /**
+     * Append all the documents in `[begin, end)` (any range of `BsonValue`).
+     *
+     * @return the number of invalid documents.
+     */
+    template <typename It>
+    size_t Append(It begin, It end);
+
+    size_t rows() const { return rows_; }
+
+    /**
+     * The values of column `col` (nullptr if it's not of that type).
+     */
+    const int64_t *Int64s(size_t col) const;
+    const double *Doubles(size_t col) const;
+    const uint8_t *Bools(size_t col) const;
+
+    /**
+     * Validity bitmap of column `col`: bit `i % 64` of word `i / 64` is set
+     * if row `i` has a value.
+     */
+    const uint64_t *Validity(size_t col) const {
+        return columns_[col].valid.data();
+    }
+
+    bool Valid(size_t col, size_t row) const {
+        return (Validity(col)[row / 64] >> (row % 64)) & 1;
+    }
+
+    size_t NullCount(size_t col) const { return rows_ - columns_[col].count; }
+
+private:
+    typedef TrieMatcher<BsonTag, fields> Matcher;
+
+    enum class Kind : uint8_t { kInt64, kDouble, kBool };
+
+    struct Column {
+        std::vector<int64_t> ints;
+        std::vector<double> doubles;
+        std::vector<uint8_t> bools;
+        std::vector<uint64_t> valid;
+        size_t count = 0;  // Non null values
+    };
+
+    static Kind KindOf(BsonTag t) {
+        return (t == BsonTag::kDouble) ? Kind::kDouble
+               : (t == BsonTag::kBool) ? Kind::kBool
+                                       : Kind::kInt64;
+    }
+
+    // Walk the document whose fields' paths start with what's in `m`
+    bool Walk(const BsonValue &doc, const Matcher &m);
+    void Set(size_t col, const BsonValue &v);
+
+    std::vector<Column> columns_;
+    size_t rows_ = 0;
+    size_t found_ = 0;  // Columns set in the current row
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <const StringMatcherAction<BsonTag> *fields>
+constexpr size_t Columns<fields>::kNumColumns;
+
+template <const StringMatcherAction<BsonTag> *fields>
+void Columns<fields>::Clear() {
+    for (Column &c : columns_) {
+        c.ints.clear();
+        c.doubles.clear();
+        c.bools.clear();
+        c.valid.clear();
+        c.count = 0;
+    }
+    rows_ = 0;
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+void Columns<fields>::Reserve(size_t rows) {
+    for (size_t i = 0; i < kNumColumns; ++i) {
+        Column &c = columns_[i];
+        switch (KindOf(fields[i].val)) {
+            case Kind::kInt64:
+                c.ints.reserve(rows);
+                break;
+            case Kind::kDouble:
+                c.doubles.reserve(rows);
+                break;
+            case Kind::kBool:
+                c.bools.reserve(rows);
+                break;
+        }
+        c.valid.reserve((rows + 63) / 64);
+    }
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+bool Columns<fields>::Append(const BsonValue &doc) {
+    for (size_t i = 0; i < kNumColumns; ++i) {
+        Column &c = columns_[i];
+        switch (KindOf(fields[i].val)) {
+            case Kind::kInt64:
+                c.ints.push_back(0);
+                break;
+            case Kind::kDouble:
+                c.doubles.push_back(0);
+                break;
+            case Kind::kBool:
+                c.bools.push_back(0);
+                break;
+        }
+        if (rows_ % 64 == 0) {
+            c.valid.push_back(0);
+        }
+    }
+    ++rows_;
+    found_ = 0;
+    if (doc.Tag() != BsonTag::kDocument) {
+        return false;
+    }
+    return Walk(doc, Matcher());
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+template <typename It>
+size_t Columns<fields>::Append(It begin, It end) {
+    size_t errors = 0;
+    for (; begin != end; ++begin) {
+        if (!Append(*begin)) {
+            ++errors;
+        }
+    }
+    return errors;
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+bool Columns<fields>::Walk(const BsonValue &doc, const Matcher &prefix) {
+    BsonValueIt it(doc);
+    while (!it.Done() && found_ < kNumColumns) {
+        Matcher m = prefix;
+        for (const char *k = it.key(); *k != '\0' && !m.Failed(); ++k) {
+            m.AddChar(*k);
+        }
+        if (!m.Failed()) {
+            Matcher leaf = m;
+            leaf.AddChar('\000');
+            const int32_t col = leaf.GetIndex();
+            if (col != -1) {
+                Set(static_cast<size_t>(col), it);
+            }
+            if (it.Tag() == BsonTag::kDocument) {
+                m.AddChar('.');
+                if (!m.Failed() && !Walk(it, m)) {
+                    return false;
+                }
+            }
+        }
+        it.next();
+    }
+    return !it.Error();
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+void Columns<fields>::Set(size_t col, const BsonValue &v) {
+    Column &c = columns_[col];
+    const size_t row = rows_ - 1;
+    uint64_t &word = c.valid[row / 64];
+    const uint64_t bit = static_cast<uint64_t>(1) << (row % 64);
+    if ((word & bit) != 0) {
+        return;  // Already set by an earlier occurrence
+    }
+    const BsonTag want = fields[col].val;
+    bool ok = true;
+    switch (want) {
+        case BsonTag::kDouble:
+            if (v.Tag() == BsonTag::kDouble) {
+                c.doubles[row] = v.GetDouble();
+            } else if (v.Tag() == BsonTag::kInt32) {
+                c.doubles[row] = v.GetInt32();
+            } else if (v.Tag() == BsonTag::kInt64) {
+                c.doubles[row] = static_cast<double>(v.GetInt64());
+            } else {
+                ok = false;
+            }
+            break;
+        case BsonTag::kBool:
+            if (v.Tag() == BsonTag::kBool) {
+                c.bools[row] = v.GetBool() ? 1 : 0;
+            } else {
+                ok = false;
+            }
+            break;
+        case BsonTag::kInt64:
+            if (v.Tag() == BsonTag::kInt64) {
+                c.ints[row] = v.GetInt64();
+            } else if (v.Tag() == BsonTag::kInt32) {
+                c.ints[row] = v.GetInt32();
+            } else {
+                ok = false;
+            }
+            break;
+        case BsonTag::kInt32:
+            if (v.Tag() == BsonTag::kInt32) {
+                c.ints[row] = v.GetInt32();
+            } else {
+                ok = false;
+            }
+            break;
+        case BsonTag::kUtcDatetime:
+            if (v.Tag() == BsonTag::kUtcDatetime) {
+                c.ints[row] = v.GetUtcDatetime();
+            } else {
+                ok = false;
+            }
+            break;
+        case BsonTag::kTimestamp:
+            if (v.Tag() == BsonTag::kTimestamp) {
+                c.ints[row] = v.GetTimestamp();
+            } else {
+                ok = false;
+            }
+            break;
+        default:
+            ok = false;
+            break;
+    }
+    if (ok) {
+        word |= bit;
+        ++c.count;
+        ++found_;
+    }
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+const int64_t *Columns<fields>::Int64s(size_t col) const {
+    return (KindOf(fields[col].val) == Kind::kInt64)
+                   ? columns_[col].ints.data()
+                   : nullptr;
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+const double *Columns<fields>::Doubles(size_t col) const {
+    return (KindOf(fields[col].val) == Kind::kDouble)
+                   ? columns_[col].doubles.data()
+                   : nullptr;
+}
+
+template <const StringMatcherAction<BsonTag> *fields>
+const uint8_t *Columns<fields>::Bools(size_t col) const {
+    return (KindOf(fields[col].val) == Kind::kBool)
+                   ? columns_[col].bools.data()
+                   : nullptr;
+}
+
+}  // namespace okmongo
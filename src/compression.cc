@@ -0,0 +1,414 @@
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "compression.h"
+#include <cassert>
+#include <string>
+
+extern "C" {
+#include <sys/uio.h>
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_SNAPPY
+#include <snappy-c.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+}
+
+namespace okmongo {
+
+bool HasCompressor(Compressor c) {
+    switch (c) {
+        case Compressor::kNoop:
+            return true;
+        case Compressor::kSnappy:
+#ifdef HAVE_SNAPPY
+            return true;
+#else
+            return false;
+#endif
+        case Compressor::kZlib:
+#ifdef HAVE_ZLIB
+            return true;
+#else
+            return false;
+#endif
+        case Compressor::kZstd:
+#ifdef HAVE_ZSTD
+            return true;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+namespace {
+
+// Upper bound of the size of `len` bytes once compressed.
+size_t CompressBound(Compressor c, size_t len) {
+    switch (c) {
+        case Compressor::kNoop:
+            return len;
+        case Compressor::kSnappy:
+#ifdef HAVE_SNAPPY
+            return snappy_max_compressed_length(len);
+#else
+            return 0;
+#endif
+        case Compressor::kZlib:
+#ifdef HAVE_ZLIB
+            return compressBound(static_cast<uLong>(len));
+#else
+            return 0;
+#endif
+        case Compressor::kZstd:
+#ifdef HAVE_ZSTD
+            return ZSTD_compressBound(len);
+#else
+            return 0;
+#endif
+    }
+    return 0;
+}
+
+// Compress `[in, in + len)` in `out` (of size `*out_len`).
+bool Compress(Compressor c, int level, const char *in, size_t len, char *out,
+              size_t *out_len) {
+    (void)level;  // Unused if we only have snappy
+    switch (c) {
+        case Compressor::kNoop:
+            std::memcpy(out, in, len);
+            *out_len = len;
+            return true;
+        case Compressor::kSnappy:
+#ifdef HAVE_SNAPPY
+            return snappy_compress(in, len, out, out_len) == SNAPPY_OK;
+#else
+            return false;
+#endif
+        case Compressor::kZlib:
+#ifdef HAVE_ZLIB
+        {
+            uLongf dst_len = static_cast<uLongf>(*out_len);
+            const int res = compress2(
+                    reinterpret_cast<Bytef *>(out), &dst_len,
+                    reinterpret_cast<const Bytef *>(in),
+                    static_cast<uLong>(len),
+                    level < 0 ? Z_DEFAULT_COMPRESSION : level);
+            *out_len = dst_len;
+            return res == Z_OK;
+        }
+#else
+            return false;
+#endif
+        case Compressor::kZstd:
+#ifdef HAVE_ZSTD
+        {
+            const size_t res =
+                    ZSTD_compress(out, *out_len, in, len,
+                                  level < 0 ? ZSTD_CLEVEL_DEFAULT : level);
+            *out_len = res;
+            return ZSTD_isError(res) == 0;
+        }
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+}  // namespace
+
+bool FillCompressedOp(BsonWriter *w, const BsonWriter &msg, Compressor c,
+                      int level) {
+    constexpr int32_t kMsgHdrSize = static_cast<int32_t>(sizeof(MsgHeader));
+    if (!HasCompressor(c) || msg.MessageLen() < kMsgHdrSize) {
+        return false;
+    }
+    MsgHeader orig;
+    std::memcpy(&orig, msg.data(), sizeof(orig));
+
+    // The body has to be contiguous for the compressors.
+    std::string gathered;
+    const char *body = msg.data() + kMsgHdrSize;
+    const size_t body_len =
+            static_cast<size_t>(msg.MessageLen() - kMsgHdrSize);
+    const int32_t num_iov = msg.IovecCount();
+    if (num_iov > 1) {
+        std::vector<struct iovec> iov(static_cast<size_t>(num_iov));
+        msg.FillIovecs(iov.data(), num_iov);
+        gathered.reserve(static_cast<size_t>(msg.MessageLen()));
+        for (const struct iovec &v : iov) {
+            gathered.append(static_cast<const char *>(v.iov_base), v.iov_len);
+        }
+        body = gathered.data() + kMsgHdrSize;
+    }
+
+    const BsonWriter::Mark mark = w->GetMark();
+    const int32_t start = w->len();
+    CompressedHeader hdr;
+    hdr.message_length = 0;
+    hdr.request_id = orig.request_id;
+    hdr.response_to = orig.response_to;
+    hdr.op_code = static_cast<int32_t>(MongoOpcode::kCompressed);
+    hdr.original_opcode = orig.op_code;
+    hdr.uncompressed_size = static_cast<int32_t>(body_len);
+    hdr.compressor_id = static_cast<uint8_t>(c);
+    w->AppendRaw(hdr);
+
+    const size_t bound = CompressBound(c, body_len);
+    if (bound > static_cast<size_t>(kMaxMessageSize)) {
+        w->Rewind(mark);
+        return false;
+    }
+    size_t out_len = bound;
+    char *out = w->ReserveRaw(static_cast<int32_t>(bound));
+    if (!Compress(c, level, body, body_len, out, &out_len)) {
+        w->Rewind(mark);
+        return false;
+    }
+    w->CommitRaw(static_cast<int32_t>(out_len));
+    w->FlushLen(start);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+
+struct Decompressor::State {
+    Compressor compressor = Compressor::kNoop;
+    int32_t compressed_left = 0;  // Input bytes we haven't been given yet
+    int32_t uncompressed_size = 0;
+    int32_t produced = 0;
+    bool ended = false;  // The codec saw the end of the data
+
+    const char *in = nullptr;
+    int32_t in_len = 0;
+
+    // Snappy: the whole input then the whole output
+    std::string buf;
+    std::string out;
+
+#ifdef HAVE_ZLIB
+    z_stream zs;
+    bool zs_init = false;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DStream *zstd = nullptr;
+#endif
+
+    ~State() {
+#ifdef HAVE_ZLIB
+        if (zs_init) {
+            inflateEnd(&zs);
+        }
+#endif
+#ifdef HAVE_ZSTD
+        if (zstd != nullptr) {
+            ZSTD_freeDStream(zstd);
+        }
+#endif
+    }
+
+    int32_t ReadNoop(char *dst, int32_t len);
+    int32_t ReadSnappy(char *dst, int32_t len);
+    int32_t ReadZlib(char *dst, int32_t len);
+    int32_t ReadZstd(char *dst, int32_t len);
+};
+
+int32_t Decompressor::State::ReadNoop(char *dst, int32_t len) {
+    const int32_t n = std::min(len, in_len);
+    std::memcpy(dst, in, static_cast<size_t>(n));
+    in += n;
+    in_len -= n;
+    return n;
+}
+
+int32_t Decompressor::State::ReadSnappy(char *dst, int32_t len) {
+#ifdef HAVE_SNAPPY
+    if (in_len > 0) {
+        buf.append(in, static_cast<size_t>(in_len));
+        in_len = 0;
+        if (compressed_left == 0) {
+            size_t out_len;
+            if (snappy_uncompressed_length(buf.data(), buf.size(), &out_len) !=
+                        SNAPPY_OK ||
+                out_len != static_cast<size_t>(uncompressed_size)) {
+                return -1;
+            }
+            out.resize(out_len);
+            if (snappy_uncompress(buf.data(), buf.size(), &out[0],
+                                  &out_len) != SNAPPY_OK) {
+                return -1;
+            }
+            ended = true;
+            std::string().swap(buf);
+        }
+    }
+    const int32_t n =
+            std::min(len, static_cast<int32_t>(out.size()) - produced);
+    std::memcpy(dst, out.data() + produced, static_cast<size_t>(n));
+    return n;
+#else
+    (void)dst;
+    (void)len;
+    return -1;
+#endif
+}
+
+int32_t Decompressor::State::ReadZlib(char *dst, int32_t len) {
+#ifdef HAVE_ZLIB
+    zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(in));
+    zs.avail_in = static_cast<uInt>(in_len);
+    zs.next_out = reinterpret_cast<Bytef *>(dst);
+    zs.avail_out = static_cast<uInt>(len);
+    // zlib might still have output to flush after it used up its input.
+    while (zs.avail_out > 0 && !ended) {
+        const int res = inflate(&zs, Z_NO_FLUSH);
+        if (res == Z_STREAM_END) {
+            ended = true;
+        } else if (res == Z_BUF_ERROR) {
+            break;  // Needs more input
+        } else if (res != Z_OK) {
+            return -1;
+        }
+    }
+    // Trailing garbage
+    if (ended && zs.avail_in > 0) {
+        return -1;
+    }
+    in = reinterpret_cast<const char *>(zs.next_in);
+    in_len = static_cast<int32_t>(zs.avail_in);
+    return len - static_cast<int32_t>(zs.avail_out);
+#else
+    (void)dst;
+    (void)len;
+    return -1;
+#endif
+}
+
+int32_t Decompressor::State::ReadZstd(char *dst, int32_t len) {
+#ifdef HAVE_ZSTD
+    ZSTD_inBuffer ib = {in, static_cast<size_t>(in_len), 0};
+    ZSTD_outBuffer ob = {dst, static_cast<size_t>(len), 0};
+    while (ob.pos < ob.size && !ended) {
+        const size_t in_pos = ib.pos, out_pos = ob.pos;
+        const size_t res = ZSTD_decompressStream(zstd, &ob, &ib);
+        if (ZSTD_isError(res) != 0) {
+            return -1;
+        }
+        ended = res == 0;
+        if (ib.pos == in_pos && ob.pos == out_pos) {
+            break;  // Needs more input
+        }
+    }
+    if (ended && ib.pos < ib.size) {
+        return -1;
+    }
+    in += ib.pos;
+    in_len -= static_cast<int32_t>(ib.pos);
+    return static_cast<int32_t>(ob.pos);
+#else
+    (void)dst;
+    (void)len;
+    return -1;
+#endif
+}
+
+Decompressor::Decompressor() : state_(new State()) {}
+
+Decompressor::~Decompressor() {}
+
+bool Decompressor::Start(Compressor c, int32_t compressed_size,
+                         int32_t uncompressed_size) {
+    if (!HasCompressor(c) || compressed_size < 0 || uncompressed_size < 0) {
+        return false;
+    }
+    State &st = *state_;
+    st.compressor = c;
+    st.compressed_left = compressed_size;
+    st.uncompressed_size = uncompressed_size;
+    st.produced = 0;
+    st.ended = false;
+    st.in = nullptr;
+    st.in_len = 0;
+    st.buf.clear();
+    st.out.clear();
+    switch (c) {
+        case Compressor::kNoop:
+            return compressed_size == uncompressed_size;
+        case Compressor::kSnappy:
+            st.buf.reserve(static_cast<size_t>(compressed_size));
+            return true;
+        case Compressor::kZlib:
+#ifdef HAVE_ZLIB
+            if (st.zs_init) {
+                return inflateReset(&st.zs) == Z_OK;
+            }
+            std::memset(&st.zs, 0, sizeof(st.zs));
+            st.zs_init = inflateInit(&st.zs) == Z_OK;
+            return st.zs_init;
+#else
+            return false;
+#endif
+        case Compressor::kZstd:
+#ifdef HAVE_ZSTD
+            if (st.zstd == nullptr) {
+                st.zstd = ZSTD_createDStream();
+                if (st.zstd == nullptr) {
+                    return false;
+                }
+            }
+            return ZSTD_isError(ZSTD_initDStream(st.zstd)) == 0;
+#else
+            return false;
+#endif
+    }
+    return false;
+}
+
+void Decompressor::SetInput(const char *s, int32_t len) {
+    State &st = *state_;
+    assert(st.in_len == 0 && len <= st.compressed_left);
+    st.in = s;
+    st.in_len = len;
+    st.compressed_left -= len;
+}
+
+int32_t Decompressor::Read(char *out, int32_t len) {
+    State &st = *state_;
+    int32_t n = -1;
+    switch (st.compressor) {
+        case Compressor::kNoop:
+            n = st.ReadNoop(out, len);
+            break;
+        case Compressor::kSnappy:
+            n = st.ReadSnappy(out, len);
+            break;
+        case Compressor::kZlib:
+            n = st.ReadZlib(out, len);
+            break;
+        case Compressor::kZstd:
+            n = st.ReadZstd(out, len);
+            break;
+    }
+    if (n < 0 || n > st.uncompressed_size - st.produced) {
+        return -1;
+    }
+    st.produced += n;
+    return n;
+}
+
+bool Decompressor::Finished() const {
+    const State &st = *state_;
+    if (st.compressed_left != 0 || st.in_len != 0 ||
+        st.produced != st.uncompressed_size) {
+        return false;
+    }
+    return st.compressor == Compressor::kNoop || st.ended;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,262 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief OP_COMPRESSED envelopes
+ *
+ * The codecs are optional build dependencies (see `./configure --help`), use
+ * `HasCompressor` to know which ones were compiled in.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include "mongo.h"
+
+namespace okmongo {
+
+/**
+ * The `compressorId`s of the wire protocol
+ */
+enum class Compressor : uint8_t {
+    kNoop = 0,  ///< Always available
+    kSnappy = 1,
+    kZlib = 2,
+    kZstd = 3
+};
+
+/**
+ * Let the codec pick its compression level.
+ */
+constexpr int kDefaultCompressionLevel = -1;
+
+#pragma pack(push, 1)
+/**
+ * Header of an OP_COMPRESSED, it is followed by the compressed body of the
+ * original message (everything after its `MsgHeader`).
+ */
+struct CompressedHeader : public MsgHeader {
+    int32_t original_opcode;   /**< `op_code` of the original message */
+    int32_t uncompressed_size; /**< Size of the original message minus its
+                                  header */
+    uint8_t compressor_id;     /**< See `Compressor` */
+};
+static_assert(sizeof(CompressedHeader) == sizeof(MsgHeader) + 9,
+              "Packing failed");
+#pragma pack(pop)
+
+/**
+ * Whether `c` was compiled in.
+ */
+bool HasCompressor(Compressor c);
+
+/**
+ * Append the message in `msg` (as built by one of the `Fill*Op`) to `w` in an
+ * OP_COMPRESSED envelope. The request id and `response_to` of `msg` are kept.
+ *
+ * @return false (and leave `w` untouched) if `c` is not available or the
+ * compression failed.
+ */
+bool FillCompressedOp(BsonWriter *w, const BsonWriter &msg, Compressor c,
+                      int level = kDefaultCompressionLevel);
+
+/**
+ * Incremental decompression of the body of an OP_COMPRESSED.
+ *
+ * The compressed bytes are given in chunks with `SetInput` and the
+ * decompressed bytes are pulled out with `Read`. Snappy has no streaming
+ * format: its whole input is buffered before anything can be read.
+ */
+class Decompressor {
+public:
+    Decompressor();
+    ~Decompressor();
+
+    Decompressor(const Decompressor &) = delete;
+    Decompressor &operator=(const Decompressor &) = delete;
+
+    /**
+     * Get ready for a new body.
+     *
+     * @return false if `c` is not available.
+     */
+    bool Start(Compressor c, int32_t compressed_size,
+               int32_t uncompressed_size);
+
+    /**
+     * The next chunk of compressed bytes, it must be kept alive until `Read`
+     * returned 0.
+     */
+    void SetInput(const char *s, int32_t len);
+
+    /**
+     * Decompress up to `len` bytes in `out`.
+     *
+     * @return the number of bytes written, 0 once the input is used up or -1
+     * if the data is corrupted.
+     */
+    int32_t Read(char *out, int32_t len);
+
+    /**
+     * The whole body was read and had the announced size.
+     */
+    bool Finished() const;
+
+    struct State;
+
+private:
+    std::unique_ptr<State> state_;
+};
+
+/**
+ * Transparently decompresses OP_COMPRESSED replies for `Reader`.
+ *
+ * This wraps any reader of one message (a `ResponseReader`, an `OpMsgReader`
+ * or `OpResponseParser`...): the original message is rebuilt and fed to the
+ * reader chunk by chunk as it is decompressed, never as a whole. Messages that
+ * are not compressed go straight through.
+ *
+ * > class Parser : public okmongo::Decompressing<okmongo::OpResponseParser> {};
+ */
+template <typename Reader>
+class Decompressing : public Reader {
+public:
+    using Reader::Reader;
+
+    /**
+     * Size of the chunks fed to the reader.
+     */
+    static constexpr int32_t kChunkSize = 16 * 1024;
+
+    int32_t Consume(const char *s, int32_t len);
+
+    void Clear() {
+        Reader::Clear();
+        hdr_len_ = 0;
+        remaining_ = 0;
+        compressed_ = false;
+    }
+
+    /**
+     * Whether the last message was compressed.
+     */
+    bool WasCompressed() const { return compressed_; }
+
+protected:
+    // Send `[s, s + len)` to the reader.
+    bool Forward(const char *s, int32_t len) {
+        return len == 0 || Reader::Consume(s, len) == len;
+    }
+
+    bool Decompress(const char *s, int32_t len);
+
+    CompressedHeader hdr_;
+    int32_t hdr_len_ = 0;
+    int32_t remaining_ = 0;  // Bytes of the message that are left
+    bool compressed_ = false;
+    Decompressor decompressor_;
+    std::vector<char> chunk_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename Reader>
+bool Decompressing<Reader>::Decompress(const char *s, int32_t len) {
+    decompressor_.SetInput(s, len);
+    for (;;) {
+        const int32_t n = decompressor_.Read(chunk_.data(), kChunkSize);
+        if (n < 0) {
+            Reader::Error("Corrupted compressed message");
+            return false;
+        }
+        if (n == 0) {
+            return true;
+        }
+        if (!Forward(chunk_.data(), n)) {
+            return false;
+        }
+    }
+}
+
+template <typename Reader>
+int32_t Decompressing<Reader>::Consume(const char *s, int32_t len) {
+    constexpr int32_t kMsgHdrSize = static_cast<int32_t>(sizeof(MsgHeader));
+    constexpr int32_t kHdrSize = static_cast<int32_t>(sizeof(CompressedHeader));
+    const char *const start = s;
+    const char *const end = s + len;
+    char *const hdr = reinterpret_cast<char *>(&hdr_);
+    // The end of a compressed body (e.g.: zlib's checksum) can come after
+    // the reader is done.
+    const bool trailer = compressed_ && remaining_ > 0 &&
+                         Reader::state_ != Reader::State::kError;
+    if (Reader::Done() && !trailer) {
+        return 0;
+    }
+    // The header of the message
+    while (hdr_len_ < kMsgHdrSize ||
+           (compressed_ && hdr_len_ < kHdrSize)) {
+        if (s == end) {
+            return len;
+        }
+        const int32_t want = compressed_ ? kHdrSize : kMsgHdrSize;
+        const int32_t n =
+                std::min(want - hdr_len_, static_cast<int32_t>(end - s));
+        std::memcpy(hdr + hdr_len_, s, static_cast<size_t>(n));
+        hdr_len_ += n;
+        s += n;
+        if (hdr_len_ == kMsgHdrSize) {
+            if (hdr_.op_code ==
+                static_cast<int32_t>(MongoOpcode::kCompressed)) {
+                compressed_ = true;
+                if (hdr_.message_length < kHdrSize) {
+                    Reader::Error("Invalid compressed message length");
+                    return static_cast<int32_t>(s - start);
+                }
+            } else {
+                remaining_ = hdr_.message_length - kMsgHdrSize;
+                if (!Forward(hdr, kMsgHdrSize)) {
+                    return static_cast<int32_t>(s - start);
+                }
+            }
+        }
+        if (compressed_ && hdr_len_ == kHdrSize) {
+            remaining_ = hdr_.message_length - kHdrSize;
+            if (hdr_.uncompressed_size < 0 ||
+                !decompressor_.Start(
+                        static_cast<Compressor>(hdr_.compressor_id),
+                        remaining_, hdr_.uncompressed_size)) {
+                Reader::Error("Unsupported compressed message");
+                return static_cast<int32_t>(s - start);
+            }
+            chunk_.resize(kChunkSize);
+            // The header of the original message...
+            MsgHeader orig = hdr_;
+            orig.message_length = hdr_.uncompressed_size + kMsgHdrSize;
+            orig.op_code = hdr_.original_opcode;
+            if (!Forward(reinterpret_cast<const char *>(&orig),
+                         kMsgHdrSize)) {
+                return static_cast<int32_t>(s - start);
+            }
+        }
+    }
+    const int32_t n = std::min(remaining_, static_cast<int32_t>(end - s));
+    remaining_ -= n;
+    if (!compressed_) {
+        if (!Forward(s, n)) {
+            return static_cast<int32_t>(s - start);
+        }
+    } else {
+        if (!Decompress(s, n)) {
+            return static_cast<int32_t>(s - start);
+        }
+        if (remaining_ == 0 && !decompressor_.Finished()) {
+            Reader::Error("Truncated compressed message");
+        }
+    }
+    s += n;
+    return static_cast<int32_t>(s - start);
+}
+
+}  // namespace okmongo
@@ -0,0 +1,73 @@
+#include "cursor.h"
+
+namespace okmongo {
+
+void CursorReaper::Abandon(int32_t conn, int64_t cursor_id, int64_t now_ms) {
+    assert(conn >= 0);
+    if (cursor_id == 0) {
+        return;
+    }
+    if (conn >= Connections()) {
+        conns_.resize(static_cast<size_t>(conn) + 1);
+    }
+    Connection &c = conns_[static_cast<size_t>(conn)];
+    if (c.ids.empty()) {
+        c.oldest_ms = now_ms;
+    }
+    c.ids.push_back(cursor_id);
+}
+
+void CursorReaper::Abandon(int32_t conn, const ResponseHeader &hdr,
+                           int64_t now_ms) {
+    if ((hdr.response_flags & (kCursorNotFound | kQueryFailure)) != 0) {
+        return;
+    }
+    Abandon(conn, hdr.cursor_id, now_ms);
+}
+
+bool CursorReaper::Due(int32_t conn, int64_t now_ms) const {
+    const int32_t pending = Pending(conn);
+    if (pending == 0) {
+        return false;
+    }
+    return pending >= opts_.max_pending ||
+           now_ms - conns_[static_cast<size_t>(conn)].oldest_ms >=
+                   opts_.flush_interval_ms;
+}
+
+bool CursorReaper::Fill(int32_t conn, BsonWriter *w, int32_t requestid) {
+    if (Pending(conn) == 0) {
+        return false;
+    }
+    std::vector<int64_t> &ids = conns_[static_cast<size_t>(conn)].ids;
+    std::vector<int64_t>::const_iterator curs = ids.cbegin();
+    if (!FillKillCursorsOp(w, requestid, &curs, ids.cend())) {
+        return false;
+    }
+    // The ones left keep the time of the oldest: they are due right away.
+    ids.erase(ids.cbegin(), curs);
+    return true;
+}
+
+void CursorReaper::Forget(int32_t conn) {
+    if (conn < Connections()) {
+        conns_[static_cast<size_t>(conn)].ids.clear();
+    }
+}
+
+int32_t CursorReaper::Pending(int32_t conn) const {
+    if (conn < 0 || conn >= Connections()) {
+        return 0;
+    }
+    return static_cast<int32_t>(conns_[static_cast<size_t>(conn)].ids.size());
+}
+
+int32_t CursorReaper::Pending() const {
+    size_t res = 0;
+    for (const Connection &c : conns_) {
+        res += c.ids.size();
+    }
+    return static_cast<int32_t>(res);
+}
+
+}  // namespace okmongo
@@ -0,0 +1,360 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Streaming the results of a query
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "mongo.h"
+
+namespace okmongo {
+
+class CursorReaper;
+
+/**
+ * Reads all the batches of a query (an OP_QUERY and the replies to it).
+ *
+ * The replies are decoded by two `Reader`s (any `ResponseReader` subclass
+ * with a default constructor) used in turn: the previous batch stays in its
+ * reader while the next one is read.
+ *
+ * Rather than waiting for a batch to be entirely read before asking for the
+ * next one the cursor wants a getMore as soon as the header of a reply tells
+ * it the cursor is still open: the next batch is sent by the server while we
+ * parse the current one. With the `kExhaust` flag the server streams all the
+ * batches on its own and no getMore is sent.
+ *
+ * `Consume` takes the replies back to back; they can come straight from a
+ * dedicated connection or from a `ResponseMultiplexer` (register the cursor
+ * for every request, and for every reply announced by `EmitMoreToCome` when
+ * using `kExhaust`).
+ *
+ * Callbacks (CRTP):
+ *  - `EmitGetMore()`: call `FillGetMore` and send the result (this can be done
+ *    right away).
+ *  - `EmitMoreToCome(int32_t response_to)`: (exhaust) another reply will
+ *    follow, its `response_to` is the `request_id` of the reply being read.
+ *  - `EmitBatch(Reader &)`: a reply has been read, the reader can be used
+ *    until the next batch after this one starts.
+ *  - `EmitDone()`: the cursor is exhausted.
+ *  - `EmitError(const char *)`: the cursor can't be read any further.
+ *
+ * > class Docs : public okmongo::Cursor<Docs, MyReader> {...};
+ * > Docs docs("db", "coll", {0, 0, 1000});
+ * > docs.FillQuery(&w, id, query);
+ */
+template <typename Implementation, typename Reader>
+class Cursor {
+public:
+    /**
+     * The strings are not copied.
+     */
+    Cursor(const char *db, const char *collection, const QueryOptions &opts)
+        : db_(db), collection_(collection), opts_(opts) {}
+
+    /**
+     * Fill the query that opens the cursor.
+     */
+    template <typename T>
+    bool FillQuery(BsonWriter *w, int32_t requestid, const T &qry) {
+        return FillQueryOp(w, requestid, db_, collection_, qry, opts_);
+    }
+
+    template <typename T, typename FldSelector>
+    bool FillQuery(BsonWriter *w, int32_t requestid, const T &qry,
+                   const FldSelector &sel) {
+        return FillQueryOp(w, requestid, db_, collection_, qry, sel, opts_);
+    }
+
+    /**
+     * Whether a getMore should be sent.
+     */
+    bool WantsGetMore() const { return wants_get_more_; }
+
+    /**
+     * Fill the getMore for the next batch.
+     */
+    bool FillGetMore(BsonWriter *w, int32_t requestid);
+
+    /**
+     * Fill a killCursors if the cursor is still open on the server.
+     */
+    bool FillKill(BsonWriter *w, int32_t requestid);
+
+    /**
+     * Stop reading and leave the cursor to `reaper` to close it on the
+     * server, along with the other cursors of `conn`.
+     */
+    void Abandon(CursorReaper *reaper, int32_t conn, int64_t now_ms);
+
+    /**
+     * Read replies out of `[s, s + len)`
+     *
+     * @return the number of bytes read or -1 on error.
+     */
+    int32_t Consume(const char *s, int32_t len);
+
+    /**
+     * All the batches have been read.
+     */
+    bool Done() const { return done_; }
+
+    int64_t CursorId() const { return cursor_id_; }
+
+    /**
+     * Number of replies read so far.
+     */
+    int32_t Batches() const { return batches_; }
+
+    void EmitGetMore() {}
+
+    void EmitMoreToCome(int32_t) {}
+
+    void EmitBatch(Reader &) {}
+
+    void EmitDone() {}
+
+    void EmitError(const char *) {}
+
+protected:
+    Implementation &impl() { return *static_cast<Implementation *>(this); }
+
+    bool Exhaust() const { return (opts_.flags & kExhaust) != 0; }
+
+    int32_t Fail(const char *msg) {
+        failed_ = true;
+        impl().EmitError(msg);
+        return -1;
+    }
+
+    // The header of a reply has been read
+    void StartReply();
+    // ... and the rest of it
+    void EndReply();
+
+    const char *db_;
+    const char *collection_;
+    QueryOptions opts_;
+
+    Reader readers_[2];
+    int current_ = 0;
+
+    int64_t cursor_id_ = 0;
+    int32_t batches_ = 0;
+    bool wants_get_more_ = false;
+    bool done_ = false;
+    bool failed_ = false;
+
+    // The reply being read
+    ResponseHeader hdr_;
+    int32_t hdr_len_ = 0;
+    int32_t remaining_ = 0;
+};
+
+struct ReaperOptions {
+    int32_t max_pending;        ///< Flush once that many cursors are pending
+    int64_t flush_interval_ms;  ///< ... or once the oldest waited that long
+};
+
+constexpr ReaperOptions kDefaultReaperOptions = {1000, 1000};
+
+/**
+ * Collects the cursors that were abandoned on every connection and closes
+ * them in batches: one killCursors for many cursors rather than a message
+ * (and a syscall) each.
+ *
+ * Connections are numbered by the caller (e.g. the index of the server in a
+ * pool), times are in milliseconds on any monotonic clock.
+ *
+ * > reaper.Abandon(conn, hdr.cursor_id, now);
+ * > ...
+ * > if (reaper.Due(conn, now) && reaper.Fill(conn, &w, id)) { send(w) }
+ */
+class CursorReaper {
+public:
+    explicit CursorReaper(const ReaperOptions &opts = kDefaultReaperOptions)
+        : opts_(opts) {}
+
+    /**
+     * `cursor_id` is still open on `conn` but won't be read anymore.
+     * 0 (no cursor) is ignored.
+     */
+    void Abandon(int32_t conn, int64_t cursor_id, int64_t now_ms);
+
+    /**
+     * Abandon the cursor opened by a reply (if it is still open).
+     */
+    void Abandon(int32_t conn, const ResponseHeader &hdr, int64_t now_ms);
+
+    /**
+     * Whether the cursors of `conn` should be closed now: there are enough of
+     * them or they have waited long enough.
+     */
+    bool Due(int32_t conn, int64_t now_ms) const;
+
+    /**
+     * Fill a killCursors for the pending cursors of `conn` (at most
+     * `kMaxKillCursors`, call again for the rest).
+     *
+     * @return false if there were none.
+     */
+    bool Fill(int32_t conn, BsonWriter *w, int32_t requestid);
+
+    /**
+     * Drop the pending cursors of `conn` (e.g. the connection was closed,
+     * which closes its cursors).
+     */
+    void Forget(int32_t conn);
+
+    /**
+     * Number of cursors waiting to be closed on `conn`.
+     */
+    int32_t Pending(int32_t conn) const;
+
+    /**
+     * Number of cursors waiting to be closed on all connections.
+     */
+    int32_t Pending() const;
+
+    /**
+     * The connections are `[0, Connections())`.
+     */
+    int32_t Connections() const {
+        return static_cast<int32_t>(conns_.size());
+    }
+
+private:
+    struct Connection {
+        std::vector<int64_t> ids;
+        int64_t oldest_ms = 0;  // When ids[0] was abandoned
+    };
+
+    const ReaperOptions opts_;
+    std::vector<Connection> conns_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename Implementation, typename Reader>
+bool Cursor<Implementation, Reader>::FillGetMore(BsonWriter *w,
+                                                 int32_t requestid) {
+    if (done_ || failed_ || cursor_id_ == 0) {
+        return false;
+    }
+    wants_get_more_ = false;
+    return FillGetMoreOp(w, requestid, db_, collection_, cursor_id_,
+                         std::max(opts_.batch_size, 0));
+}
+
+template <typename Implementation, typename Reader>
+bool Cursor<Implementation, Reader>::FillKill(BsonWriter *w,
+                                              int32_t requestid) {
+    if (done_ || cursor_id_ == 0) {
+        return false;
+    }
+    wants_get_more_ = false;
+    done_ = true;
+    return FillKillCursorsOp(w, requestid, cursor_id_);
+}
+
+template <typename Implementation, typename Reader>
+void Cursor<Implementation, Reader>::Abandon(CursorReaper *reaper,
+                                             int32_t conn, int64_t now_ms) {
+    if (!done_) {
+        reaper->Abandon(conn, cursor_id_, now_ms);
+    }
+    wants_get_more_ = false;
+    done_ = true;
+}
+
+template <typename Implementation, typename Reader>
+void Cursor<Implementation, Reader>::StartReply() {
+    constexpr int32_t kBad = kCursorNotFound | kQueryFailure;
+    const bool last = hdr_.cursor_id == 0 || (hdr_.response_flags & kBad);
+    cursor_id_ = last ? 0 : hdr_.cursor_id;
+    if (last) {
+        return;
+    }
+    if (Exhaust()) {
+        impl().EmitMoreToCome(hdr_.request_id);
+    } else {
+        wants_get_more_ = true;
+        impl().EmitGetMore();
+    }
+}
+
+template <typename Implementation, typename Reader>
+void Cursor<Implementation, Reader>::EndReply() {
+    Reader &r = readers_[current_];
+    current_ = 1 - current_;
+    ++batches_;
+    hdr_len_ = 0;
+    if ((hdr_.response_flags & kCursorNotFound) != 0) {
+        Fail("Cursor not found");
+        return;
+    }
+    impl().EmitBatch(r);
+    if ((hdr_.response_flags & kQueryFailure) != 0) {
+        Fail("Query failure");
+        return;
+    }
+    if (cursor_id_ == 0) {
+        done_ = true;
+        impl().EmitDone();
+    }
+}
+
+template <typename Implementation, typename Reader>
+int32_t Cursor<Implementation, Reader>::Consume(const char *s, int32_t len) {
+    if (failed_) {
+        return -1;
+    }
+    const char *const start = s;
+    const char *const end = s + len;
+    constexpr int32_t kHdrSize = static_cast<int32_t>(sizeof(ResponseHeader));
+    while (s < end && !done_) {
+        Reader &r = readers_[current_];
+        if (hdr_len_ < kHdrSize) {
+            const int32_t n = std::min(kHdrSize - hdr_len_,
+                                       static_cast<int32_t>(end - s));
+            std::memcpy(reinterpret_cast<char *>(&hdr_) + hdr_len_, s,
+                        static_cast<size_t>(n));
+            hdr_len_ += n;
+            s += n;
+            if (hdr_len_ < kHdrSize) {
+                break;
+            }
+            if (hdr_.message_length < kHdrSize ||
+                hdr_.op_code != static_cast<int32_t>(MongoOpcode::kReply)) {
+                return Fail("Invalid reply");
+            }
+            remaining_ = hdr_.message_length - kHdrSize;
+            r.Clear();
+            if (r.Consume(reinterpret_cast<const char *>(&hdr_), kHdrSize) !=
+                kHdrSize) {
+                return Fail("Invalid reply");
+            }
+            StartReply();
+        }
+        const int32_t n = std::min(remaining_, static_cast<int32_t>(end - s));
+        if (n > 0 && r.Consume(s, n) != n) {
+            return Fail("Invalid reply");
+        }
+        s += n;
+        remaining_ -= n;
+        if (remaining_ == 0) {
+            EndReply();
+            if (failed_) {
+                return -1;
+            }
+        }
+    }
+    return static_cast<int32_t>(s - start);
+}
+
+}  // namespace okmongo
@@ -0,0 +1,745 @@
+#include "json_reader.h"
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace okmongo {
+
+namespace {
+
+// Longest number (or literal) we accept
+constexpr size_t kMaxTokenLen = 64;
+
+int HexValue(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+void AppendUtf8(std::string *out, uint32_t cp) {
+    if (cp < 0x80) {
+        out->push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out->push_back(static_cast<char>(0xc0 | (cp >> 6)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out->push_back(static_cast<char>(0xe0 | (cp >> 12)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+        out->push_back(static_cast<char>(0xf0 | (cp >> 18)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+        out->push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out->push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+}
+
+bool IsWs(char c) { return c == ' ' || c == '\n' || c == '\t' || c == '\r'; }
+
+bool IsNumberChar(char c) {
+    return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+           c == 'e' || c == 'E';
+}
+
+// `[-]digits` without overflowing
+bool ParseInteger(const std::string &s, int64_t *res) {
+    size_t i = 0;
+    const bool neg = !s.empty() && s[0] == '-';
+    if (neg) {
+        ++i;
+    }
+    if (i == s.size()) {
+        return false;
+    }
+    const uint64_t limit =
+            static_cast<uint64_t>(std::numeric_limits<int64_t>::max()) +
+            (neg ? 1 : 0);
+    uint64_t v = 0;
+    for (; i < s.size(); ++i) {
+        if (s[i] < '0' || s[i] > '9') {
+            return false;
+        }
+        const uint64_t d = static_cast<uint64_t>(s[i] - '0');
+        if (v > (limit - d) / 10) {
+            return false;
+        }
+        v = v * 10 + d;
+    }
+    *res = neg ? static_cast<int64_t>(~v + 1) : static_cast<int64_t>(v);
+    return true;
+}
+
+// Check `s` is a JSON number
+bool IsNumber(const std::string &s, bool *integer) {
+    size_t i = 0;
+    const size_t n = s.size();
+    auto digits = [&]() {
+        const size_t start = i;
+        while (i < n && s[i] >= '0' && s[i] <= '9') {
+            ++i;
+        }
+        return i > start;
+    };
+    if (i < n && s[i] == '-') {
+        ++i;
+    }
+    if (i < n && s[i] == '0') {
+        ++i;
+    } else if (!digits()) {
+        return false;
+    }
+    *integer = true;
+    if (i < n && s[i] == '.') {
+        ++i;
+        *integer = false;
+        if (!digits()) {
+            return false;
+        }
+    }
+    if (i < n && (s[i] == 'e' || s[i] == 'E')) {
+        ++i;
+        *integer = false;
+        if (i < n && (s[i] == '+' || s[i] == '-')) {
+            ++i;
+        }
+        if (!digits()) {
+            return false;
+        }
+    }
+    return i == n;
+}
+
+int64_t DaysFromCivil(int64_t y, int64_t m, int64_t d) {
+    y -= m <= 2;
+    const int64_t era = (y >= 0 ? y : y - 399) / 400;
+    const int64_t yoe = y - era * 400;
+    const int64_t doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    const int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+// "YYYY-MM-DDTHH:MM:SSZ" as printed by `BsonDumper`
+bool ParseDate(const std::string &s, int64_t *res) {
+    const char *p = s.c_str();
+    auto num = [&p](size_t min_len, size_t max_len, int64_t *v) {
+        size_t len = 0;
+        *v = 0;
+        while (*p >= '0' && *p <= '9' && len < max_len) {
+            *v = *v * 10 + (*p - '0');
+            ++p;
+            ++len;
+        }
+        return len >= min_len;
+    };
+    auto sep = [&p](char c) { return *(p++) == c; };
+    int64_t y, mo, d, h, mi, sec;
+    if (!num(4, 12, &y) || !sep('-') || !num(2, 2, &mo) || !sep('-') ||
+        !num(2, 2, &d) || !sep('T') || !num(2, 2, &h) || !sep(':') ||
+        !num(2, 2, &mi) || !sep(':') || !num(2, 2, &sec) || !sep('Z') ||
+        *p != '\000') {
+        return false;
+    }
+    if (mo < 1 || mo > 12 || d < 1 || d > 31 || h > 23 || mi > 59 ||
+        sec > 60) {
+        return false;
+    }
+    *res = DaysFromCivil(y, mo, d) * 86400 + h * 3600 + mi * 60 + sec;
+    return true;
+}
+
+bool IsExtensionKey(const std::string &k) {
+    return k == "$oid" || k == "$date" || k == "$binary" ||
+           k == "$numberLong" || k == "$timestamp";
+}
+
+}  // namespace
+
+JsonReader::JsonReader(BsonWriter *w, Target target)
+    : w_(w), target_(target) {
+    Clear();
+}
+
+void JsonReader::Clear() {
+    error_ = nullptr;
+    lex_ = Lex::kWs;
+    expect_ = Expect::kStart;
+    tok_.clear();
+    esc_val_ = 0;
+    esc_len_ = 0;
+    high_surrogate_ = 0;
+    stack_.clear();
+    key_.clear();
+    ext_expect_ = ExtExpect::kKey;
+    ext_depth_ = 0;
+    ext_values_.clear();
+}
+
+bool JsonReader::Done() const {
+    return lex_ == Lex::kDone || lex_ == Lex::kError;
+}
+
+bool JsonReader::Fail(const char *msg) {
+    if (expect_ != Expect::kStart) {
+        // Close what we opened so we can go back to where we started.
+        size_t open = stack_.size();
+        if (target_ == Target::kFields && open > 0) {
+            --open;
+        }
+        for (size_t i = 0; i < open; ++i) {
+            w_->Pop();
+        }
+        w_->Rewind(mark_);
+    }
+    stack_.clear();
+    error_ = msg;
+    lex_ = Lex::kError;
+    return false;
+}
+
+void JsonReader::Cancel() {
+    if (!Done()) {
+        Fail("Cancelled");
+    }
+}
+
+int32_t JsonReader::Consume(const char *s, int32_t len) {
+    assert(len >= 0);
+    if (Done()) {
+        return Failed() ? -1 : 0;
+    }
+    const char *const end = s + len;
+    const char *p = s;
+    while (p != nullptr && p < end && !Done()) {
+        switch (lex_) {
+            case Lex::kWs:
+                p = ConsumeWs(p, end);
+                break;
+            case Lex::kString:
+                p = ConsumeString(p, end);
+                break;
+            case Lex::kEscape:
+                p = ConsumeEscape(p, end);
+                break;
+            case Lex::kHex:
+            case Lex::kUnicode:
+                p = ConsumeHex(p, end);
+                break;
+            case Lex::kNumber:
+            case Lex::kLiteral:
+                p = ConsumeToken(p, end);
+                break;
+            case Lex::kDone:
+            case Lex::kError:
+                break;
+        }
+    }
+    if (p == nullptr) {
+        return -1;
+    }
+    return static_cast<int32_t>(p - s);
+}
+
+//------------------------------------------------------------------------------
+// Lexer
+
+const char *JsonReader::ConsumeWs(const char *s, const char *end) {
+    while (s < end) {
+        const char c = *s;
+        if (IsWs(c)) {
+            ++s;
+            continue;
+        }
+        Token t;
+        switch (c) {
+            case '{':
+                t = Token::kOpenDoc;
+                break;
+            case '}':
+                t = Token::kCloseDoc;
+                break;
+            case '[':
+                t = Token::kOpenArray;
+                break;
+            case ']':
+                t = Token::kCloseArray;
+                break;
+            case ':':
+                t = Token::kColon;
+                break;
+            case ',':
+                t = Token::kComma;
+                break;
+            case '"':
+                tok_.clear();
+                lex_ = Lex::kString;
+                return s + 1;
+            default:
+                tok_.clear();
+                if (c == '-' || (c >= '0' && c <= '9')) {
+                    lex_ = Lex::kNumber;
+                } else if (c >= 'a' && c <= 'z') {
+                    lex_ = Lex::kLiteral;
+                } else {
+                    Fail("Unexpected character");
+                    return nullptr;
+                }
+                return s;
+        }
+        ++s;
+        if (!OnToken(t)) {
+            return nullptr;
+        }
+        if (lex_ == Lex::kDone) {
+            return s;
+        }
+    }
+    return s;
+}
+
+const char *JsonReader::ConsumeString(const char *s, const char *end) {
+    const char *run = s;
+    while (s < end && *s != '"' && *s != '\\' &&
+           static_cast<unsigned char>(*s) >= 0x20) {
+        ++s;
+    }
+    if (s > run || (s < end && *s == '"')) {
+        if (high_surrogate_ != 0) {
+            Fail("Invalid unicode escape");
+            return nullptr;
+        }
+    }
+    tok_.append(run, static_cast<size_t>(s - run));
+    if (s == end) {
+        return s;
+    }
+    if (*s == '"') {
+        lex_ = Lex::kWs;
+        if (!OnToken(Token::kString)) {
+            return nullptr;
+        }
+        return s + 1;
+    }
+    if (*s == '\\') {
+        lex_ = Lex::kEscape;
+        return s + 1;
+    }
+    Fail("Control character in a string");
+    return nullptr;
+}
+
+const char *JsonReader::ConsumeEscape(const char *s, const char *) {
+    const char c = *s;
+    if (high_surrogate_ != 0 && c != 'u') {
+        Fail("Invalid unicode escape");
+        return nullptr;
+    }
+    lex_ = Lex::kString;
+    switch (c) {
+        case '"':
+        case '\\':
+        case '/':
+            tok_.push_back(c);
+            break;
+        case 'b':
+            tok_.push_back('\b');
+            break;
+        case 'f':
+            tok_.push_back('\f');
+            break;
+        case 'n':
+            tok_.push_back('\n');
+            break;
+        case 'r':
+            tok_.push_back('\r');
+            break;
+        case 't':
+            tok_.push_back('\t');
+            break;
+        case 'x':
+        case 'u':
+            lex_ = c == 'x' ? Lex::kHex : Lex::kUnicode;
+            esc_val_ = 0;
+            esc_len_ = 0;
+            break;
+        default:
+            Fail("Invalid escape");
+            return nullptr;
+    }
+    return s + 1;
+}
+
+const char *JsonReader::ConsumeHex(const char *s, const char *end) {
+    const int8_t want = lex_ == Lex::kHex ? 2 : 4;
+    while (s < end && esc_len_ < want) {
+        const int v = HexValue(*s);
+        if (v < 0) {
+            Fail("Invalid escape");
+            return nullptr;
+        }
+        esc_val_ = esc_val_ * 16 + static_cast<uint32_t>(v);
+        ++esc_len_;
+        ++s;
+    }
+    if (esc_len_ < want) {
+        return s;
+    }
+    if (lex_ == Lex::kHex) {
+        tok_.push_back(static_cast<char>(esc_val_));
+    } else if (high_surrogate_ != 0) {
+        if (esc_val_ < 0xdc00 || esc_val_ > 0xdfff) {
+            Fail("Invalid unicode escape");
+            return nullptr;
+        }
+        AppendUtf8(&tok_, 0x10000 + ((high_surrogate_ - 0xd800) << 10) +
+                                  (esc_val_ - 0xdc00));
+        high_surrogate_ = 0;
+    } else if (esc_val_ >= 0xd800 && esc_val_ <= 0xdbff) {
+        high_surrogate_ = esc_val_;
+    } else if (esc_val_ >= 0xdc00 && esc_val_ <= 0xdfff) {
+        Fail("Invalid unicode escape");
+        return nullptr;
+    } else {
+        AppendUtf8(&tok_, esc_val_);
+    }
+    lex_ = Lex::kString;
+    return s;
+}
+
+const char *JsonReader::ConsumeToken(const char *s, const char *end) {
+    const bool number = lex_ == Lex::kNumber;
+    const char *run = s;
+    while (s < end && (number ? IsNumberChar(*s) : (*s >= 'a' && *s <= 'z'))) {
+        ++s;
+    }
+    tok_.append(run, static_cast<size_t>(s - run));
+    if (tok_.size() > kMaxTokenLen) {
+        Fail(number ? "Invalid number" : "Invalid literal");
+        return nullptr;
+    }
+    if (s == end) {
+        return s;
+    }
+    lex_ = Lex::kWs;
+    if (!OnToken(number ? Token::kNumber : Token::kLiteral)) {
+        return nullptr;
+    }
+    return s;
+}
+
+//------------------------------------------------------------------------------
+// Parser
+
+bool JsonReader::OnToken(Token t) {
+    switch (expect_) {
+        case Expect::kStart:
+            if (t != Token::kOpenDoc) {
+                return Fail("Expected a document");
+            }
+            mark_ = w_->GetMark();
+            if (target_ == Target::kDocument) {
+                w_->Document();
+            }
+            stack_.push_back(Level{false, 0});
+            expect_ = Expect::kKeyOrClose;
+            return true;
+        case Expect::kExtension:
+            return OnExtToken(t);
+        case Expect::kFirstKey:
+            if (t == Token::kCloseDoc) {
+                w_->PushDocument(Key());
+                w_->Pop();
+                expect_ = Expect::kCommaOrClose;
+                return true;
+            }
+            if (t != Token::kString) {
+                return Fail("Expected a key");
+            }
+            if (IsExtensionKey(tok_)) {
+                ext_path_ = tok_;
+                ext_depth_ = 1;
+                ext_expect_ = ExtExpect::kColon;
+                ext_values_.clear();
+                expect_ = Expect::kExtension;
+                return true;
+            }
+            w_->PushDocument(Key());
+            stack_.push_back(Level{false, 0});
+            return SetKey();
+        case Expect::kKeyOrClose:
+            if (t == Token::kCloseDoc) {
+                return Close(false);
+            }
+            // fallthrough
+        case Expect::kKey:
+            if (t != Token::kString) {
+                return Fail("Expected a key");
+            }
+            return SetKey();
+        case Expect::kColon:
+            if (t != Token::kColon) {
+                return Fail("Expected ':'");
+            }
+            expect_ = Expect::kValue;
+            return true;
+        case Expect::kValueOrClose:
+            if (t == Token::kCloseArray) {
+                return Close(true);
+            }
+            // fallthrough
+        case Expect::kValue:
+            return OnValue(t);
+        case Expect::kCommaOrClose:
+            if (t == Token::kComma) {
+                expect_ = stack_.back().array ? Expect::kValue : Expect::kKey;
+                return true;
+            }
+            if (t == Token::kCloseDoc || t == Token::kCloseArray) {
+                return Close(t == Token::kCloseArray);
+            }
+            return Fail("Expected ',' or the end of the value");
+    }
+    return Fail("Internal error");
+}
+
+bool JsonReader::OnValue(Token t) {
+    switch (t) {
+        case Token::kOpenDoc:
+        case Token::kOpenArray:
+            if (stack_.size() >= static_cast<size_t>(kMaxDepth)) {
+                return Fail("Too deeply nested");
+            }
+            if (t == Token::kOpenDoc) {
+                // We don't know yet if this is a document or an extended
+                // value.
+                expect_ = Expect::kFirstKey;
+            } else {
+                w_->PushArray(Key());
+                stack_.push_back(Level{true, 0});
+                expect_ = Expect::kValueOrClose;
+            }
+            return true;
+        case Token::kString:
+        case Token::kNumber:
+        case Token::kLiteral:
+            expect_ = Expect::kCommaOrClose;
+            return WriteScalar(t);
+        default:
+            return Fail("Expected a value");
+    }
+}
+
+bool JsonReader::Close(bool array) {
+    if (stack_.back().array != array) {
+        return Fail("Mismatched brackets");
+    }
+    stack_.pop_back();
+    if (!stack_.empty() || target_ == Target::kDocument) {
+        w_->Pop();
+    }
+    if (stack_.empty()) {
+        lex_ = Lex::kDone;
+    }
+    expect_ = Expect::kCommaOrClose;
+    return true;
+}
+
+const char *JsonReader::Key() {
+    Level &l = stack_.back();
+    if (l.array) {
+        key_ = std::to_string(l.index++);
+    }
+    return key_.c_str();
+}
+
+bool JsonReader::SetKey() {
+    if (tok_.find('\000') != std::string::npos) {
+        return Fail("Invalid key");
+    }
+    key_.swap(tok_);
+    expect_ = Expect::kColon;
+    return true;
+}
+
+bool JsonReader::WriteScalar(Token t) {
+    if (t == Token::kString) {
+        w_->Element(Key(), tok_.data(), static_cast<int32_t>(tok_.size()));
+        return true;
+    }
+    if (t == Token::kLiteral) {
+        if (tok_ == "true" || tok_ == "false") {
+            w_->Element(Key(), tok_ == "true");
+        } else if (tok_ == "null") {
+            w_->Element(Key(), nullptr);
+        } else {
+            return Fail("Invalid literal");
+        }
+        return true;
+    }
+    bool integer;
+    if (!IsNumber(tok_, &integer)) {
+        return Fail("Invalid number");
+    }
+    int64_t i;
+    if (integer && ParseInteger(tok_, &i)) {
+        if (i >= std::numeric_limits<int32_t>::min() &&
+            i <= std::numeric_limits<int32_t>::max()) {
+            w_->Element(Key(), static_cast<int32_t>(i));
+        } else {
+            w_->Element(Key(), i);
+        }
+        return true;
+    }
+    w_->Element(Key(), std::strtod(tok_.c_str(), nullptr));
+    return true;
+}
+
+bool JsonReader::OnExtToken(Token t) {
+    switch (ext_expect_) {
+        case ExtExpect::kKey:
+            if (t != Token::kString) {
+                break;
+            }
+            ext_path_ = ext_depth_ == 1 ? tok_ : ext_outer_ + "." + tok_;
+            ext_expect_ = ExtExpect::kColon;
+            return true;
+        case ExtExpect::kColon:
+            if (t != Token::kColon) {
+                break;
+            }
+            ext_expect_ = ExtExpect::kValue;
+            return true;
+        case ExtExpect::kValue:
+            if ((t == Token::kString || t == Token::kNumber) &&
+                ext_values_.size() < 4) {
+                ext_values_.push_back(
+                        ExtValue{ext_path_, tok_, t == Token::kString});
+                ext_expect_ = ExtExpect::kCommaOrClose;
+                return true;
+            }
+            if (t == Token::kOpenDoc && ext_depth_ == 1) {
+                ext_depth_ = 2;
+                ext_outer_ = ext_path_;
+                ext_expect_ = ExtExpect::kKey;
+                return true;
+            }
+            break;
+        case ExtExpect::kCommaOrClose:
+            if (t == Token::kComma) {
+                ext_expect_ = ExtExpect::kKey;
+                return true;
+            }
+            if (t != Token::kCloseDoc) {
+                break;
+            }
+            if (ext_depth_ == 2) {
+                ext_depth_ = 1;
+                return true;
+            }
+            expect_ = Expect::kCommaOrClose;
+            return WriteExtension();
+    }
+    return Fail("Invalid extended JSON");
+}
+
+bool JsonReader::WriteExtension() {
+    auto find = [this](const char *path, bool is_string) -> const ExtValue * {
+        for (const ExtValue &v : ext_values_) {
+            if (v.path == path) {
+                return v.is_string == is_string ? &v : nullptr;
+            }
+        }
+        return nullptr;
+    };
+    int64_t i;
+    const ExtValue *v;
+    if (ext_values_.size() == 1) {
+        if ((v = find("$oid", true)) != nullptr &&
+            v->value.size() == 2 * kObjectIdLen) {
+            char oid[kObjectIdLen];
+            for (int32_t j = 0; j < kObjectIdLen; ++j) {
+                const int hi = HexValue(v->value[2 * j]);
+                const int lo = HexValue(v->value[2 * j + 1]);
+                if (hi < 0 || lo < 0) {
+                    return Fail("Invalid extended JSON");
+                }
+                oid[j] = static_cast<char>(hi * 16 + lo);
+            }
+            w_->ElementObjectId(Key(), oid);
+            return true;
+        }
+        if ((v = find("$numberLong", true)) != nullptr &&
+            ParseInteger(v->value, &i)) {
+            w_->Element(Key(), i);
+            return true;
+        }
+        if (((v = find("$date", true)) != nullptr &&
+             ParseDate(v->value, &i)) ||
+            ((v = find("$date", false)) != nullptr &&
+             ParseInteger(v->value, &i)) ||
+            ((v = find("$date.$numberLong", true)) != nullptr &&
+             ParseInteger(v->value, &i))) {
+            w_->ElementUtcDatetime(Key(), i);
+            return true;
+        }
+    } else if (ext_values_.size() == 2) {
+        const ExtValue *bin = find("$binary", true);
+        const ExtValue *typ = find("$type", true);
+        if (bin != nullptr && typ != nullptr && !typ->value.empty() &&
+            typ->value.size() <= 2) {
+            int st = 0;
+            for (const char c : typ->value) {
+                const int d = HexValue(c);
+                if (d < 0) {
+                    return Fail("Invalid extended JSON");
+                }
+                st = st * 16 + d;
+            }
+            w_->ElementBindata(Key(), static_cast<BindataSubtype>(st),
+                               bin->value.data(),
+                               static_cast<int32_t>(bin->value.size()));
+            return true;
+        }
+        const ExtValue *inc = find("$timestamp.i", false);
+        const ExtValue *sec = find("$timestamp.s", false);
+        int64_t s;
+        constexpr int64_t kMax = std::numeric_limits<uint32_t>::max();
+        if (inc != nullptr && sec != nullptr && ParseInteger(inc->value, &i) &&
+            ParseInteger(sec->value, &s) && i >= 0 && i <= kMax && s >= 0 &&
+            s <= kMax) {
+            w_->ElementTimestamp(
+                    Key(), static_cast<int64_t>(static_cast<uint64_t>(i) << 32 |
+                                                static_cast<uint64_t>(s)));
+            return true;
+        }
+    }
+    return Fail("Invalid extended JSON");
+}
+
+template <>
+bool BsonWriteFields<JsonDocument>(BsonWriter *w, const JsonDocument &doc) {
+    const BsonWriter::Mark mark = w->GetMark();
+    JsonReader r(w, JsonReader::Target::kFields);
+    const int32_t n = r.Consume(doc.data, doc.len);
+    bool ok = n >= 0 && r.Done();
+    for (int32_t i = n; ok && i < doc.len; ++i) {
+        ok = IsWs(doc.data[i]);
+    }
+    if (!ok) {
+        if (!r.Done()) {
+            r.Cancel();
+        } else if (!r.Failed()) {
+            w->Rewind(mark);
+        }
+    }
+    return ok;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,201 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Reading extended JSON straight into a `BsonWriter`
+ */
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "bson.h"
+#include "mongo.h"
+
+namespace okmongo {
+
+/**
+ * A reentrant JSON parser that writes the documents it reads in a
+ * `BsonWriter`.
+ *
+ * This is the inverse of `BsonDumper`: the input can come in chunks of any
+ * size and the fields are written as soon as they are read, no tree is built.
+ * The extended forms printed by `BsonDumper` are understood:
+ *
+ *  - `{"$oid": "<24 hex digits>"}`
+ *  - `{"$date": "YYYY-MM-DDTHH:MM:SSZ"}`, `{"$date": <integer>}` and
+ *    `{"$date": {"$numberLong": "<integer>"}}`
+ *  - `{"$binary": "<bytes>", "$type": "<hex subtype>"}`
+ *  - `{"$numberLong": "<integer>"}`
+ *  - `{"$timestamp": {"i": <integer>, "s": <integer>}}`
+ *
+ * Like `BsonDumper` the value of a `$date` string is a number of seconds and
+ * the `$binary` bytes are not base64 encoded (`\xhh` escapes are accepted in
+ * all strings). Integers are written as int32 if they fit, int64 otherwise.
+ *
+ * One top level document is read, `Clear` readies the parser for the next
+ * one. On error everything that was written for the document is dropped from
+ * the writer.
+ */
+class JsonReader {
+public:
+    /**
+     * What to write for the top level document.
+     */
+    enum class Target : uint8_t {
+        kDocument,  ///< A whole document (`Document()`...`Pop()`)
+        kFields     ///< Only the fields, in the document open in the writer
+    };
+
+    /**
+     * Documents can't be nested deeper than this (the same limit as mongo).
+     */
+    static constexpr int32_t kMaxDepth = 100;
+
+    /**
+     * The writer must outlive the parser.
+     */
+    explicit JsonReader(BsonWriter *w, Target target = Target::kDocument);
+
+    /**
+     * Reset the parser to its initial state.
+     */
+    void Clear();
+
+    /**
+     * Read the document out of `[s, s + len)`.
+     *
+     * @return the number of bytes read (input after the end of the document
+     * is not read) or -1 on error.
+     */
+    int32_t Consume(const char *s, int32_t len);
+
+    /**
+     * Give up on the document being read (e.g.: the input was truncated),
+     * what was written for it is dropped from the writer.
+     */
+    void Cancel();
+
+    /**
+     * The document was read (or there was an error).
+     */
+    bool Done() const;
+
+    bool Failed() const { return lex_ == Lex::kError; }
+
+    /**
+     * What went wrong (nullptr if nothing did).
+     */
+    const char *ErrorMsg() const { return error_; }
+
+protected:
+    enum class Lex : uint8_t {
+        kWs,       // Between tokens
+        kString,   // In a string literal
+        kEscape,   // After a backslash
+        kHex,      // In a `\xhh` escape
+        kUnicode,  // In a `\uhhhh` escape
+        kNumber,
+        kLiteral,  // true, false or null
+        kDone,
+        kError
+    };
+
+    enum class Token : uint8_t {
+        kOpenDoc,
+        kCloseDoc,
+        kOpenArray,
+        kCloseArray,
+        kColon,
+        kComma,
+        kString,
+        kNumber,
+        kLiteral
+    };
+
+    // What the parser expects next
+    enum class Expect : uint8_t {
+        kStart,          // The top level document
+        kFirstKey,       // After a `{` that might start an extended value
+        kKeyOrClose,     // After a `{`
+        kKey,            // After a `,` in a document
+        kColon,
+        kValueOrClose,   // After a `[`
+        kValue,
+        kCommaOrClose,
+        kExtension       // In an extended value
+    };
+
+    // Where we are in an extended value
+    enum class ExtExpect : uint8_t { kKey, kColon, kValue, kCommaOrClose };
+
+    struct Level {
+        bool array;
+        int32_t index;
+    };
+
+    struct ExtValue {
+        std::string path;  // e.g.: "$date.$numberLong"
+        std::string value;
+        bool is_string;
+    };
+
+    // Report an error, always returns false.
+    bool Fail(const char *msg);
+
+    // Lexer
+    const char *ConsumeWs(const char *s, const char *end);
+    const char *ConsumeString(const char *s, const char *end);
+    const char *ConsumeEscape(const char *s, const char *end);
+    const char *ConsumeHex(const char *s, const char *end);
+    const char *ConsumeToken(const char *s, const char *end);
+
+    // Parser: returns false on error
+    bool OnToken(Token t);
+    bool OnValue(Token t);
+    bool OnExtToken(Token t);
+    bool Close(bool array);
+
+    // Key of the next value in the current document or array
+    const char *Key();
+    bool SetKey();
+    bool WriteScalar(Token t);
+    bool WriteExtension();
+
+    BsonWriter *w_;
+    Target target_;
+    BsonWriter::Mark mark_;
+    const char *error_;
+
+    Lex lex_;
+    Expect expect_;
+    std::string tok_;
+    // \x and \u escapes
+    uint32_t esc_val_;
+    int8_t esc_len_;
+    uint32_t high_surrogate_;
+
+    std::vector<Level> stack_;
+    std::string key_;
+
+    ExtExpect ext_expect_;
+    int8_t ext_depth_;
+    std::string ext_path_;
+    std::string ext_outer_;
+    std::vector<ExtValue> ext_values_;
+};
+
+/**
+ * A JSON document to write with the `Fill*Op` functions.
+ *
+ * > std::vector<okmongo::JsonDocument> docs = ...;
+ * > auto curs = docs.cbegin();
+ * > okmongo::FillInsertRangeOp(&w, id, "db", "coll", &curs, docs.cend());
+ */
+struct JsonDocument {
+    const char *data;
+    int32_t len;
+};
+
+template <>
+bool BsonWriteFields<JsonDocument>(BsonWriter *w, const JsonDocument &doc);
+
+}  // namespace okmongo
@@ -0,0 +1,235 @@
+#include "merge.h"
+#include <algorithm>
+#include <limits>
+
+namespace okmongo {
+
+SortKey::SortKey(const std::vector<SortField> &fields) {
+    for (const SortField &f : fields) {
+        Field res;
+        res.direction = f.direction;
+        size_t start = 0;
+        for (;;) {
+            const size_t dot = f.path.find('.', start);
+            res.path.push_back(f.path.substr(start, dot - start));
+            if (dot == std::string::npos) {
+                break;
+            }
+            start = dot + 1;
+        }
+        fields_.push_back(res);
+    }
+}
+
+BsonValue SortKey::Get(const BsonValue &doc, const Field &f) {
+    BsonValue res = doc;
+    for (const std::string &key : f.path) {
+        res = res.GetField(key.c_str());
+        if (res.Empty()) {
+            break;
+        }
+    }
+    return res;
+}
+
+int SortKey::Compare(const BsonValue &l, const BsonValue &r) const {
+    for (const Field &f : fields_) {
+        const int res = Get(l, f).Compare(Get(r, f));
+        if (res != 0) {
+            return f.direction < 0 ? -res : res;
+        }
+    }
+    return 0;
+}
+
+void CursorMerger::Batch::EmitBsonValue(const BsonValue &v) {
+    docs.offsets.push_back(static_cast<int32_t>(docs.data.size()));
+    docs.data.insert(docs.data.end(), v.GetRaw(), v.GetRaw() + v.GetRawSize());
+}
+
+void CursorMerger::Batch::Clear() {
+    BsonValueResponseReader<Batch>::Clear();
+    docs.data.clear();
+    docs.offsets.clear();
+}
+
+void CursorMerger::Source::EmitBatch(Batch &b) {
+    // The document of a failed query is its error
+    if ((b.Header().response_flags & kQueryFailure) == 0) {
+        merger_->AddBatch(index_, &b);
+    }
+}
+
+BsonValue CursorMerger::Source::Head() const {
+    const Documents &d = batches.front();
+    const int32_t offset = d.offsets[pos];
+    return BsonValue(d.data.data() + offset,
+                     static_cast<int32_t>(d.data.size()) - offset);
+}
+
+void CursorMerger::Source::Pop(std::vector<char> *spent) {
+    ++pos;
+    if (pos == batches.front().offsets.size()) {
+        *spent = std::move(batches.front().data);
+        batches.pop_front();
+        pos = 0;
+    }
+}
+
+CursorMerger::CursorMerger(const SortKey &key, const MergeOptions &opts)
+    : key_(key), opts_(opts) {}
+
+int32_t CursorMerger::Budget() const {
+    if (opts_.limit <= 0) {
+        return std::numeric_limits<int32_t>::max();
+    }
+    const int64_t res = static_cast<int64_t>(std::max(opts_.skip, 0)) +
+                        static_cast<int64_t>(opts_.limit);
+    return static_cast<int32_t>(
+            std::min<int64_t>(res, std::numeric_limits<int32_t>::max()));
+}
+
+int32_t CursorMerger::AddSource(const char *db, const char *collection) {
+    int32_t batch_size = opts_.batch_size;
+    if (opts_.limit > 0 && (batch_size == 0 || batch_size > Budget())) {
+        batch_size = Budget();
+    }
+    const QueryOptions qopts = {opts_.flags, 0, batch_size};
+    const int32_t res = Sources();
+    sources_.emplace_back(new Source(this, res, db, collection, qopts));
+    ++starving_;
+    return res;
+}
+
+int32_t CursorMerger::Consume(int32_t source, const char *s, int32_t len) {
+    Source &src = *sources_[static_cast<size_t>(source)];
+    // ... we only need to know which cursor to kill
+    if (src.closed && (src.Done() || src.CursorId() != 0)) {
+        return len;
+    }
+    const int32_t res = src.Consume(s, len);
+    if (res == -1 || !src.closed) {
+        return res;
+    }
+    return len;
+}
+
+bool CursorMerger::WantsGetMore(int32_t source) const {
+    const Source &src = *sources_[static_cast<size_t>(source)];
+    return !Failed() && !src.closed && src.WantsGetMore() &&
+           src.batches.size() <= 1;
+}
+
+bool CursorMerger::FillGetMore(int32_t source, BsonWriter *w,
+                               int32_t requestid) {
+    if (!WantsGetMore(source)) {
+        return false;
+    }
+    return sources_[static_cast<size_t>(source)]->FillGetMore(w, requestid);
+}
+
+bool CursorMerger::WantsKill(int32_t source) const {
+    const Source &src = *sources_[static_cast<size_t>(source)];
+    return src.closed && !src.Done() && src.CursorId() != 0;
+}
+
+bool CursorMerger::FillKill(int32_t source, BsonWriter *w, int32_t requestid) {
+    if (!WantsKill(source)) {
+        return false;
+    }
+    return sources_[static_cast<size_t>(source)]->FillKill(w, requestid);
+}
+
+bool CursorMerger::Done() const {
+    return (opts_.limit > 0 && returned_ >= opts_.limit) ||
+           (heap_.empty() && starving_ == 0);
+}
+
+bool CursorMerger::After(int32_t l, int32_t r) const {
+    const int res = key_.Compare(sources_[static_cast<size_t>(l)]->Head(),
+                                 sources_[static_cast<size_t>(r)]->Head());
+    // Ties are broken on the source to keep the order stable
+    return res > 0 || (res == 0 && l > r);
+}
+
+void CursorMerger::Close(Source *s) {
+    if (s->closed) {
+        return;
+    }
+    if (Live(*s) && !s->HasHead()) {
+        --starving_;
+    }
+    s->closed = true;
+}
+
+void CursorMerger::SourceDone(int32_t source) {
+    Source &src = *sources_[static_cast<size_t>(source)];
+    if (Live(src) && !src.HasHead()) {
+        --starving_;
+    }
+    src.exhausted = true;
+}
+
+void CursorMerger::AddBatch(int32_t source, Batch *b) {
+    Source &src = *sources_[static_cast<size_t>(source)];
+    if (src.closed || b->docs.offsets.empty()) {
+        return;
+    }
+    // Anything past the budget would never be returned
+    const size_t left = static_cast<size_t>(Budget() - src.received);
+    if (b->docs.offsets.size() > left) {
+        b->docs.offsets.resize(left);
+    }
+    src.received += static_cast<int32_t>(b->docs.offsets.size());
+    const bool starved = !src.HasHead();
+    src.batches.emplace_back();
+    src.batches.back().data.swap(b->docs.data);
+    src.batches.back().offsets.swap(b->docs.offsets);
+    if (starved) {
+        --starving_;
+        heap_.push_back(source);
+        std::push_heap(heap_.begin(), heap_.end(),
+                       [this](int32_t l, int32_t r) { return After(l, r); });
+    }
+    if (src.received >= Budget()) {
+        Close(&src);
+    }
+}
+
+void CursorMerger::Advance(int32_t source) {
+    Source &src = *sources_[static_cast<size_t>(source)];
+    src.Pop(&spent_);
+    if (src.HasHead()) {
+        heap_.push_back(source);
+        std::push_heap(heap_.begin(), heap_.end(),
+                       [this](int32_t l, int32_t r) { return After(l, r); });
+    } else if (Live(src)) {
+        ++starving_;
+    }
+}
+
+bool CursorMerger::Next(BsonValue *doc) {
+    while (!Failed() && !Done() && starving_ == 0) {
+        std::pop_heap(heap_.begin(), heap_.end(),
+                      [this](int32_t l, int32_t r) { return After(l, r); });
+        const int32_t source = heap_.back();
+        heap_.pop_back();
+        if (skipped_ < opts_.skip) {
+            ++skipped_;
+            Advance(source);
+            continue;
+        }
+        *doc = sources_[static_cast<size_t>(source)]->Head();
+        ++returned_;
+        Advance(source);
+        if (opts_.limit > 0 && returned_ >= opts_.limit) {
+            for (auto &src : sources_) {
+                Close(src.get());
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+}  // namespace okmongo
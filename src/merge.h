@@ -0,0 +1,244 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Merging the sorted results of queries sent to several servers
+ */
+#pragma once
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+#include "cursor.h"
+
+namespace okmongo {
+
+/**
+ * A field of a sort specification.
+ */
+struct SortField {
+    std::string path;   ///< Dotted path of the field (e.g. "a.b")
+    int32_t direction;  ///< 1 for ascending, -1 for descending
+};
+
+/**
+ * The order of the documents in a sorted query (its `$orderby`).
+ *
+ * Fields are compared with `BsonValue::Compare`; a path goes through
+ * subdocuments but not through arrays (arrays are compared as a whole rather
+ * than on their lowest or highest element).
+ */
+class SortKey {
+public:
+    explicit SortKey(const std::vector<SortField> &fields);
+
+    /**
+     * @return a negative number, 0 or a positive number if the document `l`
+     * comes before, with or after the document `r`.
+     */
+    int Compare(const BsonValue &l, const BsonValue &r) const;
+
+private:
+    struct Field {
+        std::vector<std::string> path;
+        int32_t direction;
+    };
+
+    static BsonValue Get(const BsonValue &doc, const Field &f);
+
+    std::vector<Field> fields_;
+};
+
+struct MergeOptions {
+    int32_t flags;       ///< `QueryFlags` of every query
+    int32_t batch_size;  ///< Documents per batch (0: let the server decide)
+    int32_t skip;        ///< Documents skipped in the merged results
+    int32_t limit;       ///< Maximum number of merged results (0: no limit)
+};
+
+/**
+ * Merges the replies to the same sorted query sent to several servers (e.g.
+ * the shards of a collection) into one sorted stream of documents.
+ *
+ * Every server is a source with its own `Cursor`: `FillQuery` opens it and
+ * `Consume` takes its replies. The documents of every batch are kept in one
+ * buffer along with their offsets until they have all been merged. `Next`
+ * picks the lowest document of all the sources out of a heap of the first
+ * document of every source; it fails when a source that isn't exhausted
+ * has no document left, until its next batch arrives.
+ *
+ * Sources prefetch: they want a getMore as long as they have at most one
+ * batch waiting to be merged (a slow consumer doesn't buffer whole result
+ * sets).
+ *
+ * The limit and skip are pushed down: no source reads more than
+ * `skip + limit` documents, and once `limit` documents have been merged the
+ * sources stop asking for batches and want their cursor closed (`WantsKill`)
+ * instead; replies they receive afterward are ignored.
+ *
+ * The queries must sort their results in the same order as the `SortKey`.
+ *
+ * > okmongo::CursorMerger merger(key, {0, 1000, 0, 50});
+ * > const int32_t i = merger.AddSource("db", "coll");
+ * > merger.FillQuery(i, &w, id, qry);
+ * > while (merger.Next(&doc)) {...}
+ * > for (i...) { if (merger.WantsGetMore(i)) merger.FillGetMore(i, &w, id) }
+ */
+class CursorMerger {
+public:
+    /**
+     * The `key` is not copied.
+     */
+    CursorMerger(const SortKey &key, const MergeOptions &opts);
+
+    /**
+     * Add a server to read the results from.
+     *
+     * The strings are not copied.
+     *
+     * @return the index of the source.
+     */
+    int32_t AddSource(const char *db, const char *collection);
+
+    int32_t Sources() const { return static_cast<int32_t>(sources_.size()); }
+
+    /**
+     * Fill the query that opens the cursor of `source`.
+     */
+    template <typename T>
+    bool FillQuery(int32_t source, BsonWriter *w, int32_t requestid,
+                   const T &qry) {
+        return sources_[static_cast<size_t>(source)]->FillQuery(w, requestid,
+                                                                qry);
+    }
+
+    /**
+     * Read replies of `source` out of `[s, s + len)`
+     *
+     * @return the number of bytes read or -1 on error.
+     */
+    int32_t Consume(int32_t source, const char *s, int32_t len);
+
+    /**
+     * Whether a getMore should be sent to `source`.
+     */
+    bool WantsGetMore(int32_t source) const;
+
+    bool FillGetMore(int32_t source, BsonWriter *w, int32_t requestid);
+
+    /**
+     * Whether the cursor of `source` is still open on the server although we
+     * don't need it anymore.
+     */
+    bool WantsKill(int32_t source) const;
+
+    bool FillKill(int32_t source, BsonWriter *w, int32_t requestid);
+
+    /**
+     * Get the next document in the merged results.
+     *
+     * The document is valid until the next call to `Next`.
+     *
+     * @return false if we are waiting on a source (`Waiting`), are `Done` or
+     * `Failed`.
+     */
+    bool Next(BsonValue *doc);
+
+    /**
+     * Whether `Next` waits for a batch of a source.
+     */
+    bool Waiting() const { return starving_ > 0 && !Done(); }
+
+    /**
+     * All the results have been merged.
+     */
+    bool Done() const;
+
+    /**
+     * One of the sources couldn't be read, its error is in `Error`.
+     */
+    bool Failed() const { return error_ != nullptr; }
+
+    const char *Error() const { return error_; }
+
+    /**
+     * Number of documents returned by `Next` so far.
+     */
+    int32_t Returned() const { return returned_; }
+
+private:
+    // The documents of a batch
+    struct Documents {
+        std::vector<char> data;  // Moving it doesn't move the documents
+        std::vector<int32_t> offsets;
+    };
+
+    // The reader of the sources
+    class Batch : public BsonValueResponseReader<Batch> {
+    public:
+        Documents docs;
+
+        void EmitBsonValue(const BsonValue &v);
+
+        // The cursor fails on its own
+        void EmitError(const char *) {}
+
+        void Clear();
+    };
+
+    class Source : public Cursor<Source, Batch> {
+    public:
+        Source(CursorMerger *merger, int32_t index, const char *db,
+               const char *collection, const QueryOptions &opts)
+            : Cursor<Source, Batch>(db, collection, opts),
+              merger_(merger),
+              index_(index) {}
+
+        void EmitBatch(Batch &b);
+
+        void EmitDone() { merger_->SourceDone(index_); }
+
+        void EmitError(const char *msg) { merger_->error_ = msg; }
+
+        bool HasHead() const { return !batches.empty(); }
+
+        BsonValue Head() const;
+
+        // Move past the head
+        void Pop(std::vector<char> *spent);
+
+        std::deque<Documents> batches;
+        size_t pos = 0;          // In `batches.front()`
+        int32_t received = 0;    // Number of documents
+        bool closed = false;     // We don't need any more documents
+        bool exhausted = false;  // ... the server doesn't have any more
+
+    private:
+        CursorMerger *const merger_;
+        const int32_t index_;
+    };
+
+    // The source might still get documents
+    bool Live(const Source &s) const { return !s.closed && !s.exhausted; }
+
+    void Close(Source *s);
+    void SourceDone(int32_t source);
+    void AddBatch(int32_t source, Batch *b);
+    // Move past the head of `source`
+    void Advance(int32_t source);
+    // Whether the head of `l` comes after the head of `r`
+    bool After(int32_t l, int32_t r) const;
+    int32_t Budget() const;
+
+    const SortKey &key_;
+    const MergeOptions opts_;
+    std::vector<std::unique_ptr<Source>> sources_;
+    std::vector<int32_t> heap_;  // Sources with a head
+    int32_t starving_ = 0;       // Live sources without a head
+    int32_t skipped_ = 0;
+    int32_t returned_ = 0;
+    std::vector<char> spent_;  // The last batch merged (`Next` points to it)
+    const char *error_ = nullptr;
+};
+
+}  // namespace okmongo
@@ -1,122 +1,17 @@
 #include "mongo.h"
+#include <cstddef>
 
 namespace okmongo {
-constexpr StringMatcherAction<OpResponseParser::BaseField>
-        OpResponseParser::sma_[];
-
-constexpr StringMatcherAction<OpResponseParser::ErrorField>
-        OpResponseParser::ema_[];
-
-void OpResponseParser::EmitFieldName(const char *data, const int32_t len) {
-    assert(len >= 0);
-    if (depth_ == 1) {
-        if (base_field_ != BaseField::kField) {
-            base_field_ = BaseField::kField;
-            new (&base_matcher_) BaseMatcher();
-        }
-        for (int32_t i = 0; i < len; i++) {
-            base_matcher_.AddChar(data[i]);
-        }
-        if (len == 0) {
-            base_matcher_.AddChar('\000');
-            base_field_ = base_matcher_.GetResult();
-            base_matcher_.~BaseMatcher();
-        }
-    } else if (IsError()) {
-        if (error_field_ != ErrorField::kField) {
-            error_field_ = ErrorField::kField;
-            new (&error_matcher_) ErrorMatcher();
-        }
-
-        for (int32_t i = 0; i < len; i++) {
-            error_matcher_.AddChar(data[i]);
-        }
-        if (len == 0) {
-            error_matcher_.AddChar('\000');
-            error_field_ = error_matcher_.GetResult();
-            error_matcher_.~ErrorMatcher();
-        }
-    }
-}
-
-void OpResponseParser::EmitOpenDoc() {
-    ++depth_;
-    if (IsError()) {
-        res_.errors.push_back(CmdError{});
-        if (base_field_ == BaseField::kWriteConcernErrors) {
-            res_.errors.back().type = CmdError::Type::WriteConcernError;
-        }
-    }
-}
-
-void OpResponseParser::EmitInt32(int32_t i) {
-    if (depth_ == 1) {
-        switch (base_field_) {
-            case BaseField::kField:
-            case BaseField::kWriteConcernErrors:
-            case BaseField::kWriteErrors:
-            case BaseField::kUnknown:
-                return;
-            case BaseField::kOk:
-                res_.ok = i;
-                break;
-            case BaseField::kN:
-                res_.n = i;
-                break;
-            case BaseField::kNModified:
-                res_.nModified = i;
-                break;
-        }
-    } else if (IsError()) {
-        switch (error_field_) {
-            case ErrorField::kCode:
-                res_.errors.back().code = i;
-                break;
-            case ErrorField::kIndex:
-                res_.errors.back().index = i;
-                break;
-            case ErrorField::kField:
-            case ErrorField::kUnknown:
-            case ErrorField::kErrMsg:
-            case ErrorField::kErrInfo:
-                break;
-        }
-    }
-}
-
-bool OpResponseParser::IsError() const {
-    return (depth_ == 3 && (base_field_ == BaseField::kWriteErrors ||
-                            base_field_ == BaseField::kWriteConcernErrors));
-}
+constexpr StringMatcherAction<OpResponseFields::BaseField>
+        OpResponseFields::sma_[];
 
-void OpResponseParser::EmitUtf8(const char *cnt, int32_t len) {
-    assert(len >= 0);
-    if (len == 0) {
-        return;
-    }
-    if (IsError()) {
-        switch (error_field_) {
-            case ErrorField::kErrMsg:
-                res_.errors.back().msg.append(cnt, static_cast<size_t>(len));
-                break;
-            case ErrorField::kErrInfo:
-                res_.errors.back().info.append(cnt, static_cast<size_t>(len));
-                break;
-            case ErrorField::kField:
-            case ErrorField::kUnknown:
-            case ErrorField::kCode:
-            case ErrorField::kIndex:
-                break;
-        }
-    }
-}
+constexpr StringMatcherAction<OpResponseFields::ErrorField>
+        OpResponseFields::ema_[];
 
-void OpResponseParser::EmitError(const char *msg) {
-    CmdError e = {};
-    e.msg = msg;
-    e.type = CmdError::Type::ParseError;
-    res_.errors.push_back(e);
-}
+namespace {
+constexpr StaticElement kIsMasterCommand[] = {StaticInt32("ismaster", 1),
+                                              StaticEnd()};
+}  // namespace
 
 void AppendCommandHeader(BsonWriter *w, int32_t requestid, const char *db) {
     w->AppendRaw(MsgHeader(requestid, MongoOpcode::kQuery));
@@ -129,23 +24,82 @@ void AppendCommandHeader(BsonWriter *w, int32_t requestid, const char *db) {
     w->AppendRaw<int32_t>(-1);  // Number to return
 }
 
-void AppendWriteConcern(BsonWriter *w) {
-    w->PushDocument("WriteConcern");
-    w->Element("w", 1);
+void AppendQueryHeader(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, const QueryOptions &opts) {
+    w->AppendRaw(MsgHeader(requestid, MongoOpcode::kQuery));
+    w->AppendRaw<int32_t>(opts.flags);
+    w->AppendRawBytes(db, static_cast<int32_t>(strlen(db)));
+    w->AppendRawBytes(".", 1);
+    w->AppendCstring(collection);
+
+    w->AppendRaw<int32_t>(opts.skip);        // Start
+    w->AppendRaw<int32_t>(opts.batch_size);  // Number to return
+}
+
+PreparedWriteCommand::PreparedWriteCommand(const char *cmd,
+                                           const char *array_key,
+                                           const char *db,
+                                           const char *collection,
+                                           void (*append_concern)(BsonWriter *),
+                                           bool expects_reply)
+    : expects_reply_(expects_reply) {
+    AppendCommandHeader(&prefix_, 0, db);
+    prefix_.Document();
+    prefix_.Element(cmd, collection);
+    prefix_.PushArray(array_key);
+
+    // The write concern doesn't depend on where it's written: we serialise it
+    // in a scratch document and keep the bytes between the length and the
+    // terminating null byte.
+    BsonWriter tmp;
+    tmp.Document();
+    append_concern(&tmp);
+    tmp.Pop();
+    suffix_.assign(tmp.data() + sizeof(int32_t),
+                   static_cast<size_t>(tmp.len()) - sizeof(int32_t) - 1);
+}
+
+void PreparedWriteCommand::Start(BsonWriter *w, int32_t requestid) const {
+    w->CopyFrom(prefix_);
+    w->PatchRaw(offsetof(MsgHeader, request_id), requestid);
+}
+
+void PreparedWriteCommand::Finish(BsonWriter *w) const {
     w->Pop();
+    w->AppendRawBytes(suffix_.data(), static_cast<int32_t>(suffix_.size()));
+    w->Pop();
+    w->FlushLen();
+}
+
+void AppendMsgHeader(BsonWriter *w, int32_t requestid, uint32_t flags) {
+    w->AppendRaw(OpMsgHeader(requestid, flags));
 }
 
+void StartMsgCommand(BsonWriter *w, const char *cmd, const char *collection) {
+    w->AppendRaw<uint8_t>(0);  // Kind: body
+    w->Document();
+    w->Element(cmd, collection);
+}
+
+int32_t StartDocumentSequence(BsonWriter *w, const char *identifier) {
+    w->AppendRaw<uint8_t>(1);  // Kind: document sequence
+    const int32_t res = w->AppendLenPlaceholder();
+    w->AppendCstring(identifier);
+    return res;
+}
+
+void EndDocumentSequence(BsonWriter *w, int32_t start) { w->FlushLen(start); }
+
 bool FillIsMasterOp(BsonWriter *w, int32_t requestid) {
     AppendCommandHeader(w, requestid, "admin");
-    w->Document();
-    w->Element("ismaster", 1);
-    w->Pop();
+    StaticDocument<kIsMasterCommand>::Append(w);
     w->FlushLen();
     return true;
 }
 
 bool FillGetMoreOp(BsonWriter *w, int32_t requestid, const char *db,
-                   const char *collection, int64_t cursorid) {
+                   const char *collection, int64_t cursorid,
+                   int32_t number_to_return) {
     w->AppendRaw(MsgHeader(requestid, MongoOpcode::kGetMore));
     w->AppendRaw<int32_t>(0);  // Zero
 
@@ -153,7 +107,7 @@ bool FillGetMoreOp(BsonWriter *w, int32_t requestid, const char *db,
     w->AppendRawBytes(".", 1);
     w->AppendCstring(collection);
 
-    w->AppendRaw<int32_t>(0);         // Number to return
+    w->AppendRaw<int32_t>(number_to_return);
     w->AppendRaw<int64_t>(cursorid);  // Cursorid
     w->FlushLen();
     return true;
@@ -6,7 +6,9 @@
  */
 
 #pragma once
+#include <vector>
 #include "bson.h"
+#include "static_document.h"
 #include "string_matcher.h"
 
 namespace okmongo {
@@ -16,7 +18,180 @@ namespace okmongo {
  * @{
  */
 
-template <typename... Values>
+/**
+ * The maximum number of documents allowed in one write command.
+ *
+ *  Can be obtained from the db via: `db.isMaster().maxWriteBatchSize`
+ */
+constexpr int32_t kMaxWriteBatchSize = 1000;
+
+/**
+ * The maximum number of documents allowed in one write command sent in an
+ * OP_MSG.
+ *
+ * Servers that speak OP_MSG (3.6+) accept 100000 statements per batch.
+ */
+constexpr int32_t kMaxMsgWriteBatchSize = 100000;
+
+/**
+ * The maximum size of a document (`db.isMaster().maxBsonObjectSize`)
+ */
+constexpr int32_t kMaxBsonObjectSize = 16 * 1024 * 1024;
+
+/**
+ * The maximum size of a message (`db.isMaster().maxMessageSizeBytes`)
+ */
+constexpr int32_t kMaxMessageSize = 48000000;
+
+/**
+ * The maximum number of cursors closed by one `FillKillCursorsOp`: what fits
+ * in a message after the header, the zero and the count.
+ */
+constexpr int32_t kMaxKillCursors = (kMaxMessageSize - 24) / 8;
+
+/**
+ * When to stop adding statements to a message in the range functions.
+ */
+struct BatchLimits {
+    int32_t max_count; /**< Maximum number of statements */
+    int32_t max_bytes; /**< Maximum size of the whole message */
+};
+
+/**
+ * Limits for the commands sent as queries on `db.$cmd`: the whole command has
+ * to fit in one document.
+ */
+constexpr BatchLimits kDefaultBatchLimits = {kMaxWriteBatchSize,
+                                             kMaxBsonObjectSize};
+
+/**
+ * Limits for the commands sent as OP_MSG
+ */
+constexpr BatchLimits kDefaultMsgBatchLimits = {kMaxMsgWriteBatchSize,
+                                                kMaxMessageSize};
+
+/**
+ * @defgroup mng_wc write concerns
+ *
+ * The write concern of a write command is a compile time policy: the first
+ * template argument of the `Fill*Op` functions (and an argument of the
+ * constructors of the prepared commands). It defaults to `Acknowledged`.
+ *
+ * > okmongo::FillInsertOp<okmongo::Unacknowledged>(&w, id, "db", "c", doc);
+ * > okmongo::FillDeleteOp<okmongo::MajorityWriteConcern<true, 500>>(...);
+ *
+ * A policy has a static `Append(BsonWriter *)` that writes the `writeConcern`
+ * field of the command and a static `kExpectsReply`. Unacknowledged OP_MSG
+ * commands are sent with `kMoreToCome`: the server doesn't reply at all.
+ * Commands on `db.$cmd` always get a reply but, with `w: 0`, it is sent
+ * without waiting for the write and can be skipped unread (e.g.: by a
+ * `ResponseMultiplexer`).
+ * @{
+ */
+
+// `j` and `wtimeout` are only written when they are set.
+template <bool Journal, int32_t WTimeoutMs>
+void AppendWriteConcernOptions(BsonWriter *w) {
+    if (Journal) {
+        w->Element("j", true);
+    }
+    if (WTimeoutMs > 0) {
+        w->Element("wtimeout", WTimeoutMs);
+    }
+}
+
+// `{w: W}` (the write concern of almost every command) serialised at compile
+// time.
+template <int32_t W>
+struct PlainWriteConcern {
+    static constexpr StaticElement kElements[] = {StaticInt32("w", W),
+                                                  StaticEnd()};
+};
+
+template <int32_t W>
+constexpr StaticElement PlainWriteConcern<W>::kElements[];
+
+/**
+ * `{w: W, j: Journal, wtimeout: WTimeoutMs}`
+ */
+template <int32_t W, bool Journal = false, int32_t WTimeoutMs = 0>
+struct WriteConcern {
+    static constexpr bool kExpectsReply = W != 0 || Journal;
+
+    static void Append(BsonWriter *w) {
+        if (!Journal && WTimeoutMs <= 0) {
+            StaticDocument<PlainWriteConcern<W>::kElements>::AppendField(
+                    w, "writeConcern");
+            return;
+        }
+        w->PushDocument("writeConcern");
+        w->Element("w", W);
+        AppendWriteConcernOptions<Journal, WTimeoutMs>(w);
+        w->Pop();
+    }
+};
+
+/**
+ * `{w: "majority", j: Journal, wtimeout: WTimeoutMs}`
+ */
+template <bool Journal = false, int32_t WTimeoutMs = 0>
+struct MajorityWriteConcern {
+    static constexpr bool kExpectsReply = true;
+
+    static void Append(BsonWriter *w) {
+        w->PushDocument("writeConcern");
+        w->Element("w", "majority");
+        AppendWriteConcernOptions<Journal, WTimeoutMs>(w);
+        w->Pop();
+    }
+};
+
+/**
+ * Wait for the primary to apply the write (the default).
+ */
+typedef WriteConcern<1> Acknowledged;
+
+/**
+ * Fire and forget.
+ */
+typedef WriteConcern<0> Unacknowledged;
+
+/** @} */
+
+/**
+ * Flags of an OP_QUERY
+ */
+enum QueryFlags : int32_t {
+    kTailableCursor = 1 << 1,  ///< Keep the cursor open at the end of the data
+    kSlaveOk = 1 << 2,         ///< The query can run on a secondary
+    kNoCursorTimeout = 1 << 4, ///< Don't time idle cursors out
+    kAwaitData = 1 << 5,  ///< Block on a tailable cursor rather than return
+    kExhaust = 1 << 6,    ///< Stream all the batches without any getMore
+    kPartial = 1 << 7     ///< Return partial results if some shards are down
+};
+
+/**
+ * How to open a cursor with `FillQueryOp`
+ */
+struct QueryOptions {
+    int32_t flags;      /**< `QueryFlags` */
+    int32_t skip;       /**< Number of documents to skip */
+    int32_t batch_size; /**< Number of documents per batch (0: let the server
+                           decide), negative values close the cursor after the
+                           first batch */
+};
+
+/**
+ * An element of the ranges passed to `FillUpdateRangeOp`
+ */
+template <typename Select, typename Operation>
+struct UpdateStatement {
+    Select q;
+    Operation u;
+    bool upsert;
+};
+
+template <typename Concern = Acknowledged, typename... Values>
 bool FillInsertOp(BsonWriter *w, int32_t requestid, const char *db,
                   const char *collection, const Values &... values);
 
@@ -24,10 +199,13 @@ bool FillInsertOp(BsonWriter *w, int32_t requestid, const char *db,
  * Insert a range of documents
  *
  * Updates `It` to point to the first document that couldn't fit in the query.
+ * The document that crossed one of the `limits` is removed from `w`. Fails if
+ * not even one document fits.
  */
-template <typename It>
+template <typename Concern = Acknowledged, typename It>
 bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
-                       const char *collection, It *start, const It end);
+                       const char *collection, It *start, const It end,
+                       const BatchLimits &limits = kDefaultBatchLimits);
 
 template <typename T>
 bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
@@ -38,24 +216,216 @@ bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
                  const char *collection, const T &qry, const FldSelector &sel,
                  int32_t limit = 0);
 
-template <typename Select, typename Operation>
+/**
+ * Open a cursor with the given `opts`
+ */
+template <typename T>
+bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
+                 const char *collection, const T &qry,
+                 const QueryOptions &opts);
+
+template <typename T, typename FldSelector>
+bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
+                 const char *collection, const T &qry, const FldSelector &sel,
+                 const QueryOptions &opts);
+
+template <typename Concern = Acknowledged, typename Select, typename Operation>
 bool FillUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
                   const char *collection, const Select &qry,
                   const Operation &op, bool upsert = false);
 
-template <typename T>
+/**
+ * Send a range of updates (of type `UpdateStatement`), the range is handled
+ * like in `FillInsertRangeOp`.
+ */
+template <typename Concern = Acknowledged, typename It>
+bool FillUpdateRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, It *start, const It end,
+                       const BatchLimits &limits = kDefaultBatchLimits);
+
+template <typename Concern = Acknowledged, typename T>
 bool FillDeleteOp(BsonWriter *w, int32_t requestid, const char *db,
                   const char *collection, const T &qry);
 
+/**
+ * Delete all the documents matching any of the queries in the range, the
+ * range is handled like in `FillInsertRangeOp`.
+ */
+template <typename Concern = Acknowledged, typename It>
+bool FillDeleteRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, It *start, const It end,
+                       const BatchLimits &limits = kDefaultBatchLimits);
+
+/**
+ * Ask for the next batch of `cursorid`, of at most `number_to_return`
+ * documents (0 lets the server pick the size of the batch).
+ */
 bool FillGetMoreOp(BsonWriter *w, int32_t requestid, const char *db,
-                   const char *collection, int64_t cursorid);
+                   const char *collection, int64_t cursorid,
+                   int32_t number_to_return = 0);
 
 bool FillIsMasterOp(BsonWriter *w, int32_t requestid);
 
+bool FillKillCursorsOp(BsonWriter *w, int32_t requestid, int64_t cursorid);
+
 /**
- * @todo iterators for Kill cursors
+ * Close the cursors in `[*start, end)` (a range of `int64_t`) in one message.
+ *
+ * At most `max_count` cursors are written, `*start` is updated to point to
+ * first one that wasn't. Fails if the range is empty.
  */
-bool FillKillCursorsOp(BsonWriter *w, int32_t requestid, int64_t cursorid);
+template <typename It>
+bool FillKillCursorsOp(BsonWriter *w, int32_t requestid, It *start,
+                       const It end, int32_t max_count = kMaxKillCursors);
+
+/**
+ * A write command where everything but the request id and the array of
+ * statements has already been serialised.
+ *
+ * The header, the command name, the collection and the write concern are
+ * written once in the constructor; every message then starts as a copy of that
+ * blob. Use one of `PreparedInsert`, `PreparedUpdate` or `PreparedDelete`.
+ */
+class PreparedWriteCommand {
+public:
+    /**
+     * Copy the prefix of the command in `w` (replacing its content) and leave
+     * it ready to receive the statements of the command.
+     */
+    void Start(BsonWriter *w, int32_t requestid) const;
+
+    /**
+     * Close the statements array and write the end of the command.
+     */
+    void Finish(BsonWriter *w) const;
+
+    /**
+     * Number of bytes written by `Finish`
+     */
+    int32_t TrailerSize() const {
+        return static_cast<int32_t>(suffix_.size()) + 2;
+    }
+
+    /**
+     * `kExpectsReply` of the write concern
+     */
+    bool ExpectsReply() const { return expects_reply_; }
+
+protected:
+    PreparedWriteCommand(const char *cmd, const char *array_key,
+                         const char *db, const char *collection,
+                         void (*append_concern)(BsonWriter *),
+                         bool expects_reply);
+
+private:
+    BsonWriter prefix_;
+    std::string suffix_;
+    bool expects_reply_;
+};
+
+/**
+ * Prepared version of `FillInsertOp` and `FillInsertRangeOp`
+ *
+ * > okmongo::PreparedInsert ins("test", "users");
+ * > ins.Fill(&w, requestid, u1, u2);
+ */
+class PreparedInsert : public PreparedWriteCommand {
+public:
+    template <typename Concern = Acknowledged>
+    PreparedInsert(const char *db, const char *collection, Concern = Concern())
+        : PreparedWriteCommand("insert", "documents", db, collection,
+                               &Concern::Append, Concern::kExpectsReply) {}
+
+    template <typename... Values>
+    bool Fill(BsonWriter *w, int32_t requestid, const Values &... values) const;
+
+    template <typename It>
+    bool FillRange(BsonWriter *w, int32_t requestid, It *start, const It end,
+                   const BatchLimits &limits = kDefaultBatchLimits) const;
+};
+
+/**
+ * Prepared version of `FillUpdateOp`
+ */
+class PreparedUpdate : public PreparedWriteCommand {
+public:
+    template <typename Concern = Acknowledged>
+    PreparedUpdate(const char *db, const char *collection, Concern = Concern())
+        : PreparedWriteCommand("update", "updates", db, collection,
+                               &Concern::Append, Concern::kExpectsReply) {}
+
+    template <typename Select, typename Operation>
+    bool Fill(BsonWriter *w, int32_t requestid, const Select &qry,
+              const Operation &op, bool upsert = false) const;
+
+    template <typename It>
+    bool FillRange(BsonWriter *w, int32_t requestid, It *start, const It end,
+                   const BatchLimits &limits = kDefaultBatchLimits) const;
+};
+
+/**
+ * Prepared version of `FillDeleteOp`
+ */
+class PreparedDelete : public PreparedWriteCommand {
+public:
+    template <typename Concern = Acknowledged>
+    PreparedDelete(const char *db, const char *collection, Concern = Concern())
+        : PreparedWriteCommand("delete", "deletes", db, collection,
+                               &Concern::Append, Concern::kExpectsReply) {}
+
+    template <typename T>
+    bool Fill(BsonWriter *w, int32_t requestid, const T &qry) const;
+
+    template <typename It>
+    bool FillRange(BsonWriter *w, int32_t requestid, It *start, const It end,
+                   const BatchLimits &limits = kDefaultBatchLimits) const;
+};
+
+/**
+ * @defgroup mng_msg_wrt writing OP_MSG commands
+ *
+ * Same as the `Fill*Op` functions but using an OP_MSG (mongodb 3.6+) instead
+ * of a query on `db.$cmd`. The statements of the command go in a document
+ * sequence (a "kind 1" section) after the body: they are written back to back,
+ * without the array keys.
+ * @{
+ */
+
+template <typename Concern = Acknowledged, typename... Values>
+bool FillMsgInsertOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const Values &... values);
+
+/**
+ * Insert a range of documents
+ *
+ * Updates `It` to point to the first document that couldn't fit in the
+ * message (see `FillInsertRangeOp`).
+ */
+template <typename Concern = Acknowledged, typename It>
+bool FillMsgInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *start, const It end,
+                          const BatchLimits &limits = kDefaultMsgBatchLimits);
+
+template <typename Concern = Acknowledged, typename Select, typename Operation>
+bool FillMsgUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const Select &qry,
+                     const Operation &op, bool upsert = false);
+
+template <typename Concern = Acknowledged, typename It>
+bool FillMsgUpdateRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *start, const It end,
+                          const BatchLimits &limits = kDefaultMsgBatchLimits);
+
+template <typename Concern = Acknowledged, typename T>
+bool FillMsgDeleteOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const T &qry);
+
+template <typename Concern = Acknowledged, typename It>
+bool FillMsgDeleteRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *start, const It end,
+                          const BatchLimits &limits = kDefaultMsgBatchLimits);
+
+/** @} */
 
 /** @} */
 
@@ -67,7 +437,9 @@ enum class MongoOpcode : int32_t {
     kQuery = 2004,      /**< query a collection */
     kGetMore = 2005,    /**< Get more data from a query. See Cursors */
     kDelete = 2006,     /**<  Delete documents */
-    kKillCursors = 2007 /**< Tell database client is done with a cursor */
+    kKillCursors = 2007, /**< Tell database client is done with a cursor */
+    kCompressed = 2012,  /**< Compressed envelope of another message */
+    kOpMsg = 2013        /**< Extensible message format (mongodb 3.6+) */
 };
 
 #pragma pack(push, 1)
@@ -92,8 +464,26 @@ struct MsgHeader {
         : request_id(id), response_to(0), op_code(static_cast<int32_t>(op)) {}
 };
 static_assert(sizeof(MsgHeader) == 4 * sizeof(int32_t), "Packing failed");
+
+/**
+ * Header of an OP_MSG, it is followed by the sections of the message.
+ */
+struct OpMsgHeader : public MsgHeader {
+    uint32_t flag_bits; /**< See `OpMsgFlags` */
+
+    OpMsgHeader() {}
+    OpMsgHeader(int32_t id, uint32_t flags)
+        : MsgHeader(id, MongoOpcode::kOpMsg), flag_bits(flags) {}
+};
+static_assert(sizeof(OpMsgHeader) == 5 * sizeof(int32_t), "Packing failed");
 #pragma pack(pop)
 
+enum OpMsgFlags : uint32_t {
+    kChecksumPresent = 1,     ///< The message ends with a crc32c checksum
+    kMoreToCome = 2,          ///< Another message follows this one
+    kExhaustAllowed = 1 << 16 ///< The client accepts several replies
+};
+
 // Specialize this template to use the functions in this header...
 template <typename T>
 bool BsonWriteFields(BsonWriter *w, const T &);
@@ -187,13 +577,108 @@ public:
 
 //------------------------------------------------------------------------------
 /**
- * This is a specialised response reader that read in `BsonValue`'s
+ * The OP_MSG counterpart of `ResponseReader`.
+ *
+ * Every document of the message is read in turn, be it the body (kind 0
+ * section) or part of a document sequence (kind 1 section). Documents are
+ * numbered in the order they appear; `EmitSequenceStart`/`EmitSequenceDone`
+ * frame the documents of a sequence.
+ *
+ * The checksum, if present, is skipped but not verified.
  */
 template <typename Implementation>
-class BsonValueResponseReader : public ResponseReader<Implementation> {
+class OpMsgReader : public BsonReader<Implementation> {
+protected:
+    typedef BsonReader<Implementation> Parent;
+
+    // What `ConsumeHdr` is reading.
+    enum class Phase : uint8_t {
+        kHeader,
+        kSectionKind,
+        kSequenceLen,
+        kSequenceId,
+        kChecksum
+    };
+
+    OpMsgHeader header_ = {};
+    Phase phase_ = Phase::kHeader;
+    int32_t doc_count_ = 0;
+    // Offsets (from the start of the message) of the end of the sections,
+    // of the start and of the end of the current document sequence.
+    int32_t msg_end_ = 0;
+    int32_t seq_start_ = 0;
+    int32_t seq_end_ = -1;
+    std::string seq_id_;
+    bool body_seen_ = false;  // The kind 0 section was read
+    // Input passed to the current call to `Consume`
+    const char *chunk_start_ = nullptr;
+
+    int32_t Offset(const char *s) const {
+        return Parent::bytes_seen_ + static_cast<int32_t>(s - chunk_start_);
+    }
+
+    const char *NextDocument(const char *s, const char *end);
+
+    const char *NextSection(const char *s, const char *end);
+
+    const char *StartDocument(const char *s, const char *end);
+
+    const char *Finish(const char *s, const char *end);
+
+public:
+    static constexpr typename Parent::State kInitialState = Parent::State::kHdr;
+
+    void StartChunk(const char *s) { chunk_start_ = s; }
+
+    // Read the header and the start of the sections
+    const char *ConsumeHdr(const char *s, const char *end);
+
+    // CRTP specializable
+    const char *DocumentStart(const char *s, const char *end) {
+        return Parent::ConsumeValueInt32(s, end);
+    }
+
+    const char *DocumentDone(const char *s, const char *end) {
+        return NextDocument(s, end);
+    }
+
+    void EmitDocumentDone() {}
+
+    void EmitDocumentStart(int32_t) {}
+
+    void EmitSequenceStart(const std::string &) {}
+
+    void EmitSequenceDone() {}
+
+    void EmitStop() {}
+
+    void EmitStart(const OpMsgHeader &) {}
+
+    void Clear();
+
+    const OpMsgHeader &Header() const { return header_; }
+
+    /**
+     * Identifier of the document sequence being read (empty in the body).
+     */
+    const std::string &SequenceId() const { return seq_id_; }
+};
+
+//------------------------------------------------------------------------------
+/**
+ * This is a specialised response reader that read in `BsonValue`'s
+ *
+ * Documents that are entirely contained in the input passed to `Consume` are
+ * handed out as views on that input; only the documents that straddle two
+ * calls to `Consume` get copied. In both cases the value passed to
+ * `EmitBsonValue` is only valid for the duration of the call.
+ */
+template <typename Implementation,
+          typename Reader = ResponseReader<Implementation>>
+class BsonValueResponseReader : public Reader {
 protected:
     std::string buf_;
-    typedef ResponseReader<Implementation> Parent;
+    typedef Reader Parent;
 
 public:
     const char *DocumentStart(const char *s, const char *end);
@@ -205,6 +690,13 @@ public:
     const char *ConsumeUsr2(const char *s, const char *end);
 };
 
+/**
+ * Read the documents of an OP_MSG in `BsonValue`'s
+ */
+template <typename Implementation>
+using BsonValueMsgReader =
+        BsonValueResponseReader<Implementation, OpMsgReader<Implementation>>;
+
 //------------------------------------------------------------------------------
 // $cmd responses...
 //------------------------------------------------------------------------------
@@ -229,11 +721,9 @@ struct OperationResponse {
 };
 
 /**
- * This class reads the result of operations (in the new mongo protocol)
- *
- * The result is parsed in an `OperationResponse`
+ * The fields of the replies read by `OpResponseDecoder`
  */
-class OpResponseParser : public ResponseReader<OpResponseParser> {
+struct OpResponseFields {
     enum class BaseField : uint8_t {
         kField,
         kOk,
@@ -242,7 +732,7 @@ class OpResponseParser : public ResponseReader<OpResponseParser> {
         kUnknown,
         kWriteConcernErrors,
         kWriteErrors
-    } base_field_ = BaseField::kUnknown;
+    };
 
     enum class ErrorField : uint8_t {
         kField,
@@ -251,27 +741,42 @@ class OpResponseParser : public ResponseReader<OpResponseParser> {
         kErrInfo,
         kCode,
         kUnknown
-    } error_field_ = ErrorField::kUnknown;
-
-    uint8_t depth_ = 0;
+    };
 
     static constexpr StringMatcherAction<BaseField> sma_[] = {
-            {"ok", BaseField::kOk},
-            {"nModified", BaseField::kNModified},
             {"n", BaseField::kN},
-            {"writeErrors", BaseField::kWriteErrors},
+            {"nModified", BaseField::kNModified},
+            {"ok", BaseField::kOk},
             {"writeConcernErrors", BaseField::kWriteConcernErrors},
+            {"writeErrors", BaseField::kWriteErrors},
             {nullptr, BaseField::kUnknown}};
 
     static constexpr StringMatcherAction<ErrorField> ema_[] = {
-            {"index", ErrorField::kIndex},
-            {"errmsg", ErrorField::kErrMsg},
+            {"code", ErrorField::kCode},
             {"errInfo", ErrorField::kErrInfo},
-            {"kcode", ErrorField::kCode},
+            {"errmsg", ErrorField::kErrMsg},
+            {"index", ErrorField::kIndex},
             {nullptr, ErrorField::kUnknown}};
+};
 
-    typedef StringMatcher<BaseField, sma_> BaseMatcher;
-    typedef StringMatcher<ErrorField, ema_> ErrorMatcher;
+/**
+ * A mixin that reads the result of operations (in the new mongo protocol)
+ *
+ * The result is parsed in an `OperationResponse`. `Parent` is the reader for
+ * the framing of the reply (`ResponseReader` or `OpMsgReader`).
+ */
+template <typename Parent>
+class OpResponseDecoder : public Parent {
+    typedef OpResponseFields::BaseField BaseField;
+    typedef OpResponseFields::ErrorField ErrorField;
+
+    BaseField base_field_ = BaseField::kUnknown;
+    ErrorField error_field_ = ErrorField::kUnknown;
+
+    uint8_t depth_ = 0;
+
+    typedef TrieMatcher<BaseField, OpResponseFields::sma_> BaseMatcher;
+    typedef TrieMatcher<ErrorField, OpResponseFields::ema_> ErrorMatcher;
 
     union {
         BaseMatcher base_matcher_;
@@ -281,7 +786,7 @@ class OpResponseParser : public ResponseReader<OpResponseParser> {
     OperationResponse res_;
 
 public:
-    OpResponseParser() {}
+    OpResponseDecoder() {}
 
     void EmitFieldName(const char *data, const int32_t len);
 
@@ -313,18 +818,27 @@ public:
 
     void EmitObjectId(const char *) {}
 
-    void EmitStart(const ResponseHeader &) {}
-
-    void EmitStop() {}
-
     const OperationResponse &Result() const { return res_; }
 };
 
+/**
+ * Reads the result of operations sent with the `Fill*Op` functions.
+ */
+class OpResponseParser
+        : public OpResponseDecoder<ResponseReader<OpResponseParser>> {};
+
+/**
+ * Reads the result of operations sent with the `FillMsg*Op` functions.
+ */
+class MsgResponseParser
+        : public OpResponseDecoder<OpMsgReader<MsgResponseParser>> {};
+
 //------------------------------------------------------------------------------
 // Implementation
 
 void AppendCommandHeader(BsonWriter *w, int32_t requestid, const char *db);
-void AppendWriteConcern(BsonWriter *w);
+void AppendQueryHeader(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, const QueryOptions &opts);
 
 // Inner function...
 template <int32_t cnt = 0>
@@ -344,40 +858,165 @@ bool InsertDocuments(BsonWriter *w, const Arg &v, const Rest &... rest) {
     return true;
 }
 
-template <typename... Values>
-bool FillInsertOp(BsonWriter *w, int32_t requestid, const char *db,
-                  const char *collection, const Values &... values) {
-    AppendCommandHeader(w, requestid, db);
+// Where the statements of a command go: in an array of the command for
+// queries on `db.$cmd`, in a document sequence for OP_MSG.
+struct ArrayStatements {
+    static void Open(BsonWriter *w, int32_t cnt) { w->PushDocument(cnt); }
+};
 
-    w->Document();
+struct SequenceStatements {
+    static void Open(BsonWriter *w, int32_t) { w->Document(); }
+};
+
+template <typename Layout, typename T>
+bool AppendInsertStatement(BsonWriter *w, int32_t cnt, const T &doc) {
+    Layout::Open(w, cnt);
+    if (!BsonWriteFields(w, doc)) {
+        return false;
+    }
+    w->Pop();
+    return true;
+}
+
+template <typename Layout, typename Select, typename Operation>
+bool AppendUpdateStatement(BsonWriter *w, int32_t cnt, const Select &qry,
+                           const Operation &op, bool upsert) {
+    Layout::Open(w, cnt);
     {
-        w->Element("insert", collection);
-        w->PushArray("documents");
+        w->PushDocument("q");
         {
-            if (!InsertDocuments(w, values...)) {
+            if (!BsonWriteFields<Select>(w, qry)) {
                 return false;
             }
         }
         w->Pop();
 
-        AppendWriteConcern(w);
+        w->PushDocument("u");
+        {
+            if (!BsonWriteFields<Operation>(w, op)) {
+                return false;
+            }
+        }
+        w->Pop();
+
+        if (upsert) {
+            w->Element("upsert", true);
+        }
     }
     w->Pop();
+    return true;
+}
 
-    w->FlushLen();
+template <typename Layout, typename T>
+bool AppendDeleteStatement(BsonWriter *w, int32_t cnt, const T &qry) {
+    Layout::Open(w, cnt);
+    {
+        w->PushDocument("q");
+        {
+            if (!BsonWriteFields<T>(w, qry)) {
+                return false;
+            }
+        }
+        w->Pop();
+
+        w->Element("limit", 0);
+    }
+    w->Pop();
     return true;
 }
 
-/**
- * The maximum number of documents allowed in one write command.
- *
- *  Can be obtained from the db via: `db.isMaster().maxWriteBatchSize`
- */
-constexpr int32_t kMaxWriteBatchSize = 1000;
+// The statements of the range functions
+struct InsertStatements {
+    template <typename Layout, typename T>
+    static bool Append(BsonWriter *w, int32_t cnt, const T &doc) {
+        return AppendInsertStatement<Layout>(w, cnt, doc);
+    }
+};
 
-template <typename It>
-bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
-                       const char *collection, It *curs, const It end) {
+struct UpdateStatements {
+    template <typename Layout, typename Stmt>
+    static bool Append(BsonWriter *w, int32_t cnt, const Stmt &stmt) {
+        return AppendUpdateStatement<Layout>(w, cnt, stmt.q, stmt.u,
+                                             stmt.upsert);
+    }
+};
+
+struct DeleteStatements {
+    template <typename Layout, typename T>
+    static bool Append(BsonWriter *w, int32_t cnt, const T &qry) {
+        return AppendDeleteStatement<Layout>(w, cnt, qry);
+    }
+};
+
+// Append the statements in `[*curs, end)` until we hit one of the `limits`;
+// `reserve` is the number of bytes that will be written after the
+// statements. The statement that doesn't fit is rolled back.
+template <typename Stmts, typename Layout, typename It>
+bool AppendStatementRange(BsonWriter *w, It *curs, const It end,
+                          const BatchLimits &limits, int32_t reserve) {
+    int32_t cnt = 0;
+    while (*curs != end && cnt < limits.max_count) {
+        const BsonWriter::Mark mark = w->GetMark();
+        // <typename It::value_type>
+        if (!Stmts::template Append<Layout>(w, cnt, *(*curs))) {
+            return false;
+        }
+        if (w->MessageLen() > limits.max_bytes - reserve) {
+            w->Rewind(mark);
+            return cnt > 0;
+        }
+        ++(*curs), ++cnt;
+    }
+    return true;
+}
+
+// Size of the end of a command on `db.$cmd` (the end of the statements
+// array, the write concern and the end of the command)
+template <typename Concern>
+int32_t CommandTrailerSize() {
+    static const int32_t res = [] {
+        BsonWriter w;
+        w.Document();
+        Concern::Append(&w);
+        w.Pop();
+        // Drop the length and the null byte of the scratch document, add the
+        // end of the statements array and of the command.
+        return w.len() - 5 + 2;
+    }();
+    return res;
+}
+
+// Write a whole command on `db.$cmd` with a range of statements
+template <typename Concern, typename Stmts, typename It>
+bool FillCommandRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                        const char *cmd, const char *array_key,
+                        const char *collection, It *curs, const It end,
+                        const BatchLimits &limits) {
+    AppendCommandHeader(w, requestid, db);
+
+    w->Document();
+    {
+        w->Element(cmd, collection);
+        w->PushArray(array_key);
+        {
+            if (!AppendStatementRange<Stmts, ArrayStatements>(
+                        w, curs, end, limits, CommandTrailerSize<Concern>())) {
+                return false;
+            }
+        }
+        w->Pop();
+
+        Concern::Append(w);
+    }
+    w->Pop();
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename... Values>
+bool FillInsertOp(BsonWriter *w, int32_t requestid, const char *db,
+                  const char *collection, const Values &... values) {
     AppendCommandHeader(w, requestid, db);
 
     w->Document();
@@ -385,20 +1024,13 @@ bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
         w->Element("insert", collection);
         w->PushArray("documents");
         {
-            int32_t cnt = 0;
-            while (*curs != end && cnt < kMaxWriteBatchSize) {
-                w->PushDocument(cnt);
-                // <typename It::value_type>
-                if (!BsonWriteFields(w, *(*curs))) {
-                    return false;
-                };
-                w->Pop();
-                ++(*curs), ++cnt;
+            if (!InsertDocuments(w, values...)) {
+                return false;
             }
         }
         w->Pop();
 
-        AppendWriteConcern(w);
+        Concern::Append(w);
     }
     w->Pop();
 
@@ -406,21 +1038,46 @@ bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
     return true;
 }
 
+template <typename Concern, typename It>
+bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, It *curs, const It end,
+                       const BatchLimits &limits) {
+    return FillCommandRangeOp<Concern, InsertStatements>(
+            w, requestid, db, "insert", "documents", collection, curs, end,
+            limits);
+}
+
+template <typename It>
+bool FillKillCursorsOp(BsonWriter *w, int32_t requestid, It *curs,
+                       const It end, int32_t max_count) {
+    if (*curs == end || max_count <= 0) {
+        return false;
+    }
+    w->AppendRaw(MsgHeader(requestid, MongoOpcode::kKillCursors));
+    w->AppendRaw<int32_t>(0);  // Zero
+    const int32_t num_offset = w->len();
+    w->AppendRaw<int32_t>(0);  // Num cursor
+    int32_t cnt = 0;
+    for (; *curs != end && cnt < max_count; ++(*curs), ++cnt) {
+        w->AppendRaw<int64_t>(*(*curs));
+    }
+    w->PatchRaw(num_offset, cnt);
+    w->FlushLen();
+    return true;
+}
+
 template <typename T>
 bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
                  const char *collection, const T &qry, int32_t limit) {
-    w->AppendRaw(MsgHeader(requestid, MongoOpcode::kQuery));
-    w->AppendRaw<int32_t>(0);  // flags
-    w->AppendRawBytes(db, static_cast<int32_t>(strlen(db)));
-    w->AppendRawBytes(".", 1);
-    w->AppendCstring(collection);
-
-    if (limit > 0) {
-        limit = -limit;
-    }
+    const QueryOptions opts = {0, 0, limit > 0 ? -limit : limit};
+    return FillQueryOp(w, requestid, db, collection, qry, opts);
+}
 
-    w->AppendRaw<int32_t>(0);      // Start
-    w->AppendRaw<int32_t>(limit);  // Number to return
+template <typename T>
+bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
+                 const char *collection, const T &qry,
+                 const QueryOptions &opts) {
+    AppendQueryHeader(w, requestid, db, collection, opts);
 
     w->Document();
     if (!BsonWriteFields<T>(w, qry)) {
@@ -436,18 +1093,15 @@ template <typename T, typename FldSelector>
 bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
                  const char *collection, const T &qry, const FldSelector &sel,
                  int32_t limit) {
-    w->AppendRaw(MsgHeader(requestid, MongoOpcode::kQuery));
-    w->AppendRaw<int32_t>(0);  // flags
-    w->AppendRawBytes(db, static_cast<int32_t>(strlen(db)));
-    w->AppendRawBytes(".", 1);
-    w->AppendCstring(collection);
-
-    if (limit > 0) {
-        limit = -limit;
-    }
+    const QueryOptions opts = {0, 0, limit > 0 ? -limit : limit};
+    return FillQueryOp(w, requestid, db, collection, qry, sel, opts);
+}
 
-    w->AppendRaw<int32_t>(0);      // Start
-    w->AppendRaw<int32_t>(limit);  // Number to return
+template <typename T, typename FldSelector>
+bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
+                 const char *collection, const T &qry, const FldSelector &sel,
+                 const QueryOptions &opts) {
+    AppendQueryHeader(w, requestid, db, collection, opts);
 
     w->Document();
     if (!BsonWriteFields<T>(w, qry)) {
@@ -465,7 +1119,7 @@ bool FillQueryOp(BsonWriter *w, int32_t requestid, const char *db,
     return true;
 }
 
-template <typename Select, typename Operation>
+template <typename Concern, typename Select, typename Operation>
 bool FillUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
                   const char *collection, const Select &qry,
                   const Operation &op, bool upsert) {
@@ -477,33 +1131,14 @@ bool FillUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
 
         w->PushArray("updates");
         {
-            w->PushDocument(0);
-            {
-                w->PushDocument("q");
-                {
-                    if (!BsonWriteFields<Select>(w, qry)) {
-                        return false;
-                    }
-                }
-                w->Pop();
-
-                w->PushDocument("u");
-                {
-                    if (!BsonWriteFields<Operation>(w, op)) {
-                        return false;
-                    }
-                }
-                w->Pop();
-
-                if (upsert) {
-                    w->Element("upsert", true);
-                }
+            if (!AppendUpdateStatement<ArrayStatements>(w, 0, qry, op,
+                                                        upsert)) {
+                return false;
             }
-            w->Pop();
         }
         w->Pop();
 
-        AppendWriteConcern(w);
+        Concern::Append(w);
     }
     w->Pop();
 
@@ -511,7 +1146,16 @@ bool FillUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
     return true;
 }
 
-template <typename T>
+template <typename Concern, typename It>
+bool FillUpdateRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, It *curs, const It end,
+                       const BatchLimits &limits) {
+    return FillCommandRangeOp<Concern, UpdateStatements>(
+            w, requestid, db, "update", "updates", collection, curs, end,
+            limits);
+}
+
+template <typename Concern, typename T>
 bool FillDeleteOp(BsonWriter *w, int32_t requestid, const char *db,
                   const char *collection, const T &qry) {
     AppendCommandHeader(w, requestid, db);
@@ -522,30 +1166,398 @@ bool FillDeleteOp(BsonWriter *w, int32_t requestid, const char *db,
 
         w->PushArray("deletes");
         {
-            w->PushDocument(0);
-            {
-                w->PushDocument("q");
-                {
-                    if (!BsonWriteFields<T>(w, qry)) {
-                        return false;
-                    }
-                }
-                w->Pop();
-
-                w->Element("limit", 0);
+            if (!AppendDeleteStatement<ArrayStatements>(w, 0, qry)) {
+                return false;
             }
-            w->Pop();
         }
         w->Pop();
 
-        AppendWriteConcern(w);
+        Concern::Append(w);
+    }
+    w->Pop();
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename It>
+bool FillDeleteRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                       const char *collection, It *curs, const It end,
+                       const BatchLimits &limits) {
+    return FillCommandRangeOp<Concern, DeleteStatements>(
+            w, requestid, db, "delete", "deletes", collection, curs, end,
+            limits);
+}
+
+template <typename... Values>
+bool PreparedInsert::Fill(BsonWriter *w, int32_t requestid,
+                          const Values &... values) const {
+    Start(w, requestid);
+    if (!InsertDocuments(w, values...)) {
+        return false;
+    }
+    Finish(w);
+    return true;
+}
+
+template <typename It>
+bool PreparedInsert::FillRange(BsonWriter *w, int32_t requestid, It *curs,
+                               const It end,
+                               const BatchLimits &limits) const {
+    Start(w, requestid);
+    if (!AppendStatementRange<InsertStatements, ArrayStatements>(
+                w, curs, end, limits, TrailerSize())) {
+        return false;
+    }
+    Finish(w);
+    return true;
+}
+
+template <typename Select, typename Operation>
+bool PreparedUpdate::Fill(BsonWriter *w, int32_t requestid, const Select &qry,
+                          const Operation &op, bool upsert) const {
+    Start(w, requestid);
+    if (!AppendUpdateStatement<ArrayStatements>(w, 0, qry, op, upsert)) {
+        return false;
+    }
+    Finish(w);
+    return true;
+}
+
+template <typename It>
+bool PreparedUpdate::FillRange(BsonWriter *w, int32_t requestid, It *curs,
+                               const It end,
+                               const BatchLimits &limits) const {
+    Start(w, requestid);
+    if (!AppendStatementRange<UpdateStatements, ArrayStatements>(
+                w, curs, end, limits, TrailerSize())) {
+        return false;
+    }
+    Finish(w);
+    return true;
+}
+
+template <typename T>
+bool PreparedDelete::Fill(BsonWriter *w, int32_t requestid,
+                          const T &qry) const {
+    Start(w, requestid);
+    if (!AppendDeleteStatement<ArrayStatements>(w, 0, qry)) {
+        return false;
+    }
+    Finish(w);
+    return true;
+}
+
+template <typename It>
+bool PreparedDelete::FillRange(BsonWriter *w, int32_t requestid, It *curs,
+                               const It end,
+                               const BatchLimits &limits) const {
+    Start(w, requestid);
+    if (!AppendStatementRange<DeleteStatements, ArrayStatements>(
+                w, curs, end, limits, TrailerSize())) {
+        return false;
     }
+    Finish(w);
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// OP_MSG
+
+void AppendMsgHeader(BsonWriter *w, int32_t requestid, uint32_t flags = 0);
+
+// Start the body of a command (the "kind 0" section)
+void StartMsgCommand(BsonWriter *w, const char *cmd, const char *collection);
+
+// Close the body of the command started with `StartMsgCommand`
+template <typename Concern>
+void EndMsgCommand(BsonWriter *w, const char *db) {
+    Concern::Append(w);
+    w->Element("$db", db);
     w->Pop();
+}
+
+// Unacknowledged writes don't get any reply
+template <typename Concern>
+void AppendMsgCommandHeader(BsonWriter *w, int32_t requestid) {
+    AppendMsgHeader(w, requestid,
+                    Concern::kExpectsReply
+                            ? 0u
+                            : static_cast<uint32_t>(kMoreToCome));
+}
+
+// Start a document sequence (a "kind 1" section) and return the offset of its
+// length.
+int32_t StartDocumentSequence(BsonWriter *w, const char *identifier);
+
+void EndDocumentSequence(BsonWriter *w, int32_t start);
+
+inline bool SequenceDocuments(BsonWriter *) { return true; }
+
+template <typename Arg, typename... Rest>
+bool SequenceDocuments(BsonWriter *w, const Arg &v, const Rest &... rest) {
+    if (!AppendInsertStatement<SequenceStatements>(w, 0, v)) {
+        return false;
+    }
+    return SequenceDocuments(w, rest...);
+}
+
+// Write a whole OP_MSG command with a range of statements
+template <typename Concern, typename Stmts, typename It>
+bool FillMsgRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                    const char *cmd, const char *seq_id,
+                    const char *collection, It *curs, const It end,
+                    const BatchLimits &limits) {
+    AppendMsgCommandHeader<Concern>(w, requestid);
+    StartMsgCommand(w, cmd, collection);
+    EndMsgCommand<Concern>(w, db);
+
+    const int32_t seq = StartDocumentSequence(w, seq_id);
+    if (!AppendStatementRange<Stmts, SequenceStatements>(w, curs, end, limits,
+                                                         0)) {
+        return false;
+    }
+    EndDocumentSequence(w, seq);
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename... Values>
+bool FillMsgInsertOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const Values &... values) {
+    AppendMsgCommandHeader<Concern>(w, requestid);
+    StartMsgCommand(w, "insert", collection);
+    EndMsgCommand<Concern>(w, db);
+
+    const int32_t seq = StartDocumentSequence(w, "documents");
+    if (!SequenceDocuments(w, values...)) {
+        return false;
+    }
+    EndDocumentSequence(w, seq);
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename It>
+bool FillMsgInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *curs, const It end,
+                          const BatchLimits &limits) {
+    return FillMsgRangeOp<Concern, InsertStatements>(
+            w, requestid, db, "insert", "documents", collection, curs, end,
+            limits);
+}
+
+template <typename Concern, typename Select, typename Operation>
+bool FillMsgUpdateOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const Select &qry,
+                     const Operation &op, bool upsert) {
+    AppendMsgCommandHeader<Concern>(w, requestid);
+    StartMsgCommand(w, "update", collection);
+    EndMsgCommand<Concern>(w, db);
+
+    const int32_t seq = StartDocumentSequence(w, "updates");
+    if (!AppendUpdateStatement<SequenceStatements>(w, 0, qry, op, upsert)) {
+        return false;
+    }
+    EndDocumentSequence(w, seq);
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename It>
+bool FillMsgUpdateRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *curs, const It end,
+                          const BatchLimits &limits) {
+    return FillMsgRangeOp<Concern, UpdateStatements>(
+            w, requestid, db, "update", "updates", collection, curs, end,
+            limits);
+}
+
+template <typename Concern, typename T>
+bool FillMsgDeleteOp(BsonWriter *w, int32_t requestid, const char *db,
+                     const char *collection, const T &qry) {
+    AppendMsgCommandHeader<Concern>(w, requestid);
+    StartMsgCommand(w, "delete", collection);
+    EndMsgCommand<Concern>(w, db);
+
+    const int32_t seq = StartDocumentSequence(w, "deletes");
+    if (!AppendDeleteStatement<SequenceStatements>(w, 0, qry)) {
+        return false;
+    }
+    EndDocumentSequence(w, seq);
 
     w->FlushLen();
     return true;
 }
 
+template <typename Concern, typename It>
+bool FillMsgDeleteRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                          const char *collection, It *curs, const It end,
+                          const BatchLimits &limits) {
+    return FillMsgRangeOp<Concern, DeleteStatements>(
+            w, requestid, db, "delete", "deletes", collection, curs, end,
+            limits);
+}
+
+template <typename Implementation>
+void OpMsgReader<Implementation>::Clear() {
+    Parent::Clear();
+    header_ = {};
+    phase_ = Phase::kHeader;
+    doc_count_ = 0;
+    msg_end_ = 0;
+    seq_start_ = 0;
+    seq_end_ = -1;
+    seq_id_.clear();
+    body_seen_ = false;
+}
+
+template <typename Implementation>
+const char *OpMsgReader<Implementation>::NextDocument(const char *s,
+                                                      const char *end) {
+    Parent::impl().EmitDocumentDone();
+    return NextSection(s, end);
+}
+
+// Figure out what comes next: another document of the current sequence, a new
+// section or the end of the message.
+template <typename Implementation>
+const char *OpMsgReader<Implementation>::NextSection(const char *s,
+                                                     const char *end) {
+    const int32_t pos = Offset(s);
+    if (seq_end_ != -1) {
+        if (pos < seq_end_) {
+            return StartDocument(s, end);
+        }
+        if (pos > seq_end_) {
+            return Parent::Error("Document overflows its sequence");
+        }
+        seq_end_ = -1;
+        Parent::impl().EmitSequenceDone();
+        seq_id_.clear();
+    }
+    if (pos < msg_end_) {
+        phase_ = Phase::kSectionKind;
+        return ConsumeHdr(s, end);
+    }
+    if (pos > msg_end_) {
+        return Parent::Error("Section overflows the message");
+    }
+    if ((header_.flag_bits & kChecksumPresent) != 0) {
+        phase_ = Phase::kChecksum;
+        return ConsumeHdr(s, end);
+    }
+    return Finish(s, end);
+}
+
+template <typename Implementation>
+const char *OpMsgReader<Implementation>::StartDocument(const char *s,
+                                                       const char *end) {
+    Parent::impl().EmitDocumentStart(doc_count_);
+    ++doc_count_;
+    this->typ_ = BsonTag::kDocument;
+    return Parent::impl().DocumentStart(s, end);
+}
+
+template <typename Implementation>
+const char *OpMsgReader<Implementation>::Finish(const char *s,
+                                                const char *end) {
+    Parent::impl().EmitStop();
+    return Parent::DocumentDone(s, end);
+}
+
+template <typename Implementation>
+const char *OpMsgReader<Implementation>::ConsumeHdr(const char *s,
+                                                    const char *end) {
+    bool done;
+    switch (phase_) {
+        case Phase::kHeader:
+            s = Parent::ReadBytes(&done, s, end, sizeof(OpMsgHeader),
+                                  reinterpret_cast<char *>(&header_),
+                                  Parent::State::kHdr);
+            if (!done) {
+                return s;
+            }
+            if (header_.op_code != static_cast<int32_t>(MongoOpcode::kOpMsg)) {
+                return Parent::Error("Not an OP_MSG");
+            }
+            msg_end_ = header_.message_length;
+            if ((header_.flag_bits & kChecksumPresent) != 0) {
+                msg_end_ -= static_cast<int32_t>(sizeof(uint32_t));
+            }
+            if (msg_end_ <= static_cast<int32_t>(sizeof(OpMsgHeader))) {
+                return Parent::Error("Message too small");
+            }
+            Parent::impl().EmitStart(header_);
+            return NextSection(s, end);
+        case Phase::kSectionKind:
+            s = Parent::ReadBytes(&done, s, end, 1, Parent::scratch_,
+                                  Parent::State::kHdr);
+            if (!done) {
+                return s;
+            }
+            if (Parent::scratch_[0] == 0) {
+                if (body_seen_) {
+                    return Parent::Error("Multiple body sections");
+                }
+                body_seen_ = true;
+                return StartDocument(s, end);
+            }
+            if (Parent::scratch_[0] != 1) {
+                return Parent::Error("Unknown section kind");
+            }
+            seq_start_ = Offset(s);
+            phase_ = Phase::kSequenceLen;
+            return ConsumeHdr(s, end);
+        case Phase::kSequenceLen: {
+            s = Parent::ReadBytes(&done, s, end, sizeof(int32_t),
+                                  Parent::scratch_, Parent::State::kHdr);
+            if (!done) {
+                return s;
+            }
+            int32_t len;
+            std::memcpy(&len, Parent::scratch_, sizeof(int32_t));
+            if (len < 5) {
+                return Parent::Error("Document sequence too small");
+            }
+            if (len > msg_end_ - seq_start_) {
+                return Parent::Error("Section overflows the message");
+            }
+            seq_end_ = seq_start_ + len;
+            phase_ = Phase::kSequenceId;
+            return ConsumeHdr(s, end);
+        }
+        case Phase::kSequenceId: {
+            const char *id_end = FindNul(s, end);
+            seq_id_.append(s, static_cast<size_t>(id_end - s));
+            if (static_cast<int32_t>(seq_id_.size()) >=
+                seq_end_ - seq_start_ - static_cast<int32_t>(sizeof(int32_t))) {
+                return Parent::Error("Document sequence identifier too long");
+            }
+            if (id_end == end) {
+                Parent::state_ = Parent::State::kHdr;
+                return end;
+            }
+            Parent::impl().EmitSequenceStart(seq_id_);
+            return NextSection(id_end + 1, end);
+        }
+        case Phase::kChecksum:
+            s = Parent::ReadBytes(&done, s, end, sizeof(uint32_t),
+                                  Parent::scratch_, Parent::State::kHdr);
+            if (!done) {
+                return s;
+            }
+            return Finish(s, end);
+    }
+    return Parent::Error("Invalid state");
+}
+
+//------------------------------------------------------------------------------
+// Readers
+
 template <typename Implementation>
 const char *ResponseReader<Implementation>::NextDocument(const char *s,
                                                          const char *end) {
@@ -587,10 +1599,22 @@ ResponseReader<Implementation>::ResponseReader(const ResponseHeader &header)
 template <typename Implementation>
 ResponseReader<Implementation>::ResponseReader() {}
 
-template <typename Implementation>
-const char *BsonValueResponseReader<Implementation>::DocumentStart(
+template <typename Implementation, typename Reader>
+const char *BsonValueResponseReader<Implementation, Reader>::DocumentStart(
         const char *s, const char *end) {
     assert(Parent::partial_ == 0);
+    if (end - s >= static_cast<ptrdiff_t>(sizeof(int32_t))) {
+        int32_t len;
+        std::memcpy(&len, s, sizeof(int32_t));
+        if (len >= 5 && end - s >= len) {
+            const BsonValue bv(s, len);
+            if (bv.Empty()) {
+                return Parent::Error("Document isn't null terminated");
+            }
+            Parent::impl().EmitBsonValue(bv);
+            return Parent::NextDocument(s + len, end);
+        }
+    }
     return ConsumeUsr1(s, end);
 }
 
@@ -601,8 +1625,8 @@ void ResponseReader<Implementation>::Clear() {
     doc_count_ = 0;
 }
 
-template <typename Implementation>
-const char *BsonValueResponseReader<Implementation>::ConsumeUsr1(
+template <typename Implementation, typename Reader>
+const char *BsonValueResponseReader<Implementation, Reader>::ConsumeUsr1(
         const char *s, const char *end) {
     bool done;
     s = Parent::ReadBytes(&done, s, end, sizeof(int32_t), Parent::scratch_,
@@ -622,8 +1646,8 @@ const char *BsonValueResponseReader<Implementation>::ConsumeUsr1(
     return ConsumeUsr2(s, end);
 }
 
-template <typename Implementation>
-const char *BsonValueResponseReader<Implementation>::ConsumeUsr2(
+template <typename Implementation, typename Reader>
+const char *BsonValueResponseReader<Implementation, Reader>::ConsumeUsr2(
         const char *s, const char *end) {
     assert(end >= s);
     int32_t inlen = static_cast<int32_t>(end - s);
@@ -634,12 +1658,139 @@ const char *BsonValueResponseReader<Implementation>::ConsumeUsr2(
         return end;
     }
     buf_.append(s, Parent::partial_);
-    assert(s[Parent::partial_ - 1] == '\000');
-    const BsonValue bv(buf_.data(), buf_.length());
+    const BsonValue bv(buf_.data(), static_cast<int32_t>(buf_.length()));
+    if (bv.Empty()) {
+        return Parent::Error("Document isn't null terminated");
+    }
     Parent::impl().EmitBsonValue(bv);
     s += Parent::partial_;
     Parent::partial_ = 0;
     return Parent::NextDocument(s, end);
 }
 
+
+template <typename Parent>
+void OpResponseDecoder<Parent>::EmitFieldName(const char *data,
+                                              const int32_t len) {
+    assert(len >= 0);
+    if (depth_ == 1) {
+        if (base_field_ != BaseField::kField) {
+            base_field_ = BaseField::kField;
+            new (&base_matcher_) BaseMatcher();
+        }
+        for (int32_t i = 0; i < len; i++) {
+            base_matcher_.AddChar(data[i]);
+        }
+        if (len == 0) {
+            base_matcher_.AddChar('\000');
+            base_field_ = base_matcher_.GetResult();
+            base_matcher_.~BaseMatcher();
+            if (base_field_ == BaseField::kUnknown) {
+                Parent::SkipValue();
+            }
+        }
+    } else if (IsError()) {
+        if (error_field_ != ErrorField::kField) {
+            error_field_ = ErrorField::kField;
+            new (&error_matcher_) ErrorMatcher();
+        }
+
+        for (int32_t i = 0; i < len; i++) {
+            error_matcher_.AddChar(data[i]);
+        }
+        if (len == 0) {
+            error_matcher_.AddChar('\000');
+            error_field_ = error_matcher_.GetResult();
+            error_matcher_.~ErrorMatcher();
+            if (error_field_ == ErrorField::kUnknown) {
+                Parent::SkipValue();
+            }
+        }
+    }
+}
+
+template <typename Parent>
+void OpResponseDecoder<Parent>::EmitOpenDoc() {
+    ++depth_;
+    if (IsError()) {
+        res_.errors.push_back(CmdError{});
+        if (base_field_ == BaseField::kWriteConcernErrors) {
+            res_.errors.back().type = CmdError::Type::WriteConcernError;
+        }
+    }
+}
+
+template <typename Parent>
+void OpResponseDecoder<Parent>::EmitInt32(int32_t i) {
+    if (depth_ == 1) {
+        switch (base_field_) {
+            case BaseField::kField:
+            case BaseField::kWriteConcernErrors:
+            case BaseField::kWriteErrors:
+            case BaseField::kUnknown:
+                return;
+            case BaseField::kOk:
+                res_.ok = i;
+                break;
+            case BaseField::kN:
+                res_.n = i;
+                break;
+            case BaseField::kNModified:
+                res_.nModified = i;
+                break;
+        }
+    } else if (IsError()) {
+        switch (error_field_) {
+            case ErrorField::kCode:
+                res_.errors.back().code = i;
+                break;
+            case ErrorField::kIndex:
+                res_.errors.back().index = i;
+                break;
+            case ErrorField::kField:
+            case ErrorField::kUnknown:
+            case ErrorField::kErrMsg:
+            case ErrorField::kErrInfo:
+                break;
+        }
+    }
+}
+
+template <typename Parent>
+bool OpResponseDecoder<Parent>::IsError() const {
+    return (depth_ == 3 && (base_field_ == BaseField::kWriteErrors ||
+                            base_field_ == BaseField::kWriteConcernErrors));
+}
+
+template <typename Parent>
+void OpResponseDecoder<Parent>::EmitUtf8(const char *cnt, int32_t len) {
+    assert(len >= 0);
+    if (len == 0) {
+        return;
+    }
+    if (IsError()) {
+        switch (error_field_) {
+            case ErrorField::kErrMsg:
+                res_.errors.back().msg.append(cnt, static_cast<size_t>(len));
+                break;
+            case ErrorField::kErrInfo:
+                res_.errors.back().info.append(cnt, static_cast<size_t>(len));
+                break;
+            case ErrorField::kField:
+            case ErrorField::kUnknown:
+            case ErrorField::kCode:
+            case ErrorField::kIndex:
+                break;
+        }
+    }
+}
+
+template <typename Parent>
+void OpResponseDecoder<Parent>::EmitError(const char *msg) {
+    CmdError e = {};
+    e.msg = msg;
+    e.type = CmdError::Type::ParseError;
+    res_.errors.push_back(e);
+}
+
 }  // namespace okmongo
@@ -0,0 +1,245 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Keeping several requests in flight on one connection
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include "mongo.h"
+
+namespace okmongo {
+
+/**
+ * Routes the replies read from a connection to the readers of the requests
+ * they answer.
+ *
+ * Every request is registered with `Expect` along with the reader for its
+ * reply (any `ResponseReader` or `OpMsgReader`). `Consume` takes the raw
+ * stream of replies, reads the `MsgHeader` of each of them and hands the
+ * whole message, header included, to the reader registered under its
+ * `response_to`. Replies can come back in any order; replies nobody is
+ * waiting for are skipped.
+ *
+ * The readers aren't owned by the multiplexer: they must stay alive until
+ * their reply has been read or the request is `Cancel`'ed.
+ *
+ * Callbacks (CRTP):
+ *  - `EmitReplyDone(int32_t request_id)`: the reply to `request_id` has been
+ *    entirely read. The request isn't in flight anymore.
+ *  - `EmitUnexpectedReply(const MsgHeader &)`: a reply to a request that we
+ *    weren't waiting for (it is skipped).
+ *  - `EmitError(const char *)`: the stream is corrupted, `Consume` will not
+ *    read anything else.
+ *
+ * The readers registered with `Expect` are kept in an `std::unordered_map`.
+ * Implementations that already keep track of their requests can look them up
+ * in their own structures on top of that (CRTP):
+ *  - `bool TakeRequest(int32_t request_id, Request *res)`: find the reader of
+ *    `request_id` and stop waiting on it.
+ *  - `bool Expecting(int32_t request_id) const`
+ *  - `size_t NumExpected() const`
+ *
+ * > class Mux : public okmongo::ResponseMultiplexer<Mux> {};
+ * > const int32_t id = mux.NextRequestId();
+ * > okmongo::FillInsertOp(&w, id, "db", "coll", doc);
+ * > mux.Expect(id, &parser);
+ */
+template <typename Implementation>
+class ResponseMultiplexer {
+public:
+    /**
+     * Allocate an id for a new request.
+     *
+     * Ids are positive and never collide with a request still in flight.
+     */
+    int32_t NextRequestId();
+
+    /**
+     * Send the reply to `request_id` to `reader`.
+     */
+    template <typename Reader>
+    void Expect(int32_t request_id, Reader *reader);
+
+    /**
+     * Stop waiting on `request_id`, its reply will be skipped.
+     *
+     * This is also safe to call while its reply is being read.
+     */
+    void Cancel(int32_t request_id);
+
+    /**
+     * Number of requests waiting for a reply.
+     */
+    size_t InFlight() const { return impl().NumExpected(); }
+
+    /**
+     * Whether a reply is partially read.
+     */
+    bool InReply() const {
+        return hdr_len_ == static_cast<int32_t>(sizeof(MsgHeader));
+    }
+
+    /**
+     * Read replies out of `[s, s + len)`
+     *
+     * @return the number of bytes read or -1 if the stream is corrupted.
+     */
+    int32_t Consume(const char *s, int32_t len);
+
+    void EmitReplyDone(int32_t) {}
+
+    void EmitUnexpectedReply(const MsgHeader &) {}
+
+    void EmitError(const char *) {}
+
+protected:
+    // A type erased reader.
+    struct Request {
+        void *reader;
+        int32_t (*consume)(void *reader, const char *s, int32_t len);
+    };
+
+    template <typename Reader>
+    static int32_t ConsumeThunk(void *reader, const char *s, int32_t len) {
+        return static_cast<Reader *>(reader)->Consume(s, len);
+    }
+
+    Implementation &impl() { return *static_cast<Implementation *>(this); }
+
+    const Implementation &impl() const {
+        return *static_cast<const Implementation *>(this);
+    }
+
+    // CRTP specializable: the requests in flight
+    bool TakeRequest(int32_t request_id, Request *res);
+
+    bool Expecting(int32_t request_id) const {
+        return in_flight_.count(request_id) != 0;
+    }
+
+    size_t NumExpected() const { return in_flight_.size(); }
+
+    // Feed `len` bytes of the current reply to its reader (if there still is
+    // one)
+    void Forward(const char *s, int32_t len);
+
+    std::unordered_map<int32_t, Request> in_flight_;
+    int32_t next_id_ = 0;
+    bool failed_ = false;
+
+    // The reply being read
+    char hdr_[sizeof(MsgHeader)];
+    int32_t hdr_len_ = 0;
+    int32_t remaining_ = 0;
+    int32_t current_id_ = 0;
+    Request current_ = {nullptr, nullptr};
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename Implementation>
+int32_t ResponseMultiplexer<Implementation>::NextRequestId() {
+    do {
+        next_id_ = (next_id_ == INT32_MAX) ? 1 : next_id_ + 1;
+    } while (impl().Expecting(next_id_) ||
+             (InReply() && next_id_ == current_id_));
+    return next_id_;
+}
+
+template <typename Implementation>
+template <typename Reader>
+void ResponseMultiplexer<Implementation>::Expect(int32_t request_id,
+                                                 Reader *reader) {
+    in_flight_[request_id] = Request{reader, &ConsumeThunk<Reader>};
+}
+
+template <typename Implementation>
+bool ResponseMultiplexer<Implementation>::TakeRequest(int32_t request_id,
+                                                      Request *res) {
+    auto it = in_flight_.find(request_id);
+    if (it == in_flight_.end()) {
+        return false;
+    }
+    *res = it->second;
+    in_flight_.erase(it);
+    return true;
+}
+
+template <typename Implementation>
+void ResponseMultiplexer<Implementation>::Cancel(int32_t request_id) {
+    in_flight_.erase(request_id);
+    if (InReply() && request_id == current_id_) {
+        current_ = Request{nullptr, nullptr};
+    }
+}
+
+template <typename Implementation>
+void ResponseMultiplexer<Implementation>::Forward(const char *s,
+                                                  int32_t len) {
+    if (current_.reader == nullptr || len == 0) {
+        return;
+    }
+    // Readers stop once their message is done; anything they don't take is
+    // dropped so we stay in sync with the stream.
+    if (current_.consume(current_.reader, s, len) != len) {
+        current_.reader = nullptr;
+    }
+}
+
+template <typename Implementation>
+int32_t ResponseMultiplexer<Implementation>::Consume(const char *s,
+                                                     int32_t len) {
+    if (failed_) {
+        return -1;
+    }
+    const char *const start = s;
+    const char *const end = s + len;
+    while (s < end) {
+        if (hdr_len_ < static_cast<int32_t>(sizeof(MsgHeader))) {
+            const int32_t n = std::min(
+                    static_cast<int32_t>(sizeof(MsgHeader)) - hdr_len_,
+                    static_cast<int32_t>(end - s));
+            std::memcpy(hdr_ + hdr_len_, s, static_cast<size_t>(n));
+            hdr_len_ += n;
+            s += n;
+            if (hdr_len_ < static_cast<int32_t>(sizeof(MsgHeader))) {
+                break;
+            }
+            MsgHeader hdr;
+            std::memcpy(&hdr, hdr_, sizeof(MsgHeader));
+            if (hdr.message_length < static_cast<int32_t>(sizeof(MsgHeader))) {
+                failed_ = true;
+                impl().EmitError("Invalid message length");
+                return -1;
+            }
+            remaining_ = hdr.message_length -
+                         static_cast<int32_t>(sizeof(MsgHeader));
+            current_id_ = hdr.response_to;
+            if (!impl().TakeRequest(hdr.response_to, &current_)) {
+                current_ = Request{nullptr, nullptr};
+                impl().EmitUnexpectedReply(hdr);
+            } else {
+                Forward(hdr_, static_cast<int32_t>(sizeof(MsgHeader)));
+            }
+        }
+        const int32_t n = std::min(remaining_, static_cast<int32_t>(end - s));
+        Forward(s, n);
+        s += n;
+        remaining_ -= n;
+        if (remaining_ == 0) {
+            const bool expected = current_.consume != nullptr;
+            hdr_len_ = 0;
+            current_ = Request{nullptr, nullptr};
+            if (expected) {
+                impl().EmitReplyDone(current_id_);
+            }
+        }
+    }
+    return static_cast<int32_t>(s - start);
+}
+
+}  // namespace okmongo
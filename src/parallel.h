@@ -0,0 +1,216 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Splitting loops over worker threads
+ *
+ * Anything that uses this needs to link with `$(PTHREAD_LIBS)`.
+ */
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace okmongo {
+
+/**
+ * Number of threads to use when asked for 0 (the number of cores).
+ */
+inline int32_t DefaultThreads() {
+    const unsigned n = std::thread::hardware_concurrency();
+    return (n == 0) ? 1 : static_cast<int32_t>(n);
+}
+
+/**
+ * Call `f(worker, begin, end)` on ranges covering `[0, n)`, from `threads`
+ * threads (the caller is one of them; 0 means `DefaultThreads()`).
+ *
+ * The ranges are at most `grain` long and handed out on demand: a worker
+ * that got a slow range doesn't hold the others back. `worker` is in
+ * `[0, threads)` and can be used to index per thread state. Returns once
+ * every range has been processed.
+ */
+template <typename F>
+void ParallelFor(size_t n, size_t grain, int32_t threads, F f) {
+    if (threads <= 0) {
+        threads = DefaultThreads();
+    }
+    grain = std::max<size_t>(grain, 1);
+    const size_t num_ranges = (n + grain - 1) / grain;
+    threads = static_cast<int32_t>(
+            std::min<size_t>(static_cast<size_t>(threads), num_ranges));
+    if (threads <= 1) {
+        for (size_t start = 0; start < n; start += grain) {
+            f(static_cast<int32_t>(0), start, std::min(n, start + grain));
+        }
+        return;
+    }
+    std::atomic<size_t> next{0};
+    const auto work = [&next, &f, n, grain](int32_t worker) {
+        for (;;) {
+            const size_t start = next.fetch_add(grain);
+            if (start >= n) {
+                return;
+            }
+            f(worker, start, std::min(n, start + grain));
+        }
+    };
+    std::vector<std::thread> workers;
+    workers.reserve(static_cast<size_t>(threads - 1));
+    for (int32_t i = 1; i < threads; ++i) {
+        workers.emplace_back(work, i);
+    }
+    work(0);
+    for (std::thread &t : workers) {
+        t.join();
+    }
+}
+
+/**
+ * Threads kept around to run `ParallelFor` over and over without starting
+ * new ones (e.g.: once per batch).
+ *
+ * The workers sleep on a condition variable between two loops. A pool runs
+ * one loop at a time: it must only be used by one thread at a time.
+ *
+ * > okmongo::WorkerPool pool(4);
+ * > pool.ParallelFor(n, 16, [&](int32_t worker, size_t begin, size_t end) {
+ * >     ...
+ * > });
+ */
+class WorkerPool {
+public:
+    /**
+     * @param threads number of threads, the caller included (0 means
+     *   `DefaultThreads()`).
+     */
+    explicit WorkerPool(int32_t threads = 0);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    int32_t threads() const {
+        return static_cast<int32_t>(workers_.size()) + 1;
+    }
+
+    /**
+     * Same as `okmongo::ParallelFor` on the threads of the pool.
+     */
+    template <typename F>
+    void ParallelFor(size_t n, size_t grain, F f) {
+        Run(&Call<F>, &f, n, grain);
+    }
+
+private:
+    typedef void (*Body)(void *f, int32_t worker, size_t begin, size_t end);
+
+    template <typename F>
+    static void Call(void *f, int32_t worker, size_t begin, size_t end) {
+        (*static_cast<F *>(f))(worker, begin, end);
+    }
+
+    void Run(Body body, void *f, size_t n, size_t grain);
+    // Process ranges until there are none left
+    void Work(int32_t worker);
+    // The main function of the workers
+    void Loop(int32_t worker);
+
+    std::mutex mu_;
+    std::condition_variable start_;
+    std::condition_variable done_;
+    uint64_t generation_ = 0;  // Number of loops started
+    int32_t running_ = 0;      // Workers still in the current loop
+    bool stop_ = false;
+    // The current loop
+    Body body_ = nullptr;
+    void *f_ = nullptr;
+    size_t n_ = 0;
+    size_t grain_ = 1;
+    std::atomic<size_t> next_{0};
+    std::vector<std::thread> workers_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+inline WorkerPool::WorkerPool(int32_t threads) {
+    if (threads <= 0) {
+        threads = DefaultThreads();
+    }
+    workers_.reserve(static_cast<size_t>(threads - 1));
+    for (int32_t i = 1; i < threads; ++i) {
+        workers_.emplace_back(&WorkerPool::Loop, this, i);
+    }
+}
+
+inline WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        stop_ = true;
+    }
+    start_.notify_all();
+    for (std::thread &t : workers_) {
+        t.join();
+    }
+}
+
+inline void WorkerPool::Work(int32_t worker) {
+    for (;;) {
+        const size_t start = next_.fetch_add(grain_);
+        if (start >= n_) {
+            return;
+        }
+        body_(f_, worker, start, std::min(n_, start + grain_));
+    }
+}
+
+inline void WorkerPool::Loop(int32_t worker) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(mu_);
+    for (;;) {
+        start_.wait(lock,
+                    [this, seen]() { return stop_ || generation_ != seen; });
+        if (stop_) {
+            return;
+        }
+        seen = generation_;
+        lock.unlock();
+        Work(worker);
+        lock.lock();
+        if (--running_ == 0) {
+            done_.notify_one();
+        }
+    }
+}
+
+inline void WorkerPool::Run(Body body, void *f, size_t n, size_t grain) {
+    grain = std::max<size_t>(grain, 1);
+    // Not worth waking anybody up
+    if (workers_.empty() || n <= grain) {
+        for (size_t start = 0; start < n; start += grain) {
+            body(f, 0, start, std::min(n, start + grain));
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        body_ = body;
+        f_ = f;
+        n_ = n;
+        grain_ = grain;
+        next_.store(0);
+        running_ = static_cast<int32_t>(workers_.size());
+        ++generation_;
+    }
+    start_.notify_all();
+    Work(0);
+    std::unique_lock<std::mutex> lock(mu_);
+    done_.wait(lock, [this]() { return running_ == 0; });
+}
+
+}  // namespace okmongo
@@ -0,0 +1,229 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Serialising large insert batches from several threads
+ *
+ * Anything that uses this needs to link with `$(PTHREAD_LIBS)`.
+ */
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "mongo.h"
+#include "parallel.h"
+
+namespace okmongo {
+
+/**
+ * A drop-in replacement for `FillInsertRangeOp` and `FillMsgInsertRangeOp`
+ * that runs `BsonWriteFields` on several threads.
+ *
+ * The documents are serialised by the workers in their own `BsonWriter`
+ * (they are handed out in small ranges, see `ParallelFor`, so a few big
+ * documents don't hold the batch back) and then copied in the message, in
+ * order, by the calling thread: that last pass adds the array keys and
+ * checks the `limits`. The messages are byte for byte the ones the
+ * sequential functions write.
+ *
+ * The documents are encoded in waves of at most `kWave` documents: the
+ * documents encoded after the one that crossed `limits.max_bytes` are wasted
+ * work.
+ *
+ * An encoder keeps its buffers and its threads (a `WorkerPool`) between
+ * calls, it should be reused but can only be used by one thread at a time.
+ *
+ * > okmongo::ParallelInsertEncoder enc;
+ * > auto curs = docs.cbegin();
+ * > while (curs != docs.cend()) {
+ * >     w.Clear();
+ * >     enc.FillInsertRangeOp(&w, id++, "db", "coll", &curs, docs.cend());
+ * >     ... send w ...
+ * > }
+ */
+class ParallelInsertEncoder {
+public:
+    /**
+     * Number of documents in the ranges handed to the workers.
+     */
+    static constexpr size_t kGrain = 16;
+
+    /**
+     * Maximum number of documents encoded before they are copied in the
+     * message.
+     */
+    static constexpr size_t kWave = 4096;
+
+    /**
+     * @param threads number of threads to use (0 means `DefaultThreads()`)
+     */
+    explicit ParallelInsertEncoder(int32_t threads = 0)
+        : pool_(threads), writers_(static_cast<size_t>(pool_.threads())) {}
+
+    ParallelInsertEncoder(const ParallelInsertEncoder &) = delete;
+    ParallelInsertEncoder &operator=(const ParallelInsertEncoder &) = delete;
+
+    int32_t threads() const { return pool_.threads(); }
+
+    /**
+     * Same as `okmongo::FillInsertRangeOp`, `It` must be a random access
+     * iterator and `BsonWriteFields` must be safe to call concurrently.
+     */
+    template <typename Concern = Acknowledged, typename It>
+    bool FillInsertRangeOp(BsonWriter *w, int32_t requestid, const char *db,
+                           const char *collection, It *start, const It end,
+                           const BatchLimits &limits = kDefaultBatchLimits);
+
+    /**
+     * Same as `okmongo::FillMsgInsertRangeOp` (see `FillInsertRangeOp`).
+     */
+    template <typename Concern = Acknowledged, typename It>
+    bool FillMsgInsertRangeOp(
+            BsonWriter *w, int32_t requestid, const char *db,
+            const char *collection, It *start, const It end,
+            const BatchLimits &limits = kDefaultMsgBatchLimits);
+
+private:
+    // Where the serialised document `i` of the current wave is.
+    struct Body {
+        int32_t worker;
+        int32_t offset;
+        int32_t len;  // -1 if `BsonWriteFields` failed
+    };
+
+    // Copies of the documents: in an array or a document sequence.
+    struct ArrayBodies {
+        static void Append(BsonWriter *w, int32_t cnt, const char *doc,
+                           int32_t len) {
+            w->ElementDocument(cnt, doc, len);
+        }
+    };
+
+    struct SequenceBodies {
+        static void Append(BsonWriter *w, int32_t, const char *doc,
+                           int32_t len) {
+            std::memcpy(w->ReserveRaw(len), doc, static_cast<size_t>(len));
+            w->CommitRaw(len);
+        }
+    };
+
+    // Serialise the `n` documents starting at `first` in `bodies_`.
+    template <typename It>
+    void Encode(It first, size_t n);
+
+    // Same as `AppendStatementRange`
+    template <typename Layout, typename It>
+    bool AppendBodies(BsonWriter *w, It *curs, const It end,
+                      const BatchLimits &limits, int32_t reserve);
+
+    WorkerPool pool_;
+    std::vector<BsonWriter> writers_;  // One per thread of `pool_`
+    std::vector<Body> bodies_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename It>
+void ParallelInsertEncoder::Encode(It first, size_t n) {
+    bodies_.resize(n);
+    for (BsonWriter &out : writers_) {
+        out.Clear();
+    }
+    pool_.ParallelFor(
+            n, kGrain, [this, first](int32_t worker, size_t begin, size_t end) {
+                BsonWriter &out = writers_[static_cast<size_t>(worker)];
+                for (size_t i = begin; i < end; ++i) {
+                    Body &body = bodies_[i];
+                    body.worker = worker;
+                    body.offset = out.len();
+                    out.Document();
+                    if (!BsonWriteFields(&out, first[i])) {
+                        body.len = -1;
+                        continue;
+                    }
+                    out.Pop();
+                    body.len = out.len() - body.offset;
+                }
+            });
+}
+
+template <typename Layout, typename It>
+bool ParallelInsertEncoder::AppendBodies(BsonWriter *w, It *curs,
+                                         const It end,
+                                         const BatchLimits &limits,
+                                         int32_t reserve) {
+    int32_t cnt = 0;
+    while (*curs != end && cnt < limits.max_count) {
+        const size_t n = std::min(
+                {static_cast<size_t>(end - *curs),
+                 static_cast<size_t>(limits.max_count - cnt), kWave});
+        Encode(*curs, n);
+        for (const Body &body : bodies_) {
+            if (body.len == -1) {
+                return false;
+            }
+            const BsonWriter::Mark mark = w->GetMark();
+            Layout::Append(w, cnt,
+                           writers_[static_cast<size_t>(body.worker)].data() +
+                                   body.offset,
+                           body.len);
+            if (w->MessageLen() > limits.max_bytes - reserve) {
+                w->Rewind(mark);
+                return cnt > 0;
+            }
+            ++(*curs), ++cnt;
+        }
+    }
+    return true;
+}
+
+template <typename Concern, typename It>
+bool ParallelInsertEncoder::FillInsertRangeOp(BsonWriter *w, int32_t requestid,
+                                              const char *db,
+                                              const char *collection,
+                                              It *curs, const It end,
+                                              const BatchLimits &limits) {
+    AppendCommandHeader(w, requestid, db);
+
+    w->Document();
+    {
+        w->Element("insert", collection);
+        w->PushArray("documents");
+        {
+            if (!AppendBodies<ArrayBodies>(w, curs, end, limits,
+                                           CommandTrailerSize<Concern>())) {
+                return false;
+            }
+        }
+        w->Pop();
+
+        Concern::Append(w);
+    }
+    w->Pop();
+
+    w->FlushLen();
+    return true;
+}
+
+template <typename Concern, typename It>
+bool ParallelInsertEncoder::FillMsgInsertRangeOp(
+        BsonWriter *w, int32_t requestid, const char *db,
+        const char *collection, It *curs, const It end,
+        const BatchLimits &limits) {
+    AppendMsgCommandHeader<Concern>(w, requestid);
+    StartMsgCommand(w, "insert", collection);
+    EndMsgCommand<Concern>(w, db);
+
+    const int32_t seq = StartDocumentSequence(w, "documents");
+    if (!AppendBodies<SequenceBodies>(w, curs, end, limits, 0)) {
+        return false;
+    }
+    EndDocumentSequence(w, seq);
+
+    w->FlushLen();
+    return true;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,131 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Vectorised scanning primitives
+ *
+ * The kernel is picked at compile time: AVX2 if the compiler targets it (e.g.
+ * `-mavx2` or `-march=native`), SSE2 on any other x86_64, NEON on aarch64 and
+ * a plain `memchr` everywhere else. Define `OKMONGO_NO_SIMD` to force the
+ * scalar version.
+ *
+ * None of these functions ever read outside of the range they are given: the
+ * vector loops stop as soon as less than a full register is left and the tail
+ * is handled byte by byte.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if !defined(OKMONGO_NO_SIMD)
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define OKMONGO_SIMD_AVX2 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define OKMONGO_SIMD_SSE2 1
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define OKMONGO_SIMD_NEON 1
+#endif
+#endif
+
+namespace okmongo {
+
+/**
+ * Name of the kernel `FindNul` was compiled with.
+ */
+inline const char *SimdKernelName() {
+#if defined(OKMONGO_SIMD_AVX2)
+    return "avx2";
+#elif defined(OKMONGO_SIMD_SSE2)
+    return "sse2";
+#elif defined(OKMONGO_SIMD_NEON)
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+/**
+ * Find the first null byte in `[s, end)`.
+ *
+ * @return a pointer to the null byte or `end` if there is none.
+ */
+inline const char *FindNul(const char *s, const char *end) {
+#if defined(OKMONGO_SIMD_AVX2)
+    const __m256i zero = _mm256_setzero_si256();
+    while (end - s >= 32) {
+        const __m256i chunk =
+                _mm256_loadu_si256(reinterpret_cast<const __m256i *>(s));
+        const uint32_t mask = static_cast<uint32_t>(
+                _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, zero)));
+        if (mask != 0) {
+            return s + __builtin_ctz(mask);
+        }
+        s += 32;
+    }
+#endif
+#if defined(OKMONGO_SIMD_AVX2) || defined(OKMONGO_SIMD_SSE2)
+    const __m128i zero16 = _mm_setzero_si128();
+    while (end - s >= 16) {
+        const __m128i chunk =
+                _mm_loadu_si128(reinterpret_cast<const __m128i *>(s));
+        const uint32_t mask = static_cast<uint32_t>(
+                _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, zero16)));
+        if (mask != 0) {
+            return s + __builtin_ctz(mask);
+        }
+        s += 16;
+    }
+    while (s < end && *s != '\000') {
+        ++s;
+    }
+    return s;
+#elif defined(OKMONGO_SIMD_NEON)
+    while (end - s >= 16) {
+        const uint8x16_t chunk = vld1q_u8(reinterpret_cast<const uint8_t *>(s));
+        const uint8x16_t eq = vceqzq_u8(chunk);
+        if (vmaxvq_u8(eq) != 0) {
+            // Narrow every byte of the comparison to a nibble so the mask fits
+            // in a 64 bit integer.
+            const uint64_t mask = vget_lane_u64(
+                    vreinterpret_u64_u8(
+                            vshrn_n_u16(vreinterpretq_u16_u8(eq), 4)),
+                    0);
+            return s + (__builtin_ctzll(mask) >> 2);
+        }
+        s += 16;
+    }
+    while (s < end && *s != '\000') {
+        ++s;
+    }
+    return s;
+#else
+    const void *res = std::memchr(s, '\000', static_cast<size_t>(end - s));
+    return res ? static_cast<const char *>(res) : end;
+#endif
+}
+
+/**
+ * Compare the null terminated key starting at `s` with `needle`.
+ *
+ * The key must be terminated before `end`.
+ *
+ * @param matched set to whether the key is equal to the first `needle_len`
+ * bytes of needle.
+ * @return a pointer to the terminating null byte of the key or `end` if it
+ * wasn't found.
+ */
+inline const char *MatchKey(const char *s, const char *end, const char *needle,
+                            size_t needle_len, bool *matched) {
+    const char *key_end = FindNul(s, end);
+    // memcmp is already vectorised by the libc, we only use it once we know
+    // the lengths match.
+    *matched = key_end != end &&
+               static_cast<size_t>(key_end - s) == needle_len &&
+               std::memcmp(s, needle, needle_len) == 0;
+    return key_end;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,441 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief BSON documents serialised at compile time
+ */
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "bson.h"
+#include "string_matcher.h"
+
+namespace okmongo {
+
+enum class StaticKind : uint8_t {
+    kEnd,   ///< Last element of the array
+    kValue, ///< A value known at compile time
+    kSlot,  ///< A value filled in when the document is written
+    kPush,  ///< Start of a sub-document or array (closed by a `kPop`)
+    kPop
+};
+
+/**
+ * An element of the description of a `StaticDocument`, use the `Static*`
+ * functions to build them.
+ */
+struct StaticElement {
+    StaticKind kind;
+    BsonTag tag;
+    const char *key;  ///< `nullptr` in arrays: the index is used
+    int64_t num;      ///< Value of the integers and booleans
+    const char *str;  ///< Value of the strings
+};
+
+/**
+ * @defgroup static_doc Elements of static documents
+ *
+ * In arrays the keys are omitted (or `nullptr`): they are computed.
+ * @{
+ */
+constexpr StaticElement StaticInt32(const char *key, int32_t v) {
+    return StaticElement{StaticKind::kValue, BsonTag::kInt32, key, v, nullptr};
+}
+
+constexpr StaticElement StaticInt32(int32_t v) {
+    return StaticInt32(nullptr, v);
+}
+
+constexpr StaticElement StaticInt64(const char *key, int64_t v) {
+    return StaticElement{StaticKind::kValue, BsonTag::kInt64, key, v, nullptr};
+}
+
+constexpr StaticElement StaticInt64(int64_t v) {
+    return StaticInt64(nullptr, v);
+}
+
+constexpr StaticElement StaticBool(const char *key, bool v) {
+    return StaticElement{StaticKind::kValue, BsonTag::kBool, key, v ? 1 : 0,
+                         nullptr};
+}
+
+constexpr StaticElement StaticBool(bool v) { return StaticBool(nullptr, v); }
+
+constexpr StaticElement StaticNull(const char *key = nullptr) {
+    return StaticElement{StaticKind::kValue, BsonTag::kNull, key, 0, nullptr};
+}
+
+constexpr StaticElement StaticString(const char *key, const char *v) {
+    return StaticElement{StaticKind::kValue, BsonTag::kUtf8, key, 0, v};
+}
+
+constexpr StaticElement StaticString(const char *v) {
+    return StaticString(nullptr, v);
+}
+
+/**
+ * A value of type `tag` given when the document is written: `kInt32`,
+ * `kInt64`, `kUtcDatetime`, `kTimestamp`, `kDouble` or `kBool` (doubles can
+ * only be slots).
+ */
+constexpr StaticElement StaticSlot(const char *key, BsonTag tag) {
+    return StaticElement{StaticKind::kSlot, tag, key, 0, nullptr};
+}
+
+constexpr StaticElement StaticSlot(BsonTag tag) {
+    return StaticSlot(nullptr, tag);
+}
+
+constexpr StaticElement StaticPushDocument(const char *key = nullptr) {
+    return StaticElement{StaticKind::kPush, BsonTag::kDocument, key, 0,
+                         nullptr};
+}
+
+constexpr StaticElement StaticPushArray(const char *key = nullptr) {
+    return StaticElement{StaticKind::kPush, BsonTag::kArray, key, 0, nullptr};
+}
+
+constexpr StaticElement StaticPop() {
+    return StaticElement{StaticKind::kPop, BsonTag::kMinKey, nullptr, 0,
+                         nullptr};
+}
+
+constexpr StaticElement StaticEnd() {
+    return StaticElement{StaticKind::kEnd, BsonTag::kMinKey, nullptr, 0,
+                         nullptr};
+}
+/** @} */
+
+constexpr bool StaticSlotTag(BsonTag t) {
+    return t == BsonTag::kInt32 || t == BsonTag::kInt64 ||
+           t == BsonTag::kUtcDatetime || t == BsonTag::kTimestamp ||
+           t == BsonTag::kDouble || t == BsonTag::kBool;
+}
+
+constexpr bool StaticValueTag(BsonTag t) {
+    return t == BsonTag::kInt32 || t == BsonTag::kInt64 ||
+           t == BsonTag::kBool || t == BsonTag::kNull || t == BsonTag::kUtf8;
+}
+
+constexpr bool StaticTypeValid(const StaticElement &e) {
+    return (e.kind == StaticKind::kSlot) ? StaticSlotTag(e.tag)
+           : (e.kind == StaticKind::kValue) ? StaticValueTag(e.tag)
+                                            : true;
+}
+
+// Every push is popped and all the types are supported.
+constexpr bool StaticValid(const StaticElement *k, int32_t depth) {
+    return (k->kind == StaticKind::kEnd)    ? depth == 0
+           : (k->kind == StaticKind::kPush) ? StaticValid(k + 1, depth + 1)
+           : (k->kind == StaticKind::kPop)
+                   ? depth > 0 && StaticValid(k + 1, depth - 1)
+                   : StaticTypeValid(*k) && StaticValid(k + 1, depth);
+}
+
+constexpr size_t StaticNumSlots(const StaticElement *k) {
+    return (k->kind == StaticKind::kEnd)
+                   ? 0
+                   : (k->kind == StaticKind::kSlot ? 1 : 0) +
+                             StaticNumSlots(k + 1);
+}
+
+// Index of the `n`th slot at or after `i`
+constexpr size_t StaticSlotIndex(const StaticElement *k, size_t i, size_t n) {
+    return (k[i].kind == StaticKind::kEnd) ? i
+           : (k[i].kind == StaticKind::kSlot)
+                   ? ((n == 0) ? i : StaticSlotIndex(k, i + 1, n - 1))
+                   : StaticSlotIndex(k, i + 1, n);
+}
+
+constexpr int32_t StaticStrlen(const char *s) {
+    return static_cast<int32_t>(ConstexprStrlen(s));
+}
+
+constexpr int32_t StaticDigits(int32_t n) {
+    return (n < 10) ? 1 : 1 + StaticDigits(n / 10);
+}
+
+constexpr int32_t StaticPow10(int32_t n) {
+    return (n == 0) ? 1 : 10 * StaticPow10(n - 1);
+}
+
+// `idx` is the position of the element in its parent
+constexpr int32_t StaticKeyLen(const StaticElement &e, int32_t idx) {
+    return e.key ? StaticStrlen(e.key) : StaticDigits(idx);
+}
+
+constexpr unsigned char StaticKeyChar(const StaticElement &e, int32_t idx,
+                                      int32_t pos) {
+    return e.key ? static_cast<unsigned char>(e.key[pos])
+                 : static_cast<unsigned char>(
+                           '0' +
+                           idx / StaticPow10(StaticDigits(idx) - 1 - pos) % 10);
+}
+
+// Byte `pos` of the little endian representation of `v`
+constexpr unsigned char StaticLEByte(int64_t v, int32_t pos) {
+    return static_cast<unsigned char>(
+            (static_cast<uint64_t>(v) >> (8 * pos)) & 0xff);
+}
+
+constexpr size_t StaticSkip(const StaticElement *k, size_t i);
+constexpr int32_t StaticDocSize(const StaticElement *k, size_t first);
+
+// Index of the `kPop` (or `kEnd`) closing the elements starting at `i`
+constexpr size_t StaticSkipChildren(const StaticElement *k, size_t i) {
+    return (k[i].kind == StaticKind::kPop || k[i].kind == StaticKind::kEnd)
+                   ? i
+                   : StaticSkipChildren(k, StaticSkip(k, i));
+}
+
+// Index of the element following the one at `i` in the same document
+constexpr size_t StaticSkip(const StaticElement *k, size_t i) {
+    return (k[i].kind == StaticKind::kPush) ? StaticSkipChildren(k, i + 1) + 1
+                                            : i + 1;
+}
+
+// Size of the value of a `kValue` or a `kSlot`
+constexpr int32_t StaticScalarSize(const StaticElement &e) {
+    return (e.tag == BsonTag::kUtf8)    ? 4 + StaticStrlen(e.str) + 1
+           : (e.tag == BsonTag::kInt32) ? 4
+           : (e.tag == BsonTag::kBool)  ? 1
+           : (e.tag == BsonTag::kNull)  ? 0
+                                        : 8;
+}
+
+constexpr int32_t StaticValueSize(const StaticElement *k, size_t i) {
+    return (k[i].kind == StaticKind::kPush) ? StaticDocSize(k, i + 1)
+                                            : StaticScalarSize(k[i]);
+}
+
+constexpr int32_t StaticElementSize(const StaticElement *k, size_t i,
+                                    int32_t idx) {
+    return 1 + StaticKeyLen(k[i], idx) + 1 + StaticValueSize(k, i);
+}
+
+constexpr int32_t StaticChildrenSize(const StaticElement *k, size_t i,
+                                     int32_t idx) {
+    return (k[i].kind == StaticKind::kPop || k[i].kind == StaticKind::kEnd)
+                   ? 0
+                   : StaticElementSize(k, i, idx) +
+                             StaticChildrenSize(k, StaticSkip(k, i), idx + 1);
+}
+
+// Size of the document whose first element is at `first`
+constexpr int32_t StaticDocSize(const StaticElement *k, size_t first) {
+    return 4 + StaticChildrenSize(k, first, 0) + 1;
+}
+
+// Offset of the value of element `target`, `off` is the offset of element `i`
+constexpr int32_t StaticValueOffset(const StaticElement *k, size_t i,
+                                    int32_t idx, int32_t off, size_t target) {
+    // The target is either this element, inside it or after it.
+    return (i == target) ? off + 2 + StaticKeyLen(k[i], idx)
+           : (target < StaticSkip(k, i))
+                   ? StaticValueOffset(k, i + 1, 0,
+                                       off + 2 + StaticKeyLen(k[i], idx) + 4,
+                                       target)
+                   : StaticValueOffset(k, StaticSkip(k, i), idx + 1,
+                                       off + StaticElementSize(k, i, idx),
+                                       target);
+}
+
+constexpr unsigned char StaticDocByte(const StaticElement *k, size_t first,
+                                      int32_t pos);
+
+// Byte `pos` of the value of a `kValue` (slots are left at 0)
+constexpr unsigned char StaticScalarByte(const StaticElement &e,
+                                         int32_t pos) {
+    return (e.kind == StaticKind::kSlot) ? 0
+           : (e.tag != BsonTag::kUtf8)   ? StaticLEByte(e.num, pos)
+           : (pos < 4) ? StaticLEByte(StaticStrlen(e.str) + 1, pos)
+                       : static_cast<unsigned char>(e.str[pos - 4]);
+}
+
+constexpr unsigned char StaticValueByte(const StaticElement *k, size_t i,
+                                        int32_t pos) {
+    return (k[i].kind == StaticKind::kPush) ? StaticDocByte(k, i + 1, pos)
+                                            : StaticScalarByte(k[i], pos);
+}
+
+constexpr unsigned char StaticElementByte(const StaticElement *k, size_t i,
+                                          int32_t idx, int32_t pos) {
+    return (pos == 0) ? static_cast<unsigned char>(k[i].tag)
+           : (pos <= StaticKeyLen(k[i], idx))
+                   ? StaticKeyChar(k[i], idx, pos - 1)
+           : (pos == StaticKeyLen(k[i], idx) + 1)
+                   ? 0
+                   : StaticValueByte(k, i, pos - StaticKeyLen(k[i], idx) - 2);
+}
+
+// Byte `pos` of the elements starting at `i` (and of the terminating null)
+constexpr unsigned char StaticChildrenByte(const StaticElement *k, size_t i,
+                                           int32_t idx, int32_t pos) {
+    return (k[i].kind == StaticKind::kPop || k[i].kind == StaticKind::kEnd)
+                   ? 0
+                   : (pos < StaticElementSize(k, i, idx))
+                             ? StaticElementByte(k, i, idx, pos)
+                             : StaticChildrenByte(
+                                       k, StaticSkip(k, i), idx + 1,
+                                       pos - StaticElementSize(k, i, idx));
+}
+
+constexpr unsigned char StaticDocByte(const StaticElement *k, size_t first,
+                                      int32_t pos) {
+    return (pos < 4) ? StaticLEByte(StaticDocSize(k, first), pos)
+                     : StaticChildrenByte(k, first, 0, pos - 4);
+}
+
+template <size_t... Is>
+constexpr std::array<char, sizeof...(Is)> StaticBytes(const StaticElement *k,
+                                                      IndexSeq<Is...>) {
+    return {{static_cast<char>(
+            StaticDocByte(k, 0, static_cast<int32_t>(Is)))...}};
+}
+
+/**
+ * The C++ types of the slots and how they are written.
+ */
+template <typename T>
+struct StaticSlotType;
+
+template <>
+struct StaticSlotType<int32_t> {
+    typedef int32_t Raw;
+    static constexpr bool Accepts(BsonTag t) { return t == BsonTag::kInt32; }
+};
+
+template <>
+struct StaticSlotType<int64_t> {
+    typedef int64_t Raw;
+    static constexpr bool Accepts(BsonTag t) {
+        return t == BsonTag::kInt64 || t == BsonTag::kUtcDatetime ||
+               t == BsonTag::kTimestamp;
+    }
+};
+
+template <>
+struct StaticSlotType<double> {
+    typedef double Raw;
+    static constexpr bool Accepts(BsonTag t) { return t == BsonTag::kDouble; }
+};
+
+template <>
+struct StaticSlotType<bool> {
+    typedef char Raw;
+    static constexpr bool Accepts(BsonTag t) { return t == BsonTag::kBool; }
+};
+
+/**
+ * A document whose shape is known at compile time.
+ *
+ * `elements` points to a `constexpr` array of `StaticElement` ending with
+ * `StaticEnd()`; the whole document (lengths, keys and array indices
+ * included) is serialised at compile time in `kBytes` and writing it is one
+ * `memcpy` followed by the copy of the values of the slots.
+ *
+ * > constexpr okmongo::StaticElement kGetLastError[] = {
+ * >         okmongo::StaticInt32("getlasterror", 1),
+ * >         okmongo::StaticSlot("wtimeout", okmongo::BsonTag::kInt32),
+ * >         okmongo::StaticEnd()};
+ * > typedef okmongo::StaticDocument<kGetLastError> GetLastError;
+ * > GetLastError::Append(&w, timeout_ms);
+ *
+ * The bytes are computed with recursive `constexpr` functions: this is meant
+ * for small documents (up to a few hundred bytes).
+ */
+template <const StaticElement *elements>
+class StaticDocument {
+    static_assert(StaticValid(elements, 0),
+                  "Unbalanced push/pop or unsupported type");
+
+public:
+    static constexpr int32_t kSize = StaticDocSize(elements, 0);
+    static constexpr size_t kNumSlots = StaticNumSlots(elements);
+
+    typedef std::array<char, static_cast<size_t>(kSize)> Bytes;
+
+    /**
+     * The document, with zeros in the slots.
+     */
+    static constexpr Bytes kBytes =
+            StaticBytes(elements, typename MakeIndexSeq<static_cast<size_t>(
+                                          kSize)>::type());
+
+    /**
+     * Offset of the value of slot `n` in the document.
+     */
+    static constexpr int32_t SlotOffset(size_t n) {
+        return StaticValueOffset(elements, 0, 0, 4,
+                                 StaticSlotIndex(elements, 0, n));
+    }
+
+    /**
+     * Write the document, `values` are the values of the slots in order.
+     */
+    template <typename... Values>
+    static void Append(BsonWriter *w, const Values &... values);
+
+    /**
+     * Write the document as the field `key` of the current document.
+     */
+    template <typename K, typename... Values>
+    static void AppendField(BsonWriter *w, const K key,
+                            const Values &... values);
+
+private:
+    template <size_t n>
+    static void Patch(BsonWriter *, int32_t) {}
+
+    template <size_t n, typename V, typename... Rest>
+    static void Patch(BsonWriter *w, int32_t start, const V &v,
+                      const Rest &... rest);
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <const StaticElement *elements>
+constexpr int32_t StaticDocument<elements>::kSize;
+
+template <const StaticElement *elements>
+constexpr size_t StaticDocument<elements>::kNumSlots;
+
+template <const StaticElement *elements>
+constexpr typename StaticDocument<elements>::Bytes
+        StaticDocument<elements>::kBytes;
+
+template <const StaticElement *elements>
+template <typename... Values>
+void StaticDocument<elements>::Append(BsonWriter *w,
+                                      const Values &... values) {
+    static_assert(sizeof...(Values) == kNumSlots, "Wrong number of values");
+    const int32_t start = w->len();
+    std::memcpy(w->ReserveRaw(kSize), kBytes.data(), kBytes.size());
+    w->CommitRaw(kSize);
+    Patch<0>(w, start, values...);
+}
+
+template <const StaticElement *elements>
+template <typename K, typename... Values>
+void StaticDocument<elements>::AppendField(BsonWriter *w, const K key,
+                                           const Values &... values) {
+    static_assert(sizeof...(Values) == kNumSlots, "Wrong number of values");
+    w->ElementDocument(key, kBytes.data(), kSize);
+    Patch<0>(w, w->len() - kSize, values...);
+}
+
+template <const StaticElement *elements>
+template <size_t n, typename V, typename... Rest>
+void StaticDocument<elements>::Patch(BsonWriter *w, int32_t start,
+                                     const V &v, const Rest &... rest) {
+    static_assert(StaticSlotType<V>::Accepts(
+                          elements[StaticSlotIndex(elements, 0, n)].tag),
+                  "The value doesn't match the type of the slot");
+    w->PatchRaw(start + SlotOffset(n),
+                static_cast<typename StaticSlotType<V>::Raw>(v));
+    Patch<n + 1>(w, start, rest...);
+}
+
+}  // namespace okmongo
@@ -4,20 +4,13 @@
 #include <cstring>
 #include <cstdint>
 #include <algorithm>
+#include <array>
+#include <type_traits>
 
 namespace okmongo {
 
-// TODO: use a combination of `offset_of` and BsonTag to implement a parser that
-// works directly on a data structure.
-// The reader class would only work for standard_layout classes
-// (std::is_standard_layout), we have to assert the address of the last field is
-// < max_int32_t maintain a bit-field of all the fields seen so far
-// and construct objects of type t...
-//
-// struct fld_info {
-//     BsonTag typ_;
-//     int32_t offset_;
-// };
+// See `struct_reader.h` for a parser built on top of these matchers that works
+// directly on a data structure.
 
 template <typename T>
 struct StringMatcherAction {
@@ -118,4 +111,236 @@ public:
     }
 };
 
+//------------------------------------------------------------------------------
+// TrieMatcher
+//------------------------------------------------------------------------------
+
+inline constexpr int ConstexprStrcmp(const char *a, const char *b) {
+    return (*a != *b || *a == '\000')
+                   ? static_cast<int>(static_cast<unsigned char>(*a)) -
+                             static_cast<int>(static_cast<unsigned char>(*b))
+                   : ConstexprStrcmp(a + 1, b + 1);
+}
+
+// Checks that actions `[lo, hi)` are strictly sorted. We split the range in
+// two rather than walking it to keep the recursion depth logarithmic.
+template <typename T>
+constexpr bool ActionsSorted(const StringMatcherAction<T> *k, size_t lo,
+                             size_t hi) {
+    return (hi - lo < 2)
+                   ? true
+                   : (ConstexprStrcmp(k[(lo + hi) / 2 - 1].match,
+                                      k[(lo + hi) / 2].match) < 0 &&
+                      ActionsSorted(k, lo, (lo + hi) / 2) &&
+                      ActionsSorted(k, (lo + hi) / 2, hi));
+}
+
+template <typename T>
+constexpr unsigned char ActionChar(const StringMatcherAction<T> *k, size_t i,
+                                   size_t pos) {
+    return static_cast<unsigned char>(k[i].match[pos]);
+}
+
+// First action in `[lo, hi)` whose char at `pos` isn't smaller than `c`
+template <typename T>
+constexpr size_t ActionsLowerBound(const StringMatcherAction<T> *k, size_t lo,
+                                   size_t hi, size_t pos, unsigned char c) {
+    return (lo >= hi) ? lo
+                      : (ActionChar(k, (lo + hi) / 2, pos) < c)
+                                ? ActionsLowerBound(k, (lo + hi) / 2 + 1, hi,
+                                                    pos, c)
+                                : ActionsLowerBound(k, lo, (lo + hi) / 2, pos,
+                                                    c);
+}
+
+// First action in `[lo, hi)` whose char at `pos` is bigger than `c`
+template <typename T>
+constexpr size_t ActionsUpperBound(const StringMatcherAction<T> *k, size_t lo,
+                                   size_t hi, size_t pos, unsigned char c) {
+    return (lo >= hi) ? lo
+                      : (ActionChar(k, (lo + hi) / 2, pos) <= c)
+                                ? ActionsUpperBound(k, (lo + hi) / 2 + 1, hi,
+                                                    pos, c)
+                                : ActionsUpperBound(k, lo, (lo + hi) / 2, pos,
+                                                    c);
+}
+
+/**
+ * Smallest unsigned type that can hold `n`.
+ */
+template <size_t n>
+struct SmallestUint {
+    typedef typename std::conditional<
+            (n < 256), uint8_t,
+            typename std::conditional<(n < 65536), uint16_t,
+                                      uint32_t>::type>::type type;
+};
+
+template <size_t... Is>
+struct IndexSeq {};
+
+template <size_t n, size_t... Is>
+struct MakeIndexSeq : MakeIndexSeq<n - 1, n - 1, Is...> {};
+
+template <size_t... Is>
+struct MakeIndexSeq<0, Is...> {
+    typedef IndexSeq<Is...> type;
+};
+
+// Half open range of actions.
+template <typename Index>
+struct ActionRange {
+    Index lo, hi;
+};
+
+// For every char `c`: the range of actions starting with `c`.
+template <typename Index, typename T, size_t... Cs>
+constexpr std::array<ActionRange<Index>, sizeof...(Cs)> FirstCharRanges(
+        const StringMatcherAction<T> *k, size_t n, IndexSeq<Cs...>) {
+    return {{ActionRange<Index>{
+            static_cast<Index>(ActionsLowerBound(
+                    k, 0, n, 0, static_cast<unsigned char>(Cs))),
+            static_cast<Index>(ActionsUpperBound(
+                    k, 0, n, 0, static_cast<unsigned char>(Cs)))}...}};
+}
+
+/**
+ * A drop-in replacement for `StringMatcher` for large keyword sets.
+ *
+ * The sorted keyword array is walked as an implicit trie: the keywords that are
+ * still candidates always form a contiguous range sharing the prefix read so
+ * far and every char narrows that range with a binary search (rather than
+ * `StringMatcher`'s linear scans). The range for the first character comes
+ * out of a table computed at compile time.
+ *
+ * The `keywords` expected are the same as for `StringMatcher` but this class
+ * checks at compile time that they are sorted and isn't limited to 256
+ * keywords of less than 256 chars: its counters are sized to fit the
+ * keyword set.
+ *
+ * @note the compile-time checks recurse once per keyword, very large sets
+ * might require raising the compiler's constexpr depth limit.
+ */
+template <typename T, const StringMatcherAction<T> *keywords>
+class TrieMatcher {
+    static constexpr size_t totlen_ = GetNumActions(keywords);
+    static_assert(totlen_ > 0, "Too few kwds...");
+    static_assert(ActionsSorted(keywords, 0, totlen_),
+                  "Keywords must be sorted and unique");
+
+    typedef typename SmallestUint<totlen_>::type Index;
+    typedef typename SmallestUint<GetMaxMatch(keywords) + 1>::type Pos;
+
+    typedef std::array<ActionRange<Index>, 256> FirstTable;
+
+    static constexpr FirstTable first_ = FirstCharRanges<Index>(
+            keywords, totlen_, typename MakeIndexSeq<256>::type());
+
+    Pos pos_ = 0;
+    // Candidates are in [lo_, hi_)
+    Index lo_ = 0;
+    Index hi_ = static_cast<Index>(totlen_);
+    enum State : uint8_t { kRunning, kSuccess, kFailed } state_ = kRunning;
+
+public:
+    // Advance the matcher by one character
+    void AddChar(const char c_in) {
+        switch (state_) {
+            case kFailed:
+                return;
+            case kSuccess:
+                assert(false);
+                return;
+            case kRunning:
+                break;
+        }
+        const unsigned char c = static_cast<unsigned char>(c_in);
+        Index lo, hi;
+        if (pos_ == 0) {
+            lo = first_[c].lo;
+            hi = first_[c].hi;
+        } else if (CharAt(lo_) == c && CharAt(hi_ - 1) == c) {
+            // All the candidates share this char (they are sorted): common
+            // prefixes don't need a search.
+            lo = lo_;
+            hi = hi_;
+        } else {
+            lo = LowerBound(c);
+            hi = UpperBound(lo, c);
+        }
+        if (lo == hi) {
+            state_ = kFailed;
+            return;
+        }
+        lo_ = lo;
+        hi_ = hi;
+        if (c == '\000') {
+            // The keywords are unique so only one of them can end here.
+            assert(hi_ - lo_ == 1);
+            state_ = kSuccess;
+            return;
+        }
+        ++pos_;
+    }
+
+    T GetResult() const {
+        return keywords[(state_ == kSuccess) ? lo_ : totlen_].val;
+    }
+
+    /**
+     * Position of the keyword matched in `keywords` (-1 if we didn't match
+     * anything).
+     */
+    int32_t GetIndex() const {
+        return (state_ == kSuccess) ? static_cast<int32_t>(lo_) : -1;
+    }
+
+    /**
+     * No keyword starts with the characters added so far.
+     */
+    bool Failed() const { return state_ == kFailed; }
+
+    void Reset() {
+        state_ = kRunning;
+        pos_ = 0;
+        lo_ = 0;
+        hi_ = static_cast<Index>(totlen_);
+    }
+
+private:
+    unsigned char CharAt(Index i) const {
+        return static_cast<unsigned char>(keywords[i].match[pos_]);
+    }
+
+    Index LowerBound(unsigned char c) const {
+        Index lo = lo_, hi = hi_;
+        while (lo < hi) {
+            const Index mid = static_cast<Index>(lo + (hi - lo) / 2);
+            if (CharAt(mid) < c) {
+                lo = static_cast<Index>(mid + 1);
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+
+    Index UpperBound(Index lo, unsigned char c) const {
+        Index hi = hi_;
+        while (lo < hi) {
+            const Index mid = static_cast<Index>(lo + (hi - lo) / 2);
+            if (CharAt(mid) <= c) {
+                lo = static_cast<Index>(mid + 1);
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+};
+
+template <typename T, const StringMatcherAction<T> *keywords>
+constexpr typename TrieMatcher<T, keywords>::FirstTable
+        TrieMatcher<T, keywords>::first_;
+
 }  // namespace okmongo
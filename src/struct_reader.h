@@ -0,0 +1,293 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Decoding BSON documents straight into C++ structs
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include "bson.h"
+#include "string_matcher.h"
+
+namespace okmongo {
+
+/**
+ * Where (and as what) a field of a document gets stored in a struct.
+ *
+ * The tag selects the type of the member:
+ *
+ * | tag                                         | member type      |
+ * |---------------------------------------------|------------------|
+ * | `kInt32`                                    | `int32_t`        |
+ * | `kInt64`, `kUtcDatetime`, `kTimestamp`      | `int64_t`        |
+ * | `kDouble`                                   | `double`         |
+ * | `kBool`                                     | `bool`           |
+ * | `kUtf8`                                     | `std::string`    |
+ * | `kObjectId`                                 | `char[kObjectIdLen]` |
+ *
+ * `kInt64` members also accept `kInt32` values.
+ */
+struct FieldDescriptor {
+    BsonTag tag;
+    int32_t offset;
+};
+
+/**
+ * The `BsonTag` used for a member of type `T`
+ */
+template <typename T>
+struct BsonTagFor;
+
+template <>
+struct BsonTagFor<int32_t> {
+    static constexpr BsonTag value = BsonTag::kInt32;
+};
+
+template <>
+struct BsonTagFor<int64_t> {
+    static constexpr BsonTag value = BsonTag::kInt64;
+};
+
+template <>
+struct BsonTagFor<double> {
+    static constexpr BsonTag value = BsonTag::kDouble;
+};
+
+template <>
+struct BsonTagFor<bool> {
+    static constexpr BsonTag value = BsonTag::kBool;
+};
+
+template <>
+struct BsonTagFor<std::string> {
+    static constexpr BsonTag value = BsonTag::kUtf8;
+};
+
+template <>
+struct BsonTagFor<char[kObjectIdLen]> {
+    static constexpr BsonTag value = BsonTag::kObjectId;
+};
+
+/**
+ * Build the entry describing the member `member` of `Struct` (where the name
+ * of the field is the name of the member).
+ *
+ * > constexpr okmongo::StringMatcherAction<okmongo::FieldDescriptor>
+ * >         user_fields[] = {OKMONGO_STRUCT_FIELD(User, counter),
+ * >                          OKMONGO_STRUCT_FIELD(User, name),
+ * >                          {nullptr, {okmongo::BsonTag::kMinKey, -1}}};
+ */
+#define OKMONGO_STRUCT_FIELD(Struct, member)                                 \
+    {                                                                        \
+        #member, {                                                           \
+            ::okmongo::BsonTagFor<decltype(Struct::member)>::value,          \
+                    static_cast<int32_t>(offsetof(Struct, member))           \
+        }                                                                    \
+    }
+
+/**
+ * A mixin that decodes the top-level fields of documents read by `Parent` into
+ * a struct of type `T`.
+ *
+ * `fields` follows the same rules as the keywords of a `TrieMatcher` (sorted,
+ * terminated by an entry with a `nullptr` match); each keyword is a field name
+ * and its value says where the field goes in `T` (see `FieldDescriptor`).
+ * Fields that aren't in the table, or whose type doesn't match the table, are
+ * ignored.
+ *
+ * A bitfield keeps track of the fields that were decoded; nothing gets
+ * allocated apart from the content of the `std::string` members.
+ *
+ * Like `BsonDumper`, this can be used on top of `BsonReader` (see
+ * `StructReader`) or `ResponseReader` (set a new target in
+ * `EmitDocumentStart` to decode every document of a reply).
+ */
+template <typename T, const StringMatcherAction<FieldDescriptor> *fields,
+          typename Parent>
+class StructDecoder : public Parent {
+    static_assert(std::is_standard_layout<T>::value,
+                  "StructDecoder only works on standard layout types");
+    static_assert(sizeof(T) < static_cast<size_t>(INT32_MAX),
+                  "Type too big");
+
+    typedef TrieMatcher<FieldDescriptor, fields> Matcher;
+
+    static constexpr size_t kNumFields_ = GetNumActions(fields);
+    static_assert(kNumFields_ <= 64, "Too many fields for the bitfield");
+
+public:
+    explicit StructDecoder(T *tgt = nullptr) : tgt_(tgt) {}
+
+    /**
+     * Decode the next fields in `tgt`.
+     *
+     * This doesn't reset the fields seen.
+     */
+    void Target(T *tgt) { tgt_ = tgt; }
+
+    /**
+     * Bitfield of the fields decoded so far. The bit `i` is set iff the
+     * field described by `fields[i]` has been seen.
+     */
+    uint64_t FieldsSeen() const { return seen_; }
+
+    /**
+     * Whether every field in `fields` was decoded.
+     */
+    bool Complete() const { return seen_ == kAllFields; }
+
+    /**
+     * Whether the parser hit an error.
+     */
+    bool Failed() const { return failed_; }
+
+    static constexpr uint64_t kAllFields =
+            (kNumFields_ == 64) ? ~static_cast<uint64_t>(0)
+                                : (static_cast<uint64_t>(1) << kNumFields_) - 1;
+
+    void ClearFields() { seen_ = 0; }
+
+    //--------------------------------------------------------------------------
+    // CRTP callbacks
+
+    void EmitError(const char *) { failed_ = true; }
+
+    void EmitFieldName(const char *data, const int32_t len) {
+        if (Parent::depth() != 1) {
+            return;
+        }
+        if (!in_name_) {
+            in_name_ = true;
+            matcher_.Reset();
+        }
+        for (int32_t i = 0; i < len; ++i) {
+            matcher_.AddChar(data[i]);
+        }
+        if (len == 0) {
+            in_name_ = false;
+            matcher_.AddChar('\000');
+            current_ = matcher_.GetIndex();
+            if (current_ == -1) {
+                Parent::SkipValue();
+            } else if (tgt_ != nullptr &&
+                       fields[current_].val.tag == BsonTag::kUtf8 &&
+                       Parent::typ_ == BsonTag::kUtf8) {
+                Member<std::string>()->clear();
+            }
+        }
+    }
+
+    void EmitInt32(int32_t v) {
+        if (Accept(BsonTag::kInt32)) {
+            *Member<int32_t>() = v;
+        } else if (Accept(BsonTag::kInt64, BsonTag::kInt32)) {
+            *Member<int64_t>() = v;
+        }
+    }
+
+    void EmitInt64(int64_t v) {
+        if (Accept(BsonTag::kInt64)) {
+            *Member<int64_t>() = v;
+        }
+    }
+
+    void EmitUtcDatetime(int64_t v) {
+        if (Accept(BsonTag::kUtcDatetime)) {
+            *Member<int64_t>() = v;
+        }
+    }
+
+    void EmitTimestamp(int64_t v) {
+        if (Accept(BsonTag::kTimestamp)) {
+            *Member<int64_t>() = v;
+        }
+    }
+
+    void EmitDouble(double v) {
+        if (Accept(BsonTag::kDouble)) {
+            *Member<double>() = v;
+        }
+    }
+
+    void EmitBool(bool v) {
+        if (Accept(BsonTag::kBool)) {
+            *Member<bool>() = v;
+        }
+    }
+
+    void EmitObjectId(const char *v) {
+        if (Accept(BsonTag::kObjectId)) {
+            std::memcpy(Member<char>(), v, kObjectIdLen);
+        }
+    }
+
+    void EmitUtf8(const char *s, int32_t len) {
+        if (Parent::depth() != 1 || current_ == -1 || tgt_ == nullptr ||
+            fields[current_].val.tag != BsonTag::kUtf8) {
+            return;
+        }
+        if (len > 0) {
+            Member<std::string>()->append(s, static_cast<size_t>(len));
+        } else {
+            Mark();
+        }
+    }
+
+private:
+    T *tgt_;
+    uint64_t seen_ = 0;
+    int32_t current_ = -1;
+    bool in_name_ = false;
+    bool failed_ = false;
+    Matcher matcher_;
+
+    template <typename M>
+    M *Member() {
+        return reinterpret_cast<M *>(reinterpret_cast<char *>(tgt_) +
+                                     fields[current_].val.offset);
+    }
+
+    void Mark() {
+        seen_ |= static_cast<uint64_t>(1) << current_;
+        current_ = -1;
+    }
+
+    // Is the value being read (of type `value_tag`) going in a member tagged
+    // with `member_tag`?
+    bool Accept(BsonTag member_tag) { return Accept(member_tag, member_tag); }
+
+    bool Accept(BsonTag member_tag, BsonTag value_tag) {
+        if (Parent::depth() != 1 || current_ == -1 || tgt_ == nullptr ||
+            fields[current_].val.tag != member_tag ||
+            Parent::typ_ != value_tag) {
+            return false;
+        }
+        // The caller writes the value right after this
+        seen_ |= static_cast<uint64_t>(1) << current_;
+        return true;
+    }
+};
+
+template <typename T, const StringMatcherAction<FieldDescriptor> *fields,
+          typename Parent>
+constexpr uint64_t StructDecoder<T, fields, Parent>::kAllFields;
+
+/**
+ * Decode a single BSON document into a `T`.
+ *
+ * > User u;
+ * > okmongo::StructReader<User, user_fields> r(&u);
+ * > r.Consume(data, len);
+ * > if (r.Done() && !r.Failed() && r.Complete()) { ... }
+ */
+template <typename T, const StringMatcherAction<FieldDescriptor> *fields>
+class StructReader
+        : public StructDecoder<T, fields, BsonReader<StructReader<T, fields>>> {
+public:
+    explicit StructReader(T *tgt = nullptr)
+        : StructDecoder<T, fields, BsonReader<StructReader<T, fields>>>(tgt) {}
+};
+
+}  // namespace okmongo
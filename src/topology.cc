@@ -0,0 +1,101 @@
+#include "topology.h"
+
+namespace okmongo {
+
+constexpr StringMatcherAction<IsMasterFields::Field> IsMasterFields::sma_[];
+
+constexpr double Topology::kRttAlpha;
+
+ServerType GetServerType(const IsMasterReply &reply) {
+    if (!reply.ok) {
+        return ServerType::kUnknown;
+    }
+    if (reply.is_mongos) {
+        return ServerType::kMongos;
+    }
+    if (reply.set_name.empty()) {
+        return reply.ismaster ? ServerType::kStandalone : ServerType::kOther;
+    }
+    if (reply.hidden || reply.arbiter_only) {
+        return ServerType::kOther;
+    }
+    if (reply.ismaster) {
+        return ServerType::kPrimary;
+    }
+    if (reply.secondary) {
+        return ServerType::kSecondary;
+    }
+    return ServerType::kOther;
+}
+
+int32_t Topology::AddServer(const std::string &name) {
+    servers_.emplace_back();
+    servers_.back().name = name;
+    return size() - 1;
+}
+
+void Topology::OnHeartbeat(int32_t server, const IsMasterReply &reply,
+                           int64_t rtt_us) {
+    Server &s = servers_[Index(server)];
+    s.description = reply;
+    s.type = GetServerType(reply);
+    if (s.type == ServerType::kUnknown) {
+        s.rtt_us = -1;
+        return;
+    }
+    if (s.rtt_us < 0) {
+        s.rtt_us = rtt_us;
+    } else {
+        const double avg = kRttAlpha * static_cast<double>(rtt_us) +
+                           (1 - kRttAlpha) * static_cast<double>(s.rtt_us);
+        s.rtt_us = static_cast<int64_t>(avg);
+    }
+}
+
+void Topology::OnServerDown(int32_t server) {
+    Server &s = servers_[Index(server)];
+    s.type = ServerType::kUnknown;
+    s.description = IsMasterReply();
+    s.rtt_us = -1;
+}
+
+void Topology::OnRequestDone(int32_t server) {
+    Server &s = servers_[Index(server)];
+    if (s.in_flight > 0) {
+        --s.in_flight;
+    }
+}
+
+int32_t Topology::Select(ReadPreference pref) const {
+    // Standalone servers and mongos take everything
+    const auto any = [](const Server &s) {
+        return s.type == ServerType::kStandalone ||
+               s.type == ServerType::kMongos;
+    };
+    const auto primary = [&any](const Server &s) {
+        return any(s) || s.type == ServerType::kPrimary;
+    };
+    const auto secondary = [&any](const Server &s) {
+        return any(s) || s.type == ServerType::kSecondary;
+    };
+    int32_t res = -1;
+    switch (pref) {
+        case ReadPreference::kPrimary:
+            return SelectAmong(primary);
+        case ReadPreference::kPrimaryPreferred:
+            res = SelectAmong(primary);
+            return (res != -1) ? res : SelectAmong(secondary);
+        case ReadPreference::kSecondary:
+            return SelectAmong(secondary);
+        case ReadPreference::kSecondaryPreferred:
+            res = SelectAmong(secondary);
+            return (res != -1) ? res : SelectAmong(primary);
+        case ReadPreference::kNearest:
+            return SelectAmong([&primary, &secondary](const Server &s) {
+                return primary(s) || secondary(s);
+            });
+    }
+    return -1;
+}
+
+}  // namespace okmongo
@@ -0,0 +1,366 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Reading `ismaster` replies and picking the server of a request
+ *
+ * Nothing in here does any IO: `ConnectionPool` (in `libokmongo_io`) sends
+ * the heartbeats and feeds their replies and round trip times to a
+ * `Topology`.
+ */
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "mongo.h"
+#include "string_matcher.h"
+
+namespace okmongo {
+
+/**
+ * What a server says about itself in its reply to `FillIsMasterOp`.
+ */
+struct IsMasterReply {
+    bool ok = false;
+    bool ismaster = false;
+    bool secondary = false;
+    bool arbiter_only = false;
+    bool hidden = false;
+    bool is_mongos = false;  ///< `msg` is "isdbgrid"
+    std::string set_name;
+    std::string primary;
+    std::vector<std::string> hosts;  ///< `hosts` and `passives`
+    int32_t max_wire_version = 0;
+    int32_t max_bson_object_size = 16 * 1024 * 1024;
+    int32_t max_message_size_bytes = kMaxMessageSize;
+    int32_t max_write_batch_size = 1000;
+};
+
+struct IsMasterFields {
+    enum class Field : uint8_t {
+        kField,
+        kArbiterOnly,
+        kHidden,
+        kHosts,
+        kIsMaster,
+        kMaxBsonObjectSize,
+        kMaxMessageSizeBytes,
+        kMaxWireVersion,
+        kMaxWriteBatchSize,
+        kMsg,
+        kOk,
+        kPassives,
+        kPrimary,
+        kSecondary,
+        kSetName,
+        kUnknown
+    };
+
+    static constexpr StringMatcherAction<Field> sma_[] = {
+            {"arbiterOnly", Field::kArbiterOnly},
+            {"hidden", Field::kHidden},
+            {"hosts", Field::kHosts},
+            {"ismaster", Field::kIsMaster},
+            {"maxBsonObjectSize", Field::kMaxBsonObjectSize},
+            {"maxMessageSizeBytes", Field::kMaxMessageSizeBytes},
+            {"maxWireVersion", Field::kMaxWireVersion},
+            {"maxWriteBatchSize", Field::kMaxWriteBatchSize},
+            {"msg", Field::kMsg},
+            {"ok", Field::kOk},
+            {"passives", Field::kPassives},
+            {"primary", Field::kPrimary},
+            {"secondary", Field::kSecondary},
+            {"setName", Field::kSetName},
+            {nullptr, Field::kUnknown}};
+};
+
+/**
+ * Decodes the reply to an `ismaster` command in an `IsMasterReply`, the
+ * fields we don't care about are skipped.
+ */
+template <typename Parent>
+class IsMasterDecoder : public Parent {
+    typedef IsMasterFields::Field Field;
+    typedef TrieMatcher<Field, IsMasterFields::sma_> Matcher;
+
+    Field field_ = Field::kUnknown;
+    Matcher matcher_;
+    IsMasterReply res_;
+    std::string msg_;
+    bool failed_ = false;
+
+    bool AtTop() const { return Parent::depth() == 1; }
+
+    void SetNumber(int64_t v);
+
+public:
+    void EmitFieldName(const char *data, const int32_t len);
+
+    void EmitInt32(int32_t v) { SetNumber(v); }
+
+    void EmitInt64(int64_t v) { SetNumber(v); }
+
+    void EmitDouble(double v) { SetNumber(static_cast<int64_t>(v)); }
+
+    void EmitBool(bool v);
+
+    void EmitUtf8(const char *cnt, int32_t len);
+
+    void EmitError(const char *) { failed_ = true; }
+
+    bool Failed() const { return failed_; }
+
+    void Clear() {
+        Parent::Clear();
+        field_ = Field::kUnknown;
+        res_ = IsMasterReply();
+        msg_.clear();
+        failed_ = false;
+    }
+
+    const IsMasterReply &Result() const { return res_; }
+};
+
+class IsMasterParser
+        : public IsMasterDecoder<ResponseReader<IsMasterParser>> {};
+
+//------------------------------------------------------------------------------
+
+enum class ServerType : uint8_t {
+    kUnknown,  ///< Not reachable (or not heard from yet)
+    kStandalone,
+    kMongos,
+    kPrimary,
+    kSecondary,
+    kOther  ///< Arbiters, hidden members, members that are still starting...
+};
+
+ServerType GetServerType(const IsMasterReply &reply);
+
+/**
+ * Which members of a replica set a request can go to (see the mongo
+ * documentation for the semantics). Standalone servers and mongos can serve
+ * any read preference.
+ */
+enum class ReadPreference : uint8_t {
+    kPrimary,
+    kPrimaryPreferred,
+    kSecondary,
+    kSecondaryPreferred,
+    kNearest
+};
+
+/**
+ * The servers of a deployment along with their latency and load.
+ *
+ * The round trip time of every server is an exponentially weighted moving
+ * average of the time its heartbeats took. Requests go to the server with
+ * the fewest requests in flight among the eligible servers that are within
+ * `local_threshold_ms` of the fastest one.
+ */
+class Topology {
+public:
+    struct Server {
+        std::string name;
+        ServerType type = ServerType::kUnknown;
+        IsMasterReply description;
+        int64_t rtt_us = -1;  ///< -1 until we have a sample
+        int32_t in_flight = 0;
+    };
+
+    /**
+     * Weight of a new sample in the round trip time average.
+     */
+    static constexpr double kRttAlpha = 0.2;
+
+    explicit Topology(int64_t local_threshold_ms = 15)
+        : local_threshold_us_(local_threshold_ms * 1000) {}
+
+    /**
+     * @return the index of the server.
+     */
+    int32_t AddServer(const std::string &name);
+
+    /**
+     * A heartbeat to `server` came back in `rtt_us` microseconds.
+     */
+    void OnHeartbeat(int32_t server, const IsMasterReply &reply,
+                     int64_t rtt_us);
+
+    /**
+     * The server couldn't be reached: it won't be selected until a
+     * heartbeat succeeds. Its round trip time is forgotten.
+     */
+    void OnServerDown(int32_t server);
+
+    void OnRequestSent(int32_t server) { ++servers_[Index(server)].in_flight; }
+
+    void OnRequestDone(int32_t server);
+
+    /**
+     * Pick a server for a request.
+     *
+     * @return the index of the server or -1 if none is eligible.
+     */
+    int32_t Select(ReadPreference pref) const;
+
+    const Server &server(int32_t i) const { return servers_[Index(i)]; }
+
+    int32_t size() const { return static_cast<int32_t>(servers_.size()); }
+
+private:
+    static size_t Index(int32_t i) { return static_cast<size_t>(i); }
+
+    // Select among the servers that satisfy `pred`
+    template <typename Pred>
+    int32_t SelectAmong(Pred pred) const;
+
+    int64_t local_threshold_us_;
+    std::vector<Server> servers_;
+};
+
+//------------------------------------------------------------------------------
+// Implementation
+
+template <typename Parent>
+void IsMasterDecoder<Parent>::EmitFieldName(const char *data,
+                                            const int32_t len) {
+    if (!AtTop()) {
+        // Elements of the host lists.
+        if (Parent::depth() == 2 && len == 0 &&
+            (field_ == Field::kHosts || field_ == Field::kPassives)) {
+            res_.hosts.emplace_back();
+        }
+        return;
+    }
+    if (field_ != Field::kField) {
+        field_ = Field::kField;
+        matcher_.Reset();
+    }
+    for (int32_t i = 0; i < len; i++) {
+        matcher_.AddChar(data[i]);
+    }
+    if (len == 0) {
+        matcher_.AddChar('\000');
+        field_ = matcher_.GetResult();
+        if (field_ == Field::kUnknown) {
+            Parent::SkipValue();
+        }
+    }
+}
+
+template <typename Parent>
+void IsMasterDecoder<Parent>::SetNumber(int64_t v) {
+    if (!AtTop()) {
+        return;
+    }
+    const int32_t v32 = static_cast<int32_t>(
+            std::max<int64_t>(std::min<int64_t>(v, INT32_MAX), INT32_MIN));
+    switch (field_) {
+        case Field::kOk:
+            res_.ok = v != 0;
+            break;
+        case Field::kIsMaster:
+            res_.ismaster = v != 0;
+            break;
+        case Field::kSecondary:
+            res_.secondary = v != 0;
+            break;
+        case Field::kMaxWireVersion:
+            res_.max_wire_version = v32;
+            break;
+        case Field::kMaxBsonObjectSize:
+            res_.max_bson_object_size = v32;
+            break;
+        case Field::kMaxMessageSizeBytes:
+            res_.max_message_size_bytes = v32;
+            break;
+        case Field::kMaxWriteBatchSize:
+            res_.max_write_batch_size = v32;
+            break;
+        default:
+            break;
+    }
+}
+
+template <typename Parent>
+void IsMasterDecoder<Parent>::EmitBool(bool v) {
+    if (!AtTop()) {
+        return;
+    }
+    switch (field_) {
+        case Field::kOk:
+            res_.ok = v;
+            break;
+        case Field::kIsMaster:
+            res_.ismaster = v;
+            break;
+        case Field::kSecondary:
+            res_.secondary = v;
+            break;
+        case Field::kArbiterOnly:
+            res_.arbiter_only = v;
+            break;
+        case Field::kHidden:
+            res_.hidden = v;
+            break;
+        default:
+            break;
+    }
+}
+
+template <typename Parent>
+void IsMasterDecoder<Parent>::EmitUtf8(const char *cnt, int32_t len) {
+    std::string *tgt = nullptr;
+    if (Parent::depth() == 2 &&
+        (field_ == Field::kHosts || field_ == Field::kPassives)) {
+        tgt = &res_.hosts.back();
+    } else if (!AtTop()) {
+        return;
+    } else if (field_ == Field::kSetName) {
+        tgt = &res_.set_name;
+    } else if (field_ == Field::kPrimary) {
+        tgt = &res_.primary;
+    } else if (field_ == Field::kMsg) {
+        tgt = &msg_;
+    } else {
+        return;
+    }
+    if (len > 0) {
+        tgt->append(cnt, static_cast<size_t>(len));
+    } else if (tgt == &msg_) {
+        res_.is_mongos = msg_ == "isdbgrid";
+    }
+}
+
+template <typename Pred>
+int32_t Topology::SelectAmong(Pred pred) const {
+    int64_t min_rtt = -1;
+    for (const Server &s : servers_) {
+        if (pred(s) && (min_rtt == -1 || s.rtt_us < min_rtt)) {
+            min_rtt = s.rtt_us;
+        }
+    }
+    if (min_rtt == -1) {
+        return -1;
+    }
+    int32_t best = -1;
+    for (int32_t i = 0; i < size(); ++i) {
+        const Server &s = servers_[Index(i)];
+        if (!pred(s) || s.rtt_us > min_rtt + local_threshold_us_) {
+            continue;
+        }
+        if (best == -1) {
+            best = i;
+            continue;
+        }
+        const Server &b = servers_[Index(best)];
+        if (s.in_flight < b.in_flight ||
+            (s.in_flight == b.in_flight && s.rtt_us < b.rtt_us)) {
+            best = i;
+        }
+    }
+    return best;
+}
+
+}  // namespace okmongo
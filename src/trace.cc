@@ -0,0 +1,79 @@
+#include "trace.h"
+#include <chrono>
+
+namespace okmongo {
+
+constexpr int32_t Histogram::kNumBuckets;
+constexpr int32_t HistogramTracer::kSlots;
+
+void Histogram::Record(int64_t v) {
+    const uint64_t u = (v > 0) ? static_cast<uint64_t>(v) : 0;
+    const int32_t bucket = (u == 0) ? 0 : 64 - __builtin_clzll(u);
+    buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+    sum_.fetch_add(u, std::memory_order_relaxed);
+    count_.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t Histogram::BucketLimit(int32_t i) {
+    if (i == kNumBuckets - 1) {
+        return UINT64_MAX;
+    }
+    return static_cast<uint64_t>(1) << i;
+}
+
+uint64_t Histogram::Quantile(double q) const {
+    uint64_t counts[kNumBuckets];
+    uint64_t total = 0;
+    for (int32_t i = 0; i < kNumBuckets; ++i) {
+        counts[i] = Bucket(i);
+        total += counts[i];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    q = (q < 0) ? 0 : (q > 1) ? 1 : q;
+    uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+    if (rank == 0) {
+        rank = 1;
+    }
+    uint64_t seen = 0;
+    for (int32_t i = 0; i < kNumBuckets; ++i) {
+        seen += counts[i];
+        if (seen >= rank) {
+            return BucketLimit(i);
+        }
+    }
+    return UINT64_MAX;
+}
+
+int64_t HistogramTracer::Now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now().time_since_epoch())
+            .count();
+}
+
+void HistogramTracer::OnBuild(const BuildTrace &t) {
+    build_ns.Record(t.end_ns - t.start_ns);
+    request_bytes.Record(t.bytes);
+    Slot &s = slots_[static_cast<uint32_t>(t.request_id) % kSlots];
+    s.built_ns.store(t.end_ns, std::memory_order_relaxed);
+    s.request_id.store(t.request_id, std::memory_order_release);
+}
+
+void HistogramTracer::OnReply(const ReplyTrace &t) {
+    if (!t.ok) {
+        errors.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+    const Slot &s = slots_[static_cast<uint32_t>(t.request_id) % kSlots];
+    if (s.request_id.load(std::memory_order_acquire) == t.request_id) {
+        wait_ns.Record(t.first_byte_ns -
+                       s.built_ns.load(std::memory_order_relaxed));
+    }
+    read_ns.Record(t.last_byte_ns - t.first_byte_ns);
+    parse_ns.Record(t.parse_ns);
+    reply_bytes.Record(t.bytes);
+    number_returned.Record(t.number_returned);
+}
+
+}  // namespace okmongo
@@ -0,0 +1,221 @@
+// -*- mode:c++ -*-
+/**
+ * @file
+ * @brief Optional latency and size instrumentation of requests and replies
+ *
+ * Tracing is a compile-time policy: a tracer is any class with
+ *
+ *  - `static int64_t Now()`: a timestamp in nanoseconds,
+ *  - `void OnBuild(const BuildTrace &)`,
+ *  - `void OnReply(const ReplyTrace &)`.
+ *
+ * `NullTracer` does nothing (and costs nothing once inlined),
+ * `HistogramTracer` aggregates everything in lock-free histograms that can be
+ * scraped from any thread.
+ */
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include "bson.h"
+#include "mongo.h"
+
+namespace okmongo {
+
+/**
+ * A request built by one of the `Fill*Op` functions.
+ */
+struct BuildTrace {
+    int32_t request_id;
+    int32_t op_code;
+    int32_t bytes;  ///< Size of the message
+    int64_t start_ns;
+    int64_t end_ns;
+};
+
+/**
+ * A reply read by a `ResponseReader`.
+ */
+struct ReplyTrace {
+    int32_t request_id;  ///< The `response_to` of the reply
+    int32_t number_returned;
+    int32_t bytes;          ///< Bytes consumed by the reader
+    int64_t first_byte_ns;  ///< When the reader was given the first byte
+    int64_t last_byte_ns;   ///< When the reader was done
+    int64_t parse_ns;       ///< Time spent in the reader
+    bool ok;                ///< The reader didn't hit an error
+};
+
+struct NullTracer {
+    static int64_t Now() { return 0; }
+    void OnBuild(const BuildTrace &) {}
+    void OnReply(const ReplyTrace &) {}
+};
+
+/**
+ * Run `fill` (a callable returning the `bool` of a `Fill*Op` function that
+ * writes one message at the end of `w`) and report it to `tracer`.
+ *
+ * > okmongo::TraceFill(&tracer, &w, [&] {
+ * >     return okmongo::FillInsertOp(&w, id, "db", "coll", doc);
+ * > });
+ */
+template <typename Tracer, typename Fill>
+bool TraceFill(Tracer *tracer, BsonWriter *w, Fill fill) {
+    const int32_t start = w->len();
+    const int32_t start_len = w->MessageLen();
+    const int64_t start_ns = Tracer::Now();
+    if (!fill()) {
+        return false;
+    }
+    const int64_t end_ns = Tracer::Now();
+    MsgHeader hdr;
+    std::memcpy(&hdr, w->data() + start, sizeof(hdr));
+    tracer->OnBuild(BuildTrace{hdr.request_id, hdr.op_code,
+                               w->MessageLen() - start_len, start_ns,
+                               end_ns});
+    return true;
+}
+
+/**
+ * Reports the reply read by `Reader` (a `ResponseReader`) to a tracer.
+ *
+ * The tracer isn't owned, the reader doesn't report anything if there is
+ * none.
+ *
+ * > class Parser
+ * >     : public okmongo::Traced<okmongo::OpResponseParser,
+ * >                              okmongo::HistogramTracer> {};
+ * > parser.SetTracer(&tracer);
+ */
+template <typename Reader, typename Tracer>
+class Traced : public Reader {
+public:
+    using Reader::Reader;
+
+    void SetTracer(Tracer *tracer) { tracer_ = tracer; }
+
+    int32_t Consume(const char *s, int32_t len) {
+        const int64_t start = Tracer::Now();
+        if (bytes_ == 0) {
+            first_byte_ns_ = start;
+        }
+        const int32_t n = Reader::Consume(s, len);
+        const int64_t end = Tracer::Now();
+        parse_ns_ += end - start;
+        if (n > 0) {
+            bytes_ += n;
+        }
+        if (!reported_ && Reader::Done()) {
+            reported_ = true;
+            if (tracer_ != nullptr) {
+                const ResponseHeader &hdr = Reader::Header();
+                tracer_->OnReply(ReplyTrace{
+                        hdr.response_to, hdr.number_returned, bytes_,
+                        first_byte_ns_, end, parse_ns_,
+                        Reader::state_ != Reader::State::kError});
+            }
+        }
+        return n;
+    }
+
+    void Clear() {
+        Reader::Clear();
+        bytes_ = 0;
+        first_byte_ns_ = 0;
+        parse_ns_ = 0;
+        reported_ = false;
+    }
+
+protected:
+    Tracer *tracer_ = nullptr;
+    int32_t bytes_ = 0;
+    int64_t first_byte_ns_ = 0;
+    int64_t parse_ns_ = 0;
+    bool reported_ = false;
+};
+
+/**
+ * A lock-free histogram with power of two buckets.
+ *
+ * `Record` can be called from any number of threads and the histogram read
+ * at any time (the counters are relaxed: a read in the middle of a `Record`
+ * might see the new sum before the new count).
+ */
+class Histogram {
+public:
+    /**
+     * Bucket 0 holds 0, bucket `i` holds `[2^(i-1), 2^i)`.
+     */
+    static constexpr int32_t kNumBuckets = 65;
+
+    /**
+     * Negative values are counted as 0.
+     */
+    void Record(int64_t v);
+
+    uint64_t Count() const { return count_.load(std::memory_order_relaxed); }
+
+    uint64_t Sum() const { return sum_.load(std::memory_order_relaxed); }
+
+    uint64_t Bucket(int32_t i) const {
+        return buckets_[i].load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Exclusive upper bound of the values in bucket `i` (UINT64_MAX for the
+     * last one).
+     */
+    static uint64_t BucketLimit(int32_t i);
+
+    /**
+     * Upper bound of the `q`th quantile (`q` in [0, 1]), 0 if the histogram
+     * is empty.
+     */
+    uint64_t Quantile(double q) const;
+
+private:
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> buckets_[kNumBuckets] = {};
+};
+
+/**
+ * A tracer that aggregates everything in `Histogram`s (times are in
+ * nanoseconds on the steady clock).
+ *
+ * The time spent waiting on the server is measured from the end of the build
+ * of a request to the first byte of its reply. Requests are remembered in a
+ * table of `kSlots` entries indexed by request id: with ids allocated
+ * sequentially (`ResponseMultiplexer::NextRequestId`...) this is exact as
+ * long as there are less than `kSlots` requests in flight.
+ */
+class HistogramTracer {
+public:
+    static constexpr int32_t kSlots = 1024;
+
+    static int64_t Now();
+
+    void OnBuild(const BuildTrace &t);
+
+    void OnReply(const ReplyTrace &t);
+
+    Histogram build_ns;
+    Histogram request_bytes;
+    Histogram wait_ns;
+    Histogram read_ns;  ///< First to last byte of the replies
+    Histogram parse_ns;
+    Histogram reply_bytes;
+    Histogram number_returned;
+    std::atomic<uint64_t> errors{0};
+
+private:
+    struct Slot {
+        std::atomic<int32_t> request_id{0};
+        std::atomic<int64_t> built_ns{0};
+    };
+
+    Slot slots_[kSlots];
+};
+
+}  // namespace okmongo